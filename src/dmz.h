@@ -149,6 +149,7 @@ struct dm_zoned_map {
 #define dmz_sect2blk(s)		((s) >> DMZ_BLOCK_SECTORS_SHIFT)
 
 #define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
 
 /*
  * Chunk mapping table metadata: 512 8-bytes entries per 4KB block.
@@ -157,6 +158,11 @@ struct dm_zoned_map {
 #define DMZ_MAP_ENTRIES_MASK	(DMZ_MAP_ENTRIES - 1)
 #define DMZ_MAP_UNMAPPED	UINT_MAX
 
+/*
+ * Zone IDs are stored on 32-bits in the mapping table.
+ */
+#define DMZ_MAX_NR_ZONES	(DMZ_MAP_UNMAPPED - 1)
+
 /*
  * Default number of sequential zones reserved for reclaim.
  */
@@ -179,6 +185,12 @@ enum dmz_dev_type {
 #define DMZ_REPAIR		0x00000004
 #define DMZ_OVERWRITE		0x00000008
 #define DMZ_METADATA_BDEV	0x00000010
+#define DMZ_DRY_RUN		0x00000020
+#define DMZ_UBLK		0x00000040
+#define DMZ_POLL		0x00000080
+#define DMZ_VALIDATE		0x00000100
+#define DMZ_NO_TUNE		0x00000200
+#define DMZ_RAW_DM		0x00000400
 
 /*
  * Operations.
@@ -190,6 +202,17 @@ enum dmz_op {
 	DMZ_OP_RELABEL,
 	DMZ_OP_START,
 	DMZ_OP_STOP,
+	DMZ_OP_BENCH,
+	DMZ_OP_BENCH_TARGET,
+	DMZ_OP_SIMULATE,
+	DMZ_OP_INJECT,
+	DMZ_OP_SCRUB,
+	DMZ_OP_SURVEY,
+	DMZ_OP_DUMP,
+	DMZ_OP_DELTA,
+	DMZ_OP_REBALANCE,
+	DMZ_OP_FINGERPRINT,
+	DMZ_OP_DECOMMISSION,
 };
 
 /*
@@ -199,9 +222,11 @@ struct dmz_block_dev {
 	char		*path;
 	char		*name;
 	char		*serial;
+	dev_t		devno;
 
 	enum dmz_dev_type type;
 	bool		direct_io;
+	bool		poll;
 
 	uuid_t		uuid;
 	__u64		capacity;
@@ -213,6 +238,13 @@ struct dmz_block_dev {
 
 	unsigned int	nr_zones;
 
+	/* Open and active zone limits (0 if unlimited) */
+	unsigned int	max_open_zones;
+	unsigned int	max_active_zones;
+
+	/* NUMA node of the device controller (-1 if unknown) */
+	int		numa_node;
+
 	int		fd;
 };
 
@@ -235,7 +267,7 @@ struct dmz_dev {
 
 	unsigned int	nr_zones;
 	unsigned int	nr_meta_zones;
-	unsigned int	nr_meta_blocks;
+	__u64		nr_meta_blocks;
 	unsigned int	nr_reserved_seq;
 	unsigned int	nr_chunks;
 	unsigned int	nr_usable_zones;
@@ -249,6 +281,13 @@ struct dmz_dev {
 	size_t		zone_nr_sectors;
 	size_t		zone_nr_blocks;
 
+	/* Smallest zone capacity (e.g. NVMe ZNS) */
+	size_t		zone_nr_cap_sectors;
+
+	/* Sequential zones opened by writes */
+	unsigned int	*open_zones;
+	unsigned int	nr_open_zones;
+
 	/* First metadata zone */
 	unsigned int	sb_version;
 	struct blk_zone	*sb_zone;
@@ -256,13 +295,65 @@ struct dmz_dev {
 
 	/* Zone bitmaps */
 	size_t		zone_nr_bitmap_blocks;
-	unsigned int	nr_bitmap_blocks;
+	__u64		nr_bitmap_blocks;
 	__u64		bitmap_block;
 
 	/* Mapping table */
 	unsigned int	nr_map_blocks;
 	__u64		map_block;
 
+	/* Target benchmark */
+	unsigned int	bench_runtime;
+	char		*bench_jobs;
+
+	/* Data mover benchmark */
+	bool		bench_mover;
+
+	/* Format planning */
+	unsigned long long plan_iops;
+	char		*plan_json;
+
+	/* Simulation */
+	char		*sim_trace;
+	char		*sim_workload;
+	char		*sim_cache;
+	char		*sim_seq;
+	unsigned int	sim_reclaim_mbps;
+
+	/* Corruption injection */
+	char		*inject_list;
+	unsigned int	inject_seed;
+	char		*inject_record;
+
+	/* Userspace target reclaim policy */
+	char		*ublk_policy;
+
+	/* Start tuning profile configuration file */
+	char		*tune_profile;
+
+	/* Device number of a target started with raw device-mapper ioctls */
+	dev_t		dm_devno;
+
+	/* Scrub bandwidth limit per block device (MB/s, 0 if unlimited) */
+	unsigned int	scrub_mbps;
+
+	/* Survey */
+	unsigned int	survey_nr_bands;
+	char		*survey_profile;
+
+	/* Stop targets with a label matching this pattern */
+	char		*stop_pattern;
+
+	/* Metadata images */
+	char		*image_path;
+	char		*delta_to;
+	char		*delta_patch;
+
+	/* Content fingerprints */
+	char		*fp_save;
+	char		*fp_compare;
+	char		*fp_image;
+
 };
 
 /*
@@ -309,6 +400,120 @@ static inline void dmz_clear_bit(__u8 *bitmap,
 	bitmap[bit >> 3] &= ~(1 << (bit & 0x7));
 }
 
+/*
+ * Compressed bitmap container types.
+ */
+enum dmz_bitmap_cont_type {
+	DMZ_BM_EMPTY = 0,
+	DMZ_BM_FULL,
+	DMZ_BM_ARRAY,
+	DMZ_BM_RUN,
+	DMZ_BM_BITSET,
+};
+
+/*
+ * Compressed bitmap container: one per on-disk bitmap block.
+ */
+struct dmz_bitmap_cont {
+	__u8		type;
+	__u16		nr;
+	unsigned int	weight;
+	void		*data;
+};
+
+/*
+ * Compressed bitmap (e.g. a zone bitmap).
+ */
+struct dmz_bitmap {
+	unsigned int		nr_bits;
+	unsigned int		nr_conts;
+	unsigned int		weight;
+	struct dmz_bitmap_cont	conts[];
+};
+
+/*
+ * Data mover job: move the valid blocks of a chunk data zone and, if
+ * @bbm is not NULL, of its buffer zone, to the same offsets of the
+ * destination zone. Blocks valid in the buffer zone are taken from the
+ * buffer zone.
+ */
+struct dmz_mover_job {
+	unsigned int		dzone_id;
+	unsigned int		bzone_id;
+	unsigned int		dst_zone_id;
+	struct dmz_bitmap	*dbm;
+	struct dmz_bitmap	*bbm;
+	int			ret;
+};
+
+/*
+ * Data mover statistics of a destination block device.
+ */
+struct dmz_mover_stats {
+	unsigned long long	nr_read_blocks;
+	unsigned long long	nr_read_ios;
+	unsigned long long	nr_written_blocks;
+	unsigned long long	nr_write_ios;
+	unsigned long long	usec;
+};
+
+/*
+ * Offline metadata transaction zone bitmap.
+ */
+struct dmz_txn_bitmap {
+	unsigned int		zone_id;
+	__u8			*buf;
+};
+
+/*
+ * Offline metadata transaction: the primary and secondary metadata sets
+ * share the same in-memory mapping table. Changed map blocks and zone
+ * bitmaps are staged until dmz_txn_commit() writes them to both sets.
+ */
+struct dmz_txn {
+	struct dmz_meta_set	mset[3];
+	__u64			gen;
+
+	bool			*map_dirty;
+	unsigned int		nr_dirty_map_blocks;
+
+	struct dmz_txn_bitmap	*bitmaps;
+	unsigned int		nr_bitmaps;
+	unsigned int		max_bitmaps;
+};
+
+/*
+ * Survey band flags.
+ */
+#define DMZ_SURVEY_SLOW		0x00000001
+#define DMZ_SURVEY_LAT		0x00000002
+#define DMZ_SURVEY_ERROR	0x00000004
+#define DMZ_SURVEY_UNSAMPLED	0x00000008
+
+/*
+ * Survey results for a band of consecutive zones of the same type
+ * of a block device. Zone numbers are relative to the block device.
+ */
+struct dmz_survey_band {
+	unsigned int		zone;
+	unsigned int		nr_zones;
+	bool			cache;
+	unsigned long long	mbps;
+	unsigned long long	lat_avg;
+	unsigned long long	lat_max;
+	unsigned int		flags;
+};
+
+/*
+ * Survey profile of a block device.
+ */
+struct dmz_survey_dev {
+	char			name[64];
+	unsigned int		nr_zones;
+	unsigned int		nr_bands;
+	struct dmz_survey_band	*bands;
+};
+
 /*
  * Metadata set flags.
  */
@@ -382,6 +587,13 @@ extern int dmz_mod_ver;
 #define dmz_zone_sector(z)	(z)->start
 #define dmz_zone_id(dev, zone)	((unsigned int)(dmz_zone_sector(zone) / (dev)->zone_nr_sectors))
 #define dmz_zone_length(z)	(z)->len
+#ifdef HAVE_BLK_ZONE_REP_V2
+#define dmz_zone_capacity(z)	(z)->capacity
+#define dmz_zone_set_capacity(z, c)	((z)->capacity = (c))
+#else
+#define dmz_zone_capacity(z)	(z)->len
+#define dmz_zone_set_capacity(z, c)	do { } while (0)
+#endif
 #define dmz_zone_wp_sector(z)	(z)->wp
 #define dmz_zone_need_reset(z)	(int)(z)->reset
 #define dmz_zone_non_seq(z)	(int)(z)->non_seq
@@ -397,29 +609,114 @@ static inline struct dmz_block_dev *dmz_zone_to_bdev(struct dmz_dev *dev,
 	return dmz_sector_to_bdev(dev, zone->start, NULL);
 }
 
+#define DMZ_REPORT_ZONES_BUFSZ	524288
+
 int dmz_open_bdev(struct dmz_block_dev *dev, enum dmz_op op, int flags);
 void dmz_close_bdev(struct dmz_block_dev *dev);
 int dmz_get_bdev_holder(struct dmz_block_dev *dev, char *holder);
+void dmz_probe_invalidate(void);
 
 int dmz_sync_dev(struct dmz_dev *dev);
 int dmz_get_dev_zones(struct dmz_dev *dev);
 int dmz_reset_zone(struct dmz_dev *dev, struct blk_zone *zone);
+int dmz_reset_bdev_zones(struct dmz_dev *dev, int d);
 int dmz_reset_zones(struct dmz_dev *dev);
+int dmz_track_open_zone(struct dmz_dev *dev, struct blk_zone *zone);
+int dmz_release_zones(struct dmz_dev *dev);
 int dmz_write_block(struct dmz_dev *dev, __u64 block, __u8 *buf);
 int dmz_read_block(struct dmz_dev *dev, __u64 block, __u8 *buf);
+__u8 *dmz_malloc_buf(size_t size);
 void dmz_get_label(struct dmz_dev *dev, char *label, bool check);
+char *dmz_get_bdev_serial(struct dmz_block_dev *bdev);
 
 __u32 dmz_crc32(__u32 crc, const void *address, size_t length);
+unsigned long long dmz_usec(void);
+unsigned long long dmz_parse_size(const char *str, char **end);
+int dmz_bind_numa_node(int node);
+int dmz_run_bdev_workers(struct dmz_dev *dev,
+			 int (*fn)(struct dmz_dev *dev, int d, void *arg),
+			 void *arg);
 
 int dmz_locate_metadata(struct dmz_dev *dev);
-int dmz_write_super(struct dmz_dev *dev, __u64 gen, __u64 offset);
+int dmz_emulate_dev(struct dmz_dev *dev, struct dmz_dev *edev,
+		    __u64 cache_capacity);
+void dmz_free_emulated_dev(struct dmz_dev *edev);
+int dmz_write_super(struct dmz_dev *dev, __u64 gen, __u64 offset,
+		    bool quiet);
 int dmz_format(struct dmz_dev *dev);
+int dmz_validate(struct dmz_dev *dev);
+int dmz_plan(struct dmz_dev *dev);
 int dmz_check(struct dmz_dev *dev);
+int dmz_check_superblocks(struct dmz_dev *dev, struct dmz_meta_set *mset);
+struct dmz_meta_set *dmz_validate_meta_set(struct dmz_dev *dev,
+					   struct dmz_meta_set *mset);
+int dmz_read_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset);
+int dmz_write_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset);
+void dmz_get_chunk_mapping(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			   unsigned int chunk, unsigned int *dzone_id,
+			   unsigned int *bzone_id);
+void dmz_set_chunk_mapping(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			   unsigned int chunk, unsigned int dzone_id,
+			   unsigned int bzone_id);
+int dmz_read_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			 unsigned int zone_id, __u8 **buf);
+int dmz_write_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			  unsigned int zone_id, __u8 *buf);
+struct dmz_bitmap *dmz_bitmap_alloc(unsigned int nr_bits);
+void dmz_bitmap_free(struct dmz_bitmap *bm);
+int dmz_bitmap_load_block(struct dmz_bitmap *bm, unsigned int c,
+			  const __u8 *buf);
+struct dmz_bitmap *dmz_bitmap_read_zone(struct dmz_dev *dev,
+					struct dmz_meta_set *mset,
+					unsigned int zone_id);
+bool dmz_bitmap_test(struct dmz_bitmap *bm, unsigned int bit);
+unsigned int dmz_bitmap_next(struct dmz_bitmap *bm, unsigned int bit);
+unsigned int dmz_bitmap_and_weight(struct dmz_bitmap *a,
+				   struct dmz_bitmap *b);
+int dmz_bitmap_and(struct dmz_bitmap *dst, struct dmz_bitmap *a,
+		   struct dmz_bitmap *b);
+size_t dmz_bitmap_size(struct dmz_bitmap *bm);
+unsigned int dmz_bitmap_extents(struct dmz_bitmap *bm);
 int dmz_repair(struct dmz_dev *dev);
 int dmz_relabel(struct dmz_dev *dev);
+int dmz_inject(struct dmz_dev *dev);
+int dmz_scrub(struct dmz_dev *dev);
+int dmz_survey(struct dmz_dev *dev);
+int dmz_survey_load(const char *path, struct dmz_block_dev *bdev,
+		    struct dmz_survey_dev *sdev);
+int dmz_dump(struct dmz_dev *dev);
+int dmz_delta(struct dmz_dev *dev);
+int dmz_rebalance(struct dmz_dev *dev);
+int dmz_mover_run(struct dmz_dev *dev, struct dmz_mover_job *jobs,
+		  unsigned int nr_jobs, struct dmz_mover_stats *stats);
+int dmz_mover_bench(struct dmz_dev *dev);
+int dmz_fingerprint(struct dmz_dev *dev);
+int dmz_decommission(struct dmz_dev *dev);
+int dmz_txn_open(struct dmz_dev *dev, struct dmz_txn *txn);
+void dmz_txn_close(struct dmz_dev *dev, struct dmz_txn *txn);
+void dmz_txn_get_mapping(struct dmz_dev *dev, struct dmz_txn *txn,
+			 unsigned int chunk, unsigned int *dzone_id,
+			 unsigned int *bzone_id);
+void dmz_txn_set_mapping(struct dmz_dev *dev, struct dmz_txn *txn,
+			 unsigned int chunk, unsigned int dzone_id,
+			 unsigned int bzone_id);
+int dmz_txn_set_bitmap(struct dmz_dev *dev, struct dmz_txn *txn,
+		       unsigned int zone_id, const __u8 *buf);
+bool dmz_txn_dirty(struct dmz_txn *txn);
+int dmz_txn_commit(struct dmz_dev *dev, struct dmz_txn *txn);
 int dmz_init_dm(int log_level);
+int dmz_init_dm_raw(int log_level);
+int dmz_create_dm_raw(struct dmz_dev *dev);
 int dmz_start(struct dmz_dev *dev);
-int dmz_stop(struct dmz_dev *dev, char *dm_dev);
+int dmz_tune_bdevs(struct dmz_dev *dev);
+int dmz_tune_dm(struct dmz_dev *dev);
+int dmz_stop(struct dmz_dev *dev);
+int dmz_deactivate_dm(char *dm_dev);
+int dmz_get_dm_status(const char *dm_dev, char *status, size_t len);
 int dmz_load_module(const char *modname, int log_level);
+int dmz_bench(struct dmz_dev *dev);
+int dmz_bench_target(struct dmz_dev *dev);
+int dmz_simulate(struct dmz_dev *dev);
+int dmz_ublk_start(struct dmz_dev *dev);
 
 #endif /* __DMZ_H__ */
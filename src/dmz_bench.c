@@ -0,0 +1,546 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+/*
+ * Run time of each benchmark test.
+ */
+#define DMZ_BENCH_RUNTIME	(2ULL * 1000000ULL)
+
+/*
+ * IO size used for sequential tests.
+ */
+#define DMZ_BENCH_SEQ_IO_SIZE	(1024 * 1024)
+
+/*
+ * Below this random write IOPS, conventional zones are
+ * considered too slow to absorb random write workloads.
+ */
+#define DMZ_BENCH_MIN_CACHE_IOPS	1000
+
+/*
+ * Benchmark test result.
+ */
+struct dmz_bench_res {
+	unsigned long long	nr_ios;
+	unsigned long long	bytes;
+	unsigned long long	usecs;
+	unsigned long long	max_lat;
+};
+
+#define dmz_bench_iops(r)	\
+	((r)->usecs ? (r)->nr_ios * 1000000ULL / (r)->usecs : 0)
+#define dmz_bench_mbps(r)	\
+	((r)->usecs ? (r)->bytes / (r)->usecs : 0)
+#define dmz_bench_lat(r)	\
+	((r)->nr_ios ? (r)->usecs / (r)->nr_ios : 0)
+
+/*
+ * Randomly writable region of a device: either all the emulated zones of
+ * a regular block device or the conventional zones of a zoned block device.
+ */
+struct dmz_bench_region {
+	struct dmz_block_dev	*bdev;
+	struct blk_zone		**zones;
+	unsigned int		nr_zones;
+
+	struct dmz_bench_res	rnd_write;
+	struct dmz_bench_res	rnd_read;
+	struct dmz_bench_res	seq_read;
+};
+
+static __u64 dmz_bench_rand(__u64 max)
+{
+	__u64 r = ((__u64)random() << 31) | (__u64)random();
+
+	return r % max;
+}
+
+/*
+ * Get a random 4KB block of a region, as a device byte offset.
+ */
+static off_t dmz_bench_rnd_offset(struct dmz_dev *dev,
+				  struct dmz_bench_region *reg)
+{
+	struct blk_zone *zone = reg->zones[dmz_bench_rand(reg->nr_zones)];
+	__u64 sector, nr_blocks = dmz_sect2blk(dmz_zone_capacity(zone));
+
+	dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &sector);
+
+	return (sector << 9) +
+		(dmz_bench_rand(nr_blocks) << DMZ_BLOCK_SHIFT);
+}
+
+/*
+ * Account an IO completion.
+ */
+static void dmz_bench_account(struct dmz_bench_res *res,
+			      size_t size, unsigned long long lat)
+{
+	res->nr_ios++;
+	res->bytes += size;
+	res->usecs += lat;
+	if (lat > res->max_lat)
+		res->max_lat = lat;
+}
+
+/*
+ * 4KB random writes or reads over a region.
+ */
+static int dmz_bench_rnd(struct dmz_dev *dev, struct dmz_bench_region *reg,
+			 bool write, __u8 *buf, struct dmz_bench_res *res)
+{
+	unsigned long long end, t;
+	ssize_t ret;
+	off_t ofst;
+
+	memset(res, 0, sizeof(*res));
+
+	end = dmz_usec() + DMZ_BENCH_RUNTIME;
+	do {
+		ofst = dmz_bench_rnd_offset(dev, reg);
+		t = dmz_usec();
+		if (write)
+			ret = pwrite(reg->bdev->fd, buf, DMZ_BLOCK_SIZE, ofst);
+		else
+			ret = pread(reg->bdev->fd, buf, DMZ_BLOCK_SIZE, ofst);
+		if (ret != DMZ_BLOCK_SIZE) {
+			fprintf(stderr,
+				"%s: %s offset %llu failed %d (%s)\n",
+				reg->bdev->name, write ? "Write" : "Read",
+				(unsigned long long)ofst,
+				errno, strerror(errno));
+			return -1;
+		}
+		t = dmz_usec() - t;
+		dmz_bench_account(res, DMZ_BLOCK_SIZE, t);
+	} while (dmz_usec() < end);
+
+	return 0;
+}
+
+/*
+ * Large sequential reads over the zones of a region.
+ */
+static int dmz_bench_seq_read(struct dmz_dev *dev,
+			      struct dmz_bench_region *reg,
+			      __u8 *buf, struct dmz_bench_res *res)
+{
+	unsigned long long end, t;
+	__u64 sector, len, ofst;
+	struct blk_zone *zone;
+	unsigned int i;
+	ssize_t ret;
+
+	memset(res, 0, sizeof(*res));
+
+	end = dmz_usec() + DMZ_BENCH_RUNTIME;
+	for (i = 0; i < reg->nr_zones && dmz_usec() < end; i++) {
+		zone = reg->zones[i];
+		dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &sector);
+		len = dmz_zone_capacity(zone) << 9;
+		for (ofst = 0; ofst + DMZ_BENCH_SEQ_IO_SIZE <= len;
+		     ofst += DMZ_BENCH_SEQ_IO_SIZE) {
+			t = dmz_usec();
+			if (t >= end)
+				break;
+			ret = pread(reg->bdev->fd, buf, DMZ_BENCH_SEQ_IO_SIZE,
+				    (sector << 9) + ofst);
+			if (ret != DMZ_BENCH_SEQ_IO_SIZE) {
+				fprintf(stderr,
+					"%s: Read offset %llu failed %d (%s)\n",
+					reg->bdev->name, (sector << 9) + ofst,
+					errno, strerror(errno));
+				return -1;
+			}
+			dmz_bench_account(res, DMZ_BENCH_SEQ_IO_SIZE,
+					  dmz_usec() - t);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sequentially write a sequential zone and reset it.
+ */
+static int dmz_bench_seq_zone(struct dmz_dev *dev, struct blk_zone *zone,
+			      __u8 *buf, struct dmz_bench_res *wres,
+			      struct dmz_bench_res *rres)
+{
+	struct dmz_block_dev *bdev;
+	unsigned long long end, t;
+	__u64 sector, len, ofst;
+	ssize_t ret;
+
+	memset(wres, 0, sizeof(*wres));
+	memset(rres, 0, sizeof(*rres));
+
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &sector);
+	if (!dmz_zone_empty(zone) && dmz_reset_zone(dev, zone) < 0)
+		return -1;
+
+	len = dmz_zone_capacity(zone) << 9;
+	end = dmz_usec() + DMZ_BENCH_RUNTIME;
+	for (ofst = 0; ofst + DMZ_BENCH_SEQ_IO_SIZE <= len;
+	     ofst += DMZ_BENCH_SEQ_IO_SIZE) {
+		t = dmz_usec();
+		if (t >= end)
+			break;
+		ret = pwrite(bdev->fd, buf, DMZ_BENCH_SEQ_IO_SIZE,
+			     (sector << 9) + ofst);
+		if (ret != DMZ_BENCH_SEQ_IO_SIZE) {
+			fprintf(stderr,
+				"%s: Write zone %u offset %llu failed %d (%s)\n",
+				bdev->name, dmz_zone_id(dev, zone), ofst,
+				errno, strerror(errno));
+			return -1;
+		}
+		dmz_bench_account(wres, DMZ_BENCH_SEQ_IO_SIZE,
+				  dmz_usec() - t);
+	}
+
+	/* Reset the zone we just wrote and time it */
+	t = dmz_usec();
+	if (dmz_reset_zone(dev, zone) < 0)
+		return -1;
+	dmz_bench_account(rres, 0, dmz_usec() - t);
+
+	return 0;
+}
+
+/*
+ * Time a full zone report of a zoned block device.
+ */
+static int dmz_bench_report_zones(struct dmz_block_dev *bdev,
+				  struct dmz_bench_res *res)
+{
+	struct blk_zone_report *rep;
+	unsigned int rep_max_zones;
+	struct blk_zone *blkz;
+	unsigned long long t;
+	__u64 sector = 0;
+
+	memset(res, 0, sizeof(*res));
+
+	rep = malloc(DMZ_REPORT_ZONES_BUFSZ);
+	if (!rep) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	rep_max_zones =
+		(DMZ_REPORT_ZONES_BUFSZ - sizeof(struct blk_zone_report))
+		/ sizeof(struct blk_zone);
+
+	while (sector < bdev->capacity) {
+		memset(rep, 0, DMZ_REPORT_ZONES_BUFSZ);
+		rep->sector = sector;
+		rep->nr_zones = rep_max_zones;
+		t = dmz_usec();
+		if (ioctl(bdev->fd, BLKREPORTZONE, rep) != 0) {
+			fprintf(stderr,
+				"%s: Get zone information failed %d (%s)\n",
+				bdev->name, errno, strerror(errno));
+			free(rep);
+			return -1;
+		}
+		res->usecs += dmz_usec() - t;
+		if (!rep->nr_zones)
+			break;
+		res->nr_ios += rep->nr_zones;
+		blkz = (struct blk_zone *)(rep + 1) + rep->nr_zones - 1;
+		sector = dmz_zone_sector(blkz) + dmz_zone_length(blkz);
+	}
+
+	free(rep);
+
+	return 0;
+}
+
+static void dmz_bench_print_rnd(const char *name, struct dmz_bench_res *res)
+{
+	printf("    4KB random %s: %llu IOPS (%llu MB/s), "
+	       "latency %llu us avg, %llu us max\n",
+	       name, dmz_bench_iops(res), dmz_bench_mbps(res),
+	       dmz_bench_lat(res), res->max_lat);
+}
+
+/*
+ * Benchmark a randomly writable region.
+ */
+static int dmz_bench_region(struct dmz_dev *dev, struct dmz_bench_region *reg,
+			    __u8 *buf)
+{
+	if (dmz_bench_rnd(dev, reg, true, buf, &reg->rnd_write) < 0)
+		return -1;
+	dmz_bench_print_rnd("write", &reg->rnd_write);
+
+	if (dmz_bench_rnd(dev, reg, false, buf, &reg->rnd_read) < 0)
+		return -1;
+	dmz_bench_print_rnd("read", &reg->rnd_read);
+
+	if (dmz_bench_seq_read(dev, reg, buf, &reg->seq_read) < 0)
+		return -1;
+	printf("    %dMB sequential read: %llu MB/s\n",
+	       DMZ_BENCH_SEQ_IO_SIZE >> 20, dmz_bench_mbps(&reg->seq_read));
+
+	return 0;
+}
+
+/*
+ * Collect the zones of a block device that can buffer random writes.
+ */
+static int dmz_bench_get_region(struct dmz_dev *dev,
+				struct dmz_block_dev *bdev,
+				struct dmz_bench_region *reg)
+{
+	struct blk_zone *zone;
+	unsigned int i;
+
+	memset(reg, 0, sizeof(*reg));
+	reg->bdev = bdev;
+	reg->zones = calloc(bdev->nr_zones, sizeof(struct blk_zone *));
+	if (!reg->zones) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &dev->zones[i];
+		if (dmz_zone_to_bdev(dev, zone) != bdev)
+			continue;
+		if (dmz_zone_unknown(zone) || dmz_zone_conv(zone))
+			reg->zones[reg->nr_zones++] = zone;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the usable sequential zones of a zoned block device.
+ */
+static struct blk_zone **dmz_bench_seq_zones(struct dmz_dev *dev,
+					     struct dmz_block_dev *bdev,
+					     unsigned int *nr_seq)
+{
+	struct blk_zone **zones, *zone;
+	unsigned int i;
+
+	*nr_seq = 0;
+	zones = calloc(bdev->nr_zones, sizeof(struct blk_zone *));
+	if (!zones) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &dev->zones[i];
+		if (dmz_zone_to_bdev(dev, zone) != bdev ||
+		    !(dmz_zone_seq_req(zone) || dmz_zone_seq_pref(zone)) ||
+		    dmz_zone_cond(zone) == BLK_ZONE_COND_READONLY ||
+		    dmz_zone_cond(zone) == BLK_ZONE_COND_OFFLINE)
+			continue;
+		zones[(*nr_seq)++] = zone;
+	}
+
+	return zones;
+}
+
+/*
+ * Benchmark the sequential zones of a zoned block device at the
+ * outer (first zones), middle and inner (last zones) positions.
+ */
+static int dmz_bench_seq(struct dmz_dev *dev, struct dmz_block_dev *bdev,
+			 __u8 *buf, unsigned long long *min_mbps)
+{
+	static const char *pos_name[] = { "outer", "middle", "inner" };
+	struct dmz_bench_res wres, rres;
+	struct blk_zone **zones, *zone;
+	unsigned int i, nr_seq;
+	int ret = -1;
+
+	zones = dmz_bench_seq_zones(dev, bdev, &nr_seq);
+	if (!zones)
+		return -1;
+	if (!nr_seq) {
+		printf("    No usable sequential zone\n");
+		ret = 0;
+		goto out;
+	}
+
+	for (i = 0; i < 3; i++) {
+		zone = zones[((nr_seq - 1) * i) / 2];
+		if (dmz_bench_seq_zone(dev, zone, buf, &wres, &rres) < 0)
+			goto out;
+		printf("    Zone %u (%s): %dMB sequential write %llu MB/s, "
+		       "reset %llu us\n",
+		       dmz_zone_id(dev, zone), pos_name[i],
+		       DMZ_BENCH_SEQ_IO_SIZE >> 20,
+		       dmz_bench_mbps(&wres), rres.usecs);
+		if (!*min_mbps || dmz_bench_mbps(&wres) < *min_mbps)
+			*min_mbps = dmz_bench_mbps(&wres);
+	}
+	ret = 0;
+
+out:
+	free(zones);
+
+	return ret;
+}
+
+/*
+ * Print recommendations from the benchmark results.
+ */
+static void dmz_bench_recommend(struct dmz_dev *dev,
+				struct dmz_bench_region *cache,
+				struct dmz_bench_region *conv,
+				unsigned long long seq_mbps)
+{
+	unsigned long long reclaim_mbps, write_mbps, ratio;
+	unsigned int nr_zoned = dev->nr_bdev > 1 ? dev->nr_bdev - 1 : 1;
+	unsigned int nr_seq;
+
+	printf("Recommendations:\n");
+
+	/* Cache device */
+	if (dev->nr_bdev > 1) {
+		if (conv && conv->nr_zones &&
+		    dmz_bench_iops(&conv->rnd_write)) {
+			/* In hundredths, the cache device may be slower */
+			ratio = dmz_bench_iops(&cache->rnd_write) * 100 /
+				dmz_bench_iops(&conv->rnd_write);
+			printf("  Cache device: %s, %llu.%02llux the "
+			       "conventional zones random write IOPS\n",
+			       cache->bdev->name, ratio / 100, ratio % 100);
+		} else {
+			printf("  Cache device: %s, required\n",
+			       cache->bdev->name);
+		}
+	} else if (!cache || cache->nr_zones < 3) {
+		printf("  Cache device: required (not enough "
+		       "conventional zones)\n");
+	} else if (dmz_bench_iops(&cache->rnd_write) <
+		   DMZ_BENCH_MIN_CACHE_IOPS) {
+		printf("  Cache device: recommended for random write "
+		       "workloads (%llu IOPS on conventional zones)\n",
+		       dmz_bench_iops(&cache->rnd_write));
+	} else {
+		printf("  Cache device: not needed\n");
+	}
+
+	if (!cache || !cache->nr_zones || !seq_mbps)
+		return;
+
+	/*
+	 * Reclaim copies valid blocks of cache zones to sequential zones,
+	 * so it cannot go faster than the slowest of the cache sequential
+	 * reads and of the inner sequential zone writes.
+	 */
+	reclaim_mbps = dmz_bench_mbps(&cache->seq_read);
+	if (!reclaim_mbps || seq_mbps < reclaim_mbps)
+		reclaim_mbps = seq_mbps;
+	if (!reclaim_mbps)
+		reclaim_mbps = 1;
+	printf("  Expected reclaim throughput: %llu MB/s per zoned device\n",
+	       reclaim_mbps);
+
+	/*
+	 * Each zoned device is reclaimed independently and needs at least
+	 * one reserved sequential zone. Add one more per zoned device for
+	 * every reclaim throughput worth of random writes the cache can
+	 * absorb, so that reclaim can keep up with bursts.
+	 */
+	write_mbps = dmz_bench_mbps(&cache->rnd_write);
+	nr_seq = nr_zoned * DIV_ROUND_UP(write_mbps, reclaim_mbps * nr_zoned);
+	if (nr_seq < nr_zoned)
+		nr_seq = nr_zoned;
+	if (nr_seq >= cache->nr_zones)
+		nr_seq = cache->nr_zones - 1;
+	printf("  Reserved sequential zones: --seq=%u\n", nr_seq);
+}
+
+/*
+ * Benchmark prospective member devices.
+ */
+int dmz_bench(struct dmz_dev *dev)
+{
+	struct dmz_bench_region *regs, *cache = NULL, *conv = NULL;
+	unsigned long long seq_mbps = 0;
+	struct dmz_block_dev *bdev;
+	struct dmz_bench_res res;
+	int i, ret = -1;
+	__u8 *buf;
+
+	printf("Benchmarking device%s (this destroys all data)\n",
+	       dev->nr_bdev > 1 ? "s" : "");
+
+	srandom(dmz_usec());
+
+	buf = dmz_malloc_buf(DMZ_BENCH_SEQ_IO_SIZE);
+	regs = calloc(dev->nr_bdev, sizeof(struct dmz_bench_region));
+	if (!buf || !regs) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	memset(buf, 0, DMZ_BENCH_SEQ_IO_SIZE);
+
+	for (i = 0; i < dev->nr_bdev; i++) {
+		bdev = &dev->bdev[i];
+
+		printf("%s:\n", bdev->name);
+		if (dmz_bench_get_region(dev, bdev, &regs[i]) < 0)
+			goto out;
+
+		if (regs[i].nr_zones) {
+			printf("  %s zones:\n",
+			       dmz_bdev_is_zoned(bdev) ?
+			       "Conventional" : "Emulated");
+			if (dmz_bench_region(dev, &regs[i], buf) < 0)
+				goto out;
+			if (!cache)
+				cache = &regs[i];
+			else if (!conv)
+				conv = &regs[i];
+		}
+
+		if (!dmz_bdev_is_zoned(bdev))
+			continue;
+
+		printf("  Sequential zones:\n");
+		if (dmz_bench_seq(dev, bdev, buf, &seq_mbps) < 0)
+			goto out;
+
+		if (dmz_bench_report_zones(bdev, &res) < 0)
+			goto out;
+		printf("  Report zones: %llu zones in %llu us "
+		       "(%llu us per 1000 zones)\n",
+		       res.nr_ios, res.usecs,
+		       res.nr_ios ? res.usecs * 1000 / res.nr_ios : 0);
+	}
+
+	dmz_bench_recommend(dev, cache, conv, seq_mbps);
+
+	ret = 0;
+
+out:
+	if (regs) {
+		for (i = 0; i < dev->nr_bdev; i++)
+			free(regs[i].zones);
+		free(regs);
+	}
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,572 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <asm/byteorder.h>
+
+/*
+ * Compressed in-memory zone bitmaps.
+ *
+ * A zone bitmap is split into containers, one per on-disk bitmap block
+ * (DMZ_BLOCK_SIZE_BITS bits). Each container uses the smallest of the
+ * following representations:
+ *   - empty or full: no data,
+ *   - array: sorted 16-bit offsets of the set bits,
+ *   - run: sorted pairs of 16-bit (start, length - 1) of set bit runs,
+ *   - bitset: a copy of the raw bitmap block.
+ * Containers of mostly empty or sequentially written zones are thus very
+ * small and all zone bitmaps of large targets can be kept in memory.
+ */
+
+#define DMZ_BM_WORDS		(DMZ_BLOCK_SIZE / sizeof(__u64))
+
+/*
+ * Number of valid bits of a container (the last container of a zone
+ * may be partial).
+ */
+static unsigned int dmz_bitmap_cont_bits(struct dmz_bitmap *bm,
+					 unsigned int c)
+{
+	unsigned int bits = bm->nr_bits - c * DMZ_BLOCK_SIZE_BITS;
+
+	return bits < DMZ_BLOCK_SIZE_BITS ? bits : DMZ_BLOCK_SIZE_BITS;
+}
+
+static void dmz_bitmap_cont_clear(struct dmz_bitmap_cont *cont)
+{
+	free(cont->data);
+	memset(cont, 0, sizeof(struct dmz_bitmap_cont));
+}
+
+/*
+ * Allocate an empty bitmap of @nr_bits bits.
+ */
+struct dmz_bitmap *dmz_bitmap_alloc(unsigned int nr_bits)
+{
+	unsigned int nr_conts = DIV_ROUND_UP(nr_bits, DMZ_BLOCK_SIZE_BITS);
+	struct dmz_bitmap *bm;
+
+	bm = calloc(1, sizeof(struct dmz_bitmap) +
+		    nr_conts * sizeof(struct dmz_bitmap_cont));
+	if (!bm)
+		return NULL;
+
+	bm->nr_bits = nr_bits;
+	bm->nr_conts = nr_conts;
+
+	return bm;
+}
+
+/*
+ * Free a bitmap.
+ */
+void dmz_bitmap_free(struct dmz_bitmap *bm)
+{
+	unsigned int c;
+
+	if (!bm)
+		return;
+
+	for (c = 0; c < bm->nr_conts; c++)
+		free(bm->conts[c].data);
+	free(bm);
+}
+
+/*
+ * Get the first bit set (or cleared) at or after @bit in uncompressed words.
+ */
+static unsigned int dmz_bitmap_words_next(const __u64 *words,
+					  unsigned int bit,
+					  unsigned int nr_bits, bool set)
+{
+	__u64 w;
+
+	while (bit < nr_bits) {
+		w = set ? words[bit / 64] : ~words[bit / 64];
+		w &= ~0ULL << (bit & 63);
+		if (w) {
+			bit = (bit & ~63U) + __builtin_ctzll(w);
+			return bit < nr_bits ? bit : nr_bits;
+		}
+		bit = (bit & ~63U) + 64;
+	}
+
+	return nr_bits;
+}
+
+/*
+ * Set a container from uncompressed words. Bits beyond @nr_bits are
+ * ignored (cleared).
+ */
+static int dmz_bitmap_cont_set(struct dmz_bitmap_cont *cont,
+			       __u64 *words, unsigned int nr_bits)
+{
+	unsigned int i, bit, end, weight = 0, nr_runs = 0, n = 0;
+	__u64 w, prev = 0;
+	__u16 *data;
+	size_t size;
+
+	dmz_bitmap_cont_clear(cont);
+
+	for (i = nr_bits / 64; i < DMZ_BM_WORDS; i++) {
+		if (i == nr_bits / 64 && (nr_bits & 63))
+			words[i] &= (1ULL << (nr_bits & 63)) - 1;
+		else
+			words[i] = 0;
+	}
+
+	/* Count set bits and runs of set bits */
+	for (i = 0; i < DMZ_BM_WORDS; i++) {
+		w = words[i];
+		weight += __builtin_popcountll(w);
+		nr_runs += __builtin_popcountll(w & ~((w << 1) | (prev >> 63)));
+		prev = w;
+	}
+
+	cont->weight = weight;
+	if (!weight) {
+		cont->type = DMZ_BM_EMPTY;
+		return 0;
+	}
+	if (weight == nr_bits) {
+		cont->type = DMZ_BM_FULL;
+		return 0;
+	}
+
+	/* Use the smallest representation */
+	if (nr_runs * 2 <= weight &&
+	    nr_runs * 2 * sizeof(__u16) < DMZ_BLOCK_SIZE) {
+		cont->type = DMZ_BM_RUN;
+		cont->nr = nr_runs;
+		size = nr_runs * 2 * sizeof(__u16);
+	} else if (weight * sizeof(__u16) < DMZ_BLOCK_SIZE) {
+		cont->type = DMZ_BM_ARRAY;
+		cont->nr = weight;
+		size = weight * sizeof(__u16);
+	} else {
+		cont->type = DMZ_BM_BITSET;
+		cont->data = malloc(DMZ_BLOCK_SIZE);
+		if (!cont->data)
+			return -1;
+		memcpy(cont->data, words, DMZ_BLOCK_SIZE);
+		return 0;
+	}
+
+	data = malloc(size);
+	if (!data)
+		return -1;
+	cont->data = data;
+
+	bit = dmz_bitmap_words_next(words, 0, nr_bits, true);
+	while (bit < nr_bits) {
+		end = dmz_bitmap_words_next(words, bit, nr_bits, false);
+		if (cont->type == DMZ_BM_RUN) {
+			data[n * 2] = bit;
+			data[n * 2 + 1] = end - bit - 1;
+			n++;
+		} else {
+			while (bit < end)
+				data[n++] = bit++;
+		}
+		bit = dmz_bitmap_words_next(words, end, nr_bits, true);
+	}
+
+	return 0;
+}
+
+/*
+ * Uncompress a container into words.
+ */
+static void dmz_bitmap_cont_expand(struct dmz_bitmap_cont *cont,
+				   __u64 *words, unsigned int nr_bits)
+{
+	__u16 *data = cont->data;
+	unsigned int i, b, end;
+
+	switch (cont->type) {
+	case DMZ_BM_EMPTY:
+		memset(words, 0, DMZ_BLOCK_SIZE);
+		break;
+	case DMZ_BM_FULL:
+		memset(words, 0, DMZ_BLOCK_SIZE);
+		for (b = 0; b < nr_bits; b++)
+			words[b / 64] |= 1ULL << (b & 63);
+		break;
+	case DMZ_BM_ARRAY:
+		memset(words, 0, DMZ_BLOCK_SIZE);
+		for (i = 0; i < cont->nr; i++)
+			words[data[i] / 64] |= 1ULL << (data[i] & 63);
+		break;
+	case DMZ_BM_RUN:
+		memset(words, 0, DMZ_BLOCK_SIZE);
+		for (i = 0; i < cont->nr; i++) {
+			end = data[i * 2] + data[i * 2 + 1];
+			for (b = data[i * 2]; b <= end; b++)
+				words[b / 64] |= 1ULL << (b & 63);
+		}
+		break;
+	case DMZ_BM_BITSET:
+		memcpy(words, cont->data, DMZ_BLOCK_SIZE);
+		break;
+	}
+}
+
+/*
+ * Load an on-disk bitmap block into the container @c of a bitmap.
+ */
+int dmz_bitmap_load_block(struct dmz_bitmap *bm, unsigned int c,
+			  const __u8 *buf)
+{
+	__u64 words[DMZ_BM_WORDS];
+	unsigned int i;
+
+	if (c >= bm->nr_conts)
+		return -1;
+
+	/* On-disk bitmaps are little-endian byte arrays */
+	memcpy(words, buf, DMZ_BLOCK_SIZE);
+	for (i = 0; i < DMZ_BM_WORDS; i++)
+		words[i] = __le64_to_cpu(words[i]);
+
+	bm->weight -= bm->conts[c].weight;
+	if (dmz_bitmap_cont_set(&bm->conts[c], words,
+				dmz_bitmap_cont_bits(bm, c)) < 0) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	bm->weight += bm->conts[c].weight;
+
+	return 0;
+}
+
+/*
+ * Read a zone bitmap from a metadata set into a compressed bitmap.
+ */
+struct dmz_bitmap *dmz_bitmap_read_zone(struct dmz_dev *dev,
+					struct dmz_meta_set *mset,
+					unsigned int zone_id)
+{
+	struct dmz_bitmap *bm;
+	__u64 bitmap_block;
+	unsigned int b;
+	__u8 *buf;
+
+	bm = dmz_bitmap_alloc(dev->zone_nr_blocks);
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!bm || !buf) {
+		fprintf(stderr, "Not enough memory\n");
+		goto err;
+	}
+
+	bitmap_block = mset->bitmap_block +
+		(zone_id * dev->zone_nr_bitmap_blocks);
+	for (b = 0; b < dev->zone_nr_bitmap_blocks; b++) {
+		if (dmz_read_block(dev, bitmap_block + b, buf) != 0) {
+			fprintf(stderr,
+				"Read zone %u bitmap block %llu failed\n",
+				zone_id, bitmap_block + b);
+			goto err;
+		}
+		if (dmz_bitmap_load_block(bm, b, buf) < 0)
+			goto err;
+	}
+
+	free(buf);
+
+	return bm;
+
+err:
+	free(buf);
+	dmz_bitmap_free(bm);
+
+	return NULL;
+}
+
+/*
+ * Get the index of the first offset of an array container at or
+ * after @ofst.
+ */
+static unsigned int dmz_bitmap_array_find(const __u16 *data,
+					  unsigned int nr, unsigned int ofst)
+{
+	unsigned int lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (data[mid] < ofst)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Get the number of runs of a run container starting at or
+ * before @ofst.
+ */
+static unsigned int dmz_bitmap_run_find(const __u16 *data,
+					unsigned int nr, unsigned int ofst)
+{
+	unsigned int lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (data[mid * 2] <= ofst)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Test a bit.
+ */
+bool dmz_bitmap_test(struct dmz_bitmap *bm, unsigned int bit)
+{
+	struct dmz_bitmap_cont *cont;
+	unsigned int i, ofst;
+	__u16 *data;
+
+	if (bit >= bm->nr_bits)
+		return false;
+
+	cont = &bm->conts[bit / DMZ_BLOCK_SIZE_BITS];
+	ofst = bit & DMZ_BLOCK_MASK_BITS;
+	data = cont->data;
+
+	switch (cont->type) {
+	case DMZ_BM_EMPTY:
+		return false;
+	case DMZ_BM_FULL:
+		return true;
+	case DMZ_BM_BITSET:
+		return ((__u64 *)data)[ofst / 64] & (1ULL << (ofst & 63));
+	case DMZ_BM_ARRAY:
+		i = dmz_bitmap_array_find(data, cont->nr, ofst);
+		return i < cont->nr && data[i] == ofst;
+	case DMZ_BM_RUN:
+		/* The last run starting at or before ofst */
+		i = dmz_bitmap_run_find(data, cont->nr, ofst);
+		return i && ofst <= (unsigned int)data[(i - 1) * 2] +
+			data[(i - 1) * 2 + 1];
+	}
+
+	return false;
+}
+
+/*
+ * Get the first set bit at or after @bit, or bm->nr_bits if none.
+ */
+unsigned int dmz_bitmap_next(struct dmz_bitmap *bm, unsigned int bit)
+{
+	struct dmz_bitmap_cont *cont;
+	unsigned int c, i, ofst, base;
+	__u16 *data;
+	__u64 w;
+
+	while (bit < bm->nr_bits) {
+		c = bit / DMZ_BLOCK_SIZE_BITS;
+		cont = &bm->conts[c];
+		base = c * DMZ_BLOCK_SIZE_BITS;
+		ofst = bit - base;
+		data = cont->data;
+
+		switch (cont->type) {
+		case DMZ_BM_EMPTY:
+			break;
+		case DMZ_BM_FULL:
+			return bit;
+		case DMZ_BM_BITSET:
+			i = ofst / 64;
+			w = ((__u64 *)data)[i] & (~0ULL << (ofst & 63));
+			while (!w && ++i < DMZ_BM_WORDS)
+				w = ((__u64 *)data)[i];
+			if (w)
+				return base + i * 64 + __builtin_ctzll(w);
+			break;
+		case DMZ_BM_ARRAY:
+			i = dmz_bitmap_array_find(data, cont->nr, ofst);
+			if (i < cont->nr)
+				return base + data[i];
+			break;
+		case DMZ_BM_RUN:
+			/* Within the last run starting at or before ofst */
+			i = dmz_bitmap_run_find(data, cont->nr, ofst);
+			if (i && ofst <= (unsigned int)data[(i - 1) * 2] +
+			    data[(i - 1) * 2 + 1])
+				return bit;
+			/* Or at the start of the next run */
+			if (i < cont->nr)
+				return base + data[i * 2];
+			break;
+		}
+
+		bit = base + DMZ_BLOCK_SIZE_BITS;
+	}
+
+	return bm->nr_bits;
+}
+
+/*
+ * Get the number of bits set in both @a and @b.
+ */
+unsigned int dmz_bitmap_and_weight(struct dmz_bitmap *a,
+				   struct dmz_bitmap *b)
+{
+	__u64 wa[DMZ_BM_WORDS], wb[DMZ_BM_WORDS];
+	struct dmz_bitmap_cont *ca, *cb;
+	unsigned int c, i, bits, weight = 0;
+	__u16 *data;
+
+	for (c = 0; c < a->nr_conts && c < b->nr_conts; c++) {
+		ca = &a->conts[c];
+		cb = &b->conts[c];
+
+		if (ca->type == DMZ_BM_EMPTY || cb->type == DMZ_BM_EMPTY)
+			continue;
+		if (ca->type == DMZ_BM_FULL) {
+			weight += cb->weight;
+			continue;
+		}
+		if (cb->type == DMZ_BM_FULL) {
+			weight += ca->weight;
+			continue;
+		}
+
+		/* Arrays: test each set bit in the other container */
+		if (cb->type == DMZ_BM_ARRAY && ca->type != DMZ_BM_ARRAY) {
+			struct dmz_bitmap_cont *t = ca;
+
+			ca = cb;
+			cb = t;
+		}
+		if (ca->type == DMZ_BM_ARRAY) {
+			struct dmz_bitmap *o = ca == &a->conts[c] ? b : a;
+
+			data = ca->data;
+			for (i = 0; i < ca->nr; i++) {
+				if (dmz_bitmap_test(o, c * DMZ_BLOCK_SIZE_BITS +
+						    data[i]))
+					weight++;
+			}
+			continue;
+		}
+
+		bits = dmz_bitmap_cont_bits(a, c);
+		dmz_bitmap_cont_expand(ca, wa, bits);
+		dmz_bitmap_cont_expand(cb, wb, bits);
+		for (i = 0; i < DMZ_BM_WORDS; i++)
+			weight += __builtin_popcountll(wa[i] & wb[i]);
+	}
+
+	return weight;
+}
+
+/*
+ * Set @dst to the intersection of @a and @b. All bitmaps must have
+ * the same number of bits.
+ */
+int dmz_bitmap_and(struct dmz_bitmap *dst, struct dmz_bitmap *a,
+		   struct dmz_bitmap *b)
+{
+	__u64 wa[DMZ_BM_WORDS], wb[DMZ_BM_WORDS];
+	unsigned int c, i, bits;
+
+	if (dst->nr_bits != a->nr_bits || dst->nr_bits != b->nr_bits)
+		return -1;
+
+	dst->weight = 0;
+	for (c = 0; c < dst->nr_conts; c++) {
+		bits = dmz_bitmap_cont_bits(dst, c);
+		dmz_bitmap_cont_expand(&a->conts[c], wa, bits);
+		dmz_bitmap_cont_expand(&b->conts[c], wb, bits);
+		for (i = 0; i < DMZ_BM_WORDS; i++)
+			wa[i] &= wb[i];
+		if (dmz_bitmap_cont_set(&dst->conts[c], wa, bits) < 0) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+		dst->weight += dst->conts[c].weight;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the memory used by a bitmap.
+ */
+size_t dmz_bitmap_size(struct dmz_bitmap *bm)
+{
+	struct dmz_bitmap_cont *cont;
+	size_t size;
+	unsigned int c;
+
+	size = sizeof(struct dmz_bitmap) +
+		bm->nr_conts * sizeof(struct dmz_bitmap_cont);
+	for (c = 0; c < bm->nr_conts; c++) {
+		cont = &bm->conts[c];
+		switch (cont->type) {
+		case DMZ_BM_ARRAY:
+			size += cont->nr * sizeof(__u16);
+			break;
+		case DMZ_BM_RUN:
+			size += cont->nr * 2 * sizeof(__u16);
+			break;
+		case DMZ_BM_BITSET:
+			size += DMZ_BLOCK_SIZE;
+			break;
+		}
+	}
+
+	return size;
+}
+
+/*
+ * Get the number of extents (runs of consecutive set bits) of a bitmap.
+ */
+unsigned int dmz_bitmap_extents(struct dmz_bitmap *bm)
+{
+	__u64 words[DMZ_BM_WORDS];
+	struct dmz_bitmap_cont *cont;
+	unsigned int c, i, extents = 0;
+	__u64 carry = 0;
+
+	for (c = 0; c < bm->nr_conts; c++) {
+		cont = &bm->conts[c];
+
+		if (cont->type == DMZ_BM_EMPTY) {
+			carry = 0;
+			continue;
+		}
+		if (cont->type == DMZ_BM_FULL &&
+		    dmz_bitmap_cont_bits(bm, c) == DMZ_BLOCK_SIZE_BITS) {
+			if (!carry)
+				extents++;
+			carry = 1;
+			continue;
+		}
+
+		/* Count the set bits not preceded by a set bit */
+		dmz_bitmap_cont_expand(cont, words, dmz_bitmap_cont_bits(bm, c));
+		for (i = 0; i < DMZ_BM_WORDS; i++) {
+			extents += __builtin_popcountll(words[i] &
+							~((words[i] << 1) | carry));
+			carry = words[i] >> 63;
+		}
+	}
+
+	return extents;
+}
@@ -49,8 +49,8 @@ static inline int dmz_repair_dev(struct dmz_dev *dev)
 /*
  * Read a zone bitmap blocks.
  */
-static int dmz_read_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
-				unsigned int zone_id, __u8 **buf)
+int dmz_read_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			 unsigned int zone_id, __u8 **buf)
 {
 	__u8 *bitmap_buf;
 	__u64 bitmap_block;
@@ -86,8 +86,8 @@ static int dmz_read_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
 /*
  * Write a zone bitmap blocks.
  */
-static int dmz_write_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
-				 unsigned int zone_id, __u8 *buf)
+int dmz_write_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
+			  unsigned int zone_id, __u8 *buf)
 {
 	__u64 bitmap_block;
 	unsigned int b;
@@ -112,7 +112,7 @@ static int dmz_write_zone_bitmap(struct dmz_dev *dev, struct dmz_meta_set *mset,
 /*
  * Read a metadata set map table blocks.
  */
-static int dmz_read_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
+int dmz_read_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
 {
 	unsigned int b;
 	int ret;
@@ -143,7 +143,7 @@ static int dmz_read_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
 /*
  * Write a metadata set map table blocks.
  */
-static int dmz_write_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
+int dmz_write_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
 {
 	unsigned int b;
 	int ret;
@@ -165,11 +165,11 @@ static int dmz_write_map_blocks(struct dmz_dev *dev, struct dmz_meta_set *mset)
 /*
  * Get a chunk mapping.
  */
-static void dmz_get_chunk_mapping(struct dmz_dev *dev,
-				  struct dmz_meta_set *mset,
-				  unsigned int chunk,
-				  unsigned int *dzone_id,
-				  unsigned int *bzone_id)
+void dmz_get_chunk_mapping(struct dmz_dev *dev,
+			   struct dmz_meta_set *mset,
+			   unsigned int chunk,
+			   unsigned int *dzone_id,
+			   unsigned int *bzone_id)
 {
 	struct dm_zoned_map *map;
 	unsigned int map_idx = chunk & DMZ_MAP_ENTRIES_MASK;
@@ -183,11 +183,11 @@ static void dmz_get_chunk_mapping(struct dmz_dev *dev,
 /*
  * Set a chunk mapping.
  */
-static void dmz_set_chunk_mapping(struct dmz_dev *dev,
-				  struct dmz_meta_set *mset,
-				  unsigned int chunk,
-				  unsigned int dzone_id,
-				  unsigned int bzone_id)
+void dmz_set_chunk_mapping(struct dmz_dev *dev,
+			   struct dmz_meta_set *mset,
+			   unsigned int chunk,
+			   unsigned int dzone_id,
+			   unsigned int bzone_id)
 {
 	struct dm_zoned_map *map;
 	unsigned int map_idx = chunk & DMZ_MAP_ENTRIES_MASK;
@@ -509,9 +509,16 @@ static int dmz_check_mapped_zone_bitmap(struct dmz_dev *dev,
 	if (ret != 0)
 		return -1;
 
-	/* No valid block should be present after the write pointer */
+	/*
+	 * No valid block should be present after the write pointer. Full
+	 * zones with a capacity smaller than the zone size may report a
+	 * write pointer at the end of the zone: no valid block should be
+	 * present after the zone capacity either.
+	 */
 	bad_bits = 0;
 	wp_block = dmz_sect2blk(zone->wp - zone->start);
+	if (wp_block > dmz_sect2blk(dmz_zone_capacity(zone)))
+		wp_block = dmz_sect2blk(dmz_zone_capacity(zone));
 	for (b = 0; b < wp_block; b++) {
 		if (dmz_test_bit(dbuf, b))
 			dzone_weight++;
@@ -843,7 +850,7 @@ static int dmz_check_sb(struct dmz_dev *dev, struct dmz_meta_set *mset)
 	if (__le64_to_cpu(sb->nr_meta_blocks) != dev->nr_meta_blocks) {
 		dmz_err(dev, 0,
 			"invalid number of metadata blocks "
-			"(expected %u, read %llu)\n",
+			"(expected %llu, read %llu)\n",
 			dev->nr_meta_blocks, __le64_to_cpu(sb->nr_meta_blocks));
 		goto err;
 	}
@@ -882,11 +889,12 @@ static int dmz_check_sb(struct dmz_dev *dev, struct dmz_meta_set *mset)
 	}
 
 	/* Check the number of zone bitmap blocks */
-	dev->nr_bitmap_blocks = dev->nr_zones * dev->zone_nr_bitmap_blocks;
+	dev->nr_bitmap_blocks =
+		(__u64)dev->nr_zones * dev->zone_nr_bitmap_blocks;
 	if (__le32_to_cpu(sb->nr_bitmap_blocks) != dev->nr_bitmap_blocks) {
 		dmz_err(dev, 0,
 			"invalid number of zone bitmap blocks "
-			"(expected %u, read %u)\n",
+			"(expected %llu, read %u)\n",
 			dev->nr_bitmap_blocks,
 			__le32_to_cpu(sb->nr_bitmap_blocks));
 		goto err;
@@ -923,14 +931,14 @@ static void dmz_check_print_format(struct dmz_dev *dev,
 
 	dmz_msg(dev, ind, "%u usable zones\n",
 		dev->nr_usable_zones);
-	dmz_msg(dev, ind, "%u metadata blocks per set\n",
+	dmz_msg(dev, ind, "%llu metadata blocks per set\n",
 		dev->nr_meta_blocks);
 	dmz_msg(dev, ind + 2, "Super block at block %llu and %llu\n",
 		dev->sb_block,
 		dev->sb_block + (dev->nr_meta_zones * dev->zone_nr_blocks));
 	dmz_msg(dev, ind + 2, "%u chunk mapping table blocks\n",
 		dev->nr_map_blocks);
-	dmz_msg(dev, ind + 2, "%u bitmap blocks\n",
+	dmz_msg(dev, ind + 2, "%llu bitmap blocks\n",
 		dev->nr_bitmap_blocks);
 	dmz_msg(dev, ind + 2, "Using %u zones per meta-data set (%u total)\n",
 		dev->nr_meta_zones,
@@ -966,8 +974,8 @@ static int dmz_block_is_sb(__u8 *buf)
 /*
  * Check validity of the device superblocks.
  */
-static int dmz_check_superblocks(struct dmz_dev *dev,
-				 struct dmz_meta_set *mset)
+int dmz_check_superblocks(struct dmz_dev *dev,
+			  struct dmz_meta_set *mset)
 {
 	unsigned int i;
 	int ret, ind = 2;
@@ -1063,8 +1071,8 @@ static int dmz_check_tertiary_superblocks(struct dmz_dev *dev)
  * Choose a valid metadata set for checks. Here valid means that
  * the set super block has no error AND has the highest generation.
  */
-static struct dmz_meta_set *dmz_validate_meta_set(struct dmz_dev *dev,
-						  struct dmz_meta_set *mset)
+struct dmz_meta_set *dmz_validate_meta_set(struct dmz_dev *dev,
+					   struct dmz_meta_set *mset)
 {
 	int valid = 0;
 
@@ -1127,7 +1135,7 @@ static int dmz_compare_meta(struct dmz_dev *dev,
 
 	if (mset->error_count == 0) {
 		dmz_msg(dev, ind + 2,
-			"No error: %u blocks checked\n",
+			"No error: %llu blocks checked\n",
 			dev->nr_meta_blocks);
 		mset->flags = DMZ_MSET_VALID;
 	} else {
@@ -1244,7 +1252,7 @@ static int dmz_repair_sync_meta(struct dmz_dev *dev,
 	/* Write super block in destination */
 	if (dst_mset->id != 0)
 		dst_sb_offset = dev->zone_nr_blocks * dev->nr_meta_zones;
-	ret = dmz_write_super(dev, src_mset->gen, dst_sb_offset);
+	ret = dmz_write_super(dev, src_mset->gen, dst_sb_offset, false);
 	if (ret != 0)
 		return -1;
 
@@ -1377,7 +1385,7 @@ int dmz_relabel(struct dmz_dev *dev)
 	memcpy(dev->label, dev->new_label, DMZ_LABEL_LEN);
 
 	/* Update primary super block */
-	ret = dmz_write_super(dev, mset[0].gen, 0);
+	ret = dmz_write_super(dev, mset[0].gen, 0, false);
 	if (ret) {
 		fprintf(stderr, "Relabel primary super block failed\n");
 		goto err;
@@ -1385,7 +1393,8 @@ int dmz_relabel(struct dmz_dev *dev)
 
 	/* Update primary super block */
 	ret = dmz_write_super(dev, mset[1].gen,
-			      dev->zone_nr_blocks * dev->nr_meta_zones);
+			      dev->zone_nr_blocks * dev->nr_meta_zones,
+			      false);
 	if (ret) {
 		fprintf(stderr, "Relabel secondary super block failed\n");
 		goto err;
@@ -1395,7 +1404,8 @@ int dmz_relabel(struct dmz_dev *dev)
 		/* Update tertiary super blocks */
 		for (i = 1; i < dev->nr_bdev; i++) {
 			ret = dmz_write_super(dev, 0,
-					      dev->bdev[i].block_offset);
+					      dev->bdev[i].block_offset,
+					      false);
 			if (ret) {
 				fprintf(stderr,
 					"Relabel tertiary super block failed\n");
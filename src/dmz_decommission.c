@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <asm/byteorder.h>
+
+/*
+ * Per block device decommission statistics.
+ */
+struct dmz_decommission_stats {
+	bool			discarded;
+	unsigned long long	usec;
+};
+
+/*
+ * Destroy a super block if there is one at @block, which starts a zone.
+ * Super blocks in sequential zones are destroyed by resetting their zone.
+ */
+static int dmz_decommission_sb(struct dmz_dev *dev, __u64 block,
+			       __u8 *buf, unsigned int *nr_sb)
+{
+	struct dm_zoned_super *sb = (struct dm_zoned_super *)buf;
+	struct blk_zone *zone = &dev->zones[dmz_block_zone_id(dev, block)];
+	bool seq = dmz_zone_seq_req(zone) || dmz_zone_seq_pref(zone);
+	struct dmz_block_dev *bdev;
+	__u64 bdev_block;
+
+	if (seq && dmz_zone_empty(zone))
+		return 0;
+
+	if (dmz_read_block(dev, block, buf) < 0)
+		return -1;
+	if (__le32_to_cpu(sb->magic) != DMZ_MAGIC)
+		return 0;
+
+	bdev = dmz_block_to_bdev(dev, block, &bdev_block);
+	printf("  Destroying super block at %s block %llu\n",
+	       bdev->name, bdev_block);
+
+	if (seq) {
+		if (dmz_reset_zone(dev, zone) < 0)
+			return -1;
+	} else {
+		memset(buf, 0, DMZ_BLOCK_SIZE);
+		if (dmz_write_block(dev, block, buf) < 0)
+			return -1;
+	}
+	(*nr_sb)++;
+
+	return 0;
+}
+
+/*
+ * Destroy the primary and secondary super blocks, which start a zone of
+ * the metadata area, and the tertiary super blocks at the start of the
+ * zoned block devices of a multi-device target.
+ */
+static int dmz_decommission_sbs(struct dmz_dev *dev)
+{
+	unsigned int i, sb_zone_id, nr_sb = 0;
+	__u8 *buf;
+	int ret = -1;
+
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	if (dmz_locate_metadata(dev) == 0 && dev->sb_zone) {
+		sb_zone_id = dmz_zone_id(dev, dev->sb_zone);
+		for (i = 0; i < dev->max_nr_meta_zones; i++) {
+			if (dmz_decommission_sb(dev,
+				(__u64)(sb_zone_id + i) * dev->zone_nr_blocks,
+				buf, &nr_sb) < 0)
+				goto out;
+		}
+	} else {
+		printf("  No metadata area found\n");
+	}
+
+	for (i = 1; i < (unsigned int)dev->nr_bdev; i++) {
+		if (dmz_decommission_sb(dev, dev->bdev[i].block_offset,
+					buf, &nr_sb) < 0)
+			goto out;
+	}
+
+	if (dmz_sync_dev(dev) < 0)
+		goto out;
+
+	printf("  Destroyed %u super block%s\n",
+	       nr_sb, nr_sb > 1 ? "s" : "");
+	ret = 0;
+
+out:
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Discard a regular block device, or zero it out if it does not support
+ * discard.
+ */
+static int dmz_decommission_regular(struct dmz_dev *dev, int d,
+				    struct dmz_decommission_stats *stats)
+{
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	__u64 range[2];
+
+	range[0] = 0;
+	range[1] = bdev->capacity << 9;
+
+	if (ioctl(bdev->fd, BLKDISCARD, range) == 0) {
+		stats->discarded = true;
+		return 0;
+	}
+
+	if (errno != EOPNOTSUPP) {
+		fprintf(stderr,
+			"%s: Discard failed %d (%s)\n",
+			bdev->name, errno, strerror(errno));
+		return -1;
+	}
+
+	printf("%s: Discard not supported, zeroing out the device\n",
+	       bdev->name);
+	fflush(stdout);
+
+	if (ioctl(bdev->fd, BLKZEROOUT, range) < 0) {
+		fprintf(stderr,
+			"%s: Zero out failed %d (%s)\n",
+			bdev->name, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reset all zones of a zoned block device, or discard a regular block
+ * device.
+ */
+static int dmz_decommission_bdev(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_decommission_stats *stats =
+		(struct dmz_decommission_stats *)arg + d;
+	unsigned long long start = dmz_usec();
+	int ret;
+
+	if (dmz_bdev_is_zoned(&dev->bdev[d]))
+		ret = dmz_reset_bdev_zones(dev, d);
+	else
+		ret = dmz_decommission_regular(dev, d, stats);
+	stats->usec = dmz_usec() - start;
+
+	return ret;
+}
+
+/*
+ * Decommission a stopped target: destroy all super block copies so that
+ * the devices are not recognized as a dm-zoned target anymore, then reset
+ * all zones of the zoned block devices and discard the regular block
+ * device, with all block devices processed in parallel.
+ */
+int dmz_decommission(struct dmz_dev *dev)
+{
+	struct dmz_decommission_stats *stats;
+	int d, ret = -1;
+
+	stats = calloc(dev->nr_bdev, sizeof(struct dmz_decommission_stats));
+	if (!stats) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	/* Without super blocks, an interrupted decommission is harmless */
+	printf("Destroying super blocks\n");
+	if (dmz_decommission_sbs(dev) < 0)
+		goto out;
+
+	printf("Resetting zones and discarding regular devices\n");
+	fflush(stdout);
+	ret = dmz_run_bdev_workers(dev, dmz_decommission_bdev, stats);
+	if (ret < 0)
+		goto out;
+
+	ret = dmz_sync_dev(dev);
+	if (ret < 0)
+		goto out;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		printf("  %s: %s in %llu.%03llu s\n",
+		       dev->bdev[d].name,
+		       dmz_bdev_is_zoned(&dev->bdev[d]) ? "zones reset" :
+		       stats[d].discarded ? "discarded" : "zeroed out",
+		       stats[d].usec / 1000000,
+		       (stats[d].usec % 1000000) / 1000);
+	}
+
+	printf("Done.\n");
+
+out:
+	free(stats);
+
+	return ret;
+}
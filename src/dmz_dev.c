@@ -21,8 +21,9 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
-#include <mntent.h>
+#include <sys/sysmacros.h>
 #include <dirent.h>
+#include <sys/uio.h>
 
 #include <blkid/blkid.h>
 
@@ -78,133 +79,376 @@ unsigned int dmz_block_zone_id(struct dmz_dev *dev, __u64 block)
 }
 
 /*
- * Test if the device is mounted.
+ * Snapshot of the system block devices, their holders and of the mounted
+ * file systems. The snapshot is loaded once when the first block device
+ * is probed and shared by all the block devices of a device, so that
+ * probing many drives does not rescan /proc and sysfs for each drive.
+ * It is invalidated whenever a target is created or removed.
  */
-static int dmz_bdev_mounted(struct dmz_block_dev *bdev)
-{
-	struct mntent *mnt = NULL;
-	FILE *file = NULL;
+struct dmz_probe_bdev {
+	dev_t		devno;
+	char		name[NAME_MAX + 1];
+	char		holder[NAME_MAX + 1];
+};
+
+struct dmz_probe_mount {
+	dev_t		devno;
+	char		*source;
+};
+
+static struct dmz_probe {
+	bool			loaded;
+	struct dmz_probe_bdev	*bdevs;
+	unsigned int		nr_bdevs;
+	struct dmz_probe_mount	*mounts;
+	unsigned int		nr_mounts;
+} dmz_probe;
+
+#define DMZ_PROBE_ALLOC		64
 
-	file = setmntent("/proc/mounts", "r");
-	if (file == NULL)
-		return 0;
+/*
+ * Find a block device of the snapshot using its device number.
+ */
+static struct dmz_probe_bdev *dmz_probe_find(dev_t devno)
+{
+	unsigned int i;
 
-	while ((mnt = getmntent(file)) != NULL) {
-		if (strcmp(bdev->path, mnt->mnt_fsname) == 0)
-			break;
+	for (i = 0; i < dmz_probe.nr_bdevs; i++) {
+		if (dmz_probe.bdevs[i].devno == devno)
+			return &dmz_probe.bdevs[i];
 	}
-	endmntent(file);
 
-	return mnt ? 1 : 0;
+	return NULL;
 }
 
 /*
- * Test if the device is already used as a target backend.
+ * Find a block device of the snapshot using its kernel name.
  */
-static int dmz_bdev_busy(struct dmz_block_dev *bdev, char *holder)
+static struct dmz_probe_bdev *dmz_probe_find_name(const char *name)
 {
-	char path[128];
-	struct dirent **namelist;
-	int n, ret = 0;
+	unsigned int i;
 
-	snprintf(path, sizeof(path),
-		 "/sys/class/block/%s/holders",
-		 bdev->name);
+	for (i = 0; i < dmz_probe.nr_bdevs; i++) {
+		if (strcmp(dmz_probe.bdevs[i].name, name) == 0)
+			return &dmz_probe.bdevs[i];
+	}
+
+	return NULL;
+}
 
-	n = scandir(path, &namelist, NULL, alphasort);
-	if (n < 0) {
-		fprintf(stderr, "scandir %s failed\n", path);
+/*
+ * Get the number and kernel name of all block devices and partitions.
+ */
+static int dmz_probe_load_bdevs(void)
+{
+	struct dmz_probe_bdev *pb;
+	char line[512], name[NAME_MAX + 1];
+	unsigned int major, minor;
+	FILE *file;
+
+	file = fopen("/proc/partitions", "r");
+	if (!file) {
+		fprintf(stderr,
+			"Open /proc/partitions failed %d (%s)\n",
+			errno, strerror(errno));
 		return -1;
 	}
 
-	while (n--) {
-		if (strcmp(namelist[n]->d_name, "..") != 0 &&
-		    strcmp(namelist[n]->d_name, ".") != 0) {
-			if (holder)
-				strncpy(holder, namelist[n]->d_name, PATH_MAX);
-			ret = 1;
+	while (fgets(line, sizeof(line), file)) {
+		/* Skip the header line */
+		if (sscanf(line, "%u %u %*u %255s",
+			   &major, &minor, name) != 3)
+			continue;
+
+		if (!(dmz_probe.nr_bdevs % DMZ_PROBE_ALLOC)) {
+			pb = realloc(dmz_probe.bdevs,
+				     sizeof(struct dmz_probe_bdev) *
+				     (dmz_probe.nr_bdevs + DMZ_PROBE_ALLOC));
+			if (!pb) {
+				fprintf(stderr, "Not enough memory\n");
+				fclose(file);
+				return -1;
+			}
+			dmz_probe.bdevs = pb;
 		}
-		free(namelist[n]);
+
+		pb = &dmz_probe.bdevs[dmz_probe.nr_bdevs];
+		memset(pb, 0, sizeof(struct dmz_probe_bdev));
+		pb->devno = makedev(major, minor);
+		strcpy(pb->name, name);
+		dmz_probe.nr_bdevs++;
 	}
-	free(namelist);
 
-	return ret;
+	fclose(file);
+
+	return 0;
 }
 
 /*
- * Check if a device is a partition.
+ * Get the holders of all block devices. Only virtual block devices
+ * (device mapper, md, bcache...) can hold other block devices, so
+ * scanning their slaves is enough to get the holders of all devices.
  */
-static int dmz_bdev_is_partition(struct dmz_block_dev *bdev)
+static void dmz_probe_load_holders(void)
 {
-	char str[PATH_MAX] = {};
-	FILE *file;
-	int len;
+	struct dmz_probe_bdev *pb;
+	struct dirent *vde, *sde;
+	char path[PATH_MAX];
+	DIR *vdir, *sdir;
 
-	len = snprintf(str, sizeof(str),
-		       "/sys/class/block/%s/partition",
-		       bdev->name);
-	if (len >= PATH_MAX) {
-		fprintf(stderr, "name %s failed: %s\n", str,
-			strerror(ENAMETOOLONG));
-		return -1;
+	vdir = opendir("/sys/devices/virtual/block");
+	if (!vdir)
+		return;
+
+	while ((vde = readdir(vdir)) != NULL) {
+		if (vde->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/virtual/block/%s/slaves",
+			 vde->d_name);
+		sdir = opendir(path);
+		if (!sdir)
+			continue;
+
+		while ((sde = readdir(sdir)) != NULL) {
+			if (sde->d_name[0] == '.')
+				continue;
+			pb = dmz_probe_find_name(sde->d_name);
+			if (pb && !pb->holder[0])
+				strcpy(pb->holder, vde->d_name);
+		}
+		closedir(sdir);
 	}
 
-	file = fopen(str, "r");
-	if (!file) {
-		if (errno != ENOENT)
-			return -1;
+	closedir(vdir);
+}
+
+/*
+ * Get the device number and source of all mounted file systems.
+ */
+static int dmz_probe_load_mounts(void)
+{
+	struct dmz_probe_mount *pm;
+	unsigned int major, minor;
+	char *line = NULL, *sep;
+	size_t len = 0;
+	FILE *file;
+	int ret = 0;
+
+	file = fopen("/proc/self/mountinfo", "r");
+	if (!file)
 		return 0;
+
+	while (getline(&line, &len, file) > 0) {
+		if (sscanf(line, "%*u %*u %u:%u", &major, &minor) != 2)
+			continue;
+
+		if (!(dmz_probe.nr_mounts % DMZ_PROBE_ALLOC)) {
+			pm = realloc(dmz_probe.mounts,
+				     sizeof(struct dmz_probe_mount) *
+				     (dmz_probe.nr_mounts + DMZ_PROBE_ALLOC));
+			if (!pm) {
+				fprintf(stderr, "Not enough memory\n");
+				ret = -1;
+				break;
+			}
+			dmz_probe.mounts = pm;
+		}
+
+		pm = &dmz_probe.mounts[dmz_probe.nr_mounts];
+		pm->devno = makedev(major, minor);
+		pm->source = NULL;
+
+		/*
+		 * File systems such as btrfs do not report the device
+		 * number of their block device: also keep the mount source
+		 * which follows the file system type after the separator.
+		 */
+		sep = strstr(line, " - ");
+		if (sep && sscanf(sep + 3, "%*s %ms", &pm->source) != 1)
+			pm->source = NULL;
+
+		dmz_probe.nr_mounts++;
 	}
 
+	free(line);
 	fclose(file);
 
-	return 1;
+	return ret;
 }
 
 /*
- * Get a zoned block device model (host-aware or howt-managed).
+ * Load the block devices and mounts snapshot if not already done.
  */
-static int dmz_get_bdev_model(struct dmz_block_dev *bdev)
+static int dmz_probe_load(void)
 {
-	char str[PATH_MAX] = {};
-	FILE *file;
-	int res;
-	int len;
+	if (dmz_probe.loaded)
+		return 0;
 
-	/* Cache devices could be partitions. Check that */
-	res = dmz_bdev_is_partition(bdev);
-	if (res < 0)
-		return res;
+	if (dmz_probe_load_bdevs() < 0)
+		return -1;
 
-	if (res) {
-		/* This is a partition: only regular devices can have one */
-		bdev->type = DMZ_TYPE_REGULAR;
-		return 0;
+	dmz_probe_load_holders();
+
+	if (dmz_probe_load_mounts() < 0)
+		return -1;
+
+	dmz_probe.loaded = true;
+
+	return 0;
+}
+
+/*
+ * Drop the block devices and mounts snapshot so that it is reloaded
+ * by the next block device check.
+ */
+void dmz_probe_invalidate(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < dmz_probe.nr_mounts; i++)
+		free(dmz_probe.mounts[i].source);
+	free(dmz_probe.mounts);
+	free(dmz_probe.bdevs);
+	memset(&dmz_probe, 0, sizeof(dmz_probe));
+}
+
+/*
+ * Test if the device is mounted.
+ */
+static int dmz_bdev_mounted(struct dmz_block_dev *bdev)
+{
+	struct dmz_probe_mount *pm;
+	unsigned int i;
+
+	for (i = 0; i < dmz_probe.nr_mounts; i++) {
+		pm = &dmz_probe.mounts[i];
+		if (pm->devno == bdev->devno ||
+		    (pm->source && strcmp(pm->source, bdev->path) == 0))
+			return 1;
 	}
 
-	/* Check that this is a zoned block device */
-	len = snprintf(str, sizeof(str),
-		       "/sys/block/%s/queue/zoned",
-		       bdev->name);
+	return 0;
+}
 
-	/* Indicates truncation */
-	if (len >= PATH_MAX) {
-		fprintf(stderr, "name %s failed: %s\n", str,
-			strerror(ENAMETOOLONG));
+/*
+ * Test if the device is already used as a target backend.
+ */
+static int dmz_bdev_busy(struct dmz_block_dev *bdev, char *holder)
+{
+	struct dmz_probe_bdev *pb;
+
+	pb = dmz_probe_find(bdev->devno);
+	if (!pb || !pb->holder[0])
+		return 0;
+
+	if (holder)
+		strncpy(holder, pb->holder, PATH_MAX);
+
+	return 1;
+}
+
+/*
+ * Open the sysfs directory of a block device. Using the device number
+ * also works for partitions and for device mapper devices referenced
+ * with their /dev/mapper name.
+ */
+static int dmz_open_bdev_sysfs(struct dmz_block_dev *bdev)
+{
+	char path[64];
+	int dfd;
+
+	snprintf(path, sizeof(path),
+		 "/sys/dev/block/%u:%u",
+		 major(bdev->devno), minor(bdev->devno));
+	dfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0)
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+
+	return dfd;
+}
+
+/*
+ * Read a sysfs attribute of a block device, without the trailing newline.
+ */
+static int dmz_read_bdev_attr(int dfd, const char *attr,
+			      char *str, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dfd, attr, O_RDONLY);
+	if (fd < 0)
 		return -1;
-	}
 
-	file = fopen(str, "r");
-	if (!file) {
-		fprintf(stderr, "Open %s failed\n", str);
+	ret = read(fd, str, len - 1);
+	close(fd);
+	if (ret <= 0)
 		return -1;
+
+	str[ret] = '\0';
+	str[strcspn(str, "\n")] = '\0';
+
+	return 0;
+}
+
+/*
+ * Read an integer sysfs attribute of a block device.
+ * Return dflt if the attribute does not exist.
+ */
+static long long dmz_read_bdev_attr_int(int dfd, const char *attr,
+					long long dflt)
+{
+	char str[64], *end;
+	long long val;
+
+	if (dmz_read_bdev_attr(dfd, attr, str, sizeof(str)) < 0)
+		return dflt;
+
+	val = strtoll(str, &end, 10);
+	if (end == str)
+		return dflt;
+
+	return val;
+}
+
+/*
+ * Get a zoned block device model (host-aware or howt-managed).
+ */
+static int dmz_get_bdev_model(struct dmz_block_dev *bdev, int dfd)
+{
+	char str[32];
+#ifdef BLKGETZONESZ
+	__u32 zone_sectors = 0;
+
+	/*
+	 * Regular block devices have no zone size: this avoids sysfs
+	 * accesses for most cache devices.
+	 */
+	if (ioctl(bdev->fd, BLKGETZONESZ, &zone_sectors) == 0) {
+		if (!zone_sectors) {
+			bdev->type = DMZ_TYPE_REGULAR;
+			return 0;
+		}
+		bdev->zone_nr_sectors = zone_sectors;
 	}
-	memset(str, 0, sizeof(str));
-	res = fscanf(file, "%s", str);
-	fclose(file);
+#endif
 
-	if (res != 1) {
-		fprintf(stderr, "Invalid file %s format\n", str);
+	/* Cache devices could be partitions. Check that */
+	if (faccessat(dfd, "partition", F_OK, 0) == 0) {
+		/* This is a partition: only regular devices can have one */
+		bdev->type = DMZ_TYPE_REGULAR;
+		return 0;
+	}
+
+	/* Check that this is a zoned block device */
+	if (dmz_read_bdev_attr(dfd, "queue/zoned", str, sizeof(str)) < 0) {
+		fprintf(stderr,
+			"%s: Get zoned model failed\n",
+			bdev->path);
 		return -1;
 	}
 
@@ -218,14 +462,65 @@ static int dmz_get_bdev_model(struct dmz_block_dev *bdev)
 	return 0;
 }
 
+/*
+ * Test if a block device has poll queues configured.
+ */
+static bool dmz_bdev_has_poll(struct dmz_block_dev *bdev)
+{
+	int dfd, poll;
+
+	dfd = dmz_open_bdev_sysfs(bdev);
+	if (dfd < 0)
+		return false;
+
+	poll = dmz_read_bdev_attr_int(dfd, "queue/io_poll", 0);
+	close(dfd);
+
+	return poll == 1;
+}
+
+/*
+ * Switch the regular block device storing the metadata to polled
+ * direct IOs. If the device does not have poll queues, interrupt
+ * driven IOs are used.
+ */
+static void dmz_set_bdev_poll(struct dmz_block_dev *bdev)
+{
+#if defined(HAVE_PREADV2) && defined(HAVE_PWRITEV2) && defined(RWF_HIPRI)
+	int fl;
+
+	if (bdev->type != DMZ_TYPE_REGULAR || !dmz_bdev_has_poll(bdev)) {
+		printf("%s: No poll queues, using interrupt driven IOs\n",
+		       bdev->name);
+		return;
+	}
+
+	fl = fcntl(bdev->fd, F_GETFL);
+	if (fl < 0 || fcntl(bdev->fd, F_SETFL, fl | O_DIRECT) < 0) {
+		fprintf(stderr,
+			"%s: Enable direct IOs failed %d (%s)\n",
+			bdev->name, errno, strerror(errno));
+		return;
+	}
+
+	bdev->direct_io = true;
+	bdev->poll = true;
+	printf("%s: Using polled IOs\n", bdev->name);
+#else
+	printf("%s: Polled IOs not supported, using interrupt driven IOs\n",
+	       bdev->name);
+#endif
+}
+
 /*
  * Get device capacity and zone size.
  */
-static int dmz_get_bdev_capacity(struct dmz_block_dev *bdev)
+static int dmz_get_bdev_capacity(struct dmz_block_dev *bdev, int dfd)
 {
-	char str[128];
-	FILE *file;
-	int res;
+	__u64 nr_zones = 0;
+#ifdef BLKGETNRZONES
+	__u32 nr;
+#endif
 
 	/* Get capacity */
 	if (ioctl(bdev->fd, BLKGETSIZE64, &bdev->capacity) < 0) {
@@ -236,29 +531,15 @@ static int dmz_get_bdev_capacity(struct dmz_block_dev *bdev)
 	}
 	bdev->capacity >>= 9;
 
-	if (bdev->type == DMZ_TYPE_REGULAR)
+	if (bdev->type == DMZ_TYPE_REGULAR) {
+		bdev->zone_nr_sectors = 0;
 		return 0;
-
-	/* Get zone size */
-	snprintf(str, sizeof(str),
-		 "/sys/block/%s/queue/chunk_sectors",
-		 bdev->name);
-	file = fopen(str, "r");
-	if (!file) {
-		fprintf(stderr, "Open %s failed\n", str);
-		return -1;
 	}
 
-	memset(str, 0, sizeof(str));
-	res = fscanf(file, "%s", str);
-	fclose(file);
-
-	if (res != 1) {
-		fprintf(stderr, "Invalid file %s format\n", str);
-		return -1;
-	}
-
-	bdev->zone_nr_sectors = atol(str);
+	/* Get zone size, if the zone ioctls are not supported */
+	if (!bdev->zone_nr_sectors)
+		bdev->zone_nr_sectors =
+			dmz_read_bdev_attr_int(dfd, "queue/chunk_sectors", 0);
 	if (!bdev->zone_nr_sectors ||
 	    (bdev->zone_nr_sectors & DMZ_BLOCK_SECTORS_MASK)) {
 		fprintf(stderr,
@@ -269,13 +550,29 @@ static int dmz_get_bdev_capacity(struct dmz_block_dev *bdev)
 	bdev->zone_nr_blocks = dmz_sect2blk(bdev->zone_nr_sectors);
 
 	/* Get number of zones */
-	bdev->nr_zones = bdev->capacity / bdev->zone_nr_sectors;
-	if (bdev->capacity % bdev->zone_nr_sectors)
-		bdev->nr_zones++;
-	if (!bdev->nr_zones) {
+#ifdef BLKGETNRZONES
+	if (ioctl(bdev->fd, BLKGETNRZONES, &nr) == 0)
+		nr_zones = nr;
+#endif
+	if (!nr_zones)
+		nr_zones = DIV_ROUND_UP(bdev->capacity, bdev->zone_nr_sectors);
+	if (!nr_zones) {
 		fprintf(stderr, "%s: invalid number of zones\n", bdev->path);
 		return -1;
 	}
+	if (nr_zones > DMZ_MAX_NR_ZONES) {
+		fprintf(stderr,
+			"%s: Too many zones (%llu, maximum %u)\n",
+			bdev->path, nr_zones, DMZ_MAX_NR_ZONES);
+		return -1;
+	}
+	bdev->nr_zones = nr_zones;
+
+	/* Older kernels do not have these attributes: assume no limit */
+	bdev->max_open_zones =
+		dmz_read_bdev_attr_int(dfd, "queue/max_open_zones", 0);
+	bdev->max_active_zones =
+		dmz_read_bdev_attr_int(dfd, "queue/max_active_zones", 0);
 
 	return 0;
 }
@@ -314,7 +611,8 @@ static void dmz_print_zone(struct dmz_dev *dev,
 	}
 
 	printf("Zone %06u (%s): type 0x%x (%s), cond 0x%x (%s), need_reset %d, "
-	       "non_seq %d, sector %llu, %llu sectors, wp sector %llu\n",
+	       "non_seq %d, sector %llu, %llu sectors, capacity %llu sectors, "
+	       "wp sector %llu\n",
 	       dmz_zone_id(dev, zone), bdev->name,
 	       dmz_zone_type(zone),
 	       dmz_zone_type_str(zone),
@@ -324,80 +622,36 @@ static void dmz_print_zone(struct dmz_dev *dev,
 	       dmz_zone_non_seq(zone),
 	       dmz_zone_sector(zone),
 	       dmz_zone_length(zone),
+	       (unsigned long long)dmz_zone_capacity(zone),
 	       dmz_zone_wp_sector(zone));
 }
 
-#ifdef HAVE_BLK_ZONE_REP_V2
-static __u64 dmz_zone_capacity(struct blk_zone *blkz)
-{
-	/*
-	 * If dmzadm was compiled using a system supporting zone capacity but
-	 * is executed on another system without zone capacity support, the
-	 * capacity field will always be reported as 0. In this case, simply
-	 * return the zone length.
-	 */
-	if (!blkz->capacity)
-		return dmz_zone_length(blkz);
-	return blkz->capacity;
-}
-#else
-static __u64 dmz_zone_capacity(struct blk_zone *blkz)
-{
-	return dmz_zone_length(blkz);
-}
-#endif
-
-#define DMZ_REPORT_ZONES_BUFSZ	524288
-
 /*
- * Get a device zone configuration.
+ * Get the zone configuration of one of the block devices of a device.
  */
-int dmz_get_dev_zones(struct dmz_dev *dev)
+static int dmz_get_bdev_zones(struct dmz_dev *dev, int d, void *arg)
 {
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	__u64 sector_offset = dmz_blk2sect(bdev->block_offset);
+	unsigned int first_zone = dmz_block_zone_id(dev, bdev->block_offset);
 	struct blk_zone_report *rep = NULL;
 	unsigned int rep_max_zones;
 	struct blk_zone *blkz;
-	unsigned int i, nr_zones;
-	__u64 sector;
-	int ret = -1, d;
-
-	dev->nr_zones = 0;
-	for (d = 0; d < dev->nr_bdev; d++)
-		dev->nr_zones += dev->bdev[d].nr_zones;
-
-	/* Allocate zone array */
-	dev->zones = calloc(dev->nr_zones, sizeof(struct blk_zone));
-	if (!dev->zones) {
-		fprintf(stderr, "Not enough memory\n");
-		return -1;
-	}
-
-	/* Get a buffer for zone report */
-	rep = malloc(DMZ_REPORT_ZONES_BUFSZ);
-	if (!rep) {
-		fprintf(stderr, "Not enough memory\n");
-		goto out;
-	}
-	rep_max_zones =
-		(DMZ_REPORT_ZONES_BUFSZ - sizeof(struct blk_zone_report))
-		/ sizeof(struct blk_zone);
-
-	sector = 0;
-	nr_zones = 0;
-	while (sector < dev->capacity) {
-		__u64 sector_offset, bdev_sector;
-		struct dmz_block_dev *bdev;
+	unsigned int i, nr_zones = 0;
+	__u64 sector = 0;
+	int ret = -1;
 
-		bdev = dmz_sector_to_bdev(dev, sector, &bdev_sector);
-		if (bdev->type == DMZ_TYPE_REGULAR) {
+	if (bdev->type == DMZ_TYPE_REGULAR) {
+		/* Emulate zone information */
+		while (sector < bdev->capacity) {
 			__u64 zone_len = dev->zone_nr_sectors;
 
-			/* Emulate zone information */
-			blkz = &dev->zones[nr_zones];
-			blkz->start = sector;
-			if (blkz->start + zone_len > bdev->capacity)
-				zone_len = bdev->capacity - blkz->start;
+			blkz = &dev->zones[first_zone + nr_zones];
+			blkz->start = sector_offset + sector;
+			if (sector + zone_len > bdev->capacity)
+				zone_len = bdev->capacity - sector;
 			blkz->len = zone_len;
+			dmz_zone_set_capacity(blkz, zone_len);
 			blkz->wp = (__u64)-1;
 			blkz->type = BLK_ZONE_TYPE_UNKNOWN;
 			blkz->cond = BLK_ZONE_COND_NOT_WP;
@@ -405,18 +659,34 @@ int dmz_get_dev_zones(struct dmz_dev *dev)
 				dmz_print_zone(dev, bdev, blkz);
 			nr_zones++;
 			sector += dev->zone_nr_sectors;
-			continue;
 		}
+		return 0;
+	}
+
+	/*
+	 * Get a buffer for zone report. This is called from the device
+	 * worker thread: the buffer is allocated and first touched on the
+	 * device NUMA node.
+	 */
+	rep = malloc(DMZ_REPORT_ZONES_BUFSZ);
+	if (!rep) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	rep_max_zones =
+		(DMZ_REPORT_ZONES_BUFSZ - sizeof(struct blk_zone_report))
+		/ sizeof(struct blk_zone);
+
+	while (sector < bdev->capacity) {
 
 		/* Get zone information */
-		sector_offset = dmz_blk2sect(bdev->block_offset);
 		memset(rep, 0, DMZ_REPORT_ZONES_BUFSZ);
-		rep->sector = bdev_sector;
+		rep->sector = sector;
 		rep->nr_zones = rep_max_zones;
 		if (dev->flags & DMZ_VVERBOSE)
 			printf("%s: report zones sector %llu(%llu) zones %u start %u\n",
-			       bdev->name, rep->sector, sector, rep->nr_zones,
-			       nr_zones);
+			       bdev->name, rep->sector, sector_offset + sector,
+			       rep->nr_zones, first_zone + nr_zones);
 		ret = ioctl(bdev->fd, BLKREPORTZONE, rep);
 		if (ret != 0) {
 			fprintf(stderr,
@@ -437,25 +707,38 @@ int dmz_get_dev_zones(struct dmz_dev *dev)
 				fprintf(stderr,
 					"%s: Invalid zone %u size\n",
 					bdev->name,
-					dmz_zone_id(dev, blkz));
+					first_zone + nr_zones);
 				ret = -1;
 				goto out;
 			}
 
+			/*
+			 * If dmzadm was compiled using a system supporting
+			 * zone capacity but is executed on another system
+			 * without zone capacity support, the capacity field
+			 * is always reported as 0. In this case, use the zone
+			 * length.
+			 */
+			if (!dmz_zone_capacity(blkz))
+				dmz_zone_set_capacity(blkz,
+						      dmz_zone_length(blkz));
+
 			/* Check zone capacity */
-			if (dmz_zone_capacity(blkz) < dmz_zone_length(blkz)) {
+			if (dmz_zone_capacity(blkz) > dmz_zone_length(blkz) ||
+			    dmz_zone_capacity(blkz) & DMZ_BLOCK_SECTORS_MASK) {
 				fprintf(stderr,
-					"%s: Unsupported device with zone "
-					"capacity smaller than zone size\n",
-					bdev->name);
+					"%s: Invalid zone %u capacity\n",
+					bdev->name,
+					first_zone + nr_zones);
 				ret = -1;
 				goto out;
 			}
 
-			if (nr_zones >= dev->nr_zones) {
+			if (nr_zones >= bdev->nr_zones) {
 				fprintf(stderr,
 					"%s: Invalid zone %u start %llu\n",
-					bdev->name, nr_zones, blkz->start);
+					bdev->name, first_zone + nr_zones,
+					blkz->start);
 				ret = -1;
 				goto out;
 			}
@@ -464,30 +747,31 @@ int dmz_get_dev_zones(struct dmz_dev *dev)
 			if (dev->flags & DMZ_VVERBOSE)
 				dmz_print_zone(dev, bdev, blkz);
 
-			dev->zones[nr_zones] = *blkz;
+			dev->zones[first_zone + nr_zones] = *blkz;
 			nr_zones++;
 
-			sector = dmz_zone_sector(blkz) + dmz_zone_length(blkz);
+			sector = dmz_zone_sector(blkz) - sector_offset +
+				dmz_zone_length(blkz);
 			blkz++;
 		}
 
 	}
 
-	if (dev->nr_zones != nr_zones) {
+	if (bdev->nr_zones != nr_zones) {
 		fprintf(stderr,
 			"%s: Invalid number of zones (expected %u, got %u)\n",
-			dev->label,
-			dev->nr_zones, nr_zones);
+			bdev->name,
+			bdev->nr_zones, nr_zones);
 		ret = -1;
 		goto out;
 	}
 
-	if (sector != nr_zones * dev->zone_nr_sectors) {
+	if (sector != bdev->capacity) {
 		fprintf(stderr,
 			"%s: Invalid zones (last sector reported is %llu, "
 			"expected %llu)\n",
-			dev->label,
-			sector, dev->capacity);
+			bdev->name,
+			sector, bdev->capacity);
 		ret = -1;
 		goto out;
 	}
@@ -499,19 +783,76 @@ out:
 }
 
 /*
- * Get a device information.
+ * Get a device zone configuration. The zones of multiple block devices
+ * are reported in parallel.
  */
-static int dmz_get_bdev_info(struct dmz_block_dev *bdev)
+int dmz_get_dev_zones(struct dmz_dev *dev)
 {
-	if (dmz_get_bdev_model(bdev) < 0)
+	struct blk_zone *blkz;
+	__u64 total_nr_zones = 0;
+	unsigned int i;
+	int d;
+
+	for (d = 0; d < dev->nr_bdev; d++)
+		total_nr_zones += dev->bdev[d].nr_zones;
+	if (total_nr_zones > DMZ_MAX_NR_ZONES) {
+		fprintf(stderr,
+			"%s: Too many zones (%llu, maximum %u)\n",
+			dev->label, total_nr_zones, DMZ_MAX_NR_ZONES);
 		return -1;
+	}
+	dev->nr_zones = total_nr_zones;
 
-	if (dmz_get_bdev_capacity(bdev) < 0)
+	/* Allocate zone array */
+	dev->zones = calloc(dev->nr_zones, sizeof(struct blk_zone));
+	if (!dev->zones) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	if (dmz_run_bdev_workers(dev, dmz_get_bdev_zones, NULL) < 0)
 		return -1;
 
+	/* Get the smallest zone capacity */
+	dev->zone_nr_cap_sectors = dev->zone_nr_sectors;
+	for (i = 0; i < dev->nr_zones; i++) {
+		blkz = &dev->zones[i];
+		if (dmz_zone_length(blkz) == dev->zone_nr_sectors &&
+		    dmz_zone_capacity(blkz) < dev->zone_nr_cap_sectors)
+			dev->zone_nr_cap_sectors = dmz_zone_capacity(blkz);
+	}
+
 	return 0;
 }
 
+/*
+ * Get a device information.
+ */
+static int dmz_get_bdev_info(struct dmz_block_dev *bdev)
+{
+	int dfd, ret = -1;
+
+	dfd = dmz_open_bdev_sysfs(bdev);
+	if (dfd < 0)
+		return -1;
+
+	bdev->zone_nr_sectors = 0;
+	if (dmz_get_bdev_model(bdev, dfd) < 0)
+		goto out;
+
+	if (dmz_get_bdev_capacity(bdev, dfd) < 0)
+		goto out;
+
+	/* NUMA node of the device controller */
+	bdev->numa_node = dmz_read_bdev_attr_int(dfd, "device/numa_node", -1);
+
+	ret = 0;
+out:
+	close(dfd);
+
+	return ret;
+}
+
 /*
  * Use libblkid to check for existing file systems on the disk.
  * Return -1 on error, 0 if something valid is detected on the disk
@@ -583,11 +924,13 @@ out:
 int dmz_open_bdev(struct dmz_block_dev *bdev, enum dmz_op op, int flags)
 {
 	int open_flags = O_RDWR | O_LARGEFILE;
+	char holder[PATH_MAX];
 	struct stat st;
 	int ret;
 
 	bdev->name = basename(bdev->path);
 	bdev->direct_io = false;
+	bdev->poll = false;
 
 	/* Check that this is a block device */
 	if (stat(bdev->path, &st) < 0) {
@@ -604,18 +947,37 @@ int dmz_open_bdev(struct dmz_block_dev *bdev, enum dmz_op op, int flags)
 			bdev->path);
 		return -1;
 	}
+	bdev->devno = st.st_rdev;
+
+	if (dmz_probe_load() < 0)
+		return -1;
 
 	switch (op) {
 	case DMZ_OP_FORMAT:
+	case DMZ_OP_BENCH:
+	case DMZ_OP_BENCH_TARGET:
+		if (flags & DMZ_DRY_RUN)
+			break;
 		if (!(flags & DMZ_OVERWRITE)) {
 			/* Check for existing valid content */
 			ret = dmz_check_overwrite(bdev);
 			if (ret <= 0)
 				return -1;
 		}
+		if (op == DMZ_OP_BENCH) {
+			/*
+			 * Benchmarks must measure the device and not the
+			 * page cache: use direct IOs for all block devices.
+			 */
+			open_flags |= O_DIRECT;
+			bdev->direct_io = true;
+			break;
+		}
 		/* fallthrough */
 	case DMZ_OP_REPAIR:
 	case DMZ_OP_RELABEL:
+	case DMZ_OP_INJECT:
+	case DMZ_OP_REBALANCE:
 		/*
 		  * For block devices other than the first block device
 		  * storing the metadata, we may not have conventional zones.
@@ -627,7 +989,18 @@ int dmz_open_bdev(struct dmz_block_dev *bdev, enum dmz_op op, int flags)
 			bdev->direct_io = true;
 		}
 		break;
+	case DMZ_OP_DECOMMISSION:
+		/* Super blocks are destroyed with direct writes */
+		open_flags |= O_DIRECT;
+		bdev->direct_io = true;
+		break;
 	case DMZ_OP_CHECK:
+	case DMZ_OP_SCRUB:
+	case DMZ_OP_SURVEY:
+	case DMZ_OP_DUMP:
+	case DMZ_OP_DELTA:
+	case DMZ_OP_FINGERPRINT:
+	case DMZ_OP_SIMULATE:
 	case DMZ_OP_START:
 	case DMZ_OP_STOP:
 		break;
@@ -643,10 +1016,15 @@ int dmz_open_bdev(struct dmz_block_dev *bdev, enum dmz_op op, int flags)
 		return -1;
 	}
 
-	if (dmz_bdev_busy(bdev, NULL)) {
-		fprintf(stderr,
-			"%s is in use\n",
-			bdev->path);
+	if (dmz_bdev_busy(bdev, holder)) {
+		if (op == DMZ_OP_DECOMMISSION)
+			fprintf(stderr,
+				"%s is in use by %s: stop the target first\n",
+				bdev->path, holder);
+		else
+			fprintf(stderr,
+				"%s is in use\n",
+				bdev->path);
 		return -1;
 	}
 
@@ -666,6 +1044,9 @@ int dmz_open_bdev(struct dmz_block_dev *bdev, enum dmz_op op, int flags)
 		return -1;
 	}
 
+	if ((flags & DMZ_POLL) && (flags & DMZ_METADATA_BDEV))
+		dmz_set_bdev_poll(bdev);
+
 	return 0;
 }
 
@@ -693,6 +1074,10 @@ int dmz_get_bdev_holder(struct dmz_block_dev *bdev, char *holder)
 			bdev->path);
 		return -1;
 	}
+	bdev->devno = st.st_rdev;
+
+	if (dmz_probe_load() < 0)
+		return -1;
 
 	if (dmz_bdev_mounted(bdev)) {
 		fprintf(stderr,
@@ -721,7 +1106,7 @@ void dmz_close_bdev(struct dmz_block_dev *bdev)
 /*
  * Allocate a page aligned buffer suitable for direct IOs.
  */
-static __u8 *dmz_malloc_buf(size_t size)
+__u8 *dmz_malloc_buf(size_t size)
 {
 	void *buf;
 
@@ -731,6 +1116,39 @@ static __u8 *dmz_malloc_buf(size_t size)
 	return buf;
 }
 
+/*
+ * Read or write a metadata block using a polled IO. If the device
+ * rejects polled IOs, fall back to interrupt driven IOs.
+ */
+static ssize_t dmz_poll_rw(struct dmz_block_dev *bdev, __u8 *buf,
+			   __u64 block, bool write)
+{
+#if defined(HAVE_PREADV2) && defined(HAVE_PWRITEV2) && defined(RWF_HIPRI)
+	ssize_t ret;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = DMZ_BLOCK_SIZE,
+	};
+
+	if (write)
+		ret = pwritev2(bdev->fd, &iov, 1,
+			       block << DMZ_BLOCK_SHIFT, RWF_HIPRI);
+	else
+		ret = preadv2(bdev->fd, &iov, 1,
+			      block << DMZ_BLOCK_SHIFT, RWF_HIPRI);
+	if (ret >= 0 || errno != EOPNOTSUPP)
+		return ret;
+
+	bdev->poll = false;
+#endif
+
+	if (write)
+		return pwrite(bdev->fd, (char *)buf, DMZ_BLOCK_SIZE,
+			      block << DMZ_BLOCK_SHIFT);
+	return pread(bdev->fd, (char *)buf, DMZ_BLOCK_SIZE,
+		     block << DMZ_BLOCK_SHIFT);
+}
+
 /*
  * Read a metadata block.
  */
@@ -739,18 +1157,23 @@ int dmz_read_block(struct dmz_dev *dev, __u64 block, __u8 *buf)
 	__u64 read_block;
 	struct dmz_block_dev *bdev =
 		dmz_block_to_bdev(dev, block, &read_block);
+	bool bounce = bdev->direct_io &&
+		((unsigned long)buf & DMZ_BLOCK_MASK);
 	ssize_t ret;
 	__u8 *rdbuf = buf;
 
-	if (bdev->direct_io) {
+	if (bounce) {
 		/* bounce buffer */
 		rdbuf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
 		if (!rdbuf)
 			return -1;
 	}
 
-	ret = pread(bdev->fd, (char *)rdbuf, DMZ_BLOCK_SIZE,
-		    read_block << DMZ_BLOCK_SHIFT);
+	if (bdev->poll)
+		ret = dmz_poll_rw(bdev, rdbuf, read_block, false);
+	else
+		ret = pread(bdev->fd, (char *)rdbuf, DMZ_BLOCK_SIZE,
+			    read_block << DMZ_BLOCK_SHIFT);
 
 	if (ret != DMZ_BLOCK_SIZE) {
 		fprintf(stderr,
@@ -758,12 +1181,12 @@ int dmz_read_block(struct dmz_dev *dev, __u64 block, __u8 *buf)
 			bdev->name,
 			read_block,
 			errno, strerror(errno));
-		if (bdev->direct_io)
+		if (bounce)
 			free(rdbuf);
 		return -1;
 	}
 
-	if (bdev->direct_io) {
+	if (bounce) {
 		memcpy(buf, rdbuf, DMZ_BLOCK_SIZE);
 		free(rdbuf);
 	}
@@ -779,10 +1202,13 @@ int dmz_write_block(struct dmz_dev *dev, __u64 block, __u8 *buf)
 	__u64 write_block;
 	struct dmz_block_dev *bdev =
 		dmz_block_to_bdev(dev, block, &write_block);
+	bool bounce = bdev->direct_io &&
+		((unsigned long)buf & DMZ_BLOCK_MASK);
+	struct blk_zone *zone;
 	ssize_t ret;
 	__u8 *wrbuf = buf;
 
-	if (bdev->direct_io) {
+	if (bounce) {
 		/* bounce buffer */
 		wrbuf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
 		if (!wrbuf)
@@ -790,10 +1216,13 @@ int dmz_write_block(struct dmz_dev *dev, __u64 block, __u8 *buf)
 		memcpy(wrbuf, buf, DMZ_BLOCK_SIZE);
 	}
 
-	ret = pwrite(bdev->fd, (char *)wrbuf, DMZ_BLOCK_SIZE,
-		     write_block << DMZ_BLOCK_SHIFT);
+	if (bdev->poll)
+		ret = dmz_poll_rw(bdev, wrbuf, write_block, true);
+	else
+		ret = pwrite(bdev->fd, (char *)wrbuf, DMZ_BLOCK_SIZE,
+			     write_block << DMZ_BLOCK_SHIFT);
 
-	if (bdev->direct_io)
+	if (bounce)
 		free(wrbuf);
 
 	if (ret != DMZ_BLOCK_SIZE) {
@@ -805,6 +1234,14 @@ int dmz_write_block(struct dmz_dev *dev, __u64 block, __u8 *buf)
 		return -1;
 	}
 
+	/* Writing a sequential zone opens it */
+	zone = &dev->zones[dmz_block_zone_id(dev, block)];
+	if (dmz_zone_seq_req(zone)) {
+		if (zone->wp < dmz_blk2sect(block + 1))
+			zone->wp = dmz_blk2sect(block + 1);
+		return dmz_track_open_zone(dev, zone);
+	}
+
 	return 0;
 }
 
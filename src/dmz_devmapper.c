@@ -13,17 +13,49 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
 #include <libkmod.h>
 #include <asm/byteorder.h>
 
 #include <libdevmapper.h>
+#include <linux/dm-ioctl.h>
+
+/*
+ * Test if a module is loaded, without the cost of loading the kmod
+ * resources. Built-in modules may not be listed.
+ */
+static bool dmz_module_loaded(const char *modname)
+{
+	char path[PATH_MAX];
+	int i, len;
+
+	len = snprintf(path, sizeof(path), "/sys/module/%s", modname);
+	for (i = strlen("/sys/module/"); i < len; i++) {
+		if (path[i] == '-')
+			path[i] = '_';
+	}
+
+	return access(path, F_OK) == 0;
+}
 
 int dmz_load_module(const char *modname, int log_level)
 {
-	struct kmod_ctx *ctx = kmod_new(NULL, NULL);
+	struct kmod_ctx *ctx;
 	struct kmod_list *modlist = NULL, *itr;
 	int state, ret;
 
+	if (dmz_module_loaded(modname)) {
+		if (log_level)
+			printf("Module '%s' already loaded\n", modname);
+		return 0;
+	}
+
+	ctx = kmod_new(NULL, NULL);
 	if (!ctx)
 		return -ENOMEM;
 	kmod_load_resources(ctx);
@@ -80,6 +112,31 @@ int dmz_load_module(const char *modname, int log_level)
 	return ret;
 }
 
+/*
+ * Get the metadata version supported by a dm-zoned target version.
+ */
+static int dmz_dm_meta_ver(const uint32_t *version, int log_level)
+{
+	if (log_level)
+		printf("Found dm-zoned version %d.%d.%d\n",
+		       version[0], version[1], version[2]);
+
+	switch (version[0]) {
+	case DMZ_DM_VER:
+		/* Interface v3 uses v2 metadata */
+		/* fall through */
+	case 2:
+		return DMZ_META_VER;
+	case 1:
+		return version[0];
+	default:
+		fprintf(stderr,
+			"Unsupported dm-zoned version %d.%d.%d\n",
+			version[0], version[1], version[2]);
+		return -EINVAL;
+	}
+}
+
 int dmz_init_dm(int log_level)
 {
 	struct dm_task *dmt;
@@ -104,31 +161,8 @@ int dmz_init_dm(int log_level)
 	tgt = dm_task_get_versions(dmt);
 	do {
 		last_tgt = tgt;
-		if (!strncmp("zoned", tgt->name, 5)) {
-			if (log_level)
-				printf("Found dm-zoned version %d.%d.%d\n",
-				       tgt->version[0], tgt->version[1],
-				       tgt->version[2]);
-			ret = 0;
-			switch (tgt->version[0]) {
-			case DMZ_DM_VER:
-				/* Interface v3 uses v2 metadata */
-				/* fall through */
-			case 2:
-				ret = DMZ_META_VER;
-				break;
-			case 1:
-				ret = tgt->version[0];
-				break;
-			default:
-				fprintf(stderr,
-					"Unsupported dm-zoned version %d.%d.%d\n",
-					tgt->version[0], tgt->version[1],
-					tgt->version[2]);
-				ret = -EINVAL;
-				break;
-			}
-		}
+		if (!strncmp("zoned", tgt->name, 5))
+			ret = dmz_dm_meta_ver(tgt->version, log_level);
 		tgt = (void *) tgt + tgt->next;
 	} while (last_tgt != tgt);
 
@@ -139,35 +173,34 @@ int dmz_init_dm(int log_level)
 	return ret;
 }
 
-int dmz_create_dm(struct dmz_dev *dev)
+/*
+ * Get the table of a target: the capacity and the parameters, that is,
+ * the list of all block device paths.
+ */
+static char *dmz_dm_table(struct dmz_dev *dev, __u64 *capacity)
 {
-	int ret = -EINVAL;
-	struct dm_task *dmt;
-	uint32_t cookie = 0;
-	__u64 capacity = dev->nr_zones * dev->zone_nr_sectors;
-	__u16 udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
-	char params[4096];
+	size_t params_len = 1;
+	char *params;
+	int i;
 
 	/*
 	 * dm-zoned interface version 3 allows for capacity
 	 * being different than the resulting device size.
 	 */
-	capacity = dev->nr_chunks * dev->zone_nr_sectors;
-
-	if (!(dmt = dm_task_create(DM_DEVICE_CREATE)))
-		return -ENOMEM;
+	*capacity = (__u64)dev->nr_chunks * dev->zone_nr_sectors;
 
-	if (!dm_task_set_name (dmt, dev->label))
-		goto out;
+	for (i = 0; i < dev->nr_bdev; i++)
+		params_len += strlen(dev->bdev[i].path) + 1;
+	params = malloc(params_len);
+	if (!params)
+		return NULL;
 
 	if (dev->sb_version > 1 && dev->nr_bdev > 1) {
-		int i;
-		unsigned len = 0;
+		size_t len = 0;
 
-		for (i = 0; i < dev->nr_bdev; i++) {
-			len += snprintf(params + len, 4096 - len,
-					"%s ", dev->bdev[i].path);
-		}
+		for (i = 0; i < dev->nr_bdev; i++)
+			len += sprintf(params + len, "%s ",
+				       dev->bdev[i].path);
 	} else {
 		sprintf(params, "%s", dev->bdev[0].path);
 		if (dmz_mod_ver == 1) {
@@ -176,16 +209,40 @@ int dmz_create_dm(struct dmz_dev *dev)
 			 * require the entire backend device capacity to be
 			 * specified.
 			 */
-			capacity = dev->bdev[0].capacity;
+			*capacity = dev->bdev[0].capacity;
 		}
 	}
 
-	if (!dm_task_add_target(dmt, 0, capacity, "zoned", params))
-		goto out;
-
 	if (dev->flags & DMZ_VERBOSE)
 		printf("%s: table 0 %llu zoned %s\n", dev->label,
-		       capacity, params);
+		       *capacity, params);
+
+	return params;
+}
+
+int dmz_create_dm(struct dmz_dev *dev)
+{
+	int ret = -EINVAL;
+	struct dm_task *dmt;
+	uint32_t cookie = 0;
+	__u64 capacity;
+	__u16 udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	char *params;
+
+	params = dmz_dm_table(dev, &capacity);
+	if (!params)
+		return -ENOMEM;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_CREATE))) {
+		free(params);
+		return -ENOMEM;
+	}
+
+	if (!dm_task_set_name (dmt, dev->label))
+		goto out;
+
+	if (!dm_task_add_target(dmt, 0, capacity, "zoned", params))
+		goto out;
 
 	if (dev->sb_version > 1) {
 		char prefixed_uuid[UUID_STR_LEN + 4];
@@ -208,11 +265,241 @@ int dmz_create_dm(struct dmz_dev *dev)
 
 out:
 	dm_task_destroy(dmt);
+	free(params);
+
+	return ret;
+}
+
+/*
+ * Size of the ioctl buffers of the raw device-mapper interface,
+ * large enough for the list of all target versions.
+ */
+#define DMZ_DM_IOCTL_BUF_SIZE	16384
+
+/*
+ * Device-mapper control device (DM_DIR is relative to /dev).
+ */
+#define DMZ_DM_CONTROL		"/dev/" DM_DIR "/" DM_CONTROL_NODE
+
+/*
+ * Prepare a raw device-mapper ioctl. The interface version 4.0.0
+ * is requested, which all kernels with dm-zoned support.
+ */
+static struct dm_ioctl *dmz_dm_ioctl_init(void *buf, const char *name)
+{
+	struct dm_ioctl *dmi = buf;
+
+	memset(buf, 0, DMZ_DM_IOCTL_BUF_SIZE);
+	dmi->version[0] = DM_VERSION_MAJOR;
+	dmi->data_size = DMZ_DM_IOCTL_BUF_SIZE;
+	dmi->data_start = sizeof(struct dm_ioctl);
+	if (name)
+		strncpy(dmi->name, name, DM_NAME_LEN - 1);
+
+	return dmi;
+}
+
+/*
+ * Execute a raw device-mapper ioctl.
+ */
+static int dmz_dm_ioctl(int fd, unsigned long cmd, struct dm_ioctl *dmi,
+			const char *cmd_name)
+{
+	int ret;
+
+	if (ioctl(fd, cmd, dmi) < 0) {
+		ret = -errno;
+		fprintf(stderr, "device-mapper %s failed %d (%s)\n",
+			cmd_name, errno, strerror(errno));
+		return ret;
+	}
+
+	if (dmi->flags & DM_BUFFER_FULL_FLAG) {
+		fprintf(stderr, "device-mapper %s: buffer too small\n",
+			cmd_name);
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the device-mapper control device.
+ */
+static int dmz_dm_open_control(void)
+{
+	int fd;
+
+	fd = open(DMZ_DM_CONTROL, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Open %s failed %d (%s)\n",
+			DMZ_DM_CONTROL, errno, strerror(errno));
+		return -errno;
+	}
+
+	return fd;
+}
+
+/*
+ * Same as dmz_init_dm(), using the device-mapper ioctls directly.
+ */
+int dmz_init_dm_raw(int log_level)
+{
+	struct dm_target_versions *tgt;
+	struct dm_ioctl *dmi;
+	void *buf, *end;
+	int fd, ret = -ENXIO;
+
+	buf = malloc(DMZ_DM_IOCTL_BUF_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	fd = dmz_dm_open_control();
+	if (fd < 0) {
+		free(buf);
+		return -ENODEV;
+	}
+
+	dmi = dmz_dm_ioctl_init(buf, NULL);
+	if (dmz_dm_ioctl(fd, DM_LIST_VERSIONS, dmi, "list versions")) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	tgt = buf + dmi->data_start;
+	end = buf + dmi->data_size;
+	while ((void *)(tgt + 1) <= end) {
+		if (!strncmp("zoned", tgt->name, 5)) {
+			ret = dmz_dm_meta_ver(tgt->version, log_level);
+			break;
+		}
+		if (!tgt->next)
+			break;
+		tgt = (void *)tgt + tgt->next;
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "dm-zoned target not supported\n");
+
+out:
+	close(fd);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Create the device node of a target if udev is not running.
+ */
+static int dmz_dm_mknod(struct dmz_dev *dev)
+{
+	char path[PATH_MAX];
+
+	if (access("/run/udev/control", F_OK) == 0)
+		return 0;
+
+	snprintf(path, sizeof(path), "/dev/" DM_DIR "/%s", dev->label);
+	if (mknod(path, S_IFBLK | 0600, dev->dm_devno) < 0 &&
+	    errno != EEXIST) {
+		fprintf(stderr, "Create %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Same as dmz_create_dm(), using the device-mapper ioctls directly to
+ * create the device, load its table and resume it. This does not
+ * synchronize with udev: without udev, the device node is created here.
+ */
+int dmz_create_dm_raw(struct dmz_dev *dev)
+{
+	struct dm_target_spec *spec;
+	struct dm_ioctl *dmi;
+	__u64 capacity;
+	char *params;
+	size_t len;
+	void *buf;
+	int fd, ret = -EINVAL;
+
+	params = dmz_dm_table(dev, &capacity);
+	if (!params)
+		return -ENOMEM;
+
+	len = sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec) +
+		strlen(params) + 1;
+	if (len > DMZ_DM_IOCTL_BUF_SIZE) {
+		fprintf(stderr, "%s: table too large\n", dev->label);
+		free(params);
+		return -EINVAL;
+	}
+
+	buf = malloc(DMZ_DM_IOCTL_BUF_SIZE);
+	if (!buf) {
+		free(params);
+		return -ENOMEM;
+	}
+
+	fd = dmz_dm_open_control();
+	if (fd < 0) {
+		ret = fd;
+		goto out_free;
+	}
+
+	/* Create the device */
+	dmi = dmz_dm_ioctl_init(buf, dev->label);
+	if (dev->sb_version > 1) {
+		strcpy(dmi->uuid, "dmz-");
+		uuid_unparse(dev->uuid, dmi->uuid + 4);
+	}
+	ret = dmz_dm_ioctl(fd, DM_DEV_CREATE, dmi, "create");
+	if (ret)
+		goto out_close;
+	dev->dm_devno = dmi->dev;
+
+	/* Load its table */
+	dmi = dmz_dm_ioctl_init(buf, dev->label);
+	dmi->target_count = 1;
+	spec = buf + dmi->data_start;
+	spec->sector_start = 0;
+	spec->length = capacity;
+	strcpy(spec->target_type, "zoned");
+	strcpy((char *)(spec + 1), params);
+	ret = dmz_dm_ioctl(fd, DM_TABLE_LOAD, dmi, "table load");
+	if (ret)
+		goto out_remove;
+
+	/* And resume it */
+	dmi = dmz_dm_ioctl_init(buf, dev->label);
+	dmi->flags = DM_SKIP_LOCKFS_FLAG | DM_NOFLUSH_FLAG;
+	ret = dmz_dm_ioctl(fd, DM_DEV_SUSPEND, dmi, "resume");
+	if (ret)
+		goto out_remove;
+
+	if (dmz_dm_mknod(dev) < 0)
+		ret = -EIO;
+
+	goto out_close;
+
+out_remove:
+	dmi = dmz_dm_ioctl_init(buf, dev->label);
+	dmz_dm_ioctl(fd, DM_DEV_REMOVE, dmi, "remove");
+	dev->dm_devno = 0;
+out_close:
+	close(fd);
+out_free:
+	free(buf);
+	free(params);
 
 	return ret;
 }
 
-int dmz_check_dm_target(struct dmz_dev *dev, char *dm_dev)
+/*
+ * Check that a dm device is a zoned target and get its name.
+ */
+static int dmz_get_dm_target_name(const char *dm_dev, char *name)
 {
 	int ret = -EINVAL;
 	struct dm_task *dmt;
@@ -234,9 +521,42 @@ int dmz_check_dm_target(struct dmz_dev *dev, char *dm_dev)
 		goto out;
 	}
 	dm_get_next_target(dmt, NULL, &start, &length, &target_type, &params);
-	if (strlen(target_type) == 5 &&
-	    !strncmp(target_type, "zoned", 5)) {
-		strcpy(dev->label, dm_task_get_name(dmt));
+	if (target_type && !strcmp(target_type, "zoned")) {
+		strcpy(name, dm_task_get_name(dmt));
+		ret = 0;
+	}
+out:
+	dm_task_destroy(dmt);
+
+	return ret;
+}
+
+/*
+ * Get the status line of an active zoned target.
+ */
+int dmz_get_dm_status(const char *dm_dev, char *status, size_t len)
+{
+	int ret = -EINVAL;
+	struct dm_task *dmt;
+	uint64_t start, length;
+	char *target_type, *params;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_STATUS)))
+		return -ENOMEM;
+
+	if (!dm_task_set_name(dmt, dm_dev)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dm_task_no_open_count(dmt);
+
+	if (!dm_task_run(dmt))
+		goto out;
+
+	dm_get_next_target(dmt, NULL, &start, &length, &target_type, &params);
+	if (target_type && params && !strcmp(target_type, "zoned")) {
+		snprintf(status, len, "%s", params);
 		ret = 0;
 	}
 out:
@@ -267,6 +587,7 @@ int dmz_deactivate_dm(char *dm_dev)
 			ret = 0;
 		}
 	}
+	dmz_probe_invalidate();
 out:
 	dm_task_destroy(dmt);
 
@@ -351,6 +672,8 @@ out:
 
 int dmz_start(struct dmz_dev *dev)
 {
+	int ret;
+
 	/* Calculate metadata location */
 	if (dmz_locate_metadata(dev) < 0) {
 		fprintf(stderr,
@@ -369,6 +692,26 @@ int dmz_start(struct dmz_dev *dev)
 		return -1;
 	}
 
+	/*
+	 * The kernel target maps each chunk to an entire zone and cannot
+	 * use zones with a capacity smaller than their size.
+	 */
+	if (!(dev->flags & DMZ_UBLK) &&
+	    dev->zone_nr_cap_sectors < dev->zone_nr_sectors) {
+		fprintf(stderr,
+			"%s: The dm-zoned kernel target does not support "
+			"zones with a capacity (%zu sectors) smaller than "
+			"the zone size (%zu sectors)\n",
+			dev->bdev[0].name, dev->zone_nr_cap_sectors,
+			dev->zone_nr_sectors);
+#ifdef HAVE_UBLK
+		fprintf(stderr,
+			"Use the --ublk option to start the userspace "
+			"target\n");
+#endif
+		return -1;
+	}
+
 	/* Generate dm name */
 	dmz_get_label(dev, dev->label, true);
 
@@ -385,19 +728,305 @@ int dmz_start(struct dmz_dev *dev)
 		       dev->sb_version);
 	}
 
-	if (dmz_create_dm(dev)) {
+	if (!(dev->flags & DMZ_NO_TUNE) && dmz_tune_bdevs(dev) < 0) {
+		fprintf(stderr,
+			"Failed to tune %s devices\n", dev->label);
+		return -1;
+	}
+
+#ifdef HAVE_UBLK
+	if (dev->flags & DMZ_UBLK) {
+		if (dmz_ublk_start(dev)) {
+			fprintf(stderr,
+				"Failed to start %s\n", dev->label);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	if (dev->flags & DMZ_RAW_DM)
+		ret = dmz_create_dm_raw(dev);
+	else
+		ret = dmz_create_dm(dev);
+	dmz_probe_invalidate();
+	if (ret) {
 		fprintf(stderr,
 			"Failed to start %s\n", dev->label);
 		return -1;
 	}
 
+	if (!(dev->flags & DMZ_NO_TUNE))
+		dmz_tune_dm(dev);
+
+	return 0;
+}
+
+/*
+ * Zoned targets to stop.
+ */
+struct dmz_stop_target {
+	char		name[DM_NAME_LEN];
+	struct dm_task	*dmt;
+	pid_t		pid;
+	int		ret;
+};
+
+struct dmz_stop {
+	struct dmz_stop_target	*targets;
+	unsigned int		nr_targets;
+};
+
+/*
+ * Add a target to the list of targets to stop, ignoring duplicates
+ * (all the block devices of a multi-device target have the same holder).
+ */
+static int dmz_stop_add(struct dmz_stop *stop, const char *name)
+{
+	struct dmz_stop_target *t;
+	unsigned int i;
+
+	for (i = 0; i < stop->nr_targets; i++) {
+		if (!strcmp(stop->targets[i].name, name))
+			return 0;
+	}
+
+	t = realloc(stop->targets,
+		    sizeof(struct dmz_stop_target) * (stop->nr_targets + 1));
+	if (!t) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	stop->targets = t;
+
+	t = &stop->targets[stop->nr_targets];
+	memset(t, 0, sizeof(struct dmz_stop_target));
+	snprintf(t->name, DM_NAME_LEN, "%s", name);
+	t->pid = -1;
+	stop->nr_targets++;
+
 	return 0;
 }
 
-int dmz_stop(struct dmz_dev *dev, char *dm_name)
+/*
+ * Test if a stop argument designates a dm device, given by its name or
+ * by the path of its device node, rather than a target block device.
+ */
+static bool dmz_stop_is_dm(const char *path)
+{
+	struct stat st;
+
+	if (!strchr(path, '/'))
+		return true;
+
+	return stat(path, &st) == 0 && S_ISBLK(st.st_mode) &&
+		dm_is_dm_major(major(st.st_rdev));
+}
+
+/*
+ * Add the zoned targets given directly or holding the block devices
+ * of a device.
+ */
+static int dmz_stop_add_bdevs(struct dmz_dev *dev, struct dmz_stop *stop)
 {
-	int ret, log_level = 0;
-	char dm_dev[PATH_MAX];
+	char holder[PATH_MAX], dm_dev[PATH_MAX + 8];
+	char name[DM_NAME_LEN];
+	int i;
+
+	for (i = 0; i < dev->nr_bdev; i++) {
+		if (dmz_stop_is_dm(dev->bdev[i].path)) {
+			if (dmz_get_dm_target_name(dev->bdev[i].path,
+						   name) < 0) {
+				fprintf(stderr,
+					"%s is not a zoned target device\n",
+					dev->bdev[i].path);
+				return -1;
+			}
+			if (dmz_stop_add(stop, name) < 0)
+				return -1;
+			continue;
+		}
+
+		if (dmz_get_bdev_holder(&dev->bdev[i], holder) < 0)
+			return -1;
+
+		if (!strlen(holder)) {
+			fprintf(stderr, "%s: no dm-zoned device found\n",
+				dev->bdev[i].name);
+			return -1;
+		}
+
+		sprintf(dm_dev, "/dev/%s", holder);
+		if (dmz_get_dm_target_name(dm_dev, name) < 0) {
+			fprintf(stderr,
+				"%s: dm device %s is not a zoned target device\n",
+				dev->bdev[i].name, holder);
+			return -1;
+		}
+
+		if (dmz_stop_add(stop, name) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Add all the zoned targets with a name matching a pattern.
+ */
+static int dmz_stop_add_matching(struct dmz_stop *stop, const char *pattern)
+{
+	char name[DM_NAME_LEN];
+	struct dm_task *dmt;
+	struct dm_names *names;
+	unsigned int next = 0;
+	int ret = -1;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		return -1;
+
+	dm_task_no_open_count(dmt);
+
+	if (!dm_task_run(dmt)) {
+		fprintf(stderr, "List dm devices failed\n");
+		goto out;
+	}
+
+	names = dm_task_get_names(dmt);
+	if (!names) {
+		fprintf(stderr, "List dm devices failed\n");
+		goto out;
+	}
+
+	if (names->dev) {
+		do {
+			names = (void *)names + next;
+			next = names->next;
+			if (fnmatch(pattern, names->name, 0) != 0)
+				continue;
+			if (dmz_get_dm_target_name(names->name, name) < 0)
+				continue;
+			if (dmz_stop_add(stop, name) < 0)
+				goto out;
+		} while (next);
+	}
+
+	ret = 0;
+out:
+	dm_task_destroy(dmt);
+
+	return ret;
+}
+
+/*
+ * Prepare the removal of a target, using the udev cookie shared by
+ * all removals.
+ */
+static int dmz_stop_prepare(struct dmz_stop_target *t, uint32_t *cookie)
+{
+	__u16 udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+
+	if (!(t->dmt = dm_task_create(DM_DEVICE_REMOVE)))
+		return -1;
+
+	if (!dm_task_set_name(t->dmt, t->name))
+		goto err;
+
+	dm_task_no_open_count(t->dmt);
+
+	if (!dm_task_set_cookie(t->dmt, cookie, udev_flags))
+		goto err;
+
+	return 0;
+
+err:
+	dm_task_destroy(t->dmt);
+	t->dmt = NULL;
+
+	return -1;
+}
+
+/*
+ * Remove the targets concurrently. The device mapper library is not
+ * thread safe, so each removal is issued from a child process. All
+ * removals share the same udev cookie: udev synchronization is done
+ * once for all targets.
+ */
+static int dmz_stop_targets(struct dmz_stop *stop)
+{
+	struct dmz_stop_target *t;
+	uint32_t cookie = 0;
+	unsigned int i, nr_failed = 0;
+	int status;
+
+	for (i = 0; i < stop->nr_targets; i++) {
+		t = &stop->targets[i];
+
+		printf("Stopping %s\n", t->name);
+		if (dmz_stop_prepare(t, &cookie) < 0) {
+			t->ret = -1;
+			continue;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		t->pid = fork();
+		if (t->pid == 0)
+			_exit(dm_task_run(t->dmt) ? 0 : 1);
+
+		if (t->pid < 0) {
+			/* Remove the target here */
+			t->ret = dm_task_run(t->dmt) ? 0 : -1;
+		}
+	}
+
+	for (i = 0; i < stop->nr_targets; i++) {
+		t = &stop->targets[i];
+		if (t->pid < 0)
+			continue;
+
+		status = 0;
+		if (waitpid(t->pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			/*
+			 * If the removal process was killed, it may not
+			 * have released the udev cookie.
+			 */
+			if (cookie && WIFSIGNALED(status))
+				dm_udev_complete(cookie);
+			t->ret = -1;
+		}
+	}
+
+	if (cookie)
+		dm_udev_wait(cookie);
+	dmz_probe_invalidate();
+
+	for (i = 0; i < stop->nr_targets; i++) {
+		t = &stop->targets[i];
+		if (t->dmt)
+			dm_task_destroy(t->dmt);
+		if (t->ret < 0) {
+			fprintf(stderr, "Could not deactivate %s\n", t->name);
+			nr_failed++;
+		}
+	}
+
+	if (stop->nr_targets > 1)
+		printf("Stopped %u / %u targets\n",
+		       stop->nr_targets - nr_failed, stop->nr_targets);
+
+	return nr_failed ? -1 : 0;
+}
+
+/*
+ * Stop the zoned targets using the block devices of a device and the
+ * zoned targets with a name matching the stop pattern.
+ */
+int dmz_stop(struct dmz_dev *dev)
+{
+	struct dmz_stop stop;
+	int ret = -1, log_level = 0;
 
 	dm_log_with_errno_init(NULL);
 
@@ -405,25 +1034,25 @@ int dmz_stop(struct dmz_dev *dev, char *dm_name)
 		log_level++;
 	dm_log_init_verbose(log_level);
 
-	sprintf(dm_dev, "/dev/%s", dm_name);
-	ret = dmz_check_dm_target(dev, dm_dev);
-	if (ret < 0) {
-		fprintf(stderr,
-			"%s: dm device %s is not a zoned target device\n",
-			dev->bdev[0].name, dm_name);
-		return ret;
-	}
+	memset(&stop, 0, sizeof(struct dmz_stop));
 
-	printf("%s: stopping %s\n",
-	       dev->bdev[0].name, dev->label);
+	if (dmz_stop_add_bdevs(dev, &stop) < 0)
+		goto out;
 
-	ret = dmz_deactivate_dm(dm_dev);
-	if (ret < 0) {
-		fprintf(stderr,
-			"%s: could not deactivate %s\n",
-			dev->bdev[0].name, dev->label);
-		return ret;
+	if (dev->stop_pattern &&
+	    dmz_stop_add_matching(&stop, dev->stop_pattern) < 0)
+		goto out;
+
+	if (!stop.nr_targets) {
+		printf("No dm-zoned target to stop\n");
+		ret = 0;
+		goto out;
 	}
 
-	return 0;
+	ret = dmz_stop_targets(&stop);
+
+out:
+	free(stop.targets);
+
+	return ret;
 }
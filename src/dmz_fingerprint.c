@@ -0,0 +1,1010 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <asm/byteorder.h>
+
+/*
+ * Content fingerprints.
+ *
+ * A fingerprint is a 64-bit hash per chunk of the logical device. Each
+ * block of a chunk is hashed with its chunk offset as seed and the block
+ * hashes are summed, so that the blocks of the data zone and of the
+ * buffer zone of a chunk can be hashed in any order by different threads.
+ * Invalid blocks are hashed as zeros, which is what reading them returns,
+ * so only valid blocks need to be read. A raw image of the logical device
+ * is hashed the same way, all its blocks being read, so that it can be
+ * compared with a target. The file layout is a header block followed by
+ * the little endian chunk hashes.
+ */
+#define DMZ_FP_MAGIC		((((unsigned int)('D')) << 24) | \
+				 (((unsigned int)('Z')) << 16) | \
+				 (((unsigned int)('F')) <<  8) | \
+				 ((unsigned int)('P')))
+
+#define DMZ_FP_VERSION		1
+
+/*
+ * Maximum number of blocks read with a single IO (1 MiB).
+ */
+#define DMZ_FP_IO_BLOCKS	256
+
+/*
+ * IO buffers and maximum number of hashing threads per block device.
+ */
+#define DMZ_FP_NR_BUFS		32
+#define DMZ_FP_MAX_HASHERS	16
+
+/*
+ * Maximum number of differing chunk ranges printed by a comparison.
+ */
+#define DMZ_FP_MAX_REPORT	32
+
+#define DMZ_FP_PRIME1		0x9E3779B185EBCA87ULL
+#define DMZ_FP_PRIME2		0xC2B2AE3D27D4EB4FULL
+#define DMZ_FP_PRIME3		0x165667B19E3779F9ULL
+
+struct dmz_fp_header {
+	__le32		magic;
+	__le32		version;
+
+	/* Fingerprint time (microseconds since the epoch) */
+	__le64		timestamp;
+
+	/* Metadata generation and target identity */
+	__le64		gen;
+	__u8		dmz_uuid[DMZ_UUID_LEN];
+	__u8		dmz_label[DMZ_LABEL_LEN];
+
+	/* Logical geometry */
+	__le32		nr_chunks;
+	__le32		chunk_nr_blocks;
+
+	/* Hash of all chunk hashes and crc of the chunk hashes */
+	__le64		digest;
+	__le32		hashes_crc;
+
+	__le32		crc;
+
+	/* Padding to a full block */
+	__u8		reserved[4000];
+
+} __attribute__ ((packed));
+
+/*
+ * Mapped zone with valid blocks to hash. Blocks valid in the buffer
+ * zone of a chunk (@mask) are ignored in its data zone. When hashing a
+ * logical image, there is one zone without bitmap per chunk.
+ */
+struct dmz_fp_zone {
+	unsigned int		zone_id;
+	unsigned int		chunk;
+	bool			buffer;
+	struct dmz_bitmap	*bm;
+	struct dmz_bitmap	*mask;
+
+	/* Sum of the valid block hashes minus their zero hashes */
+	__u64			sum;
+};
+
+/*
+ * Extent of valid blocks read and waiting to be hashed.
+ */
+struct dmz_fp_io {
+	struct dmz_fp_zone	*fz;
+	unsigned int		block;
+	unsigned int		nr_blocks;
+	__u8			*buf;
+};
+
+/*
+ * Per block device statistics.
+ */
+struct dmz_fp_stats {
+	unsigned long long	nr_blocks;
+	unsigned long long	nr_ios;
+	unsigned long long	usec;
+};
+
+struct dmz_fp;
+
+/*
+ * Per block device reader and hashers.
+ */
+struct dmz_fp_queue {
+	struct dmz_fp		*fp;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct dmz_fp_io	io[DMZ_FP_NR_BUFS];
+	unsigned int		free[DMZ_FP_NR_BUFS];
+	unsigned int		nr_free;
+	unsigned int		full[DMZ_FP_NR_BUFS];
+	unsigned int		full_head;
+	unsigned int		nr_full;
+	bool			done;
+};
+
+/*
+ * Fingerprint context.
+ */
+struct dmz_fp {
+	const char		*image;
+	struct dmz_meta_set	mset[3];
+	struct dmz_meta_set	*valid;
+	struct dmz_fp_zone	*zones;
+	unsigned int		nr_zones;
+	unsigned long long	nr_valid_blocks;
+	struct dmz_fp_stats	*stats;
+	unsigned int		nr_hashers;
+
+	/* Hash of a zero block at each chunk offset and of a zero chunk */
+	__u64			*zero_hash;
+	__u64			zero_sum;
+
+	__u64			*hashes;
+};
+
+static inline __u64 dmz_fp_rotl(__u64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline __u64 dmz_fp_round(__u64 v, __u64 w)
+{
+	return dmz_fp_rotl(v + w * DMZ_FP_PRIME2, 31) * DMZ_FP_PRIME1;
+}
+
+static inline __u64 dmz_fp_mix(__u64 h)
+{
+	h ^= h >> 33;
+	h *= DMZ_FP_PRIME2;
+	h ^= h >> 29;
+	h *= DMZ_FP_PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/*
+ * Hash a block: a 64-bit multiply-rotate hash of the block words in
+ * four independent lanes, seeded with the block offset in its chunk.
+ */
+static __u64 dmz_fp_hash_block(const __u8 *buf, __u64 seed)
+{
+	const __le64 *w = (const __le64 *)buf;
+	__u64 v0 = seed + DMZ_FP_PRIME1 + DMZ_FP_PRIME2;
+	__u64 v1 = seed + DMZ_FP_PRIME2;
+	__u64 v2 = seed;
+	__u64 v3 = seed - DMZ_FP_PRIME1;
+	unsigned int i;
+
+	for (i = 0; i < DMZ_BLOCK_SIZE / sizeof(__le64); i += 4) {
+		v0 = dmz_fp_round(v0, __le64_to_cpu(w[i]));
+		v1 = dmz_fp_round(v1, __le64_to_cpu(w[i + 1]));
+		v2 = dmz_fp_round(v2, __le64_to_cpu(w[i + 2]));
+		v3 = dmz_fp_round(v3, __le64_to_cpu(w[i + 3]));
+	}
+
+	return dmz_fp_mix(dmz_fp_rotl(v0, 1) + dmz_fp_rotl(v1, 7) +
+			  dmz_fp_rotl(v2, 12) + dmz_fp_rotl(v3, 18) +
+			  DMZ_BLOCK_SIZE);
+}
+
+/*
+ * Add a mapped zone with valid blocks to the list of zones to hash.
+ */
+static int dmz_fp_add_zone(struct dmz_dev *dev, struct dmz_fp *fp,
+			   unsigned int chunk, unsigned int zone_id,
+			   bool buffer, struct dmz_bitmap **bm)
+{
+	struct dmz_fp_zone *fz;
+
+	*bm = NULL;
+	if (zone_id >= dev->nr_zones) {
+		fprintf(stderr,
+			"Chunk %u: invalid %s zone ID %u, "
+			"run check first\n",
+			chunk, buffer ? "buffer" : "data", zone_id);
+		return -1;
+	}
+
+	*bm = dmz_bitmap_read_zone(dev, fp->valid, zone_id);
+	if (!*bm)
+		return -1;
+
+	if (!(*bm)->weight) {
+		dmz_bitmap_free(*bm);
+		*bm = NULL;
+		return 0;
+	}
+
+	fz = &fp->zones[fp->nr_zones];
+	fz->zone_id = zone_id;
+	fz->chunk = chunk;
+	fz->buffer = buffer;
+	fz->bm = *bm;
+	fp->nr_zones++;
+	fp->nr_valid_blocks += (*bm)->weight;
+
+	return 0;
+}
+
+/*
+ * Load the metadata and the bitmaps of all mapped zones.
+ */
+static int dmz_fp_load(struct dmz_dev *dev, struct dmz_fp *fp)
+{
+	unsigned int chunk, dzone_id, bzone_id, b;
+	struct dmz_bitmap *dbm, *bbm;
+	__u8 *zero;
+	long nr_cpus;
+
+	memset(fp->mset, 0, sizeof(struct dmz_meta_set) * 3);
+	fp->mset[1].id = 1;
+	fp->mset[2].id = 2;
+
+	if (dmz_check_superblocks(dev, fp->mset) < 0)
+		return -1;
+
+	fp->valid = dmz_validate_meta_set(dev, fp->mset);
+	if (!fp->valid)
+		return -1;
+
+	printf("Using the %s metadata set (generation %llu)\n",
+	       fp->valid->id == 0 ? "primary" : "secondary", fp->valid->gen);
+
+	if (!fp->image && dmz_read_map_blocks(dev, fp->valid) < 0)
+		return -1;
+
+	/* At most a data zone and a buffer zone per chunk */
+	fp->zones = calloc(dev->nr_chunks * 2, sizeof(struct dmz_fp_zone));
+	fp->stats = calloc(dev->nr_bdev, sizeof(struct dmz_fp_stats));
+	fp->hashes = calloc(dev->nr_chunks, sizeof(__u64));
+	fp->zero_hash = calloc(dev->zone_nr_blocks, sizeof(__u64));
+	zero = calloc(1, DMZ_BLOCK_SIZE);
+	if (!fp->zones || !fp->stats || !fp->hashes ||
+	    !fp->zero_hash || !zero) {
+		fprintf(stderr, "Not enough memory\n");
+		free(zero);
+		return -1;
+	}
+
+	for (b = 0; b < dev->zone_nr_blocks; b++) {
+		fp->zero_hash[b] = dmz_fp_hash_block(zero, b);
+		fp->zero_sum += fp->zero_hash[b];
+	}
+	free(zero);
+
+	for (chunk = 0; chunk < dev->nr_chunks && fp->image; chunk++) {
+		fp->zones[chunk].chunk = chunk;
+		fp->nr_zones++;
+	}
+
+	for (chunk = 0; chunk < dev->nr_chunks && !fp->image; chunk++) {
+		dmz_get_chunk_mapping(dev, fp->valid, chunk,
+				      &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		if (dmz_fp_add_zone(dev, fp, chunk, dzone_id, false,
+				    &dbm) < 0)
+			return -1;
+		if (bzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		if (dmz_fp_add_zone(dev, fp, chunk, bzone_id, true,
+				    &bbm) < 0)
+			return -1;
+		if (dbm && bbm)
+			fp->zones[fp->nr_zones - 2].mask = bbm;
+	}
+
+	/* Spread the CPUs between the block devices or use all for an image */
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fp->nr_hashers = nr_cpus > 0 ?
+		nr_cpus / (fp->image ? 1 : dev->nr_bdev) : 1;
+	if (!fp->nr_hashers)
+		fp->nr_hashers = 1;
+	if (fp->nr_hashers > DMZ_FP_MAX_HASHERS)
+		fp->nr_hashers = DMZ_FP_MAX_HASHERS;
+
+	return 0;
+}
+
+/*
+ * Test if a block of a zone must be hashed.
+ */
+static inline bool dmz_fp_block_valid(struct dmz_fp_zone *fz,
+				      unsigned int b)
+{
+	return dmz_bitmap_test(fz->bm, b) &&
+		(!fz->mask || !dmz_bitmap_test(fz->mask, b));
+}
+
+/*
+ * Hash the blocks of an extent and account them to the zone.
+ */
+static void *dmz_fp_hasher(void *arg)
+{
+	struct dmz_fp_queue *q = arg;
+	struct dmz_fp *fp = q->fp;
+	struct dmz_fp_io *io;
+	unsigned int i, b;
+	__u64 sum;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!q->nr_full && !q->done)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (!q->nr_full)
+			break;
+
+		i = q->full[q->full_head];
+		q->full_head = (q->full_head + 1) % DMZ_FP_NR_BUFS;
+		q->nr_full--;
+		pthread_mutex_unlock(&q->lock);
+
+		io = &q->io[i];
+		sum = 0;
+		for (b = 0; b < io->nr_blocks; b++)
+			sum += dmz_fp_hash_block(io->buf +
+					((size_t)b << DMZ_BLOCK_SHIFT),
+					io->block + b) -
+				fp->zero_hash[io->block + b];
+
+		pthread_mutex_lock(&q->lock);
+		io->fz->sum += sum;
+		q->free[q->nr_free++] = i;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * Get a free IO buffer, waiting for the hashers if needed.
+ */
+static struct dmz_fp_io *dmz_fp_get_io(struct dmz_fp_queue *q,
+				       unsigned int *i)
+{
+	pthread_mutex_lock(&q->lock);
+	while (!q->nr_free)
+		pthread_cond_wait(&q->cond, &q->lock);
+	*i = q->free[--q->nr_free];
+	pthread_mutex_unlock(&q->lock);
+
+	return &q->io[*i];
+}
+
+/*
+ * Queue an IO buffer for the hashers.
+ */
+static void dmz_fp_queue_io(struct dmz_fp_queue *q, unsigned int i)
+{
+	pthread_mutex_lock(&q->lock);
+	q->full[(q->full_head + q->nr_full) % DMZ_FP_NR_BUFS] = i;
+	q->nr_full++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Release an IO buffer that was not queued.
+ */
+static void dmz_fp_put_io(struct dmz_fp_queue *q, unsigned int i)
+{
+	pthread_mutex_lock(&q->lock);
+	q->free[q->nr_free++] = i;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Free a queue and its IO buffers.
+ */
+static void dmz_fp_free_queue(struct dmz_fp_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < DMZ_FP_NR_BUFS; i++)
+		free(q->io[i].buf);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+/*
+ * Allocate a queue with its IO buffers and start its hashing threads.
+ */
+static struct dmz_fp_queue *dmz_fp_start_queue(struct dmz_fp *fp,
+					       const char *name,
+					       pthread_t *hashers,
+					       unsigned int *nr_started)
+{
+	struct dmz_fp_queue *q;
+	unsigned int i;
+
+	q = calloc(1, sizeof(struct dmz_fp_queue));
+	if (!q) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	q->fp = fp;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	for (i = 0; i < DMZ_FP_NR_BUFS; i++) {
+		q->io[i].buf = dmz_malloc_buf(DMZ_FP_IO_BLOCKS *
+					      DMZ_BLOCK_SIZE);
+		if (!q->io[i].buf) {
+			fprintf(stderr, "Not enough memory\n");
+			dmz_fp_free_queue(q);
+			return NULL;
+		}
+		q->free[q->nr_free++] = i;
+	}
+
+	*nr_started = 0;
+	for (i = 0; i < fp->nr_hashers; i++) {
+		if (pthread_create(&hashers[i], NULL, dmz_fp_hasher, q))
+			break;
+		(*nr_started)++;
+	}
+	if (!*nr_started) {
+		fprintf(stderr, "%s: Create hashing threads failed\n", name);
+		dmz_fp_free_queue(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/*
+ * Wait for the hashers of a queue to hash all queued IOs, then free it.
+ */
+static void dmz_fp_stop_queue(struct dmz_fp_queue *q, pthread_t *hashers,
+			      unsigned int nr_started)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&q->lock);
+	q->done = true;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(hashers[i], NULL);
+
+	dmz_fp_free_queue(q);
+}
+
+/*
+ * Read the valid blocks of all mapped zones of a block device in zone
+ * order, merging adjacent valid blocks into large reads, and hash them
+ * with several threads.
+ */
+static int dmz_fp_bdev(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_fp *fp = arg;
+	struct dmz_fp_stats *stats = &fp->stats[d];
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	pthread_t hashers[DMZ_FP_MAX_HASHERS];
+	unsigned int i, n, b, nr, nr_started;
+	struct dmz_fp_queue *q;
+	struct dmz_fp_zone *fz;
+	struct dmz_fp_io *io;
+	unsigned long long start;
+	__u64 sector;
+	size_t size;
+	int fd, ret = 0;
+
+	/* Read the media, not the page cache */
+	fd = open(bdev->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			bdev->path,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	q = dmz_fp_start_queue(fp, bdev->name, hashers, &nr_started);
+	if (!q) {
+		close(fd);
+		return -1;
+	}
+
+	start = dmz_usec();
+	for (i = 0; i < fp->nr_zones && !ret; i++) {
+		fz = &fp->zones[i];
+		if (dmz_zone_to_bdev(dev, &dev->zones[fz->zone_id]) != bdev)
+			continue;
+
+		if (dev->flags & DMZ_VVERBOSE)
+			printf("%s: hashing %s zone %u of chunk %u, "
+			       "%u valid blocks\n",
+			       bdev->name, fz->buffer ? "buffer" : "data",
+			       fz->zone_id, fz->chunk, fz->bm->weight);
+
+		b = dmz_bitmap_next(fz->bm, 0);
+		while (b < fz->bm->nr_bits) {
+			if (!dmz_fp_block_valid(fz, b)) {
+				b = dmz_bitmap_next(fz->bm, b + 1);
+				continue;
+			}
+
+			nr = 1;
+			while (nr < DMZ_FP_IO_BLOCKS &&
+			       b + nr < fz->bm->nr_bits &&
+			       dmz_fp_block_valid(fz, b + nr))
+				nr++;
+
+			io = dmz_fp_get_io(q, &n);
+			io->fz = fz;
+			io->block = b;
+			io->nr_blocks = nr;
+
+			dmz_sector_to_bdev(dev,
+				dmz_zone_sector(&dev->zones[fz->zone_id]) +
+				dmz_blk2sect((__u64)b), &sector);
+			size = (size_t)nr << DMZ_BLOCK_SHIFT;
+			stats->nr_ios++;
+			stats->nr_blocks += nr;
+			if (pread(fd, io->buf, size, sector << 9) !=
+			    (ssize_t)size) {
+				fprintf(stderr,
+					"%s: Read chunk %u %s zone %u "
+					"block %u failed\n",
+					bdev->name, fz->chunk,
+					fz->buffer ? "buffer" : "data",
+					fz->zone_id, b);
+				dmz_fp_put_io(q, n);
+				ret = -1;
+				break;
+			}
+			dmz_fp_queue_io(q, n);
+
+			b = dmz_bitmap_next(fz->bm, b + nr);
+		}
+	}
+
+	dmz_fp_stop_queue(q, hashers, nr_started);
+	stats->usec = dmz_usec() - start;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Read all the blocks of a raw image of the logical device and hash
+ * them with several threads. Blocks past the end of the image are
+ * hashed as zeros.
+ */
+static int dmz_fp_image(struct dmz_dev *dev, struct dmz_fp *fp)
+{
+	struct dmz_fp_stats *stats = &fp->stats[0];
+	pthread_t hashers[DMZ_FP_MAX_HASHERS];
+	unsigned int n, b, nr, nr_started;
+	__u64 blk, nr_blocks, capacity;
+	struct dmz_fp_queue *q;
+	struct dmz_fp_io *io;
+	unsigned long long start;
+	struct stat st;
+	ssize_t size;
+	int fd, ret = 0;
+
+	fd = open(fp->image, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			fp->image, errno, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr,
+			"Get %s stat failed %d (%s)\n",
+			fp->image, errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	capacity = (__u64)dev->nr_chunks * dev->zone_nr_blocks;
+	nr_blocks = ((__u64)st.st_size + DMZ_BLOCK_SIZE - 1) >>
+		DMZ_BLOCK_SHIFT;
+	if (nr_blocks > capacity) {
+		fprintf(stderr,
+			"%s: %llu blocks, larger than the %llu blocks of "
+			"the target logical device\n",
+			fp->image, nr_blocks, capacity);
+		close(fd);
+		return -1;
+	}
+
+	q = dmz_fp_start_queue(fp, fp->image, hashers, &nr_started);
+	if (!q) {
+		close(fd);
+		return -1;
+	}
+
+	start = dmz_usec();
+	for (blk = 0; blk < nr_blocks; blk += nr) {
+		/* Reads do not cross chunk boundaries */
+		b = blk % dev->zone_nr_blocks;
+		nr = dev->zone_nr_blocks - b;
+		if (nr > DMZ_FP_IO_BLOCKS)
+			nr = DMZ_FP_IO_BLOCKS;
+		if (nr > nr_blocks - blk)
+			nr = nr_blocks - blk;
+
+		io = dmz_fp_get_io(q, &n);
+		io->fz = &fp->zones[blk / dev->zone_nr_blocks];
+		io->block = b;
+		io->nr_blocks = nr;
+
+		stats->nr_ios++;
+		stats->nr_blocks += nr;
+		size = pread(fd, io->buf, (size_t)nr << DMZ_BLOCK_SHIFT,
+			     blk << DMZ_BLOCK_SHIFT);
+		if (size <= 0) {
+			fprintf(stderr,
+				"%s: Read block %llu failed %d (%s)\n",
+				fp->image, blk, errno, strerror(errno));
+			dmz_fp_put_io(q, n);
+			ret = -1;
+			break;
+		}
+		if (size < (ssize_t)nr << DMZ_BLOCK_SHIFT) {
+			/* Partial last block */
+			memset(io->buf + size, 0,
+			       ((size_t)nr << DMZ_BLOCK_SHIFT) - size);
+		}
+		dmz_fp_queue_io(q, n);
+	}
+
+	dmz_fp_stop_queue(q, hashers, nr_started);
+	stats->usec = dmz_usec() - start;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Combine the zone sums into the chunk hashes and hash them together.
+ */
+static __u64 dmz_fp_finish(struct dmz_dev *dev, struct dmz_fp *fp)
+{
+	__u64 digest = DMZ_FP_PRIME3;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_chunks; i++)
+		fp->hashes[i] = fp->zero_sum;
+	for (i = 0; i < fp->nr_zones; i++)
+		fp->hashes[fp->zones[i].chunk] += fp->zones[i].sum;
+
+	for (i = 0; i < dev->nr_chunks; i++)
+		digest = dmz_fp_round(digest, fp->hashes[i]);
+
+	return dmz_fp_mix(digest);
+}
+
+/*
+ * Save a fingerprint to a file.
+ */
+static int dmz_fp_save(struct dmz_dev *dev, struct dmz_fp *fp,
+		       __u64 digest, const char *path)
+{
+	struct dmz_fp_header hdr;
+	const char *name;
+	__le64 *hashes;
+	size_t size = dev->nr_chunks * sizeof(__le64);
+	unsigned int i;
+	int fd, ret = -1;
+
+	hashes = malloc(size);
+	if (!hashes) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	for (i = 0; i < dev->nr_chunks; i++)
+		hashes[i] = __cpu_to_le64(fp->hashes[i]);
+
+	memset(&hdr, 0, sizeof(struct dmz_fp_header));
+	hdr.magic = __cpu_to_le32(DMZ_FP_MAGIC);
+	hdr.version = __cpu_to_le32(DMZ_FP_VERSION);
+	hdr.timestamp = __cpu_to_le64(dmz_usec());
+	if (fp->image) {
+		/* An image has no metadata generation nor identity */
+		name = strrchr(fp->image, '/');
+		snprintf((char *)hdr.dmz_label, DMZ_LABEL_LEN, "%s",
+			 name ? name + 1 : fp->image);
+	} else {
+		hdr.gen = __cpu_to_le64(fp->valid->gen);
+		memcpy(hdr.dmz_uuid, dev->uuid, DMZ_UUID_LEN);
+		memcpy(hdr.dmz_label, dev->label, DMZ_LABEL_LEN);
+	}
+	hdr.nr_chunks = __cpu_to_le32(dev->nr_chunks);
+	hdr.chunk_nr_blocks = __cpu_to_le32(dev->zone_nr_blocks);
+	hdr.digest = __cpu_to_le64(digest);
+	hdr.hashes_crc = __cpu_to_le32(dmz_crc32(DMZ_FP_MAGIC, hashes, size));
+	hdr.crc = __cpu_to_le32(dmz_crc32(DMZ_FP_MAGIC, &hdr,
+					  sizeof(struct dmz_fp_header)));
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Create %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		goto out;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, hashes, size) != (ssize_t)size) {
+		fprintf(stderr,
+			"Write %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+	} else if (fsync(fd) < 0) {
+		fprintf(stderr,
+			"Sync %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+	} else {
+		ret = 0;
+	}
+	close(fd);
+	if (ret < 0)
+		unlink(path);
+	else
+		printf("Saved the fingerprint to %s\n", path);
+
+out:
+	free(hashes);
+
+	return ret;
+}
+
+/*
+ * Load a fingerprint file chunk hashes.
+ */
+static __u64 *dmz_fp_load_file(struct dmz_dev *dev, const char *path,
+			       struct dmz_fp_header *hdr)
+{
+	__le64 *hashes = NULL;
+	__u64 *ret = NULL;
+	__u32 stored_crc;
+	unsigned int i;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return NULL;
+	}
+
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+		fprintf(stderr, "%s: read header failed\n", path);
+		goto out;
+	}
+
+	if (__le32_to_cpu(hdr->magic) != DMZ_FP_MAGIC) {
+		fprintf(stderr, "%s: not a fingerprint\n", path);
+		goto out;
+	}
+
+	stored_crc = __le32_to_cpu(hdr->crc);
+	hdr->crc = 0;
+	if (dmz_crc32(DMZ_FP_MAGIC, hdr, sizeof(*hdr)) != stored_crc) {
+		fprintf(stderr, "%s: invalid header crc\n", path);
+		goto out;
+	}
+
+	if (__le32_to_cpu(hdr->version) != DMZ_FP_VERSION) {
+		fprintf(stderr, "%s: unsupported version %u\n",
+			path, __le32_to_cpu(hdr->version));
+		goto out;
+	}
+
+	if (__le32_to_cpu(hdr->nr_chunks) != dev->nr_chunks ||
+	    __le32_to_cpu(hdr->chunk_nr_blocks) != dev->zone_nr_blocks) {
+		fprintf(stderr,
+			"%s: %u chunks of %u blocks, the device has "
+			"%u chunks of %zu blocks\n",
+			path, __le32_to_cpu(hdr->nr_chunks),
+			__le32_to_cpu(hdr->chunk_nr_blocks),
+			dev->nr_chunks, dev->zone_nr_blocks);
+		goto out;
+	}
+
+	size = dev->nr_chunks * sizeof(__le64);
+	hashes = malloc(size);
+	ret = malloc(dev->nr_chunks * sizeof(__u64));
+	if (!hashes || !ret) {
+		fprintf(stderr, "Not enough memory\n");
+		goto err;
+	}
+
+	if (pread(fd, hashes, size, sizeof(*hdr)) != (ssize_t)size) {
+		fprintf(stderr, "%s: read chunk hashes failed\n", path);
+		goto err;
+	}
+
+	if (dmz_crc32(DMZ_FP_MAGIC, hashes, size) !=
+	    __le32_to_cpu(hdr->hashes_crc)) {
+		fprintf(stderr, "%s: invalid chunk hashes crc\n", path);
+		goto err;
+	}
+
+	for (i = 0; i < dev->nr_chunks; i++)
+		ret[i] = __le64_to_cpu(hashes[i]);
+	goto out;
+
+err:
+	free(ret);
+	ret = NULL;
+out:
+	free(hashes);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Compare the device fingerprint with a saved fingerprint chunk by chunk.
+ */
+static int dmz_fp_compare(struct dmz_dev *dev, struct dmz_fp *fp,
+			  const char *path)
+{
+	unsigned int i, first, nr_diff = 0, nr_ranges = 0;
+	struct dmz_fp_header hdr;
+	char label[DMZ_LABEL_LEN + 1];
+	__u64 *hashes;
+
+	hashes = dmz_fp_load_file(dev, path, &hdr);
+	if (!hashes)
+		return -1;
+
+	memcpy(label, hdr.dmz_label, DMZ_LABEL_LEN);
+	label[DMZ_LABEL_LEN] = '\0';
+	printf("Comparing with %s (target %s, generation %llu)\n",
+	       path, label, __le64_to_cpu(hdr.gen));
+
+	i = 0;
+	while (i < dev->nr_chunks) {
+		if (hashes[i] == fp->hashes[i]) {
+			i++;
+			continue;
+		}
+		first = i;
+		while (i < dev->nr_chunks && hashes[i] != fp->hashes[i])
+			i++;
+		nr_diff += i - first;
+		nr_ranges++;
+		if (nr_ranges <= DMZ_FP_MAX_REPORT ||
+		    (dev->flags & DMZ_VERBOSE)) {
+			if (i - first > 1)
+				printf("  Chunks %u..%u differ\n",
+				       first, i - 1);
+			else
+				printf("  Chunk %u differs\n", first);
+		}
+	}
+
+	free(hashes);
+
+	if (nr_ranges > DMZ_FP_MAX_REPORT && !(dev->flags & DMZ_VERBOSE))
+		printf("  ... (%u more ranges, use --verbose to list all)\n",
+		       nr_ranges - DMZ_FP_MAX_REPORT);
+
+	if (nr_diff) {
+		printf("%u / %u chunks differ\n", nr_diff, dev->nr_chunks);
+		return -1;
+	}
+
+	printf("All %u chunks match\n", dev->nr_chunks);
+
+	return 0;
+}
+
+/*
+ * Print the read statistics of a block device or of an image.
+ */
+static void dmz_fp_print_stats(const char *name, struct dmz_fp_stats *stats)
+{
+	if (!stats->nr_ios)
+		return;
+
+	printf("  %s: %llu blocks read in %llu IOs, %llu.%03llu s "
+	       "(%llu MB/s)\n",
+	       name, stats->nr_blocks, stats->nr_ios,
+	       stats->usec / 1000000, (stats->usec % 1000000) / 1000,
+	       stats->usec ?
+	       (stats->nr_blocks << DMZ_BLOCK_SHIFT) / stats->usec : 0);
+}
+
+/*
+ * Compute the per-chunk content fingerprint of the logical device, or
+ * of a raw image of the logical device using the target geometry.
+ */
+int dmz_fingerprint(struct dmz_dev *dev)
+{
+	struct dmz_fp fp;
+	unsigned long long start, usec;
+	unsigned int i;
+	__u64 digest;
+	int d, ret = -1;
+
+	memset(&fp, 0, sizeof(struct dmz_fp));
+	fp.image = dev->fp_image;
+
+	if (dmz_fp_load(dev, &fp) < 0)
+		goto out;
+
+	if (fp.image) {
+		printf("Hashing image %s (%u hashing thread%s)\n",
+		       fp.image, fp.nr_hashers,
+		       fp.nr_hashers > 1 ? "s" : "");
+		fflush(stdout);
+
+		start = dmz_usec();
+		ret = dmz_fp_image(dev, &fp);
+		if (ret < 0)
+			goto out;
+		usec = dmz_usec() - start;
+
+		dmz_fp_print_stats(fp.image, &fp.stats[0]);
+	} else {
+		printf("Hashing %llu valid blocks in %u zones "
+		       "(%u hashing thread%s per device)\n",
+		       fp.nr_valid_blocks, fp.nr_zones, fp.nr_hashers,
+		       fp.nr_hashers > 1 ? "s" : "");
+		fflush(stdout);
+
+		start = dmz_usec();
+		ret = dmz_run_bdev_workers(dev, dmz_fp_bdev, &fp);
+		if (ret < 0)
+			goto out;
+		usec = dmz_usec() - start;
+
+		for (d = 0; d < dev->nr_bdev; d++)
+			dmz_fp_print_stats(dev->bdev[d].name, &fp.stats[d]);
+	}
+
+	digest = dmz_fp_finish(dev, &fp);
+	printf("Fingerprint of %u chunks: %016llx (%llu.%03llu s)\n",
+	       dev->nr_chunks, digest,
+	       usec / 1000000, (usec % 1000000) / 1000);
+
+	if (dev->fp_save) {
+		ret = dmz_fp_save(dev, &fp, digest, dev->fp_save);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (dev->fp_compare)
+		ret = dmz_fp_compare(dev, &fp, dev->fp_compare);
+
+out:
+	/* Buffer zone bitmaps are shared as data zone masks */
+	for (i = 0; i < fp.nr_zones; i++)
+		dmz_bitmap_free(fp.zones[i].bm);
+	free(fp.zones);
+	free(fp.stats);
+	free(fp.hashes);
+	free(fp.zero_hash);
+	free(fp.mset[0].map_buf);
+	free(fp.mset[1].map_buf);
+
+	return ret;
+}
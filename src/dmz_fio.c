@@ -0,0 +1,496 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+/*
+ * Default run time of each fio job and target status sampling interval.
+ */
+#define DMZ_FIO_RUNTIME		60
+#define DMZ_FIO_INTERVAL	(1000000ULL)
+
+#define DMZ_FIO_MAX_ARGS	32
+
+/*
+ * fio job profiles.
+ */
+struct dmz_fio_job {
+	const char	*name;
+	const char	*desc;
+	int		nr_jobs;
+	const char	*args[8];
+};
+
+static struct dmz_fio_job dmz_fio_jobs[] = {
+	{
+		/*
+		 * 256MB bursts of 4KB random writes separated by idle
+		 * time, to observe cache filling and reclaim catching up.
+		 */
+		"randwrite", "random write bursts", 1,
+		{ "--rw=randwrite", "--bs=4k", "--iodepth=32",
+		  "--thinktime=2s", "--thinktime_blocks=65536", NULL }
+	},
+	{
+		/* Concurrent sequential streams over separate regions */
+		"seqwrite", "sequential write streams", 4,
+		{ "--rw=write", "--bs=1M", "--iodepth=4", NULL }
+	},
+	{
+		"mixed", "mixed random reads and writes", 1,
+		{ "--rw=randrw", "--rwmixread=70", "--bs=16k",
+		  "--iodepth=16", NULL }
+	},
+};
+
+#define DMZ_FIO_NR_JOBS	(sizeof(dmz_fio_jobs) / sizeof(dmz_fio_jobs[0]))
+
+/*
+ * One sample of the target state.
+ */
+struct dmz_fio_sample {
+	unsigned long long	usec;
+
+	/* dm device disk stats */
+	unsigned long long	rd_ios;
+	unsigned long long	rd_sect;
+	unsigned long long	rd_ticks;
+	unsigned long long	wr_ios;
+	unsigned long long	wr_sect;
+	unsigned long long	wr_ticks;
+
+	/* Target status: zones (total) and unmapped (free) zones */
+	unsigned int		nr_cache;
+	unsigned int		nr_unmap_cache;
+	unsigned int		nr_rnd;
+	unsigned int		nr_unmap_rnd;
+	unsigned int		nr_seq;
+	unsigned int		nr_unmap_seq;
+
+	/* Sectors written in sequential zones (write pointers) */
+	unsigned long long	wp_sect;
+};
+
+/*
+ * Test if a job was selected by the user (all jobs are by default).
+ */
+static bool dmz_fio_job_selected(struct dmz_dev *dev, struct dmz_fio_job *job)
+{
+	const char *p = dev->bench_jobs;
+	size_t len = strlen(job->name);
+
+	if (!p)
+		return true;
+
+	while (p && *p) {
+		if (!strncmp(p, job->name, len) &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return true;
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+
+	return false;
+}
+
+/*
+ * Check that the jobs list given is valid.
+ */
+static int dmz_fio_check_jobs(struct dmz_dev *dev)
+{
+	const char *p = dev->bench_jobs;
+	unsigned int i;
+	size_t len;
+
+	while (p && *p) {
+		len = strcspn(p, ",");
+		for (i = 0; i < DMZ_FIO_NR_JOBS; i++) {
+			if (strlen(dmz_fio_jobs[i].name) == len &&
+			    !strncmp(p, dmz_fio_jobs[i].name, len))
+				break;
+		}
+		if (i >= DMZ_FIO_NR_JOBS) {
+			fprintf(stderr, "Unknown job \"%.*s\"\n",
+				(int)len, p);
+			return -1;
+		}
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a dm-zoned status line:
+ *   <nr zones> zones <unmap>/<total> cache
+ * followed for each zoned device by:
+ *   <unmap>/<total> random <unmap>/<total> sequential
+ */
+static int dmz_fio_parse_status(const char *status, struct dmz_fio_sample *s)
+{
+	unsigned int nr_zones, ur, r, us, sq;
+	int n;
+
+	if (sscanf(status, "%u zones %u/%u cache%n",
+		   &nr_zones, &s->nr_unmap_cache, &s->nr_cache, &n) != 3)
+		return -1;
+
+	status += n;
+	while (sscanf(status, " %u/%u random %u/%u sequential%n",
+		      &ur, &r, &us, &sq, &n) == 4) {
+		s->nr_unmap_rnd += ur;
+		s->nr_rnd += r;
+		s->nr_unmap_seq += us;
+		s->nr_seq += sq;
+		status += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the amount of sectors written in the sequential zones of a zoned
+ * block device from the zones write pointer position.
+ */
+static int dmz_fio_get_wp(struct dmz_block_dev *bdev, __u8 *buf,
+			  unsigned long long *wp_sect)
+{
+	struct blk_zone_report *rep = (struct blk_zone_report *)buf;
+	unsigned int i, rep_max_zones;
+	struct blk_zone *blkz;
+	__u64 sector = 0;
+
+	rep_max_zones =
+		(DMZ_REPORT_ZONES_BUFSZ - sizeof(struct blk_zone_report))
+		/ sizeof(struct blk_zone);
+
+	while (sector < bdev->capacity) {
+		memset(rep, 0, DMZ_REPORT_ZONES_BUFSZ);
+		rep->sector = sector;
+		rep->nr_zones = rep_max_zones;
+		if (ioctl(bdev->fd, BLKREPORTZONE, rep) != 0) {
+			fprintf(stderr,
+				"%s: Get zone information failed %d (%s)\n",
+				bdev->name, errno, strerror(errno));
+			return -1;
+		}
+		if (!rep->nr_zones)
+			break;
+
+		blkz = (struct blk_zone *)(rep + 1);
+		for (i = 0; i < rep->nr_zones; i++, blkz++) {
+			if (dmz_zone_conv(blkz))
+				continue;
+			if (dmz_zone_cond(blkz) == BLK_ZONE_COND_FULL)
+				*wp_sect += dmz_zone_length(blkz);
+			else if (!dmz_zone_empty(blkz))
+				*wp_sect += dmz_zone_wp_sector(blkz) -
+					dmz_zone_sector(blkz);
+		}
+		blkz--;
+		sector = dmz_zone_sector(blkz) + dmz_zone_length(blkz);
+	}
+
+	return 0;
+}
+
+/*
+ * Sample the target: dm device disk stats, target status and
+ * zoned devices write pointers.
+ */
+static int dmz_fio_sample(struct dmz_dev *dev, const char *dm_name,
+			  __u8 *buf, struct dmz_fio_sample *s)
+{
+	char path[PATH_MAX], status[4096];
+	FILE *file;
+	int i, ret;
+
+	memset(s, 0, sizeof(*s));
+	s->usec = dmz_usec();
+
+	snprintf(path, sizeof(path), "/sys/block/%s/stat", dm_name);
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Open %s failed\n", path);
+		return -1;
+	}
+	ret = fscanf(file, "%llu %*u %llu %llu %llu %*u %llu %llu",
+		     &s->rd_ios, &s->rd_sect, &s->rd_ticks,
+		     &s->wr_ios, &s->wr_sect, &s->wr_ticks);
+	fclose(file);
+	if (ret != 6) {
+		fprintf(stderr, "Invalid file %s format\n", path);
+		return -1;
+	}
+
+	if (dmz_get_dm_status(dev->label, status, sizeof(status)) < 0 ||
+	    dmz_fio_parse_status(status, s) < 0) {
+		fprintf(stderr, "%s: Get target status failed\n", dev->label);
+		return -1;
+	}
+
+	for (i = 0; i < dev->nr_bdev; i++) {
+		if (!dmz_bdev_is_zoned(&dev->bdev[i]))
+			continue;
+		if (dmz_fio_get_wp(&dev->bdev[i], buf, &s->wp_sect) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static unsigned int dmz_fio_pct(unsigned int unmap, unsigned int total)
+{
+	if (!total)
+		return 0;
+	return ((total - unmap) * 100) / total;
+}
+
+/*
+ * Percentage of the zones buffering random writes that are in use: cache
+ * zones if the target has a cache device, random zones otherwise.
+ */
+static unsigned int dmz_fio_cache_pct(struct dmz_fio_sample *s)
+{
+	if (s->nr_cache)
+		return dmz_fio_pct(s->nr_unmap_cache, s->nr_cache);
+	return dmz_fio_pct(s->nr_unmap_rnd, s->nr_rnd);
+}
+
+#define dmz_fio_delta(c, p, f)	((c)->f - (p)->f)
+
+static unsigned long long dmz_fio_mbps(unsigned long long sect,
+				       unsigned long long usec)
+{
+	return usec ? (sect << 9) / usec : 0;
+}
+
+static unsigned long long dmz_fio_lat(unsigned long long ticks,
+				      unsigned long long ios)
+{
+	return ios ? (ticks * 1000) / ios : 0;
+}
+
+static void dmz_fio_print_sample(struct dmz_fio_sample *first,
+				 struct dmz_fio_sample *prev,
+				 struct dmz_fio_sample *cur)
+{
+	unsigned long long usec = dmz_fio_delta(cur, prev, usec);
+
+	printf("  %5llu %8llu %8llu %8llu %8llu %6u%% %6u%% %6u%% %8llu\n",
+	       (cur->usec - first->usec) / 1000000ULL,
+	       dmz_fio_mbps(dmz_fio_delta(cur, prev, rd_sect), usec),
+	       dmz_fio_mbps(dmz_fio_delta(cur, prev, wr_sect), usec),
+	       dmz_fio_lat(dmz_fio_delta(cur, prev, rd_ticks),
+			   dmz_fio_delta(cur, prev, rd_ios)),
+	       dmz_fio_lat(dmz_fio_delta(cur, prev, wr_ticks),
+			   dmz_fio_delta(cur, prev, wr_ios)),
+	       dmz_fio_cache_pct(cur),
+	       dmz_fio_pct(cur->nr_unmap_rnd, cur->nr_rnd),
+	       dmz_fio_pct(cur->nr_unmap_seq, cur->nr_seq),
+	       dmz_fio_mbps(dmz_fio_delta(cur, prev, wp_sect), usec));
+	fflush(stdout);
+}
+
+/*
+ * Run a fio job against the target, sampling the target state
+ * until fio completes.
+ */
+static int dmz_fio_run_job(struct dmz_dev *dev, struct dmz_fio_job *job,
+			   const char *dm_path, const char *dm_name,
+			   __u8 *buf)
+{
+	struct dmz_fio_sample first, prev, cur;
+	char args[6][128], filename[PATH_MAX + 16];
+	char *argv[DMZ_FIO_MAX_ARGS];
+	unsigned long long capacity, size, next;
+	unsigned int max_cache_pct = 0;
+	int i, argc = 0, status, ret = -1;
+	pid_t pid;
+
+	capacity = (unsigned long long)dev->nr_chunks *
+		dev->zone_nr_sectors << 9;
+	size = capacity / job->nr_jobs;
+	size &= ~((unsigned long long)DMZ_BLOCK_MASK);
+
+	argv[argc++] = "fio";
+	snprintf(args[0], sizeof(args[0]), "--name=%s", job->name);
+	snprintf(filename, sizeof(filename), "--filename=%s", dm_path);
+	snprintf(args[1], sizeof(args[1]), "--runtime=%u", dev->bench_runtime);
+	snprintf(args[2], sizeof(args[2]), "--output=%s-%s.fio",
+		 dev->label, job->name);
+	snprintf(args[3], sizeof(args[3]), "--numjobs=%d", job->nr_jobs);
+	snprintf(args[4], sizeof(args[4]), "--size=%llu", size);
+	snprintf(args[5], sizeof(args[5]), "--offset_increment=%llu", size);
+	argv[argc++] = args[0];
+	argv[argc++] = filename;
+	for (i = 1; i < 6; i++)
+		argv[argc++] = args[i];
+	argv[argc++] = "--direct=1";
+	argv[argc++] = "--ioengine=libaio";
+	argv[argc++] = "--time_based";
+	argv[argc++] = "--group_reporting";
+	for (i = 0; job->args[i]; i++)
+		argv[argc++] = (char *)job->args[i];
+	argv[argc] = NULL;
+
+	printf("Running job %s (%s) for %u seconds\n",
+	       job->name, job->desc, dev->bench_runtime);
+	if (dev->flags & DMZ_VERBOSE) {
+		printf(" ");
+		for (i = 0; i < argc; i++)
+			printf(" %s", argv[i]);
+		printf("\n");
+	}
+
+	if (dmz_fio_sample(dev, dm_name, buf, &first) < 0)
+		return -1;
+	prev = first;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork failed %d (%s)\n",
+			errno, strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		fprintf(stderr, "Execute %s failed %d (%s)\n",
+			argv[0], errno, strerror(errno));
+		_exit(127);
+	}
+
+	printf("  %5s %8s %8s %8s %8s %7s %7s %7s %8s\n",
+	       "sec", "rd MB/s", "wr MB/s", "rd lat", "wr lat",
+	       "cache", "random", "seq", "wp MB/s");
+
+	next = first.usec + DMZ_FIO_INTERVAL;
+	for (;;) {
+		ret = waitpid(pid, &status, WNOHANG);
+		if (ret != 0)
+			break;
+
+		cur.usec = dmz_usec();
+		if (cur.usec < next) {
+			usleep(next - cur.usec);
+			continue;
+		}
+		next += DMZ_FIO_INTERVAL;
+
+		if (dmz_fio_sample(dev, dm_name, buf, &cur) < 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, &status, 0);
+			return -1;
+		}
+		dmz_fio_print_sample(&first, &prev, &cur);
+		if (dmz_fio_cache_pct(&cur) > max_cache_pct)
+			max_cache_pct = dmz_fio_cache_pct(&cur);
+		prev = cur;
+	}
+
+	if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Job %s failed (see %s-%s.fio)\n",
+			job->name, dev->label, job->name);
+		return -1;
+	}
+
+	if (dmz_fio_sample(dev, dm_name, buf, &cur) < 0)
+		return -1;
+
+	printf("  Job %s summary:\n", job->name);
+	printf("    Read %llu MB/s, avg latency %llu us\n",
+	       dmz_fio_mbps(dmz_fio_delta(&cur, &first, rd_sect),
+			    dmz_fio_delta(&cur, &first, usec)),
+	       dmz_fio_lat(dmz_fio_delta(&cur, &first, rd_ticks),
+			   dmz_fio_delta(&cur, &first, rd_ios)));
+	printf("    Write %llu MB/s, avg latency %llu us\n",
+	       dmz_fio_mbps(dmz_fio_delta(&cur, &first, wr_sect),
+			    dmz_fio_delta(&cur, &first, usec)),
+	       dmz_fio_lat(dmz_fio_delta(&cur, &first, wr_ticks),
+			   dmz_fio_delta(&cur, &first, wr_ios)));
+	printf("    %llu MB written by the host, %llu MB written "
+	       "to sequential zones\n",
+	       dmz_fio_delta(&cur, &first, wr_sect) >> 11,
+	       dmz_fio_delta(&cur, &first, wp_sect) >> 11);
+	printf("    Cache zones usage: %u%% max, %u%% at end\n",
+	       max_cache_pct, dmz_fio_cache_pct(&cur));
+	printf("    fio report: %s-%s.fio\n", dev->label, job->name);
+
+	return 0;
+}
+
+/*
+ * Format and start a target, run fio jobs against it and stop it.
+ */
+int dmz_bench_target(struct dmz_dev *dev)
+{
+	char path[PATH_MAX], *dm_path = NULL;
+	unsigned int i;
+	int ret = -1;
+	__u8 *buf;
+
+	if (dmz_fio_check_jobs(dev) < 0)
+		return -1;
+
+	if (!dev->bench_runtime)
+		dev->bench_runtime = DMZ_FIO_RUNTIME;
+
+	buf = malloc(DMZ_REPORT_ZONES_BUFSZ);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	if (dmz_format(dev) < 0 || dmz_release_zones(dev) < 0)
+		goto out;
+
+	if (dmz_start(dev) < 0)
+		goto out;
+
+	snprintf(path, sizeof(path), "/dev/mapper/%s", dev->label);
+	dm_path = realpath(path, NULL);
+	if (!dm_path) {
+		fprintf(stderr, "%s: Get device real path failed\n", path);
+		goto out_stop;
+	}
+
+	for (i = 0; i < DMZ_FIO_NR_JOBS; i++) {
+		if (!dmz_fio_job_selected(dev, &dmz_fio_jobs[i]))
+			continue;
+		if (dmz_fio_run_job(dev, &dmz_fio_jobs[i], path,
+				    basename(dm_path), buf) < 0)
+			goto out_stop;
+	}
+
+	ret = 0;
+
+out_stop:
+	printf("Stopping %s\n", dev->label);
+	if (dmz_deactivate_dm(dev->label) < 0) {
+		fprintf(stderr, "%s: could not deactivate\n", dev->label);
+		ret = -1;
+	}
+out:
+	free(dm_path);
+	free(buf);
+
+	return ret;
+}
@@ -40,9 +40,11 @@ static int dmz_prepare_super_zone(struct dmz_dev *dev, __u64 sb_block)
 }
 
 /*
- * Fill and write a super block.
+ * Fill and write a super block. Unless @quiet is true, the super block
+ * location is printed.
  */
-int dmz_write_super(struct dmz_dev *dev, __u64 gen, __u64 offset)
+int dmz_write_super(struct dmz_dev *dev, __u64 gen, __u64 offset,
+		    bool quiet)
 {
 	__u64 sb_block = dev->sb_block + offset, bdev_sb_block;
 	struct dm_zoned_super *sb;
@@ -63,8 +65,9 @@ int dmz_write_super(struct dmz_dev *dev, __u64 gen, __u64 offset)
 
 	bdev = dmz_block_to_bdev(dev, sb_block, &bdev_sb_block);
 
-	printf("  Writing super block to %s block %llu\n",
-	       bdev->name, bdev_sb_block);
+	if (!quiet)
+		printf("  Writing super block to %s block %llu\n",
+		       bdev->name, bdev_sb_block);
 
 	sb = (struct dm_zoned_super *) buf;
 
@@ -149,8 +152,7 @@ static int dmz_write_mapping(struct dmz_dev *dev, __u64 offset)
  */
 static int dmz_write_bitmap(struct dmz_dev *dev, __u64 offset)
 {
-	__u64 bitmap_block;
-	unsigned int i;
+	__u64 bitmap_block, i;
 	__u8 *buf;
 	int ret = -1;
 
@@ -196,7 +198,7 @@ static int dmz_write_meta(struct dmz_dev *dev, __u64 offset)
 		return -1;
 
 	/* Write super block */
-	if (dmz_write_super(dev, 1, offset) < 0)
+	if (dmz_write_super(dev, 1, offset, false) < 0)
 		return -1;
 
 	return 0;
@@ -219,6 +221,9 @@ int dmz_format(struct dmz_dev *dev)
 			dev->sb_version);
 	}
 
+	if (dev->flags & DMZ_DRY_RUN)
+		return dmz_plan(dev);
+
 	/* calculate location of metadata blocks */
 	if (dmz_locate_metadata(dev) < 0)
 		return -1;
@@ -259,7 +264,7 @@ int dmz_format(struct dmz_dev *dev)
 		}
 		printf("  %u useble zones\n",
 		       dev->nr_usable_zones);
-		printf("  Primary meta-data set: %u metadata blocks from block %llu (zone %u)\n",
+		printf("  Primary meta-data set: %llu metadata blocks from block %llu (zone %u)\n",
 		       dev->nr_meta_blocks,
 		       dev->sb_block,
 		       dmz_zone_id(dev, dev->sb_zone));
@@ -268,7 +273,7 @@ int dmz_format(struct dmz_dev *dev)
 		       dev->sb_block + (dev->nr_meta_zones * dev->zone_nr_blocks));
 		printf("    %u chunk mapping table blocks\n",
 		       dev->nr_map_blocks);
-		printf("    %u bitmap blocks\n",
+		printf("    %llu bitmap blocks\n",
 		       dev->nr_bitmap_blocks);
 		printf("    Using %u zones per meta-data set (%u total)\n",
 		       dev->nr_meta_zones,
@@ -280,6 +285,13 @@ int dmz_format(struct dmz_dev *dev)
 			dev->nr_reserved_seq);
 		printf("  %u data chunks capacity\n",
 		       dev->nr_chunks);
+		if (dev->zone_nr_cap_sectors < dev->zone_nr_sectors)
+			printf("    Zone capacity %zu 512-byte sectors: "
+			       "%llu usable sectors "
+			       "(userspace target only)\n",
+			       dev->zone_nr_cap_sectors,
+			       (unsigned long long)dev->nr_chunks *
+			       dev->zone_nr_cap_sectors);
 		printf("    %u cache zone%s\n",
 		       dev->nr_cache_zones,
 		       dev->nr_cache_zones > 1 ? "s" : "");
@@ -292,6 +304,10 @@ int dmz_format(struct dmz_dev *dev)
 
 	}
 
+	/* Catch bad metadata and cache zones before using them */
+	if ((dev->flags & DMZ_VALIDATE) && dmz_validate(dev) < 0)
+		return -1;
+
 	/* Ready to write: first reset all zones */
 	printf("Resetting sequential zones\n");
 	if (dmz_reset_zones(dev) < 0)
@@ -312,7 +328,8 @@ int dmz_format(struct dmz_dev *dev)
 		printf("Writing tertiary metadata\n");
 		for (i = 1; i < dev->nr_bdev; i++) {
 			if (dmz_write_super(dev, 0,
-					    dev->bdev[i].block_offset) < 0)
+					    dev->bdev[i].block_offset,
+					    false) < 0)
 				return -1;
 		}
 	}
@@ -0,0 +1,954 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+
+#include <asm/byteorder.h>
+
+/*
+ * Metadata images.
+ *
+ * An image is a copy of the blocks of the valid metadata set of a device
+ * (super block, chunk mapping table and zone bitmaps). A patch only holds
+ * the metadata blocks that changed since a base image (or patch), so
+ * that periodic snapshots of a device only cost the changed blocks.
+ * The file layout is a header block, followed for images by all the
+ * metadata blocks, and for patches by the sorted numbers of the changed
+ * blocks (padded to a block) and the changed blocks.
+ */
+#define DMZ_IMAGE_MAGIC		((((unsigned int)('D')) << 24) | \
+				 (((unsigned int)('Z')) << 16) | \
+				 (((unsigned int)('I')) <<  8) | \
+				 ((unsigned int)('M')))
+
+#define DMZ_IMAGE_FULL		1
+#define DMZ_IMAGE_PATCH		2
+
+/*
+ * Maximum number of patches applied on top of an image.
+ */
+#define DMZ_IMAGE_MAX_DEPTH	256
+
+#define DMZ_IMAGE_BASE_LEN	256
+
+struct dmz_image_header {
+	__le32		magic;
+	__le32		type;
+
+	/* Snapshot time (microseconds since the epoch) */
+	__le64		timestamp;
+
+	/* Metadata generation */
+	__le64		gen;
+
+	/* Metadata geometry */
+	__le64		nr_meta_blocks;
+	__le32		nr_zones;
+	__le32		nr_chunks;
+	__le32		nr_map_blocks;
+	__le32		zone_nr_bitmap_blocks;
+	__u8		dmz_uuid[DMZ_UUID_LEN];
+
+	/* Number of metadata blocks stored */
+	__le64		nr_blocks;
+
+	/* Base image of a patch */
+	__le64		base_gen;
+	__le64		base_timestamp;
+	char		base[DMZ_IMAGE_BASE_LEN];
+
+	__le32		crc;
+
+	/* Padding to a full block */
+	__u8		reserved[3748];
+
+} __attribute__ ((packed));
+
+/*
+ * Source of metadata blocks: an image, a patch applied on top of its base
+ * or the valid metadata set of the device.
+ */
+struct dmz_image {
+	char			*path;
+	int			fd;
+	unsigned int		type;
+	unsigned long long	timestamp;
+	__u64			gen;
+
+	/* Changed blocks of a patch and offset of their data */
+	__u64			*blocks;
+	__u64			nr_blocks;
+	off_t			data_offset;
+	struct dmz_image	*base;
+
+	/* Device metadata set */
+	struct dmz_dev		*dev;
+	struct dmz_meta_set	*mset;
+};
+
+/*
+ * Delta statistics.
+ */
+struct dmz_delta {
+	unsigned int		nr_mapped;
+	unsigned int		nr_unmapped;
+	unsigned int		nr_remapped;
+	unsigned int		nr_buf_gained;
+	unsigned int		nr_buf_released;
+	unsigned int		nr_zones;
+	unsigned long long	nr_written;
+	unsigned long long	nr_invalidated;
+	unsigned int		nr_map_blocks;
+	unsigned long long	nr_bitmap_blocks;
+
+	/* Changed metadata blocks */
+	__u64			*blocks;
+	__u64			nr_blocks;
+};
+
+static unsigned long long dmz_image_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000ULL +
+		ts.tv_nsec / 1000;
+}
+
+/*
+ * Load the valid metadata set of the device.
+ */
+static struct dmz_meta_set *dmz_image_load_mset(struct dmz_dev *dev,
+						struct dmz_meta_set *mset)
+{
+	struct dmz_meta_set *valid;
+
+	memset(mset, 0, sizeof(struct dmz_meta_set) * 3);
+	mset[1].id = 1;
+	mset[2].id = 2;
+
+	if (dmz_check_superblocks(dev, mset) < 0)
+		return NULL;
+
+	valid = dmz_validate_meta_set(dev, mset);
+	if (valid)
+		printf("Using the %s metadata set (generation %llu)\n",
+		       valid->id == 0 ? "primary" : "secondary", valid->gen);
+
+	return valid;
+}
+
+static void dmz_image_close(struct dmz_image *img)
+{
+	if (!img)
+		return;
+
+	dmz_image_close(img->base);
+	if (img->fd >= 0)
+		close(img->fd);
+	free(img->blocks);
+	free(img->path);
+	free(img);
+}
+
+static struct dmz_image *dmz_image_alloc(const char *path)
+{
+	struct dmz_image *img;
+
+	img = calloc(1, sizeof(struct dmz_image));
+	if (!img) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	img->fd = -1;
+
+	if (path) {
+		img->path = strdup(path);
+		if (!img->path) {
+			fprintf(stderr, "Not enough memory\n");
+			free(img);
+			return NULL;
+		}
+	}
+
+	return img;
+}
+
+/*
+ * Use the valid metadata set of the device as a source of blocks.
+ */
+static struct dmz_image *dmz_image_live(struct dmz_dev *dev,
+					struct dmz_meta_set *mset)
+{
+	struct dmz_image *img;
+
+	img = dmz_image_alloc(NULL);
+	if (!img)
+		return NULL;
+
+	img->type = DMZ_IMAGE_FULL;
+	img->timestamp = dmz_image_time();
+	img->gen = mset->gen;
+	img->dev = dev;
+	img->mset = mset;
+
+	return img;
+}
+
+/*
+ * Initialize an image header with the device metadata geometry.
+ */
+static void dmz_image_init_header(struct dmz_dev *dev,
+				  struct dmz_image_header *hdr,
+				  unsigned int type, struct dmz_image *img,
+				  __u64 nr_blocks)
+{
+	memset(hdr, 0, sizeof(struct dmz_image_header));
+	hdr->magic = __cpu_to_le32(DMZ_IMAGE_MAGIC);
+	hdr->type = __cpu_to_le32(type);
+	hdr->timestamp = __cpu_to_le64(img->timestamp);
+	hdr->gen = __cpu_to_le64(img->gen);
+	hdr->nr_meta_blocks = __cpu_to_le64(dev->nr_meta_blocks);
+	hdr->nr_zones = __cpu_to_le32(dev->nr_zones);
+	hdr->nr_chunks = __cpu_to_le32(dev->nr_chunks);
+	hdr->nr_map_blocks = __cpu_to_le32(dev->nr_map_blocks);
+	hdr->zone_nr_bitmap_blocks =
+		__cpu_to_le32(dev->zone_nr_bitmap_blocks);
+	memcpy(hdr->dmz_uuid, dev->uuid, DMZ_UUID_LEN);
+	hdr->nr_blocks = __cpu_to_le64(nr_blocks);
+}
+
+static void dmz_image_set_crc(struct dmz_image_header *hdr)
+{
+	hdr->crc = 0;
+	hdr->crc = __cpu_to_le32(dmz_crc32(DMZ_IMAGE_MAGIC, hdr,
+					   sizeof(struct dmz_image_header)));
+}
+
+/*
+ * Check that an image header is valid and matches the device metadata.
+ */
+static int dmz_image_check_header(struct dmz_dev *dev, const char *path,
+				  struct dmz_image_header *hdr)
+{
+	__u32 stored_crc, crc;
+
+	if (__le32_to_cpu(hdr->magic) != DMZ_IMAGE_MAGIC) {
+		fprintf(stderr, "%s: not a metadata image\n", path);
+		return -1;
+	}
+
+	stored_crc = __le32_to_cpu(hdr->crc);
+	hdr->crc = 0;
+	crc = dmz_crc32(DMZ_IMAGE_MAGIC, hdr,
+			sizeof(struct dmz_image_header));
+	if (crc != stored_crc) {
+		fprintf(stderr, "%s: invalid header crc\n", path);
+		return -1;
+	}
+
+	if (__le32_to_cpu(hdr->type) != DMZ_IMAGE_FULL &&
+	    __le32_to_cpu(hdr->type) != DMZ_IMAGE_PATCH) {
+		fprintf(stderr, "%s: invalid image type %u\n",
+			path, __le32_to_cpu(hdr->type));
+		return -1;
+	}
+
+	if (__le64_to_cpu(hdr->nr_meta_blocks) != dev->nr_meta_blocks ||
+	    __le32_to_cpu(hdr->nr_zones) != dev->nr_zones ||
+	    __le32_to_cpu(hdr->nr_chunks) != dev->nr_chunks ||
+	    __le32_to_cpu(hdr->nr_map_blocks) != dev->nr_map_blocks ||
+	    __le32_to_cpu(hdr->zone_nr_bitmap_blocks) !=
+	    dev->zone_nr_bitmap_blocks) {
+		fprintf(stderr,
+			"%s: metadata geometry does not match the device\n",
+			path);
+		return -1;
+	}
+
+	if (!uuid_is_null(dev->uuid) &&
+	    uuid_compare(hdr->dmz_uuid, dev->uuid) != 0) {
+		fprintf(stderr,
+			"%s: image of a different dm-zoned device\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the path of the base of a patch: relative paths are relative
+ * to the directory of the patch.
+ */
+static char *dmz_image_base_path(const char *path, const char *base)
+{
+	char *dir, *tmp, *bpath;
+
+	if (base[0] == '/')
+		return strdup(base);
+
+	tmp = strdup(path);
+	if (!tmp)
+		return NULL;
+	dir = dirname(tmp);
+
+	if (asprintf(&bpath, "%s/%s", dir, base) < 0)
+		bpath = NULL;
+	free(tmp);
+
+	return bpath;
+}
+
+/*
+ * Open an image or a patch and the chain of its bases.
+ */
+static struct dmz_image *dmz_image_open(struct dmz_dev *dev,
+					const char *path, int depth)
+{
+	struct dmz_image_header hdr;
+	struct dmz_image *img;
+	size_t index_size;
+	char *bpath;
+	__le64 *index;
+	__u64 i;
+
+	if (depth > DMZ_IMAGE_MAX_DEPTH) {
+		fprintf(stderr, "%s: too many patches\n", path);
+		return NULL;
+	}
+
+	img = dmz_image_alloc(path);
+	if (!img)
+		return NULL;
+
+	img->fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (img->fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		goto err;
+	}
+
+	if (pread(img->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		fprintf(stderr, "%s: read header failed\n", path);
+		goto err;
+	}
+
+	if (dmz_image_check_header(dev, path, &hdr) < 0)
+		goto err;
+
+	img->type = __le32_to_cpu(hdr.type);
+	img->timestamp = __le64_to_cpu(hdr.timestamp);
+	img->gen = __le64_to_cpu(hdr.gen);
+	if (img->type == DMZ_IMAGE_FULL)
+		return img;
+
+	/* Load the changed block numbers of the patch */
+	img->nr_blocks = __le64_to_cpu(hdr.nr_blocks);
+	if (img->nr_blocks > dev->nr_meta_blocks) {
+		fprintf(stderr, "%s: invalid number of blocks\n", path);
+		goto err;
+	}
+	index_size = img->nr_blocks * sizeof(__le64);
+	img->data_offset = DMZ_BLOCK_SIZE +
+		DIV_ROUND_UP(index_size, DMZ_BLOCK_SIZE) * DMZ_BLOCK_SIZE;
+	index = malloc(index_size + 1);
+	img->blocks = malloc(img->nr_blocks * sizeof(__u64) + 1);
+	if (!index || !img->blocks) {
+		fprintf(stderr, "Not enough memory\n");
+		free(index);
+		goto err;
+	}
+	if (pread(img->fd, index, index_size, DMZ_BLOCK_SIZE) !=
+	    (ssize_t)index_size) {
+		fprintf(stderr, "%s: read block index failed\n", path);
+		free(index);
+		goto err;
+	}
+	for (i = 0; i < img->nr_blocks; i++) {
+		img->blocks[i] = __le64_to_cpu(index[i]);
+		if (img->blocks[i] >= dev->nr_meta_blocks ||
+		    (i && img->blocks[i] <= img->blocks[i - 1])) {
+			fprintf(stderr, "%s: invalid block index\n", path);
+			free(index);
+			goto err;
+		}
+	}
+	free(index);
+
+	/* Open the base, which may itself be a patch */
+	hdr.base[DMZ_IMAGE_BASE_LEN - 1] = '\0';
+	bpath = dmz_image_base_path(path, hdr.base);
+	if (!bpath) {
+		fprintf(stderr, "Not enough memory\n");
+		goto err;
+	}
+	img->base = dmz_image_open(dev, bpath, depth + 1);
+	free(bpath);
+	if (!img->base)
+		goto err;
+
+	if (img->base->gen != __le64_to_cpu(hdr.base_gen) ||
+	    img->base->timestamp != __le64_to_cpu(hdr.base_timestamp)) {
+		fprintf(stderr,
+			"%s: base image %s does not match the patch\n",
+			path, img->base->path);
+		goto err;
+	}
+
+	return img;
+
+err:
+	dmz_image_close(img);
+
+	return NULL;
+}
+
+/*
+ * Read a metadata block of an image.
+ */
+static int dmz_image_read_block(struct dmz_image *img, __u64 block,
+				__u8 *buf)
+{
+	__u64 lo = 0, hi, mid;
+
+	if (img->dev)
+		return dmz_read_block(img->dev, img->mset->sb_block + block,
+				      buf);
+
+	if (img->type == DMZ_IMAGE_FULL) {
+		if (pread(img->fd, buf, DMZ_BLOCK_SIZE,
+			  (off_t)(block + 1) * DMZ_BLOCK_SIZE) !=
+		    DMZ_BLOCK_SIZE) {
+			fprintf(stderr, "%s: read block %llu failed\n",
+				img->path, block);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Changed block of the patch, or block of the base */
+	hi = img->nr_blocks;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (img->blocks[mid] < block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo >= img->nr_blocks || img->blocks[lo] != block)
+		return dmz_image_read_block(img->base, block, buf);
+
+	if (pread(img->fd, buf, DMZ_BLOCK_SIZE,
+		  img->data_offset + (off_t)lo * DMZ_BLOCK_SIZE) !=
+	    DMZ_BLOCK_SIZE) {
+		fprintf(stderr, "%s: read block %llu failed\n",
+			img->path, block);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dmz_image_write(int fd, const char *path, const void *buf,
+			   size_t size)
+{
+	ssize_t ret;
+
+	ret = write(fd, buf, size);
+	if (ret != (ssize_t)size) {
+		fprintf(stderr,
+			"Write %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dmz_image_create(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0)
+		fprintf(stderr,
+			"Create %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+
+	return fd;
+}
+
+static int dmz_image_finish(int fd, const char *path, int ret)
+{
+	if (ret == 0 && fsync(fd) < 0) {
+		fprintf(stderr,
+			"Sync %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+
+	if (ret < 0)
+		unlink(path);
+
+	return ret;
+}
+
+/*
+ * Save the valid metadata set of a device to an image file.
+ */
+int dmz_dump(struct dmz_dev *dev)
+{
+	struct dmz_image_header hdr;
+	struct dmz_meta_set mset[3], *valid;
+	struct dmz_image *live = NULL;
+	__u8 *buf = NULL;
+	__u64 b;
+	int fd, ret = -1;
+
+	valid = dmz_image_load_mset(dev, mset);
+	if (!valid)
+		return -1;
+
+	live = dmz_image_live(dev, valid);
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!live || !buf) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	fd = dmz_image_create(dev->image_path);
+	if (fd < 0)
+		goto out;
+
+	dmz_image_init_header(dev, &hdr, DMZ_IMAGE_FULL, live,
+			      dev->nr_meta_blocks);
+	dmz_image_set_crc(&hdr);
+	ret = dmz_image_write(fd, dev->image_path, &hdr, sizeof(hdr));
+
+	for (b = 0; !ret && b < dev->nr_meta_blocks; b++) {
+		ret = dmz_image_read_block(live, b, buf);
+		if (!ret)
+			ret = dmz_image_write(fd, dev->image_path, buf,
+					      DMZ_BLOCK_SIZE);
+	}
+
+	ret = dmz_image_finish(fd, dev->image_path, ret);
+	if (ret == 0)
+		printf("Saved metadata generation %llu to %s "
+		       "(%llu blocks, %llu MiB)\n",
+		       live->gen, dev->image_path, dev->nr_meta_blocks,
+		       (dev->nr_meta_blocks * DMZ_BLOCK_SIZE) >> 20);
+
+out:
+	dmz_image_close(live);
+	free(buf);
+
+	return ret;
+}
+
+static int dmz_delta_add_block(struct dmz_delta *delta, __u64 block)
+{
+	__u64 *blocks;
+
+	if (!(delta->nr_blocks & 1023)) {
+		blocks = realloc(delta->blocks,
+				 (delta->nr_blocks + 1024) * sizeof(__u64));
+		if (!blocks) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+		delta->blocks = blocks;
+	}
+
+	delta->blocks[delta->nr_blocks++] = block;
+
+	return 0;
+}
+
+/*
+ * Compare two runs of metadata blocks, recording the changed blocks.
+ * Return the number of changed blocks or -1 on error.
+ */
+static long long dmz_delta_read(struct dmz_image *from,
+				struct dmz_image *to,
+				struct dmz_delta *delta, __u64 block,
+				unsigned int nr_blocks,
+				__u8 *from_buf, __u8 *to_buf)
+{
+	long long nr_changed = 0;
+	unsigned int b;
+
+	for (b = 0; b < nr_blocks; b++) {
+		if (dmz_image_read_block(from, block + b,
+					 from_buf + b * DMZ_BLOCK_SIZE) < 0 ||
+		    dmz_image_read_block(to, block + b,
+					 to_buf + b * DMZ_BLOCK_SIZE) < 0)
+			return -1;
+		if (memcmp(from_buf + b * DMZ_BLOCK_SIZE,
+			   to_buf + b * DMZ_BLOCK_SIZE, DMZ_BLOCK_SIZE) == 0)
+			continue;
+		if (dmz_delta_add_block(delta, block + b) < 0)
+			return -1;
+		nr_changed++;
+	}
+
+	return nr_changed;
+}
+
+/*
+ * Compare the chunk mapping tables.
+ */
+static void dmz_delta_map(struct dmz_dev *dev, struct dmz_delta *delta,
+			  __u8 *from_map, __u8 *to_map,
+			  unsigned int *zone_chunk)
+{
+	struct dm_zoned_map *fm = (struct dm_zoned_map *)from_map;
+	struct dm_zoned_map *tm = (struct dm_zoned_map *)to_map;
+	unsigned int chunk, fd, fb, td, tb;
+
+	for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+		fd = __le32_to_cpu(fm[chunk].dzone_id);
+		fb = __le32_to_cpu(fm[chunk].bzone_id);
+		td = __le32_to_cpu(tm[chunk].dzone_id);
+		tb = __le32_to_cpu(tm[chunk].bzone_id);
+
+		/* Zone to chunk map for the bitmap comparison */
+		if (fd < dev->nr_zones)
+			zone_chunk[fd] = chunk;
+		if (fb < dev->nr_zones)
+			zone_chunk[fb] = chunk;
+		if (td < dev->nr_zones)
+			zone_chunk[td] = chunk;
+		if (tb < dev->nr_zones)
+			zone_chunk[tb] = chunk;
+
+		if (fd != td) {
+			if (fd == DMZ_MAP_UNMAPPED) {
+				printf("Chunk %u: mapped to zone %u\n",
+				       chunk, td);
+				delta->nr_mapped++;
+			} else if (td == DMZ_MAP_UNMAPPED) {
+				printf("Chunk %u: unmapped from zone %u\n",
+				       chunk, fd);
+				delta->nr_unmapped++;
+			} else {
+				printf("Chunk %u: remapped from zone %u "
+				       "to zone %u\n",
+				       chunk, fd, td);
+				delta->nr_remapped++;
+			}
+		}
+
+		if (fb != tb) {
+			if (fb != DMZ_MAP_UNMAPPED) {
+				printf("Chunk %u: released buffer zone %u\n",
+				       chunk, fb);
+				delta->nr_buf_released++;
+			}
+			if (tb != DMZ_MAP_UNMAPPED) {
+				printf("Chunk %u: gained buffer zone %u\n",
+				       chunk, tb);
+				delta->nr_buf_gained++;
+			}
+		}
+	}
+}
+
+/*
+ * Compare the bitmaps of a zone.
+ */
+static int dmz_delta_zone(struct dmz_dev *dev, struct dmz_delta *delta,
+			  unsigned int zone_id, unsigned int chunk,
+			  unsigned int nr_changed,
+			  __u8 *from_buf, __u8 *to_buf)
+{
+	struct dmz_bitmap *fbm, *tbm;
+	unsigned int b, common;
+	int ret = -1;
+
+	fbm = dmz_bitmap_alloc(dev->zone_nr_blocks);
+	tbm = dmz_bitmap_alloc(dev->zone_nr_blocks);
+	if (!fbm || !tbm) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	for (b = 0; b < dev->zone_nr_bitmap_blocks; b++) {
+		if (dmz_bitmap_load_block(fbm, b,
+					  from_buf + b * DMZ_BLOCK_SIZE) < 0 ||
+		    dmz_bitmap_load_block(tbm, b,
+					  to_buf + b * DMZ_BLOCK_SIZE) < 0)
+			goto out;
+	}
+
+	common = dmz_bitmap_and_weight(fbm, tbm);
+
+	if (chunk == DMZ_MAP_UNMAPPED)
+		printf("Zone %u (unmapped): ", zone_id);
+	else
+		printf("Zone %u (chunk %u): ", zone_id, chunk);
+	printf("%u -> %u valid blocks (%+lld), %u written, "
+	       "%u invalidated, %u -> %u extents, "
+	       "%u bitmap block%s changed\n",
+	       fbm->weight, tbm->weight,
+	       (long long)tbm->weight - fbm->weight,
+	       tbm->weight - common, fbm->weight - common,
+	       dmz_bitmap_extents(fbm), dmz_bitmap_extents(tbm),
+	       nr_changed, nr_changed > 1 ? "s" : "");
+
+	delta->nr_zones++;
+	delta->nr_written += tbm->weight - common;
+	delta->nr_invalidated += fbm->weight - common;
+	ret = 0;
+
+out:
+	dmz_bitmap_free(fbm);
+	dmz_bitmap_free(tbm);
+
+	return ret;
+}
+
+/*
+ * Get the path of the base of a patch to store in the patch header:
+ * the base file name if it is in the same directory as the patch,
+ * its absolute path otherwise.
+ */
+static char *dmz_image_rel_base(const char *base, const char *path)
+{
+	char *rbase, *rdir = NULL, *tmp, *bname;
+
+	rbase = realpath(base, NULL);
+	tmp = strdup(path);
+	if (rbase && tmp)
+		rdir = realpath(dirname(tmp), NULL);
+	free(tmp);
+	if (!rbase || !rdir) {
+		free(rdir);
+		return rbase;
+	}
+
+	tmp = strdup(rbase);
+	if (tmp && strcmp(dirname(tmp), rdir) == 0) {
+		bname = strdup(basename(rbase));
+		if (bname) {
+			free(rbase);
+			rbase = bname;
+		}
+	}
+	free(tmp);
+	free(rdir);
+
+	return rbase;
+}
+
+/*
+ * Save the changed blocks as a patch of the base image.
+ */
+static int dmz_delta_save_patch(struct dmz_dev *dev, struct dmz_delta *delta,
+				struct dmz_image *from, struct dmz_image *to)
+{
+	const char *path = dev->delta_patch;
+	struct dmz_image_header hdr;
+	size_t index_size;
+	__le64 *index;
+	__u8 *buf;
+	char *base;
+	__u64 i;
+	int fd, ret = 0;
+
+	base = dmz_image_rel_base(from->path, path);
+	if (!base) {
+		fprintf(stderr, "%s: get base image path failed\n",
+			from->path);
+		return -1;
+	}
+	if (strlen(base) >= DMZ_IMAGE_BASE_LEN) {
+		fprintf(stderr, "%s: base image path too long\n", base);
+		free(base);
+		return -1;
+	}
+
+	index_size = DIV_ROUND_UP(delta->nr_blocks * sizeof(__le64),
+				  DMZ_BLOCK_SIZE) * DMZ_BLOCK_SIZE;
+	index = calloc(1, index_size + 1);
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!index || !buf) {
+		fprintf(stderr, "Not enough memory\n");
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < delta->nr_blocks; i++)
+		index[i] = __cpu_to_le64(delta->blocks[i]);
+
+	fd = dmz_image_create(path);
+	if (fd < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	dmz_image_init_header(dev, &hdr, DMZ_IMAGE_PATCH, to,
+			      delta->nr_blocks);
+	hdr.base_gen = __cpu_to_le64(from->gen);
+	hdr.base_timestamp = __cpu_to_le64(from->timestamp);
+	strcpy(hdr.base, base);
+	dmz_image_set_crc(&hdr);
+
+	ret = dmz_image_write(fd, path, &hdr, sizeof(hdr));
+	if (!ret && index_size)
+		ret = dmz_image_write(fd, path, index, index_size);
+	for (i = 0; !ret && i < delta->nr_blocks; i++) {
+		ret = dmz_image_read_block(to, delta->blocks[i], buf);
+		if (!ret)
+			ret = dmz_image_write(fd, path, buf, DMZ_BLOCK_SIZE);
+	}
+
+	ret = dmz_image_finish(fd, path, ret);
+	if (ret == 0)
+		printf("Saved %llu changed blocks to patch %s (%llu KiB)\n",
+		       delta->nr_blocks, path,
+		       (DMZ_BLOCK_SIZE + index_size +
+			delta->nr_blocks * DMZ_BLOCK_SIZE) >> 10);
+
+out:
+	free(base);
+	free(index);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Compare a metadata image (or patch) with another image or with the
+ * device metadata, and report the chunk mapping and zone bitmap changes.
+ */
+int dmz_delta(struct dmz_dev *dev)
+{
+	struct dmz_meta_set mset[3], *valid;
+	struct dmz_image *from = NULL, *to = NULL;
+	struct dmz_delta delta;
+	unsigned int *zone_chunk = NULL;
+	unsigned long long usec;
+	__u8 *from_buf = NULL, *to_buf = NULL;
+	__u8 *from_map = NULL, *to_map = NULL;
+	size_t zbuf_size;
+	unsigned int z;
+	__u64 block;
+	long long nr;
+	int ret = -1;
+
+	memset(&delta, 0, sizeof(struct dmz_delta));
+
+	valid = dmz_image_load_mset(dev, mset);
+	if (!valid)
+		return -1;
+
+	from = dmz_image_open(dev, dev->image_path, 0);
+	if (!from)
+		goto out;
+
+	if (dev->delta_to)
+		to = dmz_image_open(dev, dev->delta_to, 0);
+	else
+		to = dmz_image_live(dev, valid);
+	if (!to)
+		goto out;
+
+	zbuf_size = dev->zone_nr_bitmap_blocks * DMZ_BLOCK_SIZE;
+	from_map = dmz_malloc_buf(dev->nr_map_blocks * DMZ_BLOCK_SIZE);
+	to_map = dmz_malloc_buf(dev->nr_map_blocks * DMZ_BLOCK_SIZE);
+	from_buf = dmz_malloc_buf(zbuf_size);
+	to_buf = dmz_malloc_buf(zbuf_size);
+	zone_chunk = malloc(dev->nr_zones * sizeof(unsigned int));
+	if (!from_map || !to_map || !from_buf || !to_buf || !zone_chunk) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	memset(zone_chunk, 0xff, dev->nr_zones * sizeof(unsigned int));
+
+	printf("Comparing %s (generation %llu) with %s (generation %llu)\n",
+	       from->path, from->gen,
+	       to->path ? to->path : "the device metadata", to->gen);
+
+	/* Super block */
+	if (dmz_delta_read(from, to, &delta, 0, 1, from_buf, to_buf) < 0)
+		goto out;
+
+	/* Chunk mapping table */
+	nr = dmz_delta_read(from, to, &delta, 1, dev->nr_map_blocks,
+			    from_map, to_map);
+	if (nr < 0)
+		goto out;
+	delta.nr_map_blocks = nr;
+	dmz_delta_map(dev, &delta, from_map, to_map, zone_chunk);
+
+	/* Zone bitmaps */
+	block = 1 + dev->nr_map_blocks;
+	for (z = 0; z < dev->nr_zones; z++) {
+		nr = dmz_delta_read(from, to, &delta, block,
+				    dev->zone_nr_bitmap_blocks,
+				    from_buf, to_buf);
+		if (nr < 0)
+			goto out;
+		if (nr) {
+			delta.nr_bitmap_blocks += nr;
+			if (dmz_delta_zone(dev, &delta, z, zone_chunk[z], nr,
+					   from_buf, to_buf) < 0)
+				goto out;
+		}
+		block += dev->zone_nr_bitmap_blocks;
+	}
+
+	usec = to->timestamp > from->timestamp ?
+		to->timestamp - from->timestamp : 0;
+	printf("Delta over %llu.%03llu s:\n",
+	       usec / 1000000, (usec % 1000000) / 1000);
+	printf("  Chunks: %u mapped, %u unmapped, %u remapped\n",
+	       delta.nr_mapped, delta.nr_unmapped, delta.nr_remapped);
+	printf("  Buffer zones: %u gained, %u released\n",
+	       delta.nr_buf_gained, delta.nr_buf_released);
+	printf("  Zones: %u changed, %llu blocks written, "
+	       "%llu blocks invalidated\n",
+	       delta.nr_zones, delta.nr_written, delta.nr_invalidated);
+	if (usec)
+		printf("  Write rate: %llu KB/s, invalidation rate: %llu KB/s\n",
+		       ((delta.nr_written << DMZ_BLOCK_SHIFT) >> 10) *
+		       1000000ULL / usec,
+		       ((delta.nr_invalidated << DMZ_BLOCK_SHIFT) >> 10) *
+		       1000000ULL / usec);
+	printf("  Metadata blocks: %llu changed (%u mapping, %llu bitmap)\n",
+	       delta.nr_blocks, delta.nr_map_blocks, delta.nr_bitmap_blocks);
+
+	if (dev->delta_patch &&
+	    dmz_delta_save_patch(dev, &delta, from, to) < 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	dmz_image_close(from);
+	dmz_image_close(to);
+	free(from_map);
+	free(to_map);
+	free(from_buf);
+	free(to_buf);
+	free(zone_chunk);
+	free(delta.blocks);
+
+	return ret;
+}
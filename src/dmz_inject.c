@@ -0,0 +1,598 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <asm/byteorder.h>
+
+/*
+ * Corruption types.
+ */
+enum dmz_inject_type {
+	DMZ_INJECT_STALE_SET = 0,
+	DMZ_INJECT_DUP_ZONE,
+	DMZ_INJECT_WP_BITS,
+	DMZ_INJECT_OVERLAP,
+	DMZ_INJECT_TORN_SB,
+	DMZ_INJECT_NR_TYPES,
+};
+
+static const char *dmz_inject_names[DMZ_INJECT_NR_TYPES] = {
+	"stale-set",
+	"dup-zone",
+	"wp-bits",
+	"overlap",
+	"torn-sb",
+};
+
+/*
+ * Maximum number of blocks written to a sequential zone
+ * used for a corruption.
+ */
+#define DMZ_INJECT_MAX_BLOCKS	32
+
+/*
+ * Injection context.
+ */
+struct dmz_inject {
+	struct dmz_dev		*dev;
+	struct dmz_meta_set	mset[3];
+	unsigned int		count[DMZ_INJECT_NR_TYPES];
+	__u8			*zone_used;
+	__u8			*chunk_used;
+	FILE			*record;
+	unsigned int		nr_errors;
+};
+
+/*
+ * Parse the corruption list: <type>[:<count>][,<type>[:<count>]...]
+ */
+static int dmz_inject_parse(struct dmz_inject *inj, char *str)
+{
+	unsigned int t, count;
+	size_t len;
+	char *p;
+
+	while (*str) {
+		len = strcspn(str, ":,");
+		for (t = 0; t < DMZ_INJECT_NR_TYPES; t++) {
+			if (strlen(dmz_inject_names[t]) == len &&
+			    strncmp(str, dmz_inject_names[t], len) == 0)
+				break;
+		}
+		if (t >= DMZ_INJECT_NR_TYPES)
+			goto err;
+		str += len;
+
+		count = 1;
+		if (*str == ':') {
+			count = strtoul(str + 1, &p, 10);
+			if (p == str + 1 || !count)
+				goto err;
+			str = p;
+		}
+		inj->count[t] += count;
+
+		if (*str == ',')
+			str++;
+		else if (*str)
+			goto err;
+	}
+
+	if (inj->count[DMZ_INJECT_STALE_SET] &&
+	    inj->count[DMZ_INJECT_TORN_SB]) {
+		fprintf(stderr,
+			"stale-set and torn-sb corruptions are exclusive\n");
+		return -1;
+	}
+
+	if (inj->count[DMZ_INJECT_STALE_SET] > 1 ||
+	    inj->count[DMZ_INJECT_TORN_SB] > 1) {
+		fprintf(stderr,
+			"stale-set and torn-sb corruptions can be "
+			"injected only once\n");
+		return -1;
+	}
+
+	return 0;
+
+err:
+	fprintf(stderr, "Invalid corruption list\n");
+	return -1;
+}
+
+/*
+ * Get a random unmapped chunk.
+ */
+static unsigned int dmz_inject_get_chunk(struct dmz_inject *inj)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int i, chunk = random() % dev->nr_chunks;
+
+	for (i = 0; i < dev->nr_chunks; i++) {
+		if (!inj->chunk_used[chunk]) {
+			inj->chunk_used[chunk] = 1;
+			return chunk;
+		}
+		chunk = (chunk + 1) % dev->nr_chunks;
+	}
+
+	fprintf(stderr, "No unmapped chunk available\n");
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * Get a random unmapped cache zone, or an unmapped empty sequential zone.
+ */
+static unsigned int dmz_inject_get_zone(struct dmz_inject *inj, bool cache)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int i, zone_id = random() % dev->nr_zones;
+	struct blk_zone *zone;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &dev->zones[zone_id];
+		if (!inj->zone_used[zone_id] &&
+		    ((cache && dmz_zone_is_cache(dev, zone)) ||
+		     (!cache && dmz_zone_seq_req(zone) &&
+		      dmz_zone_empty(zone)))) {
+			inj->zone_used[zone_id] = 1;
+			return zone_id;
+		}
+		zone_id = (zone_id + 1) % dev->nr_zones;
+	}
+
+	fprintf(stderr, "No unmapped %s zone available\n",
+		cache ? "cache" : "empty sequential");
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * Write @nr_blocks zeroed blocks at the write pointer of a sequential zone.
+ */
+static int dmz_inject_fill_zone(struct dmz_inject *inj, unsigned int zone_id,
+				unsigned int nr_blocks)
+{
+	struct dmz_dev *dev = inj->dev;
+	struct blk_zone *zone = &dev->zones[zone_id];
+	struct dmz_block_dev *bdev;
+	__u64 sector;
+	size_t size = nr_blocks << DMZ_BLOCK_SHIFT;
+	ssize_t ret;
+	__u8 *buf;
+	int fd;
+
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_wp_sector(zone), &sector);
+
+	/* Sequential zones must be written with direct IOs */
+	fd = open(bdev->path, O_WRONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			bdev->path,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	buf = dmz_malloc_buf(size);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	memset(buf, 0, size);
+
+	ret = pwrite(fd, buf, size, sector << 9);
+	free(buf);
+	close(fd);
+	if (ret != (ssize_t)size) {
+		fprintf(stderr,
+			"%s: Write zone %u failed %d (%s)\n",
+			bdev->name, zone_id,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	zone->wp += dmz_blk2sect(nr_blocks);
+
+	return dmz_track_open_zone(dev, zone);
+}
+
+/*
+ * Map a chunk in all metadata sets.
+ */
+static void dmz_inject_map(struct dmz_inject *inj, unsigned int chunk,
+			   unsigned int dzone_id, unsigned int bzone_id)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		dmz_set_chunk_mapping(inj->dev, &inj->mset[i], chunk,
+				      dzone_id, bzone_id);
+}
+
+/*
+ * Set bits of a zone bitmap in all metadata sets: @nr_bits bits from
+ * @start, and @nr_rnd_bits random bits between @rnd_start and @rnd_end.
+ * Return the number of random bits set that were not already set.
+ */
+static int dmz_inject_set_bits(struct dmz_inject *inj, unsigned int zone_id,
+			       unsigned int start, unsigned int nr_bits,
+			       unsigned int rnd_start, unsigned int rnd_end,
+			       unsigned int nr_rnd_bits)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int b, *rnd_bits, nr_set = 0;
+	__u8 *buf;
+	int i, ret = 0;
+
+	rnd_bits = calloc(nr_rnd_bits + 1, sizeof(unsigned int));
+	if (!rnd_bits) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	for (b = 0; b < nr_rnd_bits; b++)
+		rnd_bits[b] = rnd_start + random() % (rnd_end - rnd_start);
+
+	for (i = 0; i < 2; i++) {
+		if (dmz_read_zone_bitmap(dev, &inj->mset[i], zone_id, &buf))
+			break;
+		for (b = start; b < start + nr_bits; b++)
+			dmz_set_bit(buf, b);
+		nr_set = 0;
+		for (b = 0; b < nr_rnd_bits; b++) {
+			if (dmz_test_bit(buf, rnd_bits[b]))
+				continue;
+			dmz_set_bit(buf, rnd_bits[b]);
+			nr_set++;
+		}
+		ret = dmz_write_zone_bitmap(dev, &inj->mset[i], zone_id, buf);
+		free(buf);
+		if (ret)
+			break;
+	}
+
+	free(rnd_bits);
+
+	if (i < 2)
+		return -1;
+
+	return nr_set;
+}
+
+/*
+ * Map two chunks to the same cache zone. Repair unmaps the chunk
+ * with the highest number.
+ */
+static int dmz_inject_dup_zone(struct dmz_inject *inj)
+{
+	unsigned int c1, c2, zone_id;
+
+	c1 = dmz_inject_get_chunk(inj);
+	c2 = dmz_inject_get_chunk(inj);
+	zone_id = dmz_inject_get_zone(inj, true);
+	if (c1 == DMZ_MAP_UNMAPPED || c2 == DMZ_MAP_UNMAPPED ||
+	    zone_id == DMZ_MAP_UNMAPPED)
+		return -1;
+
+	dmz_inject_map(inj, c1, zone_id, DMZ_MAP_UNMAPPED);
+	dmz_inject_map(inj, c2, zone_id, DMZ_MAP_UNMAPPED);
+	if (dmz_inject_set_bits(inj, zone_id, 0, 1 + random() % 16,
+				0, 1, 0) < 0)
+		return -1;
+
+	inj->nr_errors++;
+	fprintf(inj->record,
+		"dup-zone chunks=%u,%u zone=%u expect=unmap-chunk:%u\n",
+		c1, c2, zone_id, c1 > c2 ? c1 : c2);
+
+	return 0;
+}
+
+/*
+ * Map a chunk to a sequential zone with valid blocks after the zone
+ * write pointer. Repair clears these blocks.
+ */
+static int dmz_inject_wp_bits(struct dmz_inject *inj)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int chunk, zone_id, nr_blocks;
+	int nr_bits;
+
+	chunk = dmz_inject_get_chunk(inj);
+	zone_id = dmz_inject_get_zone(inj, false);
+	if (chunk == DMZ_MAP_UNMAPPED || zone_id == DMZ_MAP_UNMAPPED)
+		return -1;
+
+	nr_blocks = 1 + random() % DMZ_INJECT_MAX_BLOCKS;
+	if (dmz_inject_fill_zone(inj, zone_id, nr_blocks) < 0)
+		return -1;
+
+	dmz_inject_map(inj, chunk, zone_id, DMZ_MAP_UNMAPPED);
+	nr_bits = dmz_inject_set_bits(inj, zone_id, 0, nr_blocks,
+				      nr_blocks, dev->zone_nr_blocks,
+				      1 + random() % 8);
+	if (nr_bits < 0)
+		return -1;
+
+	inj->nr_errors += nr_bits;
+	fprintf(inj->record,
+		"wp-bits chunk=%u zone=%u wp=%u bits=%d expect=clear-bits:%d\n",
+		chunk, zone_id, nr_blocks, nr_bits, nr_bits);
+
+	return 0;
+}
+
+/*
+ * Map a chunk to a sequential zone and a buffer zone with the same
+ * blocks valid in both zones. Repair invalidates the blocks in the
+ * sequential zone.
+ */
+static int dmz_inject_overlap(struct dmz_inject *inj)
+{
+	unsigned int chunk, dzone_id, bzone_id, nr_blocks;
+	int nr_bits;
+
+	chunk = dmz_inject_get_chunk(inj);
+	dzone_id = dmz_inject_get_zone(inj, false);
+	bzone_id = dmz_inject_get_zone(inj, true);
+	if (chunk == DMZ_MAP_UNMAPPED || dzone_id == DMZ_MAP_UNMAPPED ||
+	    bzone_id == DMZ_MAP_UNMAPPED)
+		return -1;
+
+	nr_blocks = 2 + random() % (DMZ_INJECT_MAX_BLOCKS - 1);
+	if (dmz_inject_fill_zone(inj, dzone_id, nr_blocks) < 0)
+		return -1;
+
+	dmz_inject_map(inj, chunk, dzone_id, bzone_id);
+	if (dmz_inject_set_bits(inj, dzone_id, 0, nr_blocks, 0, 1, 0) < 0)
+		return -1;
+	nr_bits = dmz_inject_set_bits(inj, bzone_id, 0, 0, 0, nr_blocks,
+				      1 + random() % (nr_blocks - 1));
+	if (nr_bits < 0)
+		return -1;
+
+	inj->nr_errors += nr_bits;
+	fprintf(inj->record,
+		"overlap chunk=%u dzone=%u bzone=%u bits=%d "
+		"expect=clear-dzone-bits:%d\n",
+		chunk, dzone_id, bzone_id, nr_bits, nr_bits);
+
+	return 0;
+}
+
+/*
+ * Make the secondary metadata set stale: map a chunk in the primary
+ * metadata set only and increase the primary set generation. Repair
+ * copies the primary set to the secondary set.
+ */
+static int dmz_inject_stale_set(struct dmz_inject *inj)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int chunk, zone_id;
+	__u64 gen = inj->mset[0].gen + 1;
+
+	chunk = dmz_inject_get_chunk(inj);
+	zone_id = dmz_inject_get_zone(inj, true);
+	if (chunk == DMZ_MAP_UNMAPPED || zone_id == DMZ_MAP_UNMAPPED)
+		return -1;
+
+	dmz_set_chunk_mapping(dev, &inj->mset[0], chunk,
+			      zone_id, DMZ_MAP_UNMAPPED);
+	if (dmz_write_map_blocks(dev, &inj->mset[0]) < 0 ||
+	    dmz_write_super(dev, gen, 0, false) < 0)
+		return -1;
+
+	fprintf(inj->record,
+		"stale-set chunk=%u zone=%u gen=%llu,%llu "
+		"expect=sync-primary-to-secondary\n",
+		chunk, zone_id, gen, inj->mset[1].gen);
+
+	return 0;
+}
+
+/*
+ * Tear the primary super block: only its first sector is updated. Repair
+ * uses the secondary metadata set and copies it to the primary set.
+ */
+static int dmz_inject_torn_sb(struct dmz_inject *inj)
+{
+	struct dmz_dev *dev = inj->dev;
+	struct dm_zoned_super *sb;
+	__u8 *buf;
+	int ret;
+
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!buf)
+		return -1;
+
+	/* New generation in the first sector, old content after */
+	memcpy(buf, inj->mset[0].buf, DMZ_BLOCK_SIZE);
+	sb = (struct dm_zoned_super *)buf;
+	sb->gen = __cpu_to_le64(inj->mset[0].gen + 1);
+	memset(buf + 512, 0, DMZ_BLOCK_SIZE - 512);
+	ret = dmz_write_block(dev, inj->mset[0].sb_block, buf);
+	free(buf);
+	if (ret)
+		return -1;
+
+	fprintf(inj->record,
+		"torn-sb block=%llu expect=sync-secondary-to-primary\n",
+		inj->mset[0].sb_block);
+
+	return 0;
+}
+
+/*
+ * Load the metadata sets and the chunks and zones already in use.
+ */
+static int dmz_inject_load(struct dmz_inject *inj)
+{
+	struct dmz_dev *dev = inj->dev;
+	unsigned int chunk, dzone_id, bzone_id, i, sb_zone_id;
+	struct dmz_block_dev *bdev;
+
+	memset(inj->mset, 0, sizeof(struct dmz_meta_set) * 3);
+	inj->mset[1].id = 1;
+	inj->mset[2].id = 2;
+
+	if (dmz_check_superblocks(dev, inj->mset) < 0)
+		return -1;
+
+	if (!(inj->mset[0].flags & DMZ_MSET_SB_VALID) ||
+	    !(inj->mset[1].flags & DMZ_MSET_SB_VALID) ||
+	    inj->mset[0].gen != inj->mset[1].gen) {
+		fprintf(stderr,
+			"%s: Metadata sets are not consistent, "
+			"run repair first\n",
+			dev->label);
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (dmz_read_map_blocks(dev, &inj->mset[i]) < 0)
+			return -1;
+	}
+
+	inj->chunk_used = calloc(dev->nr_chunks, 1);
+	inj->zone_used = calloc(dev->nr_zones, 1);
+	if (!inj->chunk_used || !inj->zone_used) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	/* Metadata zones, super block zones and unusable zones */
+	sb_zone_id = dmz_zone_id(dev, dev->sb_zone);
+	for (i = 0; i < dev->nr_zones; i++) {
+		bdev = dmz_zone_to_bdev(dev, &dev->zones[i]);
+		if ((i >= sb_zone_id &&
+		     i < sb_zone_id + dev->nr_meta_zones * 2) ||
+		    (bdev->block_offset &&
+		     dmz_sect2blk(dmz_zone_sector(&dev->zones[i])) ==
+		     bdev->block_offset) ||
+		    dmz_zone_cond(&dev->zones[i]) == BLK_ZONE_COND_READONLY ||
+		    dmz_zone_cond(&dev->zones[i]) == BLK_ZONE_COND_OFFLINE)
+			inj->zone_used[i] = 1;
+	}
+
+	/* Mapped chunks and zones */
+	for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+		dmz_get_chunk_mapping(dev, &inj->mset[0], chunk,
+				      &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		inj->chunk_used[chunk] = 1;
+		if (dzone_id < dev->nr_zones)
+			inj->zone_used[dzone_id] = 1;
+		if (bzone_id < dev->nr_zones)
+			inj->zone_used[bzone_id] = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Inject corruptions into a formatted device metadata and record
+ * the expected outcome of a repair.
+ */
+int dmz_inject(struct dmz_dev *dev)
+{
+	struct dmz_inject inj;
+	unsigned int t, n;
+	int ret = -1;
+
+	memset(&inj, 0, sizeof(struct dmz_inject));
+	inj.dev = dev;
+
+	if (!dev->inject_list) {
+		fprintf(stderr, "No corruption specified\n");
+		return -1;
+	}
+	if (dmz_inject_parse(&inj, dev->inject_list) < 0)
+		return -1;
+
+	if (!dev->inject_seed)
+		dev->inject_seed = time(NULL);
+	srandom(dev->inject_seed);
+
+	if (dmz_inject_load(&inj) < 0)
+		goto out;
+
+	if (dev->inject_record) {
+		inj.record = fopen(dev->inject_record, "w");
+		if (!inj.record) {
+			fprintf(stderr,
+				"Open %s failed %d (%s)\n",
+				dev->inject_record,
+				errno, strerror(errno));
+			goto out;
+		}
+	} else {
+		inj.record = stdout;
+	}
+
+	printf("Injecting corruptions (seed %u)\n", dev->inject_seed);
+	fprintf(inj.record, "# %s: corruptions injected with seed %u\n",
+		dev->label, dev->inject_seed);
+
+	/* Mapping and bitmap corruptions are injected in both sets */
+	for (n = 0; n < inj.count[DMZ_INJECT_DUP_ZONE]; n++) {
+		if (dmz_inject_dup_zone(&inj) < 0)
+			goto out;
+	}
+	for (n = 0; n < inj.count[DMZ_INJECT_WP_BITS]; n++) {
+		if (dmz_inject_wp_bits(&inj) < 0)
+			goto out;
+	}
+	for (n = 0; n < inj.count[DMZ_INJECT_OVERLAP]; n++) {
+		if (dmz_inject_overlap(&inj) < 0)
+			goto out;
+	}
+	for (t = 0; t < 2; t++) {
+		if (dmz_write_map_blocks(dev, &inj.mset[t]) < 0)
+			goto out;
+	}
+
+	/* Super block corruptions */
+	if (inj.count[DMZ_INJECT_STALE_SET] &&
+	    dmz_inject_stale_set(&inj) < 0)
+		goto out;
+	if (inj.count[DMZ_INJECT_TORN_SB] &&
+	    dmz_inject_torn_sb(&inj) < 0)
+		goto out;
+
+	fprintf(inj.record, "expect repair-errors=%u\n", inj.nr_errors);
+
+	ret = dmz_sync_dev(dev);
+	if (ret == 0) {
+		for (t = 0; t < DMZ_INJECT_NR_TYPES; t++) {
+			if (inj.count[t])
+				printf("  %u %s corruption%s\n",
+				       inj.count[t], dmz_inject_names[t],
+				       inj.count[t] > 1 ? "s" : "");
+		}
+		printf("  %u error%s expected to be repaired\n",
+		       inj.nr_errors, inj.nr_errors > 1 ? "s" : "");
+	}
+
+out:
+	if (inj.record && inj.record != stdout)
+		fclose(inj.record);
+	free(inj.mset[0].map_buf);
+	free(inj.mset[1].map_buf);
+	free(inj.chunk_used);
+	free(inj.zone_used);
+
+	return ret;
+}
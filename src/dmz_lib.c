@@ -14,10 +14,15 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <libudev.h>
 
@@ -40,6 +45,142 @@ __u32 dmz_crc32(__u32 crc, const void *buf, size_t length)
 	return crc;
 }
 
+/*
+ * Get the current time in micro-seconds (monotonic clock).
+ */
+unsigned long long dmz_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000ULL +
+		ts.tv_nsec / 1000;
+}
+
+/*
+ * Bind the calling thread to the CPUs of a NUMA node so that the memory
+ * it allocates and first touches is local to the node. This is a no-op
+ * if the node is unknown or the system does not expose NUMA information.
+ */
+int dmz_bind_numa_node(int node)
+{
+	char str[128], list[4096];
+	unsigned long first, last, cpu;
+	cpu_set_t cpus;
+	char *p, *end;
+	FILE *file;
+
+	if (node < 0)
+		return 0;
+
+	snprintf(str, sizeof(str),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+	file = fopen(str, "r");
+	if (!file)
+		return 0;
+	p = fgets(list, sizeof(list), file);
+	fclose(file);
+	if (!p)
+		return 0;
+
+	/* The CPU list format is "0-3,8-11" */
+	CPU_ZERO(&cpus);
+	while (*p && *p != '\n') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		last = first;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &cpus);
+		p = end;
+		if (*p == ',')
+			p++;
+	}
+
+	if (!CPU_COUNT(&cpus))
+		return 0;
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) < 0) {
+		fprintf(stderr,
+			"Bind to NUMA node %d failed %d (%s)\n",
+			node, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Per block device worker.
+ */
+struct dmz_bdev_worker {
+	pthread_t	thread;
+	bool		started;
+	struct dmz_dev	*dev;
+	int		d;
+	int		(*fn)(struct dmz_dev *dev, int d, void *arg);
+	void		*arg;
+	int		ret;
+};
+
+static void *dmz_bdev_worker_fn(void *arg)
+{
+	struct dmz_bdev_worker *w = arg;
+
+	dmz_bind_numa_node(w->dev->bdev[w->d].numa_node);
+	w->ret = w->fn(w->dev, w->d, w->arg);
+
+	return NULL;
+}
+
+/*
+ * Execute @fn for all block devices of a device, passing @arg along.
+ * With multiple block devices, @fn is executed in parallel by one thread
+ * per block device, bound to the NUMA node of the block device controller.
+ */
+int dmz_run_bdev_workers(struct dmz_dev *dev,
+			 int (*fn)(struct dmz_dev *dev, int d, void *arg),
+			 void *arg)
+{
+	struct dmz_bdev_worker *w;
+	int d, ret = 0;
+
+	if (dev->nr_bdev == 1)
+		return fn(dev, 0, arg);
+
+	w = calloc(dev->nr_bdev, sizeof(struct dmz_bdev_worker));
+	if (!w) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		w[d].dev = dev;
+		w[d].d = d;
+		w[d].fn = fn;
+		w[d].arg = arg;
+		if (pthread_create(&w[d].thread, NULL,
+				   dmz_bdev_worker_fn, &w[d]) == 0)
+			w[d].started = true;
+		else
+			w[d].ret = fn(dev, d, arg);
+	}
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (w[d].started)
+			pthread_join(w[d].thread, NULL);
+		if (w[d].ret < 0)
+			ret = -1;
+	}
+
+	free(w);
+
+	return ret;
+}
+
 /*
  * Get the kernel version to check for the ALL zone reset operation support
  * in kernel versions 5.4 and above.
@@ -167,21 +308,173 @@ int dmz_reset_zone(struct dmz_dev *dev, struct blk_zone *zone)
 }
 
 /*
- * Reset all zones of a device.
+ * Remember a sequential zone opened by a write so that it can be closed
+ * or finished once the operation completes.
  */
-int dmz_reset_zones(struct dmz_dev *dev)
+int dmz_track_open_zone(struct dmz_dev *dev, struct blk_zone *zone)
+{
+	unsigned int i, zone_id = dmz_zone_id(dev, zone);
+	unsigned int *open_zones;
+
+	if (zone->wp >= dmz_zone_sector(zone) + dmz_zone_capacity(zone))
+		zone->cond = BLK_ZONE_COND_FULL;
+	else
+		zone->cond = BLK_ZONE_COND_IMP_OPEN;
+
+	for (i = 0; i < dev->nr_open_zones; i++) {
+		if (dev->open_zones[i] == zone_id)
+			return 0;
+	}
+
+	open_zones = realloc(dev->open_zones,
+			     sizeof(unsigned int) * (dev->nr_open_zones + 1));
+	if (!open_zones) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	dev->open_zones = open_zones;
+	dev->open_zones[dev->nr_open_zones] = zone_id;
+	dev->nr_open_zones++;
+
+	return 0;
+}
+
+/*
+ * Test if a zone holds a tertiary super block.
+ */
+static bool dmz_zone_is_sb(struct dmz_dev *dev, struct blk_zone *zone)
 {
+	int i;
+
+	for (i = 1; i < dev->nr_bdev; i++) {
+		if (dmz_sect2blk(dmz_zone_sector(zone)) ==
+		    dev->bdev[i].block_offset)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Release the open and active zone resources used by the zones opened
+ * by the operation: zones holding a super block are finished as they
+ * will not be written again, other zones are closed.
+ */
+int dmz_release_zones(struct dmz_dev *dev)
+{
+	struct dmz_block_dev *bdev;
+	struct blk_zone_range range;
 	struct blk_zone *zone;
-	unsigned int i = 0;
+	unsigned int i;
+	bool finish;
+	int ret = 0;
+
+	for (i = 0; i < dev->nr_open_zones; i++) {
+		zone = &dev->zones[dev->open_zones[i]];
+		if (dmz_zone_cond(zone) != BLK_ZONE_COND_IMP_OPEN)
+			continue;
+
+		bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone),
+					  &range.sector);
+		range.nr_sectors = dmz_zone_length(zone);
+		finish = dmz_zone_is_sb(dev, zone);
+
+		if (dev->flags & DMZ_VERBOSE)
+			printf("%s: %s zone %u\n",
+			       bdev->name,
+			       finish ? "Finishing" : "Closing",
+			       dmz_zone_id(dev, zone));
+
+#if defined(BLKFINISHZONE) && defined(BLKCLOSEZONE)
+		if (ioctl(bdev->fd, finish ? BLKFINISHZONE : BLKCLOSEZONE,
+			  &range) < 0) {
+			fprintf(stderr,
+				"%s: %s zone %u failed %d (%s)\n",
+				bdev->name,
+				finish ? "Finish" : "Close",
+				dmz_zone_id(dev, zone),
+				errno, strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (finish) {
+			zone->wp = dmz_zone_sector(zone) + dmz_zone_length(zone);
+			zone->cond = BLK_ZONE_COND_FULL;
+		} else {
+			zone->cond = BLK_ZONE_COND_CLOSED;
+		}
+#else
+		printf("%s: %s zone %u not supported, zone left open\n",
+		       bdev->name, finish ? "Finishing" : "Closing",
+		       dmz_zone_id(dev, zone));
+#endif
+	}
+
+	free(dev->open_zones);
+	dev->open_zones = NULL;
+	dev->nr_open_zones = 0;
+
+	return ret;
+}
+
+/*
+ * Reset a range of contiguous sequential zones of the same block device
+ * with a single request.
+ */
+static int dmz_reset_zone_range(struct dmz_dev *dev, struct blk_zone *zone,
+				unsigned int nr_zones)
+{
+	struct blk_zone *last = zone + nr_zones - 1;
+	struct dmz_block_dev *bdev;
+	struct blk_zone_range range;
+	__u64 zone_sector;
+	unsigned int i;
+
+	if (nr_zones == 1)
+		return dmz_reset_zone(dev, zone);
+
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &zone_sector);
+
+	range.sector = zone_sector;
+	range.nr_sectors = dmz_zone_sector(last) + dmz_zone_length(last) -
+		dmz_zone_sector(zone);
+	if (ioctl(bdev->fd, BLKRESETZONE, &range) < 0) {
+		fprintf(stderr,
+			"%s: Reset zones %u..%u failed %d (%s)\n",
+			bdev->name,
+			dmz_zone_id(dev, zone), dmz_zone_id(dev, last),
+			errno, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < nr_zones; i++, zone++) {
+		zone->wp = zone->start;
+		zone->cond = BLK_ZONE_COND_EMPTY;
+	}
+
+	return 0;
+}
+
+/*
+ * Reset all zones of one of the block devices of a device.
+ */
+int dmz_reset_bdev_zones(struct dmz_dev *dev, int d)
+{
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned int i = dmz_block_zone_id(dev, bdev->block_offset);
+	unsigned int end = i + bdev->nr_zones;
+	struct blk_zone *zone;
+	unsigned int n;
 	int ret;
 
-	while (i < dev->nr_zones) {
+	while (i < end) {
 		zone = &dev->zones[i];
 
 		/*
-		 * Try reset all zones of the current bdev. If the device does
-		 * not support this operation, continue resetting the device
-		 * zones one at a time.
+		 * Try reset all zones of the bdev. If the device does
+		 * not support this operation, continue resetting runs of
+		 * contiguous non-empty sequential zones, one run at a time.
 		 */
 		ret = dmz_reset_all_zones(dev, zone);
 		if (ret > 0) {
@@ -189,15 +482,43 @@ int dmz_reset_zones(struct dmz_dev *dev)
 			continue;
 		}
 
-		if (dmz_reset_zone(dev, zone) < 0)
+		if ((!dmz_zone_seq_req(zone) && !dmz_zone_seq_pref(zone)) ||
+		    dmz_zone_empty(zone)) {
+			i++;
+			continue;
+		}
+
+		n = 1;
+		while (i + n < end &&
+		       (dmz_zone_seq_req(&zone[n]) ||
+			dmz_zone_seq_pref(&zone[n])) &&
+		       !dmz_zone_empty(&zone[n]))
+			n++;
+
+		if (dmz_reset_zone_range(dev, zone, n) < 0)
 			return -1;
 
-		i++;
+		i += n;
 	}
 
 	return 0;
 }
 
+static int dmz_reset_bdev_zones_worker(struct dmz_dev *dev, int d,
+				       void *arg)
+{
+	return dmz_reset_bdev_zones(dev, d);
+}
+
+/*
+ * Reset all zones of a device, resetting the zones of multiple
+ * block devices in parallel.
+ */
+int dmz_reset_zones(struct dmz_dev *dev)
+{
+	return dmz_run_bdev_workers(dev, dmz_reset_bdev_zones_worker, NULL);
+}
+
 /*
  * Determine location and amount of metadata blocks.
  */
@@ -205,13 +526,15 @@ int dmz_locate_metadata(struct dmz_dev *dev)
 {
 	struct blk_zone *zone;
 	unsigned int i = 0;
-	unsigned int nr_meta_blocks, nr_map_blocks;
+	unsigned int nr_map_blocks;
 	unsigned int nr_chunks, nr_meta_zones;
 	unsigned int nr_bitmap_zones;
+	__u64 nr_meta_blocks;
 
 	if (dev->flags & DMZ_VERBOSE)
 		printf("Locating metadata...\n");
 
+	dev->sb_zone = NULL;
 	dev->nr_usable_zones = 0;
 	dev->max_nr_meta_zones = 0;
 	dev->last_meta_zone = 0;
@@ -283,9 +606,10 @@ int dmz_locate_metadata(struct dmz_dev *dev)
 		dev->zone_nr_blocks >> (DMZ_BLOCK_SHIFT + 3);
 	if (!dev->zone_nr_bitmap_blocks)
 		dev->zone_nr_bitmap_blocks = 1;
-	dev->nr_bitmap_blocks = dev->nr_zones * dev->zone_nr_bitmap_blocks;
-	nr_bitmap_zones = (dev->nr_bitmap_blocks + dev->zone_nr_blocks - 1)
-		/ dev->zone_nr_blocks;
+	dev->nr_bitmap_blocks =
+		(__u64)dev->nr_zones * dev->zone_nr_bitmap_blocks;
+	nr_bitmap_zones = DIV_ROUND_UP(dev->nr_bitmap_blocks,
+				       dev->zone_nr_blocks);
 
 	if ((nr_bitmap_zones + dev->nr_reserved_seq) > dev->nr_usable_zones) {
 		fprintf(stderr,
@@ -339,24 +663,265 @@ int dmz_locate_metadata(struct dmz_dev *dev)
 			 / dev->zone_nr_blocks);
 	dev->total_nr_meta_zones = dev->nr_meta_zones << 1;
 
+	/* The super block stores the number of metadata blocks on 32-bits */
+	if (dev->nr_meta_blocks > UINT_MAX) {
+		fprintf(stderr,
+			"%s: Too many metadata blocks (%llu, maximum %u)\n",
+			dev->label, dev->nr_meta_blocks, UINT_MAX);
+		return -1;
+	}
+
 	return 0;
 }
 
+/*
+ * Build an emulated device using the zoned block devices of @dev and, if
+ * @cache_capacity (in 512B sectors) is not 0, a regular block device of
+ * @cache_capacity sectors in place of the regular block device of @dev.
+ * No IO can be issued to the emulated device, but its zone configuration
+ * can be used to determine the metadata layout.
+ */
+int dmz_emulate_dev(struct dmz_dev *dev, struct dmz_dev *edev,
+		    __u64 cache_capacity)
+{
+	int i, first_zoned = dev->nr_bdev > 1 ? 1 : 0;
+	int nr_zoned = dev->nr_bdev - first_zoned;
+	struct dmz_block_dev *bdev;
+	struct blk_zone *blkz;
+	__u64 block_offset = 0, shift;
+	unsigned int z, nr_zones = 0;
+
+	if (!cache_capacity && nr_zoned > 1) {
+		fprintf(stderr,
+			"A regular block device is needed with "
+			"multiple zoned block devices\n");
+		return -1;
+	}
+
+	if (DIV_ROUND_UP(cache_capacity, dev->zone_nr_sectors) +
+	    dev->nr_zones > DMZ_MAX_NR_ZONES) {
+		fprintf(stderr,
+			"Too many zones with a %llu sectors cache device\n",
+			cache_capacity);
+		return -1;
+	}
+
+	memset(edev, 0, sizeof(struct dmz_dev));
+	memcpy(edev->label, dev->label, DMZ_LABEL_LEN);
+	edev->flags = dev->flags & ~(DMZ_VERBOSE | DMZ_VVERBOSE);
+	edev->op = dev->op;
+	edev->sb_version = dev->sb_version;
+	edev->nr_reserved_seq = dev->nr_reserved_seq;
+	edev->zone_nr_sectors = dev->zone_nr_sectors;
+	edev->zone_nr_blocks = dev->zone_nr_blocks;
+	edev->zone_nr_cap_sectors = dev->zone_nr_cap_sectors;
+	edev->nr_bdev = nr_zoned + (cache_capacity ? 1 : 0);
+	edev->bdev = calloc(edev->nr_bdev, sizeof(struct dmz_block_dev));
+	if (!edev->bdev)
+		goto err;
+
+	bdev = edev->bdev;
+	if (cache_capacity) {
+		bdev->path = "cache";
+		bdev->name = "cache";
+		bdev->type = DMZ_TYPE_REGULAR;
+		bdev->capacity = cache_capacity;
+		bdev->zone_nr_sectors = dev->zone_nr_sectors;
+		bdev->zone_nr_blocks = dev->zone_nr_blocks;
+		bdev->nr_zones = DIV_ROUND_UP(cache_capacity,
+					      dev->zone_nr_sectors);
+		bdev->fd = -1;
+		bdev++;
+	}
+	for (i = first_zoned; i < dev->nr_bdev; i++, bdev++) {
+		*bdev = dev->bdev[i];
+		bdev->fd = -1;
+	}
+
+	for (i = 0; i < edev->nr_bdev; i++) {
+		bdev = &edev->bdev[i];
+		bdev->block_offset = block_offset;
+		block_offset += bdev->nr_zones * edev->zone_nr_blocks;
+		edev->capacity += bdev->capacity;
+		nr_zones += bdev->nr_zones;
+	}
+
+	edev->nr_zones = nr_zones;
+	edev->zones = calloc(nr_zones, sizeof(struct blk_zone));
+	if (!edev->zones)
+		goto err;
+
+	blkz = edev->zones;
+	for (i = 0; i < edev->nr_bdev; i++) {
+		bdev = &edev->bdev[i];
+		if (bdev->type == DMZ_TYPE_REGULAR) {
+			/* Emulate zone information */
+			for (z = 0; z < bdev->nr_zones; z++, blkz++) {
+				blkz->start = z * edev->zone_nr_sectors;
+				blkz->len = edev->zone_nr_sectors;
+				if (blkz->start + blkz->len > bdev->capacity)
+					blkz->len = bdev->capacity - blkz->start;
+				dmz_zone_set_capacity(blkz, blkz->len);
+				blkz->wp = (__u64)-1;
+				blkz->type = BLK_ZONE_TYPE_UNKNOWN;
+				blkz->cond = BLK_ZONE_COND_NOT_WP;
+			}
+			continue;
+		}
+
+		/* Copy the zoned device zones, shifted to their new offset */
+		z = dmz_block_zone_id(dev, dev->bdev[i + first_zoned -
+				      (edev->nr_bdev - nr_zoned)].block_offset);
+		shift = dmz_blk2sect(bdev->block_offset) -
+			dmz_zone_sector(&dev->zones[z]);
+		memcpy(blkz, &dev->zones[z],
+		       sizeof(struct blk_zone) * bdev->nr_zones);
+		for (z = 0; z < bdev->nr_zones; z++, blkz++) {
+			blkz->start += shift;
+			blkz->wp += shift;
+		}
+	}
+
+	return 0;
+
+err:
+	fprintf(stderr, "Not enough memory\n");
+	dmz_free_emulated_dev(edev);
+	return -1;
+}
+
+/*
+ * Free an emulated device resources.
+ */
+void dmz_free_emulated_dev(struct dmz_dev *edev)
+{
+	free(edev->zones);
+	edev->zones = NULL;
+	free(edev->bdev);
+	edev->bdev = NULL;
+}
+
+/*
+ * Parse a size with an optional k, M, G or T (power of 2) unit suffix.
+ * Return the size in bytes, or 0 if the string is not a valid size.
+ */
+unsigned long long dmz_parse_size(const char *str, char **end)
+{
+	unsigned long long size;
+	char *p;
+
+	size = strtoull(str, &p, 10);
+	if (p == str)
+		return 0;
+
+	switch (*p) {
+	case 't':
+	case 'T':
+		size <<= 10;
+		/* fallthrough */
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'k':
+	case 'K':
+		size <<= 10;
+		p++;
+		break;
+	default:
+		break;
+	}
+
+	if (end)
+		*end = p;
+
+	return size;
+}
+
+/*
+ * Get a block device serial number from its sysfs device attributes:
+ * the serial attribute of NVMe devices or the unit serial number VPD
+ * page of SCSI and ATA devices.
+ */
+static char *dmz_get_bdev_sysfs_serial(struct dmz_block_dev *bdev)
+{
+	unsigned char buf[256];
+	char path[128];
+	char *serial;
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path),
+		 "/sys/dev/block/%u:%u/device/serial",
+		 major(bdev->devno), minor(bdev->devno));
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		ret = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (ret <= 0)
+			return NULL;
+		serial = (char *)buf;
+		len = ret;
+	} else {
+		snprintf(path, sizeof(path),
+			 "/sys/dev/block/%u:%u/device/vpd_pg80",
+			 major(bdev->devno), minor(bdev->devno));
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return NULL;
+		ret = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (ret <= 4 || buf[1] != 0x80)
+			return NULL;
+		serial = (char *)buf + 4;
+		len = (buf[2] << 8) | buf[3];
+		if (len > (size_t)ret - 4)
+			len = ret - 4;
+	}
+
+	/* Strip the padding spaces */
+	while (len && isspace(serial[len - 1]))
+		len--;
+	while (len && isspace(*serial)) {
+		serial++;
+		len--;
+	}
+	if (!len)
+		return NULL;
+
+	return strndup(serial, len);
+}
+
 /*
  * Get a block device serial number.
  */
-static char *dmz_get_bdev_serial(struct dmz_block_dev *bdev)
+char *dmz_get_bdev_serial(struct dmz_block_dev *bdev)
 {
 	static struct udev *udev;
 	struct udev_device *dev;
 	const char *data;
+	char *serial = NULL;
+
+	/*
+	 * The udev serial defines the default label of existing targets.
+	 * The sysfs serial may differ from it (e.g. the SCSI unit serial
+	 * number versus a WWN based ID), so it is used only without udev
+	 * (early boot, containers).
+	 */
+	if (access("/run/udev/data", F_OK) != 0)
+		return dmz_get_bdev_sysfs_serial(bdev);
 
         if (!udev)
                 udev = udev_new();
         if (!udev)
 		return NULL;
 
-	dev = udev_device_new_from_subsystem_sysname(udev, "block", bdev->name);
+	dev = udev_device_new_from_devnum(udev, 'b', bdev->devno);
         if (!dev)
 		return NULL;
 
@@ -367,10 +932,11 @@ static char *dmz_get_bdev_serial(struct dmz_block_dev *bdev)
 		data = udev_device_get_property_value(dev, "ID_SCSI_SERIAL");
 	if (!data)
 		data = udev_device_get_property_value(dev, "SCSI_IDENT_SERIAL");
-	if (!data)
-		return NULL;
+	if (data)
+		serial = strdup(data);
+	udev_device_unref(dev);
 
-	return strdup(data);
+	return serial;
 }
 
 /*
@@ -0,0 +1,944 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+/*
+ * Maximum number of blocks read or written with a single IO (1 MiB).
+ */
+#define DMZ_MOVER_IO_BLOCKS	256
+
+/*
+ * Number of IO buffers between the reader and the writer of a stream.
+ */
+#define DMZ_MOVER_NR_BUFS	8
+
+/*
+ * Maximum number of destination zones written at the same time on
+ * a block device, each by its own stream.
+ */
+#define DMZ_MOVER_NR_STREAMS	4
+
+/*
+ * Number of source zones per block device, percentage of valid blocks
+ * and maximum length of runs of valid or invalid blocks used by the
+ * benchmark.
+ */
+#define DMZ_MOVER_BENCH_ZONES	4
+#define DMZ_MOVER_BENCH_VALID	50
+#define DMZ_MOVER_BENCH_RUN	64
+
+/*
+ * Extent of valid blocks read into an IO buffer. A job ends with an
+ * extent of 0 blocks and a stream ends with an extent without a job.
+ */
+struct dmz_mover_io {
+	struct dmz_mover_job	*job;
+	unsigned int		block;
+	unsigned int		nr_blocks;
+	__u8			*buf;
+};
+
+/*
+ * Jobs queue of a destination block device.
+ */
+struct dmz_mover_queue {
+	int			d;
+	pthread_mutex_t		lock;
+	unsigned int		next;
+	unsigned int		nr_jobs;
+	unsigned int		nr_streams;
+};
+
+/*
+ * A stream copies one job at a time, with a reader thread filling
+ * a ring of IO buffers and a writer thread emptying it.
+ */
+struct dmz_mover_stream {
+	struct dmz_mover	*mv;
+	struct dmz_mover_queue	*q;
+	pthread_t		reader;
+	pthread_t		writer;
+	bool			started;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct dmz_mover_io	ring[DMZ_MOVER_NR_BUFS];
+	unsigned int		head;
+	unsigned int		tail;
+	bool			error;
+
+	struct dmz_mover_stats	stats;
+};
+
+/*
+ * Data mover context.
+ */
+struct dmz_mover {
+	struct dmz_dev		*dev;
+	struct dmz_mover_job	*jobs;
+	unsigned int		nr_jobs;
+	struct dmz_mover_queue	*queues;
+	struct dmz_mover_stats	*stats;
+	int			*fd;
+	__u8			*zero_buf;
+};
+
+/*
+ * Get the index of the block device of a zone.
+ */
+static int dmz_mover_zone_bdev(struct dmz_dev *dev, unsigned int zone_id)
+{
+	return dmz_zone_to_bdev(dev, &dev->zones[zone_id]) - dev->bdev;
+}
+
+/*
+ * Get the next job of a queue.
+ */
+static struct dmz_mover_job *dmz_mover_next_job(struct dmz_mover *mv,
+						struct dmz_mover_queue *q)
+{
+	struct dmz_mover_job *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->next < mv->nr_jobs) {
+		job = &mv->jobs[q->next++];
+		if (dmz_mover_zone_bdev(mv->dev, job->dst_zone_id) == q->d)
+			break;
+		job = NULL;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+/*
+ * Get the next extent of valid blocks of a job at or after @block:
+ * blocks valid in the buffer zone are read from the buffer zone and
+ * the other valid blocks from the data zone. Return the number of
+ * blocks of the extent, 0 if there are no more valid blocks.
+ */
+static unsigned int dmz_mover_next_extent(struct dmz_mover_job *job,
+					  unsigned int block,
+					  unsigned int *start,
+					  unsigned int *zone_id)
+{
+	unsigned int b, bb, nr = 1;
+	bool buffer;
+
+	b = dmz_bitmap_next(job->dbm, block);
+	if (job->bbm) {
+		bb = dmz_bitmap_next(job->bbm, block);
+		if (bb < b)
+			b = bb;
+	}
+	if (b >= job->dbm->nr_bits)
+		return 0;
+
+	buffer = job->bbm && dmz_bitmap_test(job->bbm, b);
+
+	/* Merge the following valid blocks of the same zone */
+	while (nr < DMZ_MOVER_IO_BLOCKS && b + nr < job->dbm->nr_bits) {
+		if (job->bbm && dmz_bitmap_test(job->bbm, b + nr)) {
+			if (!buffer)
+				break;
+		} else if (buffer || !dmz_bitmap_test(job->dbm, b + nr)) {
+			break;
+		}
+		nr++;
+	}
+
+	*start = b;
+	*zone_id = buffer ? job->bzone_id : job->dzone_id;
+
+	return nr;
+}
+
+/*
+ * Wait for a free IO buffer of a stream ring. Return NULL if the
+ * stream failed.
+ */
+static struct dmz_mover_io *dmz_mover_get_io(struct dmz_mover_stream *s)
+{
+	struct dmz_mover_io *io = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->error && s->tail - s->head >= DMZ_MOVER_NR_BUFS)
+		pthread_cond_wait(&s->cond, &s->lock);
+	if (!s->error)
+		io = &s->ring[s->tail % DMZ_MOVER_NR_BUFS];
+	pthread_mutex_unlock(&s->lock);
+
+	return io;
+}
+
+/*
+ * Pass a filled IO buffer to the writer of a stream.
+ */
+static void dmz_mover_put_io(struct dmz_mover_stream *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->tail++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Mark a stream as failed so that its reader and writer stop.
+ */
+static void dmz_mover_fail(struct dmz_mover_stream *s,
+			   struct dmz_mover_job *job)
+{
+	pthread_mutex_lock(&s->lock);
+	s->error = true;
+	if (job)
+		job->ret = -1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Read the valid blocks of the jobs of a stream.
+ */
+static void *dmz_mover_reader(void *arg)
+{
+	struct dmz_mover_stream *s = arg;
+	struct dmz_mover *mv = s->mv;
+	struct dmz_dev *dev = mv->dev;
+	unsigned int b, nr, zone_id;
+	struct dmz_block_dev *bdev;
+	struct dmz_mover_job *job;
+	struct dmz_mover_io *io;
+	size_t size;
+	__u64 sector;
+
+	while ((job = dmz_mover_next_job(mv, s->q))) {
+		if (dev->flags & DMZ_VVERBOSE)
+			printf("%s: moving zone %u%s to zone %u\n",
+			       dev->bdev[s->q->d].name, job->dzone_id,
+			       job->bbm ? " and its buffer zone" : "",
+			       job->dst_zone_id);
+
+		b = 0;
+		while ((nr = dmz_mover_next_extent(job, b, &b, &zone_id))) {
+			io = dmz_mover_get_io(s);
+			if (!io)
+				return NULL;
+
+			size = (size_t)nr << DMZ_BLOCK_SHIFT;
+			bdev = dmz_sector_to_bdev(dev,
+				dmz_zone_sector(&dev->zones[zone_id]) +
+				dmz_blk2sect((__u64)b), &sector);
+			if (pread(mv->fd[bdev - dev->bdev], io->buf, size,
+				  sector << 9) != (ssize_t)size) {
+				fprintf(stderr,
+					"%s: Read zone %u at sector %llu "
+					"failed %d (%s)\n",
+					bdev->name, zone_id, sector,
+					errno, strerror(errno));
+				dmz_mover_fail(s, job);
+				return NULL;
+			}
+			s->stats.nr_read_blocks += nr;
+			s->stats.nr_read_ios++;
+
+			io->job = job;
+			io->block = b;
+			io->nr_blocks = nr;
+			dmz_mover_put_io(s);
+
+			b += nr;
+		}
+
+		/* End of the job */
+		io = dmz_mover_get_io(s);
+		if (!io)
+			return NULL;
+		io->job = job;
+		io->nr_blocks = 0;
+		dmz_mover_put_io(s);
+	}
+
+	/* End of the stream */
+	io = dmz_mover_get_io(s);
+	if (io) {
+		io->job = NULL;
+		dmz_mover_put_io(s);
+	}
+
+	return NULL;
+}
+
+/*
+ * Write blocks of a destination zone.
+ */
+static int dmz_mover_write(struct dmz_mover *mv, struct dmz_mover_stream *s,
+			   struct blk_zone *zone, __u8 *buf,
+			   unsigned int block, unsigned int nr_blocks)
+{
+	struct dmz_dev *dev = mv->dev;
+	size_t size = (size_t)nr_blocks << DMZ_BLOCK_SHIFT;
+	struct dmz_block_dev *bdev;
+	__u64 sector;
+
+	if (dmz_blk2sect((__u64)block + nr_blocks) >
+	    dmz_zone_capacity(zone)) {
+		fprintf(stderr,
+			"Zone %u: block %u is beyond the zone capacity\n",
+			dmz_zone_id(dev, zone), block + nr_blocks - 1);
+		return -1;
+	}
+
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone) +
+				  dmz_blk2sect((__u64)block), &sector);
+	if (pwrite(mv->fd[bdev - dev->bdev], buf, size,
+		   sector << 9) != (ssize_t)size) {
+		fprintf(stderr,
+			"%s: Write zone %u at sector %llu failed %d (%s)\n",
+			bdev->name, dmz_zone_id(dev, zone), sector,
+			errno, strerror(errno));
+		return -1;
+	}
+	s->stats.nr_written_blocks += nr_blocks;
+	s->stats.nr_write_ios++;
+
+	if (dmz_zone_seq_req(zone) || dmz_zone_seq_pref(zone)) {
+		zone->wp = dmz_zone_sector(zone) +
+			dmz_blk2sect((__u64)block + nr_blocks);
+		zone->cond = BLK_ZONE_COND_IMP_OPEN;
+	}
+
+	return 0;
+}
+
+/*
+ * Write an extent of valid blocks to its destination zone. Invalid
+ * blocks between the write pointer of a sequential zone and the extent
+ * are written with zeros.
+ */
+static int dmz_mover_write_io(struct dmz_mover *mv,
+			      struct dmz_mover_stream *s,
+			      struct dmz_mover_io *io)
+{
+	struct blk_zone *zone = &mv->dev->zones[io->job->dst_zone_id];
+	unsigned int wp_block, nr;
+
+	if (dmz_zone_seq_req(zone)) {
+		wp_block = dmz_sect2blk(dmz_zone_wp_sector(zone) -
+					dmz_zone_sector(zone));
+		while (wp_block < io->block) {
+			nr = io->block - wp_block;
+			if (nr > DMZ_MOVER_IO_BLOCKS)
+				nr = DMZ_MOVER_IO_BLOCKS;
+			if (dmz_mover_write(mv, s, zone, mv->zero_buf,
+					    wp_block, nr) < 0)
+				return -1;
+			wp_block += nr;
+		}
+	}
+
+	return dmz_mover_write(mv, s, zone, io->buf, io->block, io->nr_blocks);
+}
+
+/*
+ * Close a destination zone once written so that it does not use the open
+ * zone resources of its device. Closed zones are still active, so with an
+ * active zone limit, the zone is finished instead.
+ */
+static int dmz_mover_end_job(struct dmz_mover *mv, struct dmz_mover_job *job)
+{
+	struct dmz_dev *dev = mv->dev;
+	struct blk_zone *zone = &dev->zones[job->dst_zone_id];
+#if defined(BLKFINISHZONE) && defined(BLKCLOSEZONE)
+	struct dmz_block_dev *bdev;
+	struct blk_zone_range range;
+	bool finish;
+#endif
+
+	if ((!dmz_zone_seq_req(zone) && !dmz_zone_seq_pref(zone)) ||
+	    dmz_zone_empty(zone))
+		return 0;
+
+	if (dmz_zone_wp_sector(zone) >=
+	    dmz_zone_sector(zone) + dmz_zone_capacity(zone)) {
+		zone->cond = BLK_ZONE_COND_FULL;
+		return 0;
+	}
+
+#if defined(BLKFINISHZONE) && defined(BLKCLOSEZONE)
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &range.sector);
+	range.nr_sectors = dmz_zone_length(zone);
+	finish = bdev->max_active_zones != 0;
+
+	if (ioctl(bdev->fd, finish ? BLKFINISHZONE : BLKCLOSEZONE,
+		  &range) < 0) {
+		fprintf(stderr,
+			"%s: %s zone %u failed %d (%s)\n",
+			bdev->name, finish ? "Finish" : "Close",
+			job->dst_zone_id, errno, strerror(errno));
+		return -1;
+	}
+
+	if (finish) {
+		zone->wp = dmz_zone_sector(zone) + dmz_zone_length(zone);
+		zone->cond = BLK_ZONE_COND_FULL;
+	} else {
+		zone->cond = BLK_ZONE_COND_CLOSED;
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * Write the extents read by the reader of a stream.
+ */
+static void *dmz_mover_writer(void *arg)
+{
+	struct dmz_mover_stream *s = arg;
+	struct dmz_mover *mv = s->mv;
+	struct dmz_mover_job *job = NULL;
+	struct dmz_mover_io *io;
+	struct blk_zone *zone;
+	bool error;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->error && s->head == s->tail)
+			pthread_cond_wait(&s->cond, &s->lock);
+		error = s->error;
+		pthread_mutex_unlock(&s->lock);
+		if (error)
+			break;
+
+		io = &s->ring[s->head % DMZ_MOVER_NR_BUFS];
+		if (!io->job)
+			break;
+
+		ret = 0;
+		if (io->job != job) {
+			/* The caller owns the destination zone data */
+			job = io->job;
+			zone = &mv->dev->zones[job->dst_zone_id];
+			if (!dmz_zone_empty(zone)) {
+				fprintf(stderr,
+					"Destination zone %u is not empty\n",
+					job->dst_zone_id);
+				ret = -1;
+			}
+		}
+		if (!ret) {
+			if (io->nr_blocks) {
+				ret = dmz_mover_write_io(mv, s, io);
+			} else {
+				ret = dmz_mover_end_job(mv, job);
+				job = NULL;
+			}
+		}
+		if (ret < 0) {
+			dmz_mover_fail(s, io->job);
+			break;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->head++;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the number of streams of a destination block device, limited by
+ * the open and active zones it has left.
+ */
+static unsigned int dmz_mover_nr_streams(struct dmz_dev *dev, int d,
+					 unsigned int nr_jobs)
+{
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned int i, nr_open = 0, nr_active = 0;
+	unsigned int nr = DMZ_MOVER_NR_STREAMS;
+	struct blk_zone *zone;
+
+	zone = &dev->zones[dmz_block_zone_id(dev, bdev->block_offset)];
+	for (i = 0; i < bdev->nr_zones; i++, zone++) {
+		switch (dmz_zone_cond(zone)) {
+		case BLK_ZONE_COND_IMP_OPEN:
+		case BLK_ZONE_COND_EXP_OPEN:
+			nr_open++;
+			/* fallthrough */
+		case BLK_ZONE_COND_CLOSED:
+			nr_active++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (bdev->max_open_zones && bdev->max_open_zones - nr_open < nr)
+		nr = bdev->max_open_zones > nr_open ?
+			bdev->max_open_zones - nr_open : 1;
+	if (bdev->max_active_zones && bdev->max_active_zones - nr_active < nr)
+		nr = bdev->max_active_zones > nr_active ?
+			bdev->max_active_zones - nr_active : 1;
+	if (nr > nr_jobs)
+		nr = nr_jobs;
+
+	return nr ? nr : 1;
+}
+
+/*
+ * Run the streams of the jobs queue of a destination block device.
+ */
+static int dmz_mover_bdev(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_mover *mv = arg;
+	struct dmz_mover_queue *q = &mv->queues[d];
+	struct dmz_mover_stats *stats = &mv->stats[d];
+	struct dmz_mover_stream *streams, *s;
+	unsigned long long start;
+	unsigned int i, j;
+	int ret = 0;
+	__u8 *bufs;
+
+	if (!q->nr_jobs)
+		return 0;
+
+	streams = calloc(q->nr_streams, sizeof(struct dmz_mover_stream));
+	bufs = dmz_malloc_buf((size_t)q->nr_streams * DMZ_MOVER_NR_BUFS *
+			      DMZ_MOVER_IO_BLOCKS * DMZ_BLOCK_SIZE);
+	if (!streams || !bufs) {
+		fprintf(stderr, "Not enough memory\n");
+		ret = -1;
+		goto out;
+	}
+
+	start = dmz_usec();
+	for (i = 0; i < q->nr_streams; i++) {
+		s = &streams[i];
+		s->mv = mv;
+		s->q = q;
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		for (j = 0; j < DMZ_MOVER_NR_BUFS; j++)
+			s->ring[j].buf = bufs +
+				((size_t)i * DMZ_MOVER_NR_BUFS + j) *
+				DMZ_MOVER_IO_BLOCKS * DMZ_BLOCK_SIZE;
+		if (pthread_create(&s->reader, NULL,
+				   dmz_mover_reader, s) != 0) {
+			fprintf(stderr, "%s: Create reader thread failed\n",
+				dev->bdev[d].name);
+			s->error = true;
+			continue;
+		}
+		if (pthread_create(&s->writer, NULL,
+				   dmz_mover_writer, s) != 0) {
+			fprintf(stderr, "%s: Create writer thread failed\n",
+				dev->bdev[d].name);
+			dmz_mover_fail(s, NULL);
+			pthread_join(s->reader, NULL);
+			continue;
+		}
+		s->started = true;
+	}
+
+	for (i = 0; i < q->nr_streams; i++) {
+		s = &streams[i];
+		if (s->started) {
+			pthread_join(s->reader, NULL);
+			pthread_join(s->writer, NULL);
+		}
+		if (s->error)
+			ret = -1;
+		stats->nr_read_blocks += s->stats.nr_read_blocks;
+		stats->nr_read_ios += s->stats.nr_read_ios;
+		stats->nr_written_blocks += s->stats.nr_written_blocks;
+		stats->nr_write_ios += s->stats.nr_write_ios;
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+	}
+
+	/* The moved data must be stable before the metadata update */
+	if (!ret && fsync(mv->fd[d]) < 0) {
+		fprintf(stderr, "%s: fsync failed %d (%s)\n",
+			dev->bdev[d].name, errno, strerror(errno));
+		ret = -1;
+	}
+	stats->usec += dmz_usec() - start;
+
+out:
+	free(bufs);
+	free(streams);
+
+	return ret;
+}
+
+/*
+ * Move the valid blocks of the data zone and buffer zone of each job to
+ * the same offsets of the job destination zone, which must be empty:
+ * a job with a destination zone that is not empty fails. The jobs of each
+ * destination block device are queued and the block devices are written
+ * in parallel, each with as many streams as its open zone limit allows.
+ * Each stream pipelines large reads of coalesced valid blocks with
+ * sequential writes through a ring of IO buffers. The moved data is
+ * on stable media when this returns. If @stats is not NULL, the
+ * statistics of the jobs of each destination block device are added to
+ * @stats[d].
+ */
+int dmz_mover_run(struct dmz_dev *dev, struct dmz_mover_job *jobs,
+		  unsigned int nr_jobs, struct dmz_mover_stats *stats)
+{
+	struct dmz_mover mv;
+	unsigned int i;
+	int d, ret = -1;
+
+	memset(&mv, 0, sizeof(struct dmz_mover));
+	mv.dev = dev;
+	mv.jobs = jobs;
+	mv.nr_jobs = nr_jobs;
+	mv.stats = stats;
+
+	mv.queues = calloc(dev->nr_bdev, sizeof(struct dmz_mover_queue));
+	mv.fd = calloc(dev->nr_bdev, sizeof(int));
+	mv.zero_buf = dmz_malloc_buf(DMZ_MOVER_IO_BLOCKS * DMZ_BLOCK_SIZE);
+	if (!stats)
+		mv.stats = calloc(dev->nr_bdev,
+				  sizeof(struct dmz_mover_stats));
+	if (!mv.queues || !mv.fd || !mv.zero_buf || !mv.stats) {
+		fprintf(stderr, "Not enough memory\n");
+		free(mv.queues);
+		free(mv.fd);
+		free(mv.zero_buf);
+		if (!stats)
+			free(mv.stats);
+		return -1;
+	}
+	memset(mv.zero_buf, 0, DMZ_MOVER_IO_BLOCKS * DMZ_BLOCK_SIZE);
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		mv.fd[d] = -1;
+		mv.queues[d].d = d;
+		pthread_mutex_init(&mv.queues[d].lock, NULL);
+	}
+
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].ret = 0;
+		if (jobs[i].dst_zone_id >= dev->nr_zones ||
+		    jobs[i].dzone_id >= dev->nr_zones ||
+		    (jobs[i].bbm && jobs[i].bzone_id >= dev->nr_zones)) {
+			fprintf(stderr, "Invalid data mover job zones\n");
+			goto out;
+		}
+		mv.queues[dmz_mover_zone_bdev(dev, jobs[i].dst_zone_id)].nr_jobs++;
+	}
+
+#if !defined(BLKFINISHZONE) || !defined(BLKCLOSEZONE)
+	/* Destination zones not entirely written remain open */
+	if (nr_jobs)
+		printf("Zone close and finish not supported, "
+		       "destination zones are left open\n");
+#endif
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		mv.fd[d] = open(dev->bdev[d].path,
+				O_RDWR | O_DIRECT | O_LARGEFILE);
+		if (mv.fd[d] < 0) {
+			fprintf(stderr,
+				"Open %s failed %d (%s)\n",
+				dev->bdev[d].path,
+				errno, strerror(errno));
+			goto out;
+		}
+		if (mv.queues[d].nr_jobs)
+			mv.queues[d].nr_streams =
+				dmz_mover_nr_streams(dev, d,
+						     mv.queues[d].nr_jobs);
+	}
+
+	ret = dmz_run_bdev_workers(dev, dmz_mover_bdev, &mv);
+
+out:
+	for (d = 0; d < dev->nr_bdev; d++) {
+		pthread_mutex_destroy(&mv.queues[d].lock);
+		if (mv.fd[d] >= 0)
+			close(mv.fd[d]);
+	}
+	free(mv.queues);
+	free(mv.fd);
+	free(mv.zero_buf);
+	if (!stats)
+		free(mv.stats);
+
+	return ret;
+}
+
+/*
+ * Benchmark context.
+ */
+struct dmz_mover_bench {
+	struct dmz_mover_job	*jobs;
+	unsigned int		nr_jobs;
+};
+
+/*
+ * Get the first sequential zones of a block device.
+ */
+static unsigned int dmz_mover_bench_zones(struct dmz_dev *dev, int d,
+					  unsigned int *zones,
+					  unsigned int nr_zones)
+{
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned int i, z, n = 0;
+	struct blk_zone *zone;
+
+	z = dmz_block_zone_id(dev, bdev->block_offset);
+	for (i = 0; i < bdev->nr_zones && n < nr_zones; i++, z++) {
+		zone = &dev->zones[z];
+		if (dmz_zone_seq_req(zone) &&
+		    dmz_zone_cond(zone) != BLK_ZONE_COND_READONLY &&
+		    dmz_zone_cond(zone) != BLK_ZONE_COND_OFFLINE)
+			zones[n++] = z;
+	}
+
+	return n;
+}
+
+/*
+ * Build a bitmap with runs of valid and invalid blocks of random lengths.
+ */
+static struct dmz_bitmap *dmz_mover_bench_bitmap(struct dmz_dev *dev,
+						 struct blk_zone *zone)
+{
+	unsigned int b, run, nr_blocks = dmz_sect2blk(dmz_zone_capacity(zone));
+	struct dmz_bitmap *bm;
+	bool valid;
+	__u8 *buf;
+
+	bm = dmz_bitmap_alloc(dev->zone_nr_blocks);
+	buf = calloc(dev->zone_nr_bitmap_blocks, DMZ_BLOCK_SIZE);
+	if (!bm || !buf) {
+		fprintf(stderr, "Not enough memory\n");
+		goto err;
+	}
+
+	b = 0;
+	while (b < nr_blocks) {
+		run = 1 + random() % DMZ_MOVER_BENCH_RUN;
+		valid = (unsigned int)(random() % 100) < DMZ_MOVER_BENCH_VALID;
+		for (; run && b < nr_blocks; run--, b++) {
+			if (valid)
+				dmz_set_bit(buf, b);
+		}
+	}
+
+	for (b = 0; b < dev->zone_nr_bitmap_blocks; b++) {
+		if (dmz_bitmap_load_block(bm, b, buf + b * DMZ_BLOCK_SIZE) < 0)
+			goto err;
+	}
+	free(buf);
+
+	return bm;
+
+err:
+	free(buf);
+	dmz_bitmap_free(bm);
+
+	return NULL;
+}
+
+/*
+ * Fill the source zones of a block device.
+ */
+static int dmz_mover_bench_fill(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_mover_bench *mb = arg;
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	size_t io_size = DMZ_MOVER_IO_BLOCKS * DMZ_BLOCK_SIZE;
+	struct blk_zone *zone;
+	__u64 sector, end;
+	unsigned int i;
+	size_t size;
+	__u8 *buf;
+	int ret = 0;
+
+	buf = dmz_malloc_buf(io_size);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	memset(buf, 0xa5, io_size);
+
+	for (i = 0; i < mb->nr_jobs && !ret; i++) {
+		zone = &dev->zones[mb->jobs[i].dzone_id];
+		if (dmz_zone_to_bdev(dev, zone) != bdev)
+			continue;
+
+		dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &sector);
+		end = sector + dmz_zone_capacity(zone);
+		while (sector < end) {
+			size = io_size;
+			if (sector + (size >> 9) > end)
+				size = (end - sector) << 9;
+			if (pwrite(bdev->fd, buf, size,
+				   sector << 9) != (ssize_t)size) {
+				fprintf(stderr,
+					"%s: Write zone %u failed %d (%s)\n",
+					bdev->name, mb->jobs[i].dzone_id,
+					errno, strerror(errno));
+				ret = -1;
+				break;
+			}
+			sector += size >> 9;
+		}
+		zone->wp = dmz_zone_sector(zone) + dmz_zone_capacity(zone);
+		zone->cond = BLK_ZONE_COND_FULL;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Benchmark the data mover: fill sequential zones of each zoned block
+ * device, move their valid blocks (a random half of the blocks) to
+ * sequential zones of the next zoned block device and report the
+ * throughput.
+ */
+int dmz_mover_bench(struct dmz_dev *dev)
+{
+	unsigned int src[DMZ_MOVER_BENCH_ZONES * 2];
+	unsigned int dst[DMZ_MOVER_BENCH_ZONES * 2];
+	unsigned long long nr_blocks = 0, nr_extents = 0, usec;
+	struct dmz_mover_stats *stats = NULL;
+	struct dmz_mover_bench mb;
+	struct dmz_mover_job *job;
+	int d, n, nr_zoned = 0, ret = -1;
+	int *zoned;
+	unsigned int i;
+
+	memset(&mb, 0, sizeof(struct dmz_mover_bench));
+
+	printf("Benchmarking the data mover (this destroys all data)\n");
+
+	srandom(dmz_usec());
+
+	zoned = calloc(dev->nr_bdev, sizeof(int));
+	stats = calloc(dev->nr_bdev, sizeof(struct dmz_mover_stats));
+	mb.jobs = calloc(dev->nr_bdev * DMZ_MOVER_BENCH_ZONES,
+			 sizeof(struct dmz_mover_job));
+	if (!zoned || !stats || !mb.jobs) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (dmz_bdev_is_zoned(&dev->bdev[d]))
+			zoned[nr_zoned++] = d;
+	}
+
+	/*
+	 * Move the first sequential zones of each zoned block device to the
+	 * following sequential zones of the next zoned block device.
+	 */
+	for (n = 0; n < nr_zoned; n++) {
+		if (dmz_mover_bench_zones(dev, zoned[n], src,
+				DMZ_MOVER_BENCH_ZONES * 2) <
+		    DMZ_MOVER_BENCH_ZONES * 2 ||
+		    dmz_mover_bench_zones(dev, zoned[(n + 1) % nr_zoned], dst,
+				DMZ_MOVER_BENCH_ZONES * 2) <
+		    DMZ_MOVER_BENCH_ZONES * 2) {
+			fprintf(stderr,
+				"%s: Not enough sequential zones\n",
+				dev->bdev[zoned[n]].name);
+			goto out;
+		}
+		for (i = 0; i < DMZ_MOVER_BENCH_ZONES; i++) {
+			job = &mb.jobs[mb.nr_jobs++];
+			job->dzone_id = src[i];
+			job->bzone_id = DMZ_MAP_UNMAPPED;
+			job->dst_zone_id = dst[DMZ_MOVER_BENCH_ZONES + i];
+			job->dbm = dmz_mover_bench_bitmap(dev,
+						&dev->zones[job->dzone_id]);
+			if (!job->dbm)
+				goto out;
+			nr_blocks += job->dbm->weight;
+			nr_extents += dmz_bitmap_extents(job->dbm);
+		}
+	}
+	if (!mb.nr_jobs) {
+		fprintf(stderr, "No zoned block device to benchmark\n");
+		goto out;
+	}
+
+	printf("Filling %u zones\n", mb.nr_jobs);
+	fflush(stdout);
+	for (i = 0; i < mb.nr_jobs; i++) {
+		if (dmz_reset_zone(dev, &dev->zones[mb.jobs[i].dzone_id]) < 0 ||
+		    dmz_reset_zone(dev, &dev->zones[mb.jobs[i].dst_zone_id]) < 0)
+			goto out;
+	}
+	ret = dmz_run_bdev_workers(dev, dmz_mover_bench_fill, &mb);
+	if (ret < 0)
+		goto out;
+
+	printf("Moving %llu valid blocks in %llu extents\n",
+	       nr_blocks, nr_extents);
+	fflush(stdout);
+	usec = dmz_usec();
+	ret = dmz_mover_run(dev, mb.jobs, mb.nr_jobs, stats);
+	usec = dmz_usec() - usec;
+	if (ret < 0)
+		goto out;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (!stats[d].nr_write_ios)
+			continue;
+		printf("  %s: %llu blocks read in %llu IOs, "
+		       "%llu blocks written in %llu IOs, %llu MB/s\n",
+		       dev->bdev[d].name,
+		       stats[d].nr_read_blocks, stats[d].nr_read_ios,
+		       stats[d].nr_written_blocks, stats[d].nr_write_ios,
+		       stats[d].usec ?
+		       (stats[d].nr_read_blocks << DMZ_BLOCK_SHIFT) /
+		       stats[d].usec : 0);
+	}
+	printf("Moved %llu MiB of valid blocks in %llu.%03llu s "
+	       "(%llu MB/s)\n",
+	       (nr_blocks << DMZ_BLOCK_SHIFT) >> 20,
+	       usec / 1000000, (usec % 1000000) / 1000,
+	       usec ? (nr_blocks << DMZ_BLOCK_SHIFT) / usec : 0);
+
+	/* Leave the zones empty */
+	for (i = 0; i < mb.nr_jobs; i++) {
+		if (dmz_reset_zone(dev, &dev->zones[mb.jobs[i].dzone_id]) < 0 ||
+		    dmz_reset_zone(dev, &dev->zones[mb.jobs[i].dst_zone_id]) < 0)
+			ret = -1;
+	}
+
+out:
+	if (mb.jobs) {
+		for (i = 0; i < mb.nr_jobs; i++)
+			dmz_bitmap_free(mb.jobs[i].dbm);
+	}
+	free(mb.jobs);
+	free(stats);
+	free(zoned);
+
+	return ret;
+}
@@ -0,0 +1,536 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/*
+ * Time spent measuring the metadata device 4KB IOPS.
+ */
+#define DMZ_PLAN_MEASURE_USEC	(1000000ULL)
+
+/*
+ * Assumed latency of a zone reset. Resetting a zone does not transfer
+ * any data and cannot be measured without writing to the device.
+ */
+#define DMZ_PLAN_RESET_USEC	2000ULL
+
+/*
+ * Numbers of reserved sequential zones shown as alternatives.
+ */
+static unsigned int dmz_plan_seqs[] = { 1, 4, 16, 32, 64 };
+
+/*
+ * Time estimates in usec.
+ */
+struct dmz_plan_est {
+	unsigned long long	format;
+	unsigned long long	check;
+	unsigned long long	repair;
+};
+
+/*
+ * Measure the 4KB sequential read IOPS of the metadata device, using
+ * direct IOs from the start of the metadata zones.
+ */
+static unsigned long long dmz_plan_measure_iops(struct dmz_dev *dev)
+{
+	struct dmz_block_dev *bdev;
+	unsigned long long start, end, nr_ios = 0;
+	__u64 block;
+	__u8 *buf;
+	int fd;
+
+	bdev = dmz_block_to_bdev(dev, dev->sb_block, &block);
+	fd = open(bdev->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			bdev->path,
+			errno, strerror(errno));
+		return 0;
+	}
+
+	buf = dmz_malloc_buf(DMZ_BLOCK_SIZE);
+	if (!buf) {
+		close(fd);
+		return 0;
+	}
+
+	start = dmz_usec();
+	end = start + DMZ_PLAN_MEASURE_USEC;
+	while (dmz_usec() < end && nr_ios < dev->nr_meta_blocks * 2) {
+		if (pread(fd, buf, DMZ_BLOCK_SIZE,
+			  (block + nr_ios) << DMZ_BLOCK_SHIFT) !=
+		    DMZ_BLOCK_SIZE) {
+			fprintf(stderr,
+				"%s: Read block %llu failed %d (%s)\n",
+				bdev->name, block + nr_ios,
+				errno, strerror(errno));
+			nr_ios = 0;
+			break;
+		}
+		nr_ios++;
+	}
+	end = dmz_usec();
+
+	free(buf);
+	close(fd);
+
+	if (!nr_ios)
+		return 0;
+
+	return nr_ios * 1000000ULL / (end - start ? end - start : 1);
+}
+
+/*
+ * Measure the time needed to get the zone information of all devices.
+ */
+static unsigned long long dmz_plan_measure_report(struct dmz_dev *dev)
+{
+	struct blk_zone *zones = dev->zones;
+	unsigned long long start;
+	int flags = dev->flags;
+
+	start = dmz_usec();
+	dev->flags &= ~DMZ_VVERBOSE;
+	if (dmz_get_dev_zones(dev) < 0) {
+		dev->flags = flags;
+		dev->zones = zones;
+		return 0;
+	}
+	start = dmz_usec() - start;
+	dev->flags = flags;
+
+	free(dev->zones);
+	dev->zones = zones;
+
+	return start;
+}
+
+/*
+ * Estimate the format, check and repair durations of a device
+ * with its metadata located.
+ */
+static void dmz_plan_estimate(struct dmz_dev *dev, unsigned long long iops,
+			      unsigned long long report_usec,
+			      struct dmz_plan_est *est)
+{
+	unsigned long long meta_usec, nr_seq = 0;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		if (dmz_zone_seq_req(&dev->zones[i]) ||
+		    dmz_zone_seq_pref(&dev->zones[i]))
+			nr_seq++;
+	}
+
+	/* Time to read or write one metadata set */
+	meta_usec = (unsigned long long)dev->nr_meta_blocks *
+		1000000ULL / iops;
+
+	est->format = nr_seq * DMZ_PLAN_RESET_USEC + meta_usec * 2;
+	est->check = report_usec + meta_usec * 2;
+	est->repair = est->check + meta_usec;
+}
+
+/*
+ * Print a duration in a human readable form.
+ */
+static char *dmz_plan_time_str(unsigned long long usec, char *str, size_t len)
+{
+	unsigned long long sec = usec / 1000000ULL;
+
+	if (sec >= 3600)
+		snprintf(str, len, "%lluh%02llum", sec / 3600,
+			 (sec % 3600) / 60);
+	else if (sec >= 60)
+		snprintf(str, len, "%llum%02llus", sec / 60, sec % 60);
+	else
+		snprintf(str, len, "%llu.%01llus", sec,
+			 (usec % 1000000ULL) / 100000ULL);
+
+	return str;
+}
+
+/*
+ * Data zones of a device with its metadata located.
+ */
+static inline unsigned int dmz_plan_nr_data_zones(struct dmz_dev *dev)
+{
+	return dev->nr_usable_zones - dev->nr_cache_zones -
+		dev->nr_reserved_seq;
+}
+
+/*
+ * Print the layout of a device.
+ */
+static void dmz_plan_print_layout(struct dmz_dev *dev)
+{
+	int i;
+
+	printf("Layout (metadata version %d):\n", dev->sb_version);
+	printf("  %u usable zones\n", dev->nr_usable_zones);
+	printf("  Primary metadata set: zones %u-%u, %llu blocks from block %llu\n",
+	       dmz_zone_id(dev, dev->sb_zone),
+	       dmz_zone_id(dev, dev->sb_zone) + dev->nr_meta_zones - 1,
+	       dev->nr_meta_blocks, dev->sb_block);
+	printf("  Secondary metadata set: zones %u-%u, %llu blocks from block %llu\n",
+	       dmz_zone_id(dev, dev->sb_zone) + dev->nr_meta_zones,
+	       dmz_zone_id(dev, dev->sb_zone) +
+	       dev->total_nr_meta_zones - 1,
+	       dev->nr_meta_blocks,
+	       dev->sb_block + dev->nr_meta_zones * dev->zone_nr_blocks);
+	printf("    1 super block, %u mapping table blocks, %llu bitmap blocks\n",
+	       dev->nr_map_blocks, dev->nr_bitmap_blocks);
+	if (dev->sb_version > 1) {
+		for (i = 1; i < dev->nr_bdev; i++)
+			printf("  Tertiary super block: %s, block %llu\n",
+			       dev->bdev[i].name, dev->bdev[i].block_offset);
+	}
+	printf("  %u data chunks (%llu GiB)\n",
+	       dev->nr_chunks,
+	       ((__u64)dev->nr_chunks * dev->zone_nr_cap_sectors) >> 21);
+	printf("    %u cache zone%s\n",
+	       dev->nr_cache_zones - dev->total_nr_meta_zones,
+	       dev->nr_cache_zones - dev->total_nr_meta_zones > 1 ? "s" : "");
+	printf("    %u data zone%s\n",
+	       dmz_plan_nr_data_zones(dev),
+	       dmz_plan_nr_data_zones(dev) > 1 ? "s" : "");
+	printf("    %u sequential zone%s reserved for reclaim\n",
+	       dev->nr_reserved_seq,
+	       dev->nr_reserved_seq > 1 ? "s" : "");
+}
+
+/*
+ * Print the slow or degraded zones of the devices found in a survey
+ * profile, and warn if metadata zones are in a flagged band.
+ */
+static int dmz_plan_print_survey(struct dmz_dev *dev)
+{
+	struct dmz_survey_dev sdev;
+	struct dmz_survey_band *band;
+	struct dmz_block_dev *bdev;
+	unsigned int b, first, nr_flagged, meta_start, meta_end;
+	unsigned long long min_mbps;
+	int d, ret;
+
+	printf("Survey profile %s:\n", dev->survey_profile);
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		bdev = &dev->bdev[d];
+		ret = dmz_survey_load(dev->survey_profile, bdev, &sdev);
+		if (ret < 0)
+			return -1;
+		if (!ret) {
+			printf("  %s: not surveyed\n", bdev->name);
+			continue;
+		}
+		if (sdev.nr_zones != bdev->nr_zones) {
+			printf("  %s: zone count mismatch, survey outdated\n",
+			       bdev->name);
+			free(sdev.bands);
+			continue;
+		}
+
+		/* Metadata zones of this device, relative to the device */
+		first = bdev->block_offset / dev->zone_nr_blocks;
+		meta_start = dmz_zone_id(dev, dev->sb_zone);
+		meta_end = meta_start + dev->total_nr_meta_zones;
+		if (meta_start >= first + bdev->nr_zones || meta_end <= first) {
+			meta_start = 0;
+			meta_end = 0;
+		} else {
+			meta_start -= first;
+			meta_end -= first;
+		}
+
+		nr_flagged = 0;
+		min_mbps = 0;
+		for (b = 0; b < sdev.nr_bands; b++) {
+			band = &sdev.bands[b];
+			if (!band->cache &&
+			    !(band->flags & DMZ_SURVEY_UNSAMPLED) &&
+			    (!min_mbps || band->mbps < min_mbps))
+				min_mbps = band->mbps;
+			if (!(band->flags & ~DMZ_SURVEY_UNSAMPLED))
+				continue;
+			nr_flagged++;
+			if (band->zone < meta_end &&
+			    band->zone + band->nr_zones > meta_start)
+				printf("  %s: WARNING: metadata zones in "
+				       "flagged zones %u-%u\n",
+				       bdev->name, band->zone,
+				       band->zone + band->nr_zones - 1);
+		}
+
+		printf("  %s: %u flagged band%s out of %u",
+		       bdev->name, nr_flagged, nr_flagged > 1 ? "s" : "",
+		       sdev.nr_bands);
+		if (min_mbps)
+			printf(", slowest sequential band %llu MB/s",
+			       min_mbps);
+		printf("\n");
+
+		free(sdev.bands);
+	}
+
+	return 0;
+}
+
+/*
+ * Write a quoted JSON string, escaping quotes, backslashes and
+ * control characters.
+ */
+static void dmz_plan_json_str(FILE *json, const char *str)
+{
+	const unsigned char *c;
+
+	fputc('"', json);
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(json, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(json, "\\u%04x", *c);
+		else
+			fputc(*c, json);
+	}
+	fputc('"', json);
+}
+
+/*
+ * Name of the devices of an alternative configuration.
+ */
+static void dmz_plan_devs_str(struct dmz_dev *dev, int nr_zoned,
+			      bool cache, char *str, size_t len)
+{
+	int i, n, first_zoned = dev->nr_bdev > 1 ? 1 : 0;
+
+	n = snprintf(str, len, "%s", cache ? dev->bdev[0].name : "");
+	for (i = 0; i < nr_zoned && n < (int)len; i++)
+		n += snprintf(str + n, len - n, "%s%s", n ? "+" : "",
+			      dev->bdev[first_zoned + i].name);
+}
+
+/*
+ * Print and save an alternative configuration.
+ */
+static void dmz_plan_alternative(struct dmz_dev *dev, FILE *json, bool *first,
+				 int nr_zoned, bool cache, unsigned int seq,
+				 unsigned long long iops,
+				 unsigned long long report_usec)
+{
+	struct dmz_dev tmp, edev;
+	struct dmz_plan_est est;
+	char devs[256], t1[32], t2[32];
+
+	/* Use the regular device and the first @nr_zoned zoned devices */
+	tmp = *dev;
+	tmp.nr_bdev = nr_zoned + (dev->nr_bdev > 1 ? 1 : 0);
+	if (dmz_emulate_dev(&tmp, &edev,
+			    cache ? dev->bdev[0].capacity : 0) < 0)
+		return;
+
+	edev.nr_reserved_seq = seq;
+	dmz_plan_devs_str(dev, nr_zoned, cache, devs, sizeof(devs));
+	if (dmz_locate_metadata(&edev) < 0) {
+		printf("  %-24s %5u  invalid configuration\n", devs, seq);
+		goto out;
+	}
+
+	/* Skip numbers of reserved zones limited by the number of cache zones */
+	if (edev.nr_reserved_seq != seq)
+		goto out;
+
+	/* The zone report time is proportional to the number of zones */
+	dmz_plan_estimate(&edev, iops,
+			  report_usec * edev.nr_zones / dev->nr_zones, &est);
+	printf("  %-24s %5u %8u %9llu %6u %8s %8s\n",
+	       devs, edev.nr_reserved_seq, edev.nr_chunks,
+	       ((__u64)edev.nr_chunks * edev.zone_nr_cap_sectors) >> 21,
+	       edev.total_nr_meta_zones,
+	       dmz_plan_time_str(est.format, t1, sizeof(t1)),
+	       dmz_plan_time_str(est.check, t2, sizeof(t2)));
+
+	if (json) {
+		fprintf(json, "%s\n    { \"devices\": ", *first ? "" : ",");
+		dmz_plan_json_str(json, devs);
+		fprintf(json,
+			", \"seq\": %u, "
+			"\"chunks\": %u, \"meta_zones\": %u, "
+			"\"cache_zones\": %u, \"data_zones\": %u, "
+			"\"format_usec\": %llu, \"check_usec\": %llu, "
+			"\"repair_usec\": %llu }",
+			edev.nr_reserved_seq, edev.nr_chunks,
+			edev.total_nr_meta_zones,
+			edev.nr_cache_zones - edev.total_nr_meta_zones,
+			dmz_plan_nr_data_zones(&edev),
+			est.format, est.check, est.repair);
+		*first = false;
+	}
+
+out:
+	dmz_free_emulated_dev(&edev);
+}
+
+/*
+ * Save the layout and estimates of a device as JSON.
+ */
+static void dmz_plan_json(struct dmz_dev *dev, FILE *json,
+			  unsigned long long iops, bool measured,
+			  struct dmz_plan_est *est)
+{
+	int i;
+
+	fprintf(json, "{\n  \"label\": ");
+	dmz_plan_json_str(json, dev->label);
+	fprintf(json, ",\n");
+	fprintf(json, "  \"metadata_version\": %d,\n", dev->sb_version);
+	fprintf(json, "  \"devices\": [");
+	for (i = 0; i < dev->nr_bdev; i++) {
+		fprintf(json, "%s\n    { \"path\": ", i ? "," : "");
+		dmz_plan_json_str(json, dev->bdev[i].path);
+		fprintf(json,
+			", \"type\": \"%s\", "
+			"\"capacity\": %llu, \"nr_zones\": %u, "
+			"\"block_offset\": %llu }",
+			dev->bdev[i].type == DMZ_TYPE_REGULAR ? "regular" :
+			(dmz_bdev_is_hm(&dev->bdev[i]) ? "host-managed" :
+			 "host-aware"),
+			dev->bdev[i].capacity, dev->bdev[i].nr_zones,
+			dev->bdev[i].block_offset);
+	}
+	fprintf(json, "\n  ],\n");
+	fprintf(json, "  \"zone_sectors\": %zu,\n", dev->zone_nr_sectors);
+	fprintf(json, "  \"usable_zones\": %u,\n", dev->nr_usable_zones);
+	fprintf(json,
+		"  \"metadata_sets\": [\n"
+		"    { \"set\": \"primary\", \"zone\": %u, \"zones\": %u, "
+		"\"sb_block\": %llu },\n"
+		"    { \"set\": \"secondary\", \"zone\": %u, \"zones\": %u, "
+		"\"sb_block\": %llu }\n  ],\n",
+		dmz_zone_id(dev, dev->sb_zone), dev->nr_meta_zones,
+		dev->sb_block,
+		dmz_zone_id(dev, dev->sb_zone) + dev->nr_meta_zones,
+		dev->nr_meta_zones,
+		dev->sb_block + dev->nr_meta_zones * dev->zone_nr_blocks);
+	fprintf(json, "  \"meta_blocks\": %llu,\n", dev->nr_meta_blocks);
+	fprintf(json, "  \"map_blocks\": %u,\n", dev->nr_map_blocks);
+	fprintf(json, "  \"bitmap_blocks\": %llu,\n", dev->nr_bitmap_blocks);
+	fprintf(json, "  \"chunks\": %u,\n", dev->nr_chunks);
+	fprintf(json, "  \"cache_zones\": %u,\n",
+		dev->nr_cache_zones - dev->total_nr_meta_zones);
+	fprintf(json, "  \"data_zones\": %u,\n",
+		dmz_plan_nr_data_zones(dev));
+	fprintf(json, "  \"reserved_seq_zones\": %u,\n",
+		dev->nr_reserved_seq);
+	fprintf(json, "  \"iops\": %llu,\n  \"iops_measured\": %s,\n",
+		iops, measured ? "true" : "false");
+	fprintf(json,
+		"  \"estimates\": { \"format_usec\": %llu, "
+		"\"check_usec\": %llu, \"repair_usec\": %llu },\n",
+		est->format, est->check, est->repair);
+	fprintf(json, "  \"alternatives\": [");
+}
+
+/*
+ * Plan a format without writing anything: locate the metadata, print the
+ * resulting layout and estimate the format, check and repair durations,
+ * for the requested configuration and alternative configurations.
+ */
+int dmz_plan(struct dmz_dev *dev)
+{
+	unsigned long long iops = dev->plan_iops, report_usec;
+	struct dmz_plan_est est;
+	FILE *json = NULL;
+	bool first = true;
+	unsigned int seqs[ARRAY_SIZE(dmz_plan_seqs) + 1];
+	unsigned int s, nr_seqs = 0;
+	int nr_zoned, i, cache;
+	char t[32];
+
+	printf("Dry run: nothing will be written\n");
+
+	if (dmz_locate_metadata(dev) < 0)
+		return -1;
+
+	dmz_get_label(dev, dev->label, false);
+	dmz_plan_print_layout(dev);
+
+	if (dev->survey_profile && dmz_plan_print_survey(dev) < 0)
+		return -1;
+
+	if (!iops) {
+		iops = dmz_plan_measure_iops(dev);
+		if (!iops)
+			return -1;
+	}
+	report_usec = dmz_plan_measure_report(dev);
+
+	dmz_plan_estimate(dev, iops, report_usec, &est);
+	printf("Estimates (%llu 4KB IOPS %s, %llu ms zone reset):\n",
+	       iops, dev->plan_iops ? "specified" : "measured",
+	       DMZ_PLAN_RESET_USEC / 1000);
+	printf("  Format: %s\n", dmz_plan_time_str(est.format, t, sizeof(t)));
+	printf("  Check: %s\n", dmz_plan_time_str(est.check, t, sizeof(t)));
+	printf("  Repair: %s\n", dmz_plan_time_str(est.repair, t, sizeof(t)));
+
+	if (dev->plan_json) {
+		json = fopen(dev->plan_json, "w");
+		if (!json) {
+			fprintf(stderr,
+				"Open %s failed %d (%s)\n",
+				dev->plan_json,
+				errno, strerror(errno));
+			return -1;
+		}
+		dmz_plan_json(dev, json, iops, !dev->plan_iops, &est);
+	}
+
+	/*
+	 * Alternatives: all numbers of reserved sequential zones with the
+	 * first 1 to N zoned devices, with and without the regular device.
+	 */
+	for (s = 0; s < ARRAY_SIZE(dmz_plan_seqs); s++) {
+		if (dmz_plan_seqs[s] > dev->nr_reserved_seq &&
+		    (!nr_seqs || seqs[nr_seqs - 1] < dev->nr_reserved_seq))
+			seqs[nr_seqs++] = dev->nr_reserved_seq;
+		if (dmz_plan_seqs[s] != dev->nr_reserved_seq)
+			seqs[nr_seqs++] = dmz_plan_seqs[s];
+	}
+	if (seqs[nr_seqs - 1] < dev->nr_reserved_seq)
+		seqs[nr_seqs++] = dev->nr_reserved_seq;
+
+	printf("Alternatives:\n");
+	printf("  %-24s %5s %8s %9s %6s %8s %8s\n",
+	       "Devices", "Seq", "Chunks", "Capacity", "Meta", "Format",
+	       "Check");
+	nr_zoned = dev->nr_bdev > 1 ? dev->nr_bdev - 1 : 1;
+	for (cache = dev->nr_bdev > 1; cache >= 0; cache--) {
+		for (i = 1; i <= nr_zoned; i++) {
+			if (!cache && i > 1)
+				break;
+			for (s = 0; s < nr_seqs; s++)
+				dmz_plan_alternative(dev, json, &first, i,
+						     cache, seqs[s],
+						     iops, report_usec);
+		}
+	}
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+	}
+
+	return 0;
+}
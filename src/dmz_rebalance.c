@@ -0,0 +1,632 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Number of chunk moves committed with a single metadata update.
+ */
+#define DMZ_REBALANCE_BATCH		64
+
+/*
+ * Chunk move from a sequential zone of a zoned block device to a free
+ * sequential zone of another zoned block device.
+ */
+struct dmz_rebalance_move {
+	unsigned int		chunk;
+	unsigned int		src_zone_id;
+	unsigned int		dst_zone_id;
+	unsigned int		bzone_id;
+	int			src_bdev;
+	int			dst_bdev;
+	struct dmz_bitmap	*bm;
+	__u8			*bitmap;
+};
+
+/*
+ * Per block device chunk occupancy and free zones.
+ */
+struct dmz_rebalance_dev {
+	bool			zoned;
+	unsigned int		nr_data_zones;
+	unsigned int		nr_chunks;
+	unsigned int		target;
+
+	unsigned int		*free_zones;
+	unsigned int		nr_free_zones;
+};
+
+/*
+ * Rebalance context.
+ */
+struct dmz_rebalance {
+	struct dmz_txn			txn;
+	struct dmz_rebalance_dev	*rdev;
+	unsigned int			nr_zoned;
+
+	struct dmz_rebalance_move	*moves;
+	unsigned int			nr_moves;
+	unsigned long long		nr_move_blocks;
+
+	/* Moves of the batch being committed */
+	unsigned int			batch_start;
+	unsigned int			batch_end;
+
+	struct dmz_mover_job		*jobs;
+	struct dmz_mover_stats		*stats;
+};
+
+/*
+ * Test if a zone can be used as a data zone.
+ */
+static bool dmz_rebalance_zone_usable(struct dmz_dev *dev,
+				      unsigned int zone_id)
+{
+	struct blk_zone *zone = &dev->zones[zone_id];
+	unsigned int sb_zone_id = dmz_zone_id(dev, dev->sb_zone);
+	int d;
+
+	/* Metadata, read-only and offline zones are not used */
+	if ((zone_id >= sb_zone_id &&
+	     zone_id < sb_zone_id + dev->total_nr_meta_zones) ||
+	    dmz_zone_cond(zone) == BLK_ZONE_COND_READONLY ||
+	    dmz_zone_cond(zone) == BLK_ZONE_COND_OFFLINE)
+		return false;
+
+	for (d = 1; d < dev->nr_bdev; d++) {
+		if (dmz_sect2blk(dmz_zone_sector(zone)) ==
+		    dev->bdev[d].block_offset)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Get the index of the block device of a zone.
+ */
+static int dmz_rebalance_zone_bdev(struct dmz_dev *dev, unsigned int zone_id)
+{
+	return dmz_zone_to_bdev(dev, &dev->zones[zone_id]) - dev->bdev;
+}
+
+/*
+ * Load the metadata and get the chunk occupancy and the free sequential
+ * zones of all zoned block devices.
+ */
+static int dmz_rebalance_load(struct dmz_dev *dev, struct dmz_rebalance *rb)
+{
+	unsigned int chunk, dzone_id, bzone_id, i;
+	struct dmz_rebalance_dev *rdev;
+	bool *mapped;
+	int d, ret = -1;
+
+	if (dmz_txn_open(dev, &rb->txn) < 0)
+		return -1;
+
+	rb->rdev = calloc(dev->nr_bdev, sizeof(struct dmz_rebalance_dev));
+	mapped = calloc(dev->nr_zones, sizeof(bool));
+	if (!rb->rdev || !mapped) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+		dmz_txn_get_mapping(dev, &rb->txn, chunk,
+				    &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		if (dzone_id >= dev->nr_zones ||
+		    (bzone_id != DMZ_MAP_UNMAPPED &&
+		     bzone_id >= dev->nr_zones)) {
+			fprintf(stderr,
+				"%s: Invalid chunk %u mapping, "
+				"run repair first\n",
+				dev->label, chunk);
+			goto out;
+		}
+		mapped[dzone_id] = true;
+		if (bzone_id != DMZ_MAP_UNMAPPED)
+			mapped[bzone_id] = true;
+		rb->rdev[dmz_rebalance_zone_bdev(dev, dzone_id)].nr_chunks++;
+	}
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		rdev = &rb->rdev[d];
+		if (!dmz_bdev_is_zoned(&dev->bdev[d]))
+			continue;
+		rdev->zoned = true;
+		rb->nr_zoned++;
+
+		rdev->free_zones = calloc(dev->bdev[d].nr_zones,
+					  sizeof(unsigned int));
+		if (!rdev->free_zones) {
+			fprintf(stderr, "Not enough memory\n");
+			goto out;
+		}
+
+		i = dmz_block_zone_id(dev, dev->bdev[d].block_offset);
+		for (; i < dmz_block_zone_id(dev, dev->bdev[d].block_offset) +
+			     dev->bdev[d].nr_zones; i++) {
+			if (!dmz_rebalance_zone_usable(dev, i))
+				continue;
+			rdev->nr_data_zones++;
+			if (!mapped[i] && dmz_zone_seq_req(&dev->zones[i]))
+				rdev->free_zones[rdev->nr_free_zones++] = i;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(mapped);
+
+	return ret;
+}
+
+/*
+ * Get the target number of chunks of each zoned block device,
+ * proportional to its number of data zones.
+ */
+static void dmz_rebalance_targets(struct dmz_dev *dev,
+				  struct dmz_rebalance *rb)
+{
+	unsigned long long nr_chunks = 0, nr_zones = 0, assigned = 0;
+	struct dmz_rebalance_dev *rdev;
+	int d, best;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (!rb->rdev[d].zoned)
+			continue;
+		nr_chunks += rb->rdev[d].nr_chunks;
+		nr_zones += rb->rdev[d].nr_data_zones;
+	}
+	if (!nr_zones)
+		return;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		rdev = &rb->rdev[d];
+		if (!rdev->zoned)
+			continue;
+		rdev->target = nr_chunks * rdev->nr_data_zones / nr_zones;
+		assigned += rdev->target;
+	}
+
+	/*
+	 * Give the remaining chunks to the devices holding the most chunks
+	 * above their target, to avoid needless moves.
+	 */
+	while (assigned < nr_chunks) {
+		best = -1;
+		for (d = 0; d < dev->nr_bdev; d++) {
+			rdev = &rb->rdev[d];
+			if (!rdev->zoned)
+				continue;
+			if (best < 0 ||
+			    (long long)rdev->nr_chunks - rdev->target >
+			    (long long)rb->rdev[best].nr_chunks -
+			    rb->rdev[best].target)
+				best = d;
+		}
+		rb->rdev[best].target++;
+		assigned++;
+	}
+}
+
+/*
+ * Sort chunk moves by increasing number of valid blocks.
+ */
+static int dmz_rebalance_cmp_weight(const void *a, const void *b)
+{
+	const struct dmz_rebalance_move *ma = a, *mb = b;
+
+	if (ma->bm->weight < mb->bm->weight)
+		return -1;
+	return ma->bm->weight > mb->bm->weight;
+}
+
+/*
+ * Get the last valid block of a bitmap, plus one.
+ */
+static unsigned int dmz_rebalance_end_block(struct dmz_bitmap *bm)
+{
+	unsigned int b, end = 0;
+
+	b = dmz_bitmap_next(bm, 0);
+	while (b < bm->nr_bits) {
+		end = b + 1;
+		b = dmz_bitmap_next(bm, b + 1);
+	}
+
+	return end;
+}
+
+/*
+ * Read the bitmap of a candidate chunk data zone.
+ */
+static int dmz_rebalance_read_bitmap(struct dmz_dev *dev,
+				     struct dmz_rebalance *rb,
+				     struct dmz_rebalance_move *mv)
+{
+	unsigned int b;
+
+	if (dmz_read_zone_bitmap(dev, &rb->txn.mset[0], mv->src_zone_id,
+				 &mv->bitmap) < 0)
+		return -1;
+
+	mv->bm = dmz_bitmap_alloc(dev->zone_nr_blocks);
+	if (!mv->bm) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	for (b = 0; b < dev->zone_nr_bitmap_blocks; b++) {
+		if (dmz_bitmap_load_block(mv->bm, b,
+					  mv->bitmap + b * DMZ_BLOCK_SIZE) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a free zone of a block device large enough for a chunk
+ * valid blocks.
+ */
+static unsigned int dmz_rebalance_get_free_zone(struct dmz_dev *dev,
+						struct dmz_rebalance_dev *rdev,
+						unsigned int nr_blocks)
+{
+	struct blk_zone *zone;
+	unsigned int i, zone_id;
+
+	for (i = 0; i < rdev->nr_free_zones; i++) {
+		zone = &dev->zones[rdev->free_zones[i]];
+		if (dmz_sect2blk(dmz_zone_capacity(zone)) < nr_blocks)
+			continue;
+		zone_id = rdev->free_zones[i];
+		rdev->nr_free_zones--;
+		memmove(&rdev->free_zones[i], &rdev->free_zones[i + 1],
+			(rdev->nr_free_zones - i) * sizeof(unsigned int));
+		return zone_id;
+	}
+
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * Get the destination device and zone of a chunk move: the device the
+ * most below its target with a free zone large enough.
+ */
+static int dmz_rebalance_get_dst(struct dmz_dev *dev,
+				 struct dmz_rebalance *rb,
+				 struct dmz_rebalance_move *mv,
+				 unsigned int *zone_id)
+{
+	unsigned int deficit, nr_blocks = dmz_rebalance_end_block(mv->bm);
+	struct dmz_rebalance_dev *rdev;
+	int d, best;
+
+	while (1) {
+		best = -1;
+		deficit = 0;
+		for (d = 0; d < dev->nr_bdev; d++) {
+			rdev = &rb->rdev[d];
+			if (!rdev->zoned ||
+			    rdev->nr_chunks >= rdev->target ||
+			    rdev->target - rdev->nr_chunks <= deficit)
+				continue;
+			best = d;
+			deficit = rdev->target - rdev->nr_chunks;
+		}
+		if (best < 0)
+			return -1;
+
+		*zone_id = dmz_rebalance_get_free_zone(dev, &rb->rdev[best],
+						       nr_blocks);
+		if (*zone_id != DMZ_MAP_UNMAPPED)
+			return best;
+
+		/* No free zone left: stop filling this device */
+		rb->rdev[best].target = rb->rdev[best].nr_chunks;
+	}
+}
+
+/*
+ * Plan the chunk moves from the devices above their target to the
+ * devices below their target, moving first the chunks with the least
+ * valid blocks.
+ */
+static int dmz_rebalance_plan(struct dmz_dev *dev, struct dmz_rebalance *rb)
+{
+	struct dmz_rebalance_move *cands = NULL, *mv;
+	struct dmz_rebalance_dev *rdev;
+	unsigned int chunk, dzone_id, bzone_id, nr_cands, i, zone_id;
+	unsigned int surplus;
+	int s, best, ret = -1;
+
+	rb->moves = calloc(dev->nr_chunks, sizeof(struct dmz_rebalance_move));
+	cands = calloc(dev->nr_chunks, sizeof(struct dmz_rebalance_move));
+	if (!rb->moves || !cands) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	for (s = 0; s < dev->nr_bdev; s++) {
+		rdev = &rb->rdev[s];
+		if (!rdev->zoned || rdev->nr_chunks <= rdev->target)
+			continue;
+		surplus = rdev->nr_chunks - rdev->target;
+
+		/* Chunks mapped to sequential zones of this device */
+		nr_cands = 0;
+		for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+			dmz_txn_get_mapping(dev, &rb->txn, chunk,
+					    &dzone_id, &bzone_id);
+			if (dzone_id == DMZ_MAP_UNMAPPED ||
+			    dmz_rebalance_zone_bdev(dev, dzone_id) != s ||
+			    !dmz_zone_seq_req(&dev->zones[dzone_id]))
+				continue;
+			mv = &cands[nr_cands++];
+			mv->chunk = chunk;
+			mv->src_zone_id = dzone_id;
+			mv->bzone_id = bzone_id;
+			mv->src_bdev = s;
+			if (dmz_rebalance_read_bitmap(dev, rb, mv) < 0)
+				goto out;
+		}
+
+		qsort(cands, nr_cands, sizeof(struct dmz_rebalance_move),
+		      dmz_rebalance_cmp_weight);
+
+		for (i = 0; i < nr_cands && surplus; i++) {
+			mv = &cands[i];
+
+			/* Move to the device the most below its target */
+			best = dmz_rebalance_get_dst(dev, rb, mv, &zone_id);
+			if (best < 0)
+				break;
+
+			mv->dst_zone_id = zone_id;
+			mv->dst_bdev = best;
+			rb->rdev[best].nr_chunks++;
+			rdev = &rb->rdev[s];
+			rdev->nr_chunks--;
+			surplus--;
+
+			/* The old data zone is free once the move commits */
+			rdev->free_zones[rdev->nr_free_zones++] =
+				mv->src_zone_id;
+
+			rb->nr_move_blocks += mv->bm->weight;
+			rb->moves[rb->nr_moves++] = *mv;
+			mv->bm = NULL;
+			mv->bitmap = NULL;
+		}
+
+		for (i = 0; i < nr_cands; i++) {
+			dmz_bitmap_free(cands[i].bm);
+			free(cands[i].bitmap);
+		}
+		memset(cands, 0, dev->nr_chunks *
+		       sizeof(struct dmz_rebalance_move));
+	}
+
+	ret = 0;
+
+out:
+	if (cands) {
+		for (i = 0; i < dev->nr_chunks; i++) {
+			dmz_bitmap_free(cands[i].bm);
+			free(cands[i].bitmap);
+		}
+	}
+	free(cands);
+
+	return ret;
+}
+
+/*
+ * Map the moved chunks of the current batch to their new data zones
+ * with a single metadata transaction.
+ */
+static int dmz_rebalance_commit(struct dmz_dev *dev, struct dmz_rebalance *rb)
+{
+	struct dmz_rebalance_move *mv;
+	unsigned int i;
+
+	for (i = rb->batch_start; i < rb->batch_end; i++) {
+		mv = &rb->moves[i];
+		dmz_txn_set_mapping(dev, &rb->txn, mv->chunk,
+				    mv->dst_zone_id, mv->bzone_id);
+		if (dmz_txn_set_bitmap(dev, &rb->txn, mv->dst_zone_id,
+				       mv->bitmap) < 0 ||
+		    dmz_txn_set_bitmap(dev, &rb->txn, mv->src_zone_id,
+				       NULL) < 0)
+			return -1;
+	}
+
+	if (dmz_txn_commit(dev, &rb->txn) < 0)
+		return -1;
+
+	/* The old data zones are now free */
+	for (i = rb->batch_start; i < rb->batch_end; i++) {
+		mv = &rb->moves[i];
+		if (dmz_reset_zone(dev, &dev->zones[mv->src_zone_id]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Print the chunk occupancy of the zoned block devices.
+ */
+static void dmz_rebalance_print(struct dmz_dev *dev,
+				struct dmz_rebalance *rb)
+{
+	struct dmz_rebalance_dev *rdev;
+	int d;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		rdev = &rb->rdev[d];
+		if (!rdev->zoned)
+			continue;
+		printf("  %s: %u mapped chunks, %u data zones, "
+		       "%u free sequential zones\n",
+		       dev->bdev[d].name, rdev->nr_chunks,
+		       rdev->nr_data_zones, rdev->nr_free_zones);
+	}
+}
+
+/*
+ * Move chunks between the zoned block devices of a multi-device target
+ * so that each device holds a number of mapped chunks proportional to
+ * its number of data zones.
+ */
+int dmz_rebalance(struct dmz_dev *dev)
+{
+	struct dmz_rebalance rb;
+	struct dmz_rebalance_move *mv;
+	struct dmz_mover_job *job;
+	struct blk_zone *zone;
+	unsigned long long start, usec;
+	unsigned int i, j;
+	int d, ret = -1;
+
+	memset(&rb, 0, sizeof(struct dmz_rebalance));
+
+	if (dmz_rebalance_load(dev, &rb) < 0)
+		goto out;
+
+	if (rb.nr_zoned < 2) {
+		fprintf(stderr,
+			"%s: Rebalancing requires at least two zoned "
+			"block devices\n",
+			dev->label);
+		goto out;
+	}
+
+	printf("Chunk occupancy:\n");
+	dmz_rebalance_print(dev, &rb);
+
+	dmz_rebalance_targets(dev, &rb);
+	if (dmz_rebalance_plan(dev, &rb) < 0)
+		goto out;
+
+	if (!rb.nr_moves) {
+		printf("Chunks are balanced, nothing to do\n");
+		ret = 0;
+		goto out;
+	}
+
+	printf("Moving %u chunks (%llu valid blocks) in %u batches\n",
+	       rb.nr_moves, rb.nr_move_blocks,
+	       DIV_ROUND_UP(rb.nr_moves, DMZ_REBALANCE_BATCH));
+	if (dev->flags & DMZ_DRY_RUN) {
+		printf("Chunk occupancy after rebalancing:\n");
+		dmz_rebalance_print(dev, &rb);
+		ret = 0;
+		goto out;
+	}
+	fflush(stdout);
+
+	rb.jobs = calloc(DMZ_REBALANCE_BATCH, sizeof(struct dmz_mover_job));
+	rb.stats = calloc(dev->nr_bdev, sizeof(struct dmz_mover_stats));
+	if (!rb.jobs || !rb.stats) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	start = dmz_usec();
+	for (i = 0; i < rb.nr_moves; i += DMZ_REBALANCE_BATCH) {
+		rb.batch_start = i;
+		rb.batch_end = i + DMZ_REBALANCE_BATCH;
+		if (rb.batch_end > rb.nr_moves)
+			rb.batch_end = rb.nr_moves;
+
+		/* Only the data zone moves, the buffer zone stays mapped */
+		for (j = rb.batch_start; j < rb.batch_end; j++) {
+			mv = &rb.moves[j];
+			job = &rb.jobs[j - rb.batch_start];
+			job->dzone_id = mv->src_zone_id;
+			job->bzone_id = DMZ_MAP_UNMAPPED;
+			job->dst_zone_id = mv->dst_zone_id;
+			job->dbm = mv->bm;
+			job->bbm = NULL;
+
+			/* Free zones may still hold stale data */
+			zone = &dev->zones[mv->dst_zone_id];
+			if (!dmz_zone_empty(zone) &&
+			    dmz_reset_zone(dev, zone) < 0) {
+				ret = -1;
+				goto out;
+			}
+			if (dev->flags & DMZ_VERBOSE)
+				printf("%s: moving chunk %u from %s zone %u "
+				       "to zone %u, %u valid blocks\n",
+				       dev->bdev[mv->dst_bdev].name,
+				       mv->chunk,
+				       dev->bdev[mv->src_bdev].name,
+				       mv->src_zone_id, mv->dst_zone_id,
+				       mv->bm->weight);
+		}
+
+		ret = dmz_mover_run(dev, rb.jobs, rb.batch_end - rb.batch_start,
+				    rb.stats);
+		if (ret < 0)
+			goto out;
+
+		ret = dmz_rebalance_commit(dev, &rb);
+		if (ret < 0)
+			goto out;
+
+		printf("Moved %u / %u chunks\n", rb.batch_end, rb.nr_moves);
+		fflush(stdout);
+	}
+	usec = dmz_usec() - start;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (!rb.stats[d].nr_write_ios)
+			continue;
+		printf("  %s: %llu blocks read in %llu IOs, "
+		       "%llu blocks written in %llu IOs\n",
+		       dev->bdev[d].name,
+		       rb.stats[d].nr_read_blocks, rb.stats[d].nr_read_ios,
+		       rb.stats[d].nr_written_blocks,
+		       rb.stats[d].nr_write_ios);
+	}
+
+	printf("Chunk occupancy after rebalancing:\n");
+	dmz_rebalance_print(dev, &rb);
+	printf("Rebalanced in %llu.%03llu s (%llu MB/s)\n",
+	       usec / 1000000, (usec % 1000000) / 1000,
+	       usec ? (rb.nr_move_blocks << DMZ_BLOCK_SHIFT) / usec : 0);
+
+out:
+	for (i = 0; i < rb.nr_moves; i++) {
+		dmz_bitmap_free(rb.moves[i].bm);
+		free(rb.moves[i].bitmap);
+	}
+	free(rb.moves);
+	if (rb.rdev) {
+		for (d = 0; d < dev->nr_bdev; d++)
+			free(rb.rdev[d].free_zones);
+	}
+	free(rb.rdev);
+	free(rb.jobs);
+	free(rb.stats);
+	dmz_txn_close(dev, &rb.txn);
+
+	return ret;
+}
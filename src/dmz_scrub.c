@@ -0,0 +1,340 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/*
+ * Maximum number of blocks read with a single IO (1 MiB).
+ */
+#define DMZ_SCRUB_IO_BLOCKS	256
+
+/*
+ * Mapped zone with valid blocks to scrub.
+ */
+struct dmz_scrub_zone {
+	unsigned int		zone_id;
+	unsigned int		chunk;
+	bool			buffer;
+	struct dmz_bitmap	*bm;
+};
+
+/*
+ * Per block device scrub statistics.
+ */
+struct dmz_scrub_stats {
+	unsigned long long	nr_blocks;
+	unsigned long long	nr_ios;
+	unsigned long long	nr_bad_blocks;
+	unsigned int		nr_bad_extents;
+	unsigned long long	usec;
+};
+
+/*
+ * Scrub context.
+ */
+struct dmz_scrub {
+	struct dmz_meta_set	mset[3];
+	struct dmz_scrub_zone	*zones;
+	unsigned int		nr_zones;
+	unsigned long long	nr_valid_blocks;
+	struct dmz_scrub_stats	*stats;
+};
+
+/*
+ * Add a mapped zone with valid blocks to the list of zones to scrub.
+ */
+static int dmz_scrub_add_zone(struct dmz_dev *dev, struct dmz_scrub *scrub,
+			      struct dmz_meta_set *mset, unsigned int chunk,
+			      unsigned int zone_id, bool buffer)
+{
+	struct dmz_scrub_zone *sz;
+	struct dmz_bitmap *bm;
+
+	if (zone_id >= dev->nr_zones) {
+		fprintf(stderr,
+			"Chunk %u: invalid %s zone ID %u, "
+			"run check first\n",
+			chunk, buffer ? "buffer" : "data", zone_id);
+		return -1;
+	}
+
+	bm = dmz_bitmap_read_zone(dev, mset, zone_id);
+	if (!bm)
+		return -1;
+
+	if (!bm->weight) {
+		dmz_bitmap_free(bm);
+		return 0;
+	}
+
+	sz = &scrub->zones[scrub->nr_zones];
+	sz->zone_id = zone_id;
+	sz->chunk = chunk;
+	sz->buffer = buffer;
+	sz->bm = bm;
+	scrub->nr_zones++;
+	scrub->nr_valid_blocks += bm->weight;
+
+	return 0;
+}
+
+/*
+ * Load the metadata and the bitmaps of all mapped zones.
+ */
+static int dmz_scrub_load(struct dmz_dev *dev, struct dmz_scrub *scrub)
+{
+	struct dmz_meta_set *mset;
+	unsigned int chunk, dzone_id, bzone_id;
+
+	memset(scrub->mset, 0, sizeof(struct dmz_meta_set) * 3);
+	scrub->mset[1].id = 1;
+	scrub->mset[2].id = 2;
+
+	if (dmz_check_superblocks(dev, scrub->mset) < 0)
+		return -1;
+
+	mset = dmz_validate_meta_set(dev, scrub->mset);
+	if (!mset)
+		return -1;
+
+	printf("Scrubbing using the %s metadata set\n",
+	       mset->id == 0 ? "primary" : "secondary");
+
+	if (dmz_read_map_blocks(dev, mset) < 0)
+		return -1;
+
+	/* At most a data zone and a buffer zone per chunk */
+	scrub->zones = calloc(dev->nr_chunks * 2,
+			      sizeof(struct dmz_scrub_zone));
+	scrub->stats = calloc(dev->nr_bdev, sizeof(struct dmz_scrub_stats));
+	if (!scrub->zones || !scrub->stats) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+		dmz_get_chunk_mapping(dev, mset, chunk, &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		if (dmz_scrub_add_zone(dev, scrub, mset, chunk,
+				       dzone_id, false) < 0)
+			return -1;
+		if (bzone_id != DMZ_MAP_UNMAPPED &&
+		    dmz_scrub_add_zone(dev, scrub, mset, chunk,
+				       bzone_id, true) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Report an extent of unreadable blocks of a zone.
+ */
+static void dmz_scrub_report(struct dmz_dev *dev, struct dmz_scrub_zone *sz,
+			     unsigned int block, unsigned int nr_blocks,
+			     struct dmz_scrub_stats *stats)
+{
+	struct blk_zone *zone = &dev->zones[sz->zone_id];
+	struct dmz_block_dev *bdev;
+	__u64 sector;
+
+	bdev = dmz_sector_to_bdev(dev, dmz_zone_sector(zone) +
+				  dmz_blk2sect((__u64)block), &sector);
+
+	printf("%s: chunk %u, %s zone %u, sector %llu: "
+	       "%u unreadable block%s at logical sector %llu\n",
+	       bdev->name, sz->chunk, sz->buffer ? "buffer" : "data",
+	       sz->zone_id, sector, nr_blocks, nr_blocks > 1 ? "s" : "",
+	       dmz_blk2sect((__u64)sz->chunk * dev->zone_nr_blocks + block));
+
+	stats->nr_bad_extents++;
+	stats->nr_bad_blocks += nr_blocks;
+}
+
+/*
+ * Read an extent of valid blocks of a zone. If the read fails, retry
+ * block by block to report only the unreadable blocks.
+ */
+static void dmz_scrub_read(struct dmz_dev *dev, int fd, __u8 *buf,
+			   struct dmz_scrub_zone *sz, unsigned int block,
+			   unsigned int nr_blocks,
+			   struct dmz_scrub_stats *stats)
+{
+	struct blk_zone *zone = &dev->zones[sz->zone_id];
+	size_t size = (size_t)nr_blocks << DMZ_BLOCK_SHIFT;
+	unsigned int b, bad = 0;
+	__u64 sector;
+	ssize_t ret;
+
+	dmz_sector_to_bdev(dev, dmz_zone_sector(zone) +
+			   dmz_blk2sect((__u64)block), &sector);
+
+	stats->nr_ios++;
+	stats->nr_blocks += nr_blocks;
+	ret = pread(fd, buf, size, sector << 9);
+	if (ret == (ssize_t)size)
+		return;
+
+	for (b = 0; b < nr_blocks; b++) {
+		ret = pread(fd, buf, DMZ_BLOCK_SIZE,
+			    (sector + dmz_blk2sect((__u64)b)) << 9);
+		if (ret != DMZ_BLOCK_SIZE) {
+			bad++;
+			continue;
+		}
+		if (bad) {
+			dmz_scrub_report(dev, sz, block + b - bad, bad, stats);
+			bad = 0;
+		}
+	}
+	if (bad)
+		dmz_scrub_report(dev, sz, block + b - bad, bad, stats);
+}
+
+/*
+ * Scrub the valid blocks of all mapped zones of a block device.
+ */
+static int dmz_scrub_bdev(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_scrub *scrub = arg;
+	struct dmz_scrub_stats *stats = &scrub->stats[d];
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned long long start, elapsed, expected;
+	struct dmz_scrub_zone *sz;
+	unsigned int i, b, nr;
+	__u8 *buf;
+	int fd;
+
+	/* Read the media, not the page cache */
+	fd = open(bdev->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			bdev->path,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	buf = dmz_malloc_buf(DMZ_SCRUB_IO_BLOCKS * DMZ_BLOCK_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory\n");
+		close(fd);
+		return -1;
+	}
+
+	start = dmz_usec();
+	for (i = 0; i < scrub->nr_zones; i++) {
+		sz = &scrub->zones[i];
+		if (dmz_zone_to_bdev(dev, &dev->zones[sz->zone_id]) != bdev)
+			continue;
+
+		if (dev->flags & DMZ_VVERBOSE)
+			printf("%s: scrubbing %s zone %u of chunk %u, "
+			       "%u valid blocks\n",
+			       bdev->name, sz->buffer ? "buffer" : "data",
+			       sz->zone_id, sz->chunk, sz->bm->weight);
+
+		/* Merge adjacent valid blocks into large reads */
+		b = dmz_bitmap_next(sz->bm, 0);
+		while (b < sz->bm->nr_bits) {
+			nr = 1;
+			while (nr < DMZ_SCRUB_IO_BLOCKS &&
+			       b + nr < sz->bm->nr_bits &&
+			       dmz_bitmap_test(sz->bm, b + nr))
+				nr++;
+
+			dmz_scrub_read(dev, fd, buf, sz, b, nr, stats);
+
+			/* Throttle to the bandwidth limit (MB/s) */
+			if (dev->scrub_mbps) {
+				expected = (stats->nr_blocks <<
+					    DMZ_BLOCK_SHIFT) / dev->scrub_mbps;
+				elapsed = dmz_usec() - start;
+				if (expected > elapsed)
+					usleep(expected - elapsed);
+			}
+
+			b = dmz_bitmap_next(sz->bm, b + nr);
+		}
+	}
+	stats->usec = dmz_usec() - start;
+
+	free(buf);
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * Read all valid blocks of the data and buffer zones of a formatted
+ * device to detect latent media errors. Fails if any block is unreadable.
+ */
+int dmz_scrub(struct dmz_dev *dev)
+{
+	struct dmz_scrub scrub;
+	struct dmz_scrub_stats *stats;
+	unsigned long long nr_bad_blocks = 0;
+	unsigned int i, nr_bad_extents = 0;
+	int d, ret = -1;
+
+	memset(&scrub, 0, sizeof(struct dmz_scrub));
+
+	if (dmz_scrub_load(dev, &scrub) < 0)
+		goto out;
+
+	printf("Scrubbing %llu valid blocks in %u zones",
+	       scrub.nr_valid_blocks, scrub.nr_zones);
+	if (dev->scrub_mbps)
+		printf(" (%u MB/s per device)", dev->scrub_mbps);
+	printf("\n");
+	fflush(stdout);
+
+	ret = dmz_run_bdev_workers(dev, dmz_scrub_bdev, &scrub);
+	if (ret < 0)
+		goto out;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		stats = &scrub.stats[d];
+		nr_bad_extents += stats->nr_bad_extents;
+		nr_bad_blocks += stats->nr_bad_blocks;
+		if (!stats->nr_ios)
+			continue;
+		printf("  %s: %llu blocks read in %llu IOs, %llu.%03llu s "
+		       "(%llu MB/s)\n",
+		       dev->bdev[d].name, stats->nr_blocks, stats->nr_ios,
+		       stats->usec / 1000000, (stats->usec % 1000000) / 1000,
+		       stats->usec ?
+		       (stats->nr_blocks << DMZ_BLOCK_SHIFT) / stats->usec : 0);
+	}
+
+	if (nr_bad_extents) {
+		printf("%llu unreadable block%s in %u extent%s\n",
+		       nr_bad_blocks, nr_bad_blocks > 1 ? "s" : "",
+		       nr_bad_extents, nr_bad_extents > 1 ? "s" : "");
+		ret = -1;
+	} else {
+		printf("No unreadable block found\n");
+	}
+
+out:
+	for (i = 0; i < scrub.nr_zones; i++)
+		dmz_bitmap_free(scrub.zones[i].bm);
+	free(scrub.zones);
+	free(scrub.stats);
+	free(scrub.mset[0].map_buf);
+	free(scrub.mset[1].map_buf);
+
+	return ret;
+}
@@ -0,0 +1,1060 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Default reclaim throughput per zoned device in MB/s (bytes per usec).
+ */
+#define DMZ_SIM_RECLAIM_MBPS	100
+
+/*
+ * The target is idle if no IO was issued during this time (the kernel
+ * DMZ_IDLE_PERIOD). Reclaim then runs at full speed.
+ */
+#define DMZ_SIM_IDLE_USEC	(10ULL * 1000000ULL)
+
+/*
+ * While the target is active, reclaim starts when the percentage of free
+ * cache zones falls below this value (the kernel DMZ_RECLAIM_LOW_UNMAP_ZONES).
+ */
+#define DMZ_SIM_RECLAIM_LOW	30
+
+/*
+ * Default synthetic workload parameters.
+ */
+#define DMZ_SIM_RATE_MBPS	100
+
+#define DMZ_SIM_MAX_CANDIDATES	32
+
+/*
+ * Zone classes.
+ */
+enum dmz_sim_zone_class {
+	DMZ_SIM_UNUSABLE = 0,
+	DMZ_SIM_CACHE,
+	DMZ_SIM_DATA,
+};
+
+/*
+ * Simulated zone state.
+ */
+struct dmz_sim_zone {
+	int			class;
+	bool			seq;
+	bool			buffer;
+	unsigned int		chunk;
+	unsigned int		wp_block;
+	unsigned int		weight;
+	unsigned long long	atime;
+	__u8			*bitmap;
+};
+
+/*
+ * Synthetic workload types.
+ */
+enum dmz_sim_wl_type {
+	DMZ_SIM_WL_RAND = 1,
+	DMZ_SIM_WL_SEQ,
+	DMZ_SIM_WL_MIXED,
+};
+
+/*
+ * Workload source: a blkparse text trace or a synthetic workload.
+ */
+struct dmz_sim_workload {
+	FILE			*trace;
+	int			type;
+	unsigned long long	bs;
+	unsigned long long	size;
+	unsigned long long	rate;
+
+	/* Synthetic workload state */
+	unsigned long long	done;
+	unsigned long long	seq_sector;
+	unsigned int		seed;
+};
+
+/*
+ * A host IO.
+ */
+struct dmz_sim_io {
+	unsigned long long	usec;
+	__u64			sector;
+	unsigned int		nr_sectors;
+	bool			write;
+	bool			discard;
+};
+
+/*
+ * Simulated target state and statistics.
+ */
+struct dmz_sim {
+	struct dmz_dev		*dev;
+	unsigned long long	bw;
+
+	unsigned int		nr_zones;
+	struct dmz_sim_zone	*zones;
+
+	unsigned int		nr_chunks;
+	unsigned int		*dzone;
+	unsigned int		*bzone;
+
+	unsigned int		nr_cache;
+	unsigned int		nr_free_cache;
+	unsigned int		*free_cache;
+	unsigned int		nr_free_data;
+	unsigned int		*free_data;
+
+	/* Time and reclaim progress */
+	unsigned long long	now;
+	unsigned long long	delay;
+	unsigned long long	last_io;
+	unsigned long long	credit;
+
+	/* Statistics */
+	unsigned long long	host_blocks;
+	unsigned long long	copy_blocks;
+	unsigned long long	zero_blocks;
+	unsigned long long	nr_reclaims;
+	unsigned long long	nr_stalls;
+	unsigned long long	stall_usec;
+	bool			exhausted;
+	unsigned long long	exhausted_usec;
+	unsigned long long	nr_failed;
+	unsigned int		min_free_cache;
+};
+
+/*
+ * Simple pseudo random number generator, so that all candidate
+ * configurations are simulated with exactly the same workload.
+ */
+static inline unsigned long long dmz_sim_rand(unsigned int *seed)
+{
+	unsigned long long r;
+
+	*seed = *seed * 1103515245 + 12345;
+	r = (*seed >> 1);
+	*seed = *seed * 1103515245 + 12345;
+	return (r << 31) | (*seed >> 1);
+}
+
+/*
+ * Parse a synthetic workload description:
+ * <type>[,bs=<size>][,size=<size>][,rate=<MB/s>]
+ */
+static int dmz_sim_parse_workload(struct dmz_dev *dev,
+				  struct dmz_sim_workload *wl)
+{
+	char *str = dev->sim_workload, *p;
+
+	if (strncmp(str, "rand", 4) == 0) {
+		wl->type = DMZ_SIM_WL_RAND;
+		wl->bs = DMZ_BLOCK_SIZE;
+		str += 4;
+	} else if (strncmp(str, "seq", 3) == 0) {
+		wl->type = DMZ_SIM_WL_SEQ;
+		wl->bs = 1024 * 1024;
+		str += 3;
+	} else if (strncmp(str, "mixed", 5) == 0) {
+		wl->type = DMZ_SIM_WL_MIXED;
+		wl->bs = 64 * 1024;
+		str += 5;
+	} else {
+		goto err;
+	}
+
+	wl->size = dev->capacity << 9;
+	wl->rate = DMZ_SIM_RATE_MBPS;
+
+	while (*str == ',') {
+		str++;
+		if (strncmp(str, "bs=", 3) == 0) {
+			wl->bs = dmz_parse_size(str + 3, &p);
+		} else if (strncmp(str, "size=", 5) == 0) {
+			wl->size = dmz_parse_size(str + 5, &p);
+		} else if (strncmp(str, "rate=", 5) == 0) {
+			wl->rate = strtoull(str + 5, &p, 10);
+		} else {
+			goto err;
+		}
+		str = p;
+	}
+
+	if (*str != '\0' || !wl->size || !wl->rate ||
+	    !wl->bs || wl->bs & (DMZ_BLOCK_SIZE - 1))
+		goto err;
+
+	return 0;
+
+err:
+	fprintf(stderr,
+		"Invalid workload \"%s\"\n",
+		dev->sim_workload);
+	return -1;
+}
+
+/*
+ * Get the next host IO of the workload. Return 1 if an IO was
+ * returned, 0 at the end of the workload and -1 on error.
+ */
+static int dmz_sim_next_io(struct dmz_sim_workload *wl, __u64 capacity,
+			   struct dmz_sim_io *io)
+{
+	unsigned long long sector, nr_sectors;
+	char line[512], action[16], rwbs[16];
+	double t;
+
+	if (wl->trace) {
+		while (fgets(line, sizeof(line), wl->trace)) {
+			/*
+			 * blkparse default output format:
+			 * maj,min cpu seq time pid action rwbs sector + nsect
+			 */
+			if (sscanf(line, "%*s %*d %*u %lf %*d %15s %15s %llu + %llu",
+				   &t, action, rwbs, &sector, &nr_sectors) != 5)
+				continue;
+			if (strcmp(action, "Q") != 0 || !nr_sectors)
+				continue;
+			io->usec = t * 1000000.0;
+			io->write = strchr(rwbs, 'W') != NULL;
+			io->discard = strchr(rwbs, 'D') != NULL;
+			/* Traces of other devices are wrapped around */
+			sector %= capacity;
+			if (sector + nr_sectors > capacity)
+				nr_sectors = capacity - sector;
+			io->sector = sector;
+			io->nr_sectors = nr_sectors;
+			return 1;
+		}
+		if (ferror(wl->trace)) {
+			fprintf(stderr, "Read trace failed\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (wl->done >= wl->size)
+		return 0;
+
+	nr_sectors = wl->bs >> 9;
+	if (wl->type == DMZ_SIM_WL_RAND ||
+	    (wl->type == DMZ_SIM_WL_MIXED && dmz_sim_rand(&wl->seed) & 1)) {
+		sector = dmz_sim_rand(&wl->seed) % (capacity / nr_sectors);
+		sector *= nr_sectors;
+	} else {
+		if (wl->seq_sector + nr_sectors > capacity)
+			wl->seq_sector = 0;
+		sector = wl->seq_sector;
+		wl->seq_sector += nr_sectors;
+	}
+
+	io->usec = wl->done / wl->rate;
+	io->sector = sector;
+	io->nr_sectors = nr_sectors;
+	io->write = true;
+	io->discard = false;
+	wl->done += wl->bs;
+
+	return 1;
+}
+
+/*
+ * Rewind a workload.
+ */
+static void dmz_sim_rewind(struct dmz_sim_workload *wl)
+{
+	if (wl->trace)
+		rewind(wl->trace);
+	wl->done = 0;
+	wl->seq_sector = 0;
+	wl->seed = 1;
+}
+
+/*
+ * Percentage of free cache zones.
+ */
+static inline unsigned int dmz_sim_free_pct(struct dmz_sim *sim)
+{
+	return sim->nr_free_cache * 100 / sim->nr_cache;
+}
+
+/*
+ * Validate or invalidate blocks of a zone, allocating the zone bitmap
+ * on first use.
+ */
+static int dmz_sim_set_blocks(struct dmz_sim *sim, unsigned int zid,
+			      unsigned int block, unsigned int nr_blocks,
+			      bool valid)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+	unsigned int b;
+
+	if (!zone->bitmap) {
+		if (!valid)
+			return 0;
+		zone->bitmap = calloc(1, sim->dev->zone_nr_blocks >> 3);
+		if (!zone->bitmap) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+	}
+
+	for (b = block; b < block + nr_blocks; b++) {
+		if (valid && !dmz_test_bit(zone->bitmap, b)) {
+			dmz_set_bit(zone->bitmap, b);
+			zone->weight++;
+		} else if (!valid && dmz_test_bit(zone->bitmap, b)) {
+			dmz_clear_bit(zone->bitmap, b);
+			zone->weight--;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Return the first (@last false) or last (@last true) valid block of
+ * a zone, or zone_nr_blocks if the zone has no valid block.
+ */
+static unsigned int dmz_sim_valid_block(struct dmz_sim *sim,
+					unsigned int zid, bool last)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+	unsigned int nr_blocks = sim->dev->zone_nr_blocks;
+	unsigned int b;
+
+	if (!zone->weight)
+		return nr_blocks;
+
+	for (b = 0; b < nr_blocks; b++) {
+		unsigned int bit = last ? nr_blocks - 1 - b : b;
+
+		if (!zone->bitmap[bit >> 3]) {
+			b += last ? bit & 0x7 : 7 - (bit & 0x7);
+			continue;
+		}
+		if (dmz_test_bit(zone->bitmap, bit))
+			return bit;
+	}
+
+	return nr_blocks;
+}
+
+/*
+ * Free a zone.
+ */
+static void dmz_sim_free_zone(struct dmz_sim *sim, unsigned int zid)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+
+	if (zone->bitmap)
+		memset(zone->bitmap, 0, sim->dev->zone_nr_blocks >> 3);
+	zone->weight = 0;
+	zone->wp_block = 0;
+	zone->buffer = false;
+	zone->chunk = DMZ_MAP_UNMAPPED;
+
+	if (zone->class == DMZ_SIM_CACHE)
+		sim->free_cache[sim->nr_free_cache++] = zid;
+	else
+		sim->free_data[sim->nr_free_data++] = zid;
+}
+
+/*
+ * Allocate a cache zone.
+ */
+static unsigned int dmz_sim_alloc_cache(struct dmz_sim *sim)
+{
+	if (!sim->nr_free_cache)
+		return DMZ_MAP_UNMAPPED;
+
+	sim->nr_free_cache--;
+	if (dmz_sim_free_pct(sim) < sim->min_free_cache)
+		sim->min_free_cache = dmz_sim_free_pct(sim);
+	if (!sim->nr_free_cache && !sim->exhausted) {
+		sim->exhausted = true;
+		sim->exhausted_usec = sim->now;
+	}
+
+	return sim->free_cache[sim->nr_free_cache];
+}
+
+/*
+ * Return true if the buffer zone @zid of a chunk has valid blocks before
+ * the chunk data zone write pointer, that is, if the buffer zone cannot
+ * be merged into the data zone.
+ */
+static inline bool dmz_sim_need_merge(struct dmz_sim *sim, unsigned int zid)
+{
+	struct dmz_sim_zone *dzone =
+		&sim->zones[sim->dzone[sim->zones[zid].chunk]];
+
+	return dmz_sim_valid_block(sim, zid, false) < dzone->wp_block;
+}
+
+/*
+ * Get the next reclaim victim: the least recently used cache zone
+ * with data that can be reclaimed. Zones of @busy_chunk are skipped.
+ */
+static unsigned int dmz_sim_get_victim(struct dmz_sim *sim,
+				       unsigned int busy_chunk)
+{
+	struct dmz_sim_zone *zone;
+	unsigned int i, victim = DMZ_MAP_UNMAPPED;
+
+	for (i = 0; i < sim->nr_zones; i++) {
+		zone = &sim->zones[i];
+		if (zone->class != DMZ_SIM_CACHE ||
+		    zone->chunk == DMZ_MAP_UNMAPPED ||
+		    zone->chunk == busy_chunk)
+			continue;
+		if (victim != DMZ_MAP_UNMAPPED &&
+		    zone->atime >= sim->zones[victim].atime)
+			continue;
+
+		/*
+		 * Reclaiming a cache data zone that is not empty needs
+		 * a free data zone.
+		 */
+		if (!sim->nr_free_data && zone->weight && !zone->buffer)
+			continue;
+
+		victim = i;
+	}
+
+	return victim;
+}
+
+/*
+ * Copy the valid blocks of zone @src to zone @dst.
+ */
+static int dmz_sim_copy(struct dmz_sim *sim, unsigned int src,
+			unsigned int dst)
+{
+	struct dmz_sim_zone *szone = &sim->zones[src];
+	struct dmz_sim_zone *dzone = &sim->zones[dst];
+	unsigned int i;
+
+	if (!szone->weight)
+		return 0;
+
+	if (!dzone->bitmap) {
+		dzone->bitmap = calloc(1, sim->dev->zone_nr_blocks >> 3);
+		if (!dzone->bitmap) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < sim->dev->zone_nr_blocks >> 3; i++) {
+		dzone->weight += __builtin_popcount(szone->bitmap[i] &
+						    ~dzone->bitmap[i]);
+		dzone->bitmap[i] |= szone->bitmap[i];
+	}
+	sim->copy_blocks += szone->weight;
+
+	return 0;
+}
+
+/*
+ * Advance the write pointer of a sequential zone after copying valid
+ * blocks to it, accounting for the blocks written to fill the gaps
+ * between the copied blocks.
+ */
+static void dmz_sim_fill(struct dmz_sim *sim, unsigned int zid,
+			 unsigned int old_weight)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+	unsigned int last = dmz_sim_valid_block(sim, zid, true);
+
+	if (!zone->seq || last >= sim->dev->zone_nr_blocks ||
+	    last < zone->wp_block)
+		return;
+
+	sim->zero_blocks += last + 1 - zone->wp_block -
+		(zone->weight - old_weight);
+	zone->wp_block = last + 1;
+}
+
+/*
+ * Reclaim a cache zone, as the kernel does. If the zone is a buffer zone,
+ * either merge it into its data zone if all its valid blocks are after the
+ * data zone write pointer, or merge the data zone into it so that it becomes
+ * the chunk data zone. If the zone is a data zone, move its valid blocks to
+ * a free data zone.
+ */
+static int dmz_sim_reclaim(struct dmz_sim *sim, unsigned int zid)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+	unsigned int chunk = zone->chunk;
+	unsigned int dzid = sim->dzone[chunk];
+	unsigned int szid, weight;
+
+	sim->nr_reclaims++;
+
+	if (!zone->weight) {
+		/* Empty zone: unmap it */
+		if (zone->buffer)
+			sim->bzone[chunk] = DMZ_MAP_UNMAPPED;
+		else
+			sim->dzone[chunk] = DMZ_MAP_UNMAPPED;
+		dmz_sim_free_zone(sim, zid);
+		return 0;
+	}
+
+	if (zone->buffer) {
+		sim->bzone[chunk] = DMZ_MAP_UNMAPPED;
+		if (!dmz_sim_need_merge(sim, zid)) {
+			/* Merge the buffer zone into the data zone */
+			weight = sim->zones[dzid].weight;
+			if (dmz_sim_copy(sim, zid, dzid) < 0)
+				return -1;
+			dmz_sim_fill(sim, dzid, weight);
+			dmz_sim_free_zone(sim, zid);
+			return 0;
+		}
+
+		/* Merge the data zone into the buffer zone */
+		if (dmz_sim_copy(sim, dzid, zid) < 0)
+			return -1;
+		zone->buffer = false;
+		sim->dzone[chunk] = zid;
+		dmz_sim_free_zone(sim, dzid);
+		return 0;
+	}
+
+	/* Move the data zone valid blocks to a free data zone */
+	szid = sim->free_data[--sim->nr_free_data];
+	if (dmz_sim_copy(sim, zid, szid) < 0)
+		return -1;
+	dmz_sim_fill(sim, szid, 0);
+	sim->zones[szid].chunk = chunk;
+	sim->zones[szid].atime = sim->now;
+	sim->dzone[chunk] = szid;
+	dmz_sim_free_zone(sim, zid);
+
+	return 0;
+}
+
+/*
+ * Reclaim cost in usec: valid blocks are read and written.
+ */
+static unsigned long long dmz_sim_reclaim_cost(struct dmz_sim *sim,
+					       unsigned int zid)
+{
+	struct dmz_sim_zone *zone = &sim->zones[zid];
+	unsigned long long blocks = zone->weight;
+
+	if (zone->buffer && dmz_sim_need_merge(sim, zid))
+		blocks = sim->zones[sim->dzone[zone->chunk]].weight;
+
+	return blocks * DMZ_BLOCK_SIZE * 2 / sim->bw;
+}
+
+/*
+ * Run background reclaim until @usec: reclaim runs at full speed when the
+ * target is idle and throttled when the target is active and the number of
+ * free cache zones is low.
+ */
+static int dmz_sim_background_reclaim(struct dmz_sim *sim,
+				      unsigned long long usec)
+{
+	unsigned long long idle, cost, elapsed;
+	unsigned int victim, pct;
+
+	while (sim->now < usec) {
+		idle = sim->last_io + DMZ_SIM_IDLE_USEC;
+		pct = dmz_sim_free_pct(sim);
+		if (sim->now < idle && pct > DMZ_SIM_RECLAIM_LOW) {
+			/* Nothing to do until the target becomes idle */
+			sim->credit = 0;
+			sim->now = idle < usec ? idle : usec;
+			continue;
+		}
+
+		if (sim->now >= idle && pct == 100)
+			break;
+
+		victim = dmz_sim_get_victim(sim, DMZ_MAP_UNMAPPED);
+		if (victim == DMZ_MAP_UNMAPPED)
+			break;
+
+		cost = dmz_sim_reclaim_cost(sim, victim);
+		if (sim->now < idle)
+			cost = cost * 100 / (100 - pct);
+		elapsed = usec - sim->now;
+		if (sim->credit + elapsed < cost) {
+			sim->credit += elapsed;
+			break;
+		}
+
+		if (sim->credit >= cost) {
+			sim->credit -= cost;
+		} else {
+			sim->now += cost - sim->credit;
+			sim->credit = 0;
+		}
+		if (dmz_sim_reclaim(sim, victim) < 0)
+			return -1;
+	}
+
+	sim->now = usec;
+
+	return 0;
+}
+
+/*
+ * Get a free cache zone for @chunk, reclaiming zones synchronously
+ * (stalling host IOs) if no cache zone is free. @zid is set to
+ * DMZ_MAP_UNMAPPED if no cache zone can be freed.
+ */
+static int dmz_sim_get_cache(struct dmz_sim *sim, unsigned int chunk,
+			     unsigned int *zid)
+{
+	unsigned long long cost;
+	unsigned int victim;
+	bool stalled = false;
+
+	*zid = DMZ_MAP_UNMAPPED;
+	while (!sim->nr_free_cache) {
+		victim = dmz_sim_get_victim(sim, chunk);
+		if (victim == DMZ_MAP_UNMAPPED)
+			return 0;
+		cost = dmz_sim_reclaim_cost(sim, victim);
+		if (cost > sim->credit)
+			cost -= sim->credit;
+		else
+			cost = 0;
+		sim->credit = 0;
+		sim->now += cost;
+		sim->delay += cost;
+		sim->stall_usec += cost;
+		if (!stalled) {
+			sim->nr_stalls++;
+			stalled = true;
+		}
+		if (dmz_sim_reclaim(sim, victim) < 0)
+			return -1;
+	}
+
+	*zid = dmz_sim_alloc_cache(sim);
+
+	return 0;
+}
+
+/*
+ * Process a write or discard of @nr_blocks blocks at @block of @chunk.
+ */
+static int dmz_sim_chunk_io(struct dmz_sim *sim, struct dmz_sim_io *io,
+			    unsigned int chunk, unsigned int block,
+			    unsigned int nr_blocks)
+{
+	struct dmz_sim_zone *zone;
+	unsigned int dzid, bzid;
+
+	dzid = sim->dzone[chunk];
+	bzid = sim->bzone[chunk];
+
+	if (io->discard) {
+		if (dzid != DMZ_MAP_UNMAPPED &&
+		    dmz_sim_set_blocks(sim, dzid, block, nr_blocks, false) < 0)
+			return -1;
+		if (bzid != DMZ_MAP_UNMAPPED &&
+		    dmz_sim_set_blocks(sim, bzid, block, nr_blocks, false) < 0)
+			return -1;
+		return 0;
+	}
+
+	if (dzid == DMZ_MAP_UNMAPPED) {
+		/* New chunk: map it to a cache zone */
+		if (dmz_sim_get_cache(sim, chunk, &dzid) < 0)
+			return -1;
+		if (dzid == DMZ_MAP_UNMAPPED)
+			goto nospc;
+		sim->zones[dzid].chunk = chunk;
+		sim->dzone[chunk] = dzid;
+	}
+
+	zone = &sim->zones[dzid];
+	if (!zone->seq || block == zone->wp_block) {
+		/* Direct write */
+		if (zone->seq)
+			zone->wp_block = block + nr_blocks;
+		zone->atime = sim->now;
+		if (bzid != DMZ_MAP_UNMAPPED &&
+		    dmz_sim_set_blocks(sim, bzid, block, nr_blocks, false) < 0)
+			return -1;
+		return dmz_sim_set_blocks(sim, dzid, block, nr_blocks, true);
+	}
+
+	/* Buffered write */
+	if (bzid == DMZ_MAP_UNMAPPED) {
+		if (dmz_sim_get_cache(sim, chunk, &bzid) < 0)
+			return -1;
+		if (bzid == DMZ_MAP_UNMAPPED)
+			goto nospc;
+		sim->zones[bzid].chunk = chunk;
+		sim->zones[bzid].buffer = true;
+		sim->bzone[chunk] = bzid;
+	}
+	sim->zones[bzid].atime = sim->now;
+	if (dmz_sim_set_blocks(sim, dzid, block, nr_blocks, false) < 0)
+		return -1;
+	return dmz_sim_set_blocks(sim, bzid, block, nr_blocks, true);
+
+nospc:
+	/* No cache zone can be freed: the write fails */
+	sim->nr_failed++;
+	return 0;
+}
+
+/*
+ * Process a host IO.
+ */
+static int dmz_sim_io(struct dmz_sim *sim, struct dmz_sim_io *io)
+{
+	unsigned long long block, end;
+	unsigned int chunk, nr_blocks;
+
+	if (dmz_sim_background_reclaim(sim, io->usec + sim->delay) < 0)
+		return -1;
+	sim->last_io = sim->now;
+
+	if (!io->write && !io->discard)
+		return 0;
+
+	block = dmz_sect2blk(io->sector);
+	end = dmz_sect2blk(io->sector + io->nr_sectors + 7);
+	if (io->write)
+		sim->host_blocks += end - block;
+
+	while (block < end) {
+		chunk = block / sim->dev->zone_nr_blocks;
+		if (chunk >= sim->nr_chunks)
+			break;
+		nr_blocks = sim->dev->zone_nr_blocks -
+			(block % sim->dev->zone_nr_blocks);
+		if (nr_blocks > end - block)
+			nr_blocks = end - block;
+		if (dmz_sim_chunk_io(sim, io, chunk,
+				     block % sim->dev->zone_nr_blocks,
+				     nr_blocks) < 0)
+			return -1;
+		block += nr_blocks;
+	}
+
+	return 0;
+}
+
+/*
+ * Free a simulation resources.
+ */
+static void dmz_sim_free(struct dmz_sim *sim)
+{
+	unsigned int i;
+
+	if (sim->zones) {
+		for (i = 0; i < sim->nr_zones; i++)
+			free(sim->zones[i].bitmap);
+	}
+	free(sim->zones);
+	free(sim->dzone);
+	free(sim->bzone);
+	free(sim->free_cache);
+	free(sim->free_data);
+}
+
+/*
+ * Initialize the simulation of a freshly formatted target using the
+ * emulated device @edev with its metadata located.
+ */
+static int dmz_sim_init(struct dmz_sim *sim, struct dmz_dev *edev,
+			unsigned long long bw)
+{
+	unsigned int i, sb_zid, nr_zoned = 0;
+	struct dmz_block_dev *bdev;
+	struct dmz_sim_zone *zone;
+	struct blk_zone *blkz;
+
+	memset(sim, 0, sizeof(struct dmz_sim));
+	sim->dev = edev;
+	sim->nr_zones = edev->nr_zones;
+	sim->nr_chunks = edev->nr_chunks;
+	sim->min_free_cache = 100;
+
+	sim->zones = calloc(sim->nr_zones, sizeof(struct dmz_sim_zone));
+	sim->dzone = malloc(sim->nr_chunks * sizeof(unsigned int));
+	sim->bzone = malloc(sim->nr_chunks * sizeof(unsigned int));
+	sim->free_cache = malloc(sim->nr_zones * sizeof(unsigned int));
+	sim->free_data = malloc(sim->nr_zones * sizeof(unsigned int));
+	if (!sim->zones || !sim->dzone || !sim->bzone ||
+	    !sim->free_cache || !sim->free_data) {
+		fprintf(stderr, "Not enough memory\n");
+		dmz_sim_free(sim);
+		return -1;
+	}
+
+	for (i = 0; i < sim->nr_chunks; i++) {
+		sim->dzone[i] = DMZ_MAP_UNMAPPED;
+		sim->bzone[i] = DMZ_MAP_UNMAPPED;
+	}
+
+	/*
+	 * Metadata zones and the tertiary super block zone of the
+	 * secondary devices are not usable.
+	 */
+	sb_zid = dmz_zone_id(edev, edev->sb_zone);
+	for (i = 0; i < sim->nr_zones; i++) {
+		zone = &sim->zones[i];
+		blkz = &edev->zones[i];
+		bdev = dmz_zone_to_bdev(edev, blkz);
+		if ((i >= sb_zid && i < sb_zid + edev->total_nr_meta_zones) ||
+		    (bdev != &edev->bdev[0] &&
+		     dmz_sect2blk(dmz_zone_sector(blkz)) == bdev->block_offset) ||
+		    dmz_zone_cond(blkz) == BLK_ZONE_COND_READONLY ||
+		    dmz_zone_cond(blkz) == BLK_ZONE_COND_OFFLINE)
+			continue;
+		if (dmz_zone_is_cache(edev, blkz)) {
+			zone->class = DMZ_SIM_CACHE;
+			sim->nr_cache++;
+		} else {
+			zone->class = DMZ_SIM_DATA;
+			zone->seq = dmz_zone_seq_req(blkz);
+			nr_zoned++;
+		}
+	}
+
+	if (!sim->nr_cache || !nr_zoned) {
+		fprintf(stderr, "%s: No usable cache or data zone\n",
+			edev->label);
+		dmz_sim_free(sim);
+		return -1;
+	}
+
+	/* Free zones are allocated from the start of the devices */
+	for (i = sim->nr_zones; i > 0; i--) {
+		zone = &sim->zones[i - 1];
+		if (zone->class != DMZ_SIM_UNUSABLE)
+			dmz_sim_free_zone(sim, i - 1);
+	}
+
+	/* Reclaim runs in parallel on all zoned devices */
+	for (i = 0; i < (unsigned int)edev->nr_bdev; i++) {
+		if (dmz_bdev_is_zoned(&edev->bdev[i]))
+			sim->bw += bw;
+	}
+
+	return 0;
+}
+
+/*
+ * Simulate a candidate configuration and print the results.
+ */
+static int dmz_sim_run(struct dmz_dev *dev, struct dmz_sim_workload *wl,
+		       __u64 cache_capacity, unsigned int nr_reserved_seq)
+{
+	struct dmz_dev edev;
+	struct dmz_sim sim;
+	struct dmz_sim_io io;
+	unsigned long long wa;
+	char cache[32], exhausted[32];
+	int ret;
+
+	if (cache_capacity)
+		snprintf(cache, sizeof(cache), "%llu GiB",
+			 (cache_capacity << 9) / (1024ULL * 1024ULL * 1024ULL));
+	else
+		strcpy(cache, "none");
+
+	if (dmz_emulate_dev(dev, &edev, cache_capacity) < 0)
+		return -1;
+	edev.nr_reserved_seq = nr_reserved_seq;
+	if (dmz_locate_metadata(&edev) < 0) {
+		printf("  %-9s %5u  invalid configuration\n",
+		       cache, nr_reserved_seq);
+		dmz_free_emulated_dev(&edev);
+		return 0;
+	}
+
+	ret = dmz_sim_init(&sim, &edev, dev->sim_reclaim_mbps);
+	if (ret)
+		goto out;
+
+	dmz_sim_rewind(wl);
+	while ((ret = dmz_sim_next_io(wl, (__u64)sim.nr_chunks *
+				      edev.zone_nr_sectors, &io)) > 0) {
+		ret = dmz_sim_io(&sim, &io);
+		if (ret)
+			break;
+	}
+	if (ret)
+		goto out_free;
+
+	if (sim.exhausted)
+		snprintf(exhausted, sizeof(exhausted), "%llu s",
+			 sim.exhausted_usec / 1000000ULL);
+	else
+		strcpy(exhausted, "never");
+	wa = 100;
+	if (sim.host_blocks)
+		wa = (sim.host_blocks + sim.copy_blocks + sim.zero_blocks) *
+			100 / sim.host_blocks;
+
+	printf("  %-9s %5u %8u %6u %7u%% %10s %8llu %8llu.%03llu %10llu %3llu.%02llu",
+	       cache, edev.nr_reserved_seq, sim.nr_chunks, sim.nr_cache,
+	       sim.min_free_cache, exhausted,
+	       sim.nr_stalls, sim.stall_usec / 1000000ULL,
+	       (sim.stall_usec % 1000000ULL) / 1000ULL,
+	       ((sim.copy_blocks + sim.zero_blocks) * DMZ_BLOCK_SIZE) /
+	       1000000ULL,
+	       wa / 100, wa % 100);
+	if (sim.nr_failed)
+		printf("  %llu failed writes", sim.nr_failed);
+	printf("\n");
+
+out_free:
+	dmz_sim_free(&sim);
+out:
+	dmz_free_emulated_dev(&edev);
+
+	return ret;
+}
+
+/*
+ * Parse a comma separated list of values.
+ */
+static int dmz_sim_parse_list(const char *opt, char *str,
+			      unsigned long long *vals, bool size)
+{
+	int nr = 0;
+	char *p;
+
+	while (*str) {
+		if (nr >= DMZ_SIM_MAX_CANDIDATES) {
+			fprintf(stderr, "Too many %s values\n", opt);
+			return -1;
+		}
+		if (size) {
+			if (strncmp(str, "none", 4) == 0) {
+				vals[nr] = 0;
+				p = str + 4;
+			} else {
+				vals[nr] = dmz_parse_size(str, &p);
+				if (p == str || (!vals[nr] && *str != '0'))
+					goto err;
+			}
+		} else {
+			vals[nr] = strtoul(str, &p, 10);
+			if (p == str || !vals[nr])
+				goto err;
+		}
+		nr++;
+		if (*p == ',')
+			p++;
+		else if (*p)
+			goto err;
+		str = p;
+	}
+
+	return nr;
+
+err:
+	fprintf(stderr, "Invalid %s value list\n", opt);
+	return -1;
+}
+
+/*
+ * Simulate the target behavior with a trace or a synthetic workload
+ * for different cache device sizes and numbers of reserved sequential
+ * zones.
+ */
+int dmz_simulate(struct dmz_dev *dev)
+{
+	unsigned long long caches[DMZ_SIM_MAX_CANDIDATES];
+	unsigned long long seqs[DMZ_SIM_MAX_CANDIDATES];
+	struct dmz_sim_workload wl;
+	int c, s, nr_caches = 1, nr_seqs = 1;
+	int ret = 0;
+
+	if (!dev->sim_trace && !dev->sim_workload) {
+		fprintf(stderr,
+			"A trace or a workload must be specified\n");
+		return -1;
+	}
+
+	/* By default, simulate the current configuration */
+	caches[0] = dev->nr_bdev > 1 ? dev->bdev[0].capacity : 0;
+	if (dev->sim_cache) {
+		nr_caches = dmz_sim_parse_list("--cache", dev->sim_cache,
+					       caches, true);
+		if (nr_caches <= 0)
+			return -1;
+		for (c = 0; c < nr_caches; c++)
+			caches[c] >>= 9;
+	}
+	seqs[0] = dev->nr_reserved_seq;
+	if (dev->sim_seq) {
+		nr_seqs = dmz_sim_parse_list("--seq", dev->sim_seq,
+					     seqs, false);
+		if (nr_seqs <= 0)
+			return -1;
+	}
+	if (!dev->sim_reclaim_mbps)
+		dev->sim_reclaim_mbps = DMZ_SIM_RECLAIM_MBPS;
+
+	memset(&wl, 0, sizeof(struct dmz_sim_workload));
+	if (dev->sim_trace) {
+		if (strcmp(dev->sim_trace, "-") == 0)
+			wl.trace = stdin;
+		else
+			wl.trace = fopen(dev->sim_trace, "r");
+		if (!wl.trace) {
+			fprintf(stderr,
+				"Open %s failed %d (%s)\n",
+				dev->sim_trace,
+				errno, strerror(errno));
+			return -1;
+		}
+		if (wl.trace == stdin && nr_caches * nr_seqs > 1) {
+			fprintf(stderr,
+				"A trace read from stdin can be used only "
+				"for a single configuration\n");
+			return -1;
+		}
+		printf("Simulating trace %s\n", dev->sim_trace);
+	} else {
+		if (dmz_sim_parse_workload(dev, &wl) < 0)
+			return -1;
+		printf("Simulating workload %s\n", dev->sim_workload);
+	}
+	printf("  Reclaim throughput: %u MB/s per zoned device\n",
+	       dev->sim_reclaim_mbps);
+
+	printf("  %-9s %5s %8s %6s %8s %10s %8s %12s %10s %6s\n",
+	       "Cache", "Seq", "Chunks", "Cache", "Min free",
+	       "Exhausted", "Stalls", "Stall time", "Reclaim MB", "WA");
+
+	for (c = 0; c < nr_caches; c++) {
+		for (s = 0; s < nr_seqs; s++) {
+			ret = dmz_sim_run(dev, &wl, caches[c], seqs[s]);
+			if (ret)
+				goto out;
+		}
+	}
+
+out:
+	if (wl.trace && wl.trace != stdin)
+		fclose(wl.trace);
+
+	return ret;
+}
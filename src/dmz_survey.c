@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/sysmacros.h>
+
+/*
+ * Default number of bands per block device.
+ */
+#define DMZ_SURVEY_NR_BANDS	64
+
+/*
+ * Amount of data read from the sampled zone of a band, and IO size.
+ */
+#define DMZ_SURVEY_SAMPLE_SIZE	(16 * 1024 * 1024)
+#define DMZ_SURVEY_IO_SIZE	(1024 * 1024)
+
+/*
+ * Bands are compared against the median of their neighbours of the same
+ * type (up to DMZ_SURVEY_WINDOW bands on each side) rather than against
+ * the whole device, since throughput naturally drops from the outer to
+ * the inner tracks of disks. A band is slow if its throughput is less
+ * than 1/DMZ_SURVEY_SLOW_DIV of the median, and has latency outliers if
+ * an IO took more than DMZ_SURVEY_LAT_MUL times the median latency.
+ */
+#define DMZ_SURVEY_WINDOW	2
+#define DMZ_SURVEY_SLOW_DIV	2
+#define DMZ_SURVEY_LAT_MUL	10
+
+static const char *dmz_survey_flag_names[] = {
+	"slow",
+	"latency",
+	"error",
+	"unsampled",
+};
+
+/*
+ * Read the start of the sampled zone of a band.
+ */
+static void dmz_survey_sample(struct dmz_dev *dev, int fd, __u8 *buf,
+			      struct blk_zone *zone,
+			      struct dmz_survey_band *band)
+{
+	unsigned long long t, usecs = 0, nr_ios = 0;
+	__u64 sector, len, ofst;
+	ssize_t ret;
+
+	dmz_sector_to_bdev(dev, dmz_zone_sector(zone), &sector);
+	len = dmz_zone_capacity(zone) << 9;
+	if (len > DMZ_SURVEY_SAMPLE_SIZE)
+		len = DMZ_SURVEY_SAMPLE_SIZE;
+
+	for (ofst = 0; ofst + DMZ_SURVEY_IO_SIZE <= len;
+	     ofst += DMZ_SURVEY_IO_SIZE) {
+		t = dmz_usec();
+		ret = pread(fd, buf, DMZ_SURVEY_IO_SIZE, (sector << 9) + ofst);
+		t = dmz_usec() - t;
+		if (ret != DMZ_SURVEY_IO_SIZE) {
+			/*
+			 * Host-managed devices may not allow reading
+			 * sequential zones above the write pointer.
+			 */
+			if (!dmz_zone_rnd(zone) &&
+			    dmz_zone_sector(zone) + (ofst >> 9) >=
+			    dmz_zone_wp_sector(zone))
+				break;
+			band->flags |= DMZ_SURVEY_ERROR;
+			continue;
+		}
+		nr_ios++;
+		usecs += t;
+		if (t > band->lat_max)
+			band->lat_max = t;
+	}
+
+	if (!nr_ios) {
+		band->flags |= DMZ_SURVEY_UNSAMPLED;
+		return;
+	}
+
+	band->mbps = nr_ios * DMZ_SURVEY_IO_SIZE / (usecs ? usecs : 1);
+	band->lat_avg = usecs / nr_ios;
+}
+
+/*
+ * Split the zones of a block device into bands of zones of the same type.
+ */
+static int dmz_survey_get_bands(struct dmz_dev *dev, int d,
+				struct dmz_survey_dev *sdev)
+{
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned int first = bdev->block_offset / dev->zone_nr_blocks;
+	unsigned int i, band_zones, nr_bands = dev->survey_nr_bands;
+	struct dmz_survey_band *band = NULL;
+	bool cache;
+
+	if (!nr_bands)
+		nr_bands = DMZ_SURVEY_NR_BANDS;
+	band_zones = DIV_ROUND_UP(bdev->nr_zones, nr_bands);
+
+	/* Type changes may add bands */
+	sdev->bands = calloc(bdev->nr_zones, sizeof(struct dmz_survey_band));
+	if (!sdev->bands) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	snprintf(sdev->name, sizeof(sdev->name), "%s", bdev->name);
+	sdev->nr_zones = bdev->nr_zones;
+
+	for (i = 0; i < bdev->nr_zones; i++) {
+		cache = dmz_zone_unknown(&dev->zones[first + i]) ||
+			dmz_zone_conv(&dev->zones[first + i]);
+		if (!band || band->nr_zones >= band_zones ||
+		    band->cache != cache) {
+			band = &sdev->bands[sdev->nr_bands++];
+			band->zone = i;
+			band->cache = cache;
+		}
+		band->nr_zones++;
+	}
+
+	return 0;
+}
+
+/*
+ * Survey the bands of a block device.
+ */
+static int dmz_survey_bdev(struct dmz_dev *dev, int d, void *arg)
+{
+	struct dmz_survey_dev *sdev = (struct dmz_survey_dev *)arg + d;
+	struct dmz_block_dev *bdev = &dev->bdev[d];
+	unsigned int first = bdev->block_offset / dev->zone_nr_blocks;
+	struct dmz_survey_band *band;
+	struct blk_zone *zone;
+	unsigned int b, i;
+	__u8 *buf;
+	int fd;
+
+	if (dmz_survey_get_bands(dev, d, sdev) < 0)
+		return -1;
+
+	/* Measure the media, not the page cache */
+	fd = open(bdev->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			bdev->path,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	buf = dmz_malloc_buf(DMZ_SURVEY_IO_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory\n");
+		close(fd);
+		return -1;
+	}
+
+	for (b = 0; b < sdev->nr_bands; b++) {
+		band = &sdev->bands[b];
+
+		/* Sample the first usable zone from the middle of the band */
+		zone = NULL;
+		for (i = band->nr_zones / 2; i < band->nr_zones; i++) {
+			zone = &dev->zones[first + band->zone + i];
+			if (dmz_zone_cond(zone) != BLK_ZONE_COND_OFFLINE)
+				break;
+			zone = NULL;
+		}
+		if (!zone) {
+			band->flags |= DMZ_SURVEY_UNSAMPLED;
+			continue;
+		}
+
+		dmz_survey_sample(dev, fd, buf, zone, band);
+	}
+
+	free(buf);
+	close(fd);
+
+	return 0;
+}
+
+static int dmz_survey_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(unsigned long long *)a;
+	unsigned long long y = *(unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Flag the bands that are slow or have latency outliers compared
+ * to their neighbours.
+ */
+static void dmz_survey_flag(struct dmz_survey_dev *sdev)
+{
+	unsigned long long mbps[DMZ_SURVEY_WINDOW * 2 + 1];
+	unsigned long long lat[DMZ_SURVEY_WINDOW * 2 + 1];
+	struct dmz_survey_band *band, *nb;
+	unsigned int b, n;
+	int i;
+
+	for (b = 0; b < sdev->nr_bands; b++) {
+		band = &sdev->bands[b];
+		if (band->flags & DMZ_SURVEY_UNSAMPLED)
+			continue;
+
+		n = 0;
+		for (i = -DMZ_SURVEY_WINDOW; i <= DMZ_SURVEY_WINDOW; i++) {
+			if ((int)b + i < 0 || b + i >= sdev->nr_bands)
+				continue;
+			nb = &sdev->bands[b + i];
+			if (nb->cache != band->cache ||
+			    (nb->flags & DMZ_SURVEY_UNSAMPLED))
+				continue;
+			mbps[n] = nb->mbps;
+			lat[n] = nb->lat_avg;
+			n++;
+		}
+		qsort(mbps, n, sizeof(unsigned long long), dmz_survey_cmp);
+		qsort(lat, n, sizeof(unsigned long long), dmz_survey_cmp);
+
+		if (band->mbps * DMZ_SURVEY_SLOW_DIV < mbps[n / 2])
+			band->flags |= DMZ_SURVEY_SLOW;
+		if (band->lat_max > lat[n / 2] * DMZ_SURVEY_LAT_MUL)
+			band->flags |= DMZ_SURVEY_LAT;
+	}
+}
+
+/*
+ * Get the names of the flags of a band.
+ */
+static char *dmz_survey_flags_str(unsigned int flags, char *str, size_t len)
+{
+	unsigned int f;
+	int n = 0;
+
+	str[0] = '\0';
+	for (f = 0; f < ARRAY_SIZE(dmz_survey_flag_names); f++) {
+		if (flags & (1 << f))
+			n += snprintf(str + n, len - n, "%s%s",
+				      n ? "," : "", dmz_survey_flag_names[f]);
+	}
+	if (!n)
+		snprintf(str, len, "-");
+
+	return str;
+}
+
+static unsigned int dmz_survey_parse_flags(char *str)
+{
+	unsigned int f, flags = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (f = 0; f < ARRAY_SIZE(dmz_survey_flag_names); f++) {
+			if (strcmp(tok, dmz_survey_flag_names[f]) == 0)
+				flags |= 1 << f;
+		}
+	}
+
+	return flags;
+}
+
+/*
+ * Print the survey results of a block device.
+ */
+static void dmz_survey_print(struct dmz_dev *dev, struct dmz_survey_dev *sdev)
+{
+	struct dmz_survey_band *band;
+	unsigned int b, nr_flagged = 0;
+	char flags[64];
+
+	printf("%s: %u bands\n", sdev->name, sdev->nr_bands);
+	for (b = 0; b < sdev->nr_bands; b++) {
+		band = &sdev->bands[b];
+		if (band->flags & ~DMZ_SURVEY_UNSAMPLED)
+			nr_flagged++;
+		if (!band->flags && !(dev->flags & DMZ_VERBOSE))
+			continue;
+		printf("  Zones %u-%u (%s): %llu MB/s, latency %llu us avg, "
+		       "%llu us max, %s\n",
+		       band->zone, band->zone + band->nr_zones - 1,
+		       band->cache ? "cache" : "sequential",
+		       band->mbps, band->lat_avg, band->lat_max,
+		       dmz_survey_flags_str(band->flags, flags,
+					    sizeof(flags)));
+	}
+
+	if (nr_flagged)
+		printf("  %u flagged band%s\n",
+		       nr_flagged, nr_flagged > 1 ? "s" : "");
+	else
+		printf("  No slow or degraded band\n");
+}
+
+/*
+ * Get the identity of a block device in survey profiles: its serial
+ * number, with the partition number for a partition, which does not
+ * change across reboots, or its kernel name if it has no serial number.
+ */
+static void dmz_survey_bdev_id(struct dmz_block_dev *bdev,
+			       char *id, size_t len)
+{
+	char path[128], *serial, *c;
+	unsigned int part = 0;
+	FILE *f;
+
+	serial = dmz_get_bdev_serial(bdev);
+	if (!serial) {
+		snprintf(id, len, "%s", bdev->name);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		 major(bdev->devno), minor(bdev->devno));
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%u", &part) != 1)
+			part = 0;
+		fclose(f);
+	}
+
+	if (part)
+		snprintf(id, len, "serial:%s-part%u", serial, part);
+	else
+		snprintf(id, len, "serial:%s", serial);
+	free(serial);
+
+	/* Keep the profile lines space separated */
+	for (c = id; *c; c++) {
+		if (isspace((unsigned char)*c))
+			*c = '_';
+	}
+}
+
+/*
+ * Save the survey profile of all block devices. Each device is keyed
+ * by its identity, its kernel name is informative only.
+ */
+static int dmz_survey_save(struct dmz_dev *dev, struct dmz_survey_dev *sdevs)
+{
+	struct dmz_survey_band *band;
+	unsigned int b;
+	char flags[64], id[128];
+	FILE *f;
+	int d;
+
+	f = fopen(dev->survey_profile, "w");
+	if (!f) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			dev->survey_profile,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "# dmzadm survey profile\n");
+	for (d = 0; d < dev->nr_bdev; d++) {
+		dmz_survey_bdev_id(&dev->bdev[d], id, sizeof(id));
+		fprintf(f, "device %s %s %u %u\n",
+			id, sdevs[d].name, sdevs[d].nr_zones,
+			sdevs[d].nr_bands);
+		for (b = 0; b < sdevs[d].nr_bands; b++) {
+			band = &sdevs[d].bands[b];
+			fprintf(f, "band %u %u %s %llu %llu %llu %s\n",
+				band->zone, band->nr_zones,
+				band->cache ? "cache" : "seq",
+				band->mbps, band->lat_avg, band->lat_max,
+				dmz_survey_flags_str(band->flags, flags,
+						     sizeof(flags)));
+		}
+	}
+
+	fclose(f);
+
+	printf("Survey profile saved to %s\n", dev->survey_profile);
+
+	return 0;
+}
+
+/*
+ * Load the bands of a block device from a survey profile.
+ * Return 0 if the block device is not in the profile.
+ */
+int dmz_survey_load(const char *path, struct dmz_block_dev *bdev,
+		    struct dmz_survey_dev *sdev)
+{
+	struct dmz_survey_band *band;
+	char line[256], id[128], str[128], name[64], type[16], flags[64];
+	unsigned int b = 0;
+	bool found = false;
+	FILE *f;
+
+	memset(sdev, 0, sizeof(struct dmz_survey_dev));
+	dmz_survey_bdev_id(bdev, id, sizeof(id));
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+
+		if (strncmp(line, "device ", 7) == 0) {
+			if (found)
+				break;
+			if (sscanf(line, "device %127s %63s %u %u", str, name,
+				   &sdev->nr_zones, &sdev->nr_bands) != 4)
+				goto err;
+			if (strcmp(str, id) != 0)
+				continue;
+			sdev->bands = calloc(sdev->nr_bands,
+					     sizeof(struct dmz_survey_band));
+			if (!sdev->bands) {
+				fprintf(stderr, "Not enough memory\n");
+				fclose(f);
+				return -1;
+			}
+			snprintf(sdev->name, sizeof(sdev->name), "%s", name);
+			found = true;
+			continue;
+		}
+
+		if (!found)
+			continue;
+
+		if (b >= sdev->nr_bands)
+			goto err;
+		band = &sdev->bands[b++];
+		if (sscanf(line, "band %u %u %15s %llu %llu %llu %63s",
+			   &band->zone, &band->nr_zones, type,
+			   &band->mbps, &band->lat_avg, &band->lat_max,
+			   flags) != 7)
+			goto err;
+		band->cache = strcmp(type, "cache") == 0;
+		band->flags = dmz_survey_parse_flags(flags);
+	}
+
+	fclose(f);
+
+	if (!found) {
+		sdev->nr_bands = 0;
+		return 0;
+	}
+
+	if (b != sdev->nr_bands)
+		goto err_free;
+
+	return 1;
+
+err:
+	fclose(f);
+err_free:
+	fprintf(stderr, "%s: Invalid survey profile\n", path);
+	free(sdev->bands);
+	sdev->bands = NULL;
+	sdev->nr_bands = 0;
+
+	return -1;
+}
+
+/*
+ * Sample the sequential read throughput and latency of bands of zones
+ * of all block devices and flag slow or degraded bands.
+ */
+int dmz_survey(struct dmz_dev *dev)
+{
+	struct dmz_survey_dev *sdevs;
+	int d, ret;
+
+	sdevs = calloc(dev->nr_bdev, sizeof(struct dmz_survey_dev));
+	if (!sdevs) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	printf("Surveying device%s\n", dev->nr_bdev > 1 ? "s" : "");
+	fflush(stdout);
+
+	ret = dmz_run_bdev_workers(dev, dmz_survey_bdev, sdevs);
+	if (ret < 0)
+		goto out;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		dmz_survey_flag(&sdevs[d]);
+		dmz_survey_print(dev, &sdevs[d]);
+	}
+
+	if (dev->survey_profile)
+		ret = dmz_survey_save(dev, sdevs);
+
+out:
+	for (d = 0; d < dev->nr_bdev; d++)
+		free(sdevs[d].bands);
+	free(sdevs);
+
+	return ret;
+}
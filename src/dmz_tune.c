@@ -0,0 +1,464 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+/*
+ * I/O priority (not defined by glibc).
+ */
+#define DMZ_IOPRIO_WHO_PROCESS		1
+#define DMZ_IOPRIO_CLASS_SHIFT		13
+#define DMZ_IOPRIO_PRIO_VALUE(c, d)	(((c) << DMZ_IOPRIO_CLASS_SHIFT) | (d))
+
+static const char *dmz_tune_ioprio_names[] = {
+	"none",
+	"rt",
+	"be",
+	"idle",
+};
+
+/*
+ * Tuning profile types.
+ */
+enum dmz_tune_type {
+	DMZ_TUNE_ZONED = 0,
+	DMZ_TUNE_REGULAR,
+	DMZ_TUNE_DM,
+	DMZ_TUNE_NR_TYPES,
+};
+
+static const char *dmz_tune_type_names[DMZ_TUNE_NR_TYPES] = {
+	"zoned",
+	"regular",
+	"dm",
+};
+
+/*
+ * Tuning profile. Empty strings and negative values leave the
+ * corresponding setting unchanged. The scheduler is a comma separated
+ * list of schedulers, by order of preference.
+ */
+struct dmz_tune_profile {
+	char	scheduler[64];
+	int	nr_requests;
+	int	read_ahead_kb;
+	char	write_cache[16];
+	int	ioprio_class;
+};
+
+/*
+ * Built-in profiles. Zoned block devices need a scheduler preserving the
+ * order of writes. The dm-zoned target issues large IOs to the regular
+ * block device, which does not need a scheduler. Sequential reads of the
+ * target benefit from a large read-ahead.
+ */
+static struct dmz_tune_profile dmz_tune_defaults[DMZ_TUNE_NR_TYPES] = {
+	{ "mq-deadline,deadline", -1, -1, "", -1 },
+	{ "none", -1, -1, "", -1 },
+	{ "", -1, 1024, "", -1 },
+};
+
+/*
+ * Parse a tuning profile configuration file. The file has a section
+ * per device type ("[zoned]", "[regular]" and "[dm]") with
+ * "<setting> = <value>" lines overriding the built-in profile.
+ */
+static int dmz_tune_parse(const char *path,
+			  struct dmz_tune_profile *profiles)
+{
+	struct dmz_tune_profile *p = NULL;
+	char line[256], *key, *val, *end;
+	unsigned int t, l = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		l++;
+		key = line;
+		while (isspace(*key))
+			key++;
+		end = key + strlen(key);
+		while (end > key && isspace(end[-1]))
+			*--end = '\0';
+		if (!*key || *key == '#')
+			continue;
+
+		if (*key == '[') {
+			p = NULL;
+			for (t = 0; t < DMZ_TUNE_NR_TYPES; t++) {
+				if (strlen(dmz_tune_type_names[t]) ==
+				    (size_t)(end - key - 2) &&
+				    strncmp(key + 1, dmz_tune_type_names[t],
+					    end - key - 2) == 0)
+					p = &profiles[t];
+			}
+			if (!p || end[-1] != ']')
+				goto err;
+			continue;
+		}
+
+		val = strchr(key, '=');
+		if (!p || !val)
+			goto err;
+		end = val;
+		while (end > key && isspace(end[-1]))
+			end--;
+		*end = '\0';
+		val++;
+		while (isspace(*val))
+			val++;
+
+		if (strcmp(key, "scheduler") == 0) {
+			if (strlen(val) >= sizeof(p->scheduler))
+				goto err;
+			strcpy(p->scheduler, val);
+		} else if (strcmp(key, "nr_requests") == 0) {
+			p->nr_requests = atoi(val);
+		} else if (strcmp(key, "read_ahead_kb") == 0) {
+			p->read_ahead_kb = atoi(val);
+		} else if (strcmp(key, "write_cache") == 0) {
+			if (strcmp(val, "write back") != 0 &&
+			    strcmp(val, "write through") != 0)
+				goto err;
+			strcpy(p->write_cache, val);
+		} else if (strcmp(key, "ioprio") == 0 &&
+			   p == &profiles[DMZ_TUNE_DM]) {
+			for (t = 0; t < ARRAY_SIZE(dmz_tune_ioprio_names); t++) {
+				if (strcmp(val, dmz_tune_ioprio_names[t]) == 0)
+					break;
+			}
+			if (t >= ARRAY_SIZE(dmz_tune_ioprio_names))
+				goto err;
+			p->ioprio_class = t;
+		} else {
+			goto err;
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+
+err:
+	fprintf(stderr, "%s: Invalid line %u\n", path, l);
+	fclose(f);
+
+	return -1;
+}
+
+/*
+ * Read a queue attribute of a block device.
+ */
+static int dmz_tune_get_attr(const char *name, const char *attr,
+			     char *val, size_t len)
+{
+	char path[128];
+	FILE *f;
+	char *p;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", name, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (!fgets(val, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	p = strchr(val, '\n');
+	if (p)
+		*p = '\0';
+
+	return 0;
+}
+
+/*
+ * Write a queue attribute of a block device.
+ */
+static int dmz_tune_set_attr(const char *name, const char *attr,
+			     const char *val)
+{
+	char path[128];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", name, attr);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	if (fprintf(f, "%s", val) < 0)
+		ret = -1;
+	if (fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Set a queue attribute if it differs from the profile.
+ * Return 1 if the attribute could not be set.
+ */
+static int dmz_tune_attr(struct dmz_dev *dev, const char *name,
+			 const char *attr, const char *val)
+{
+	char cur[128];
+
+	if (dmz_tune_get_attr(name, attr, cur, sizeof(cur)) < 0) {
+		printf("  %s: %s not available, expected %s\n",
+		       name, attr, val);
+		return 1;
+	}
+
+	if (strcmp(cur, val) == 0) {
+		if (dev->flags & DMZ_VERBOSE)
+			printf("  %s: %s %s\n", name, attr, val);
+		return 0;
+	}
+
+	if (dmz_tune_set_attr(name, attr, val) < 0) {
+		printf("  %s: set %s to %s failed %d (%s), using %s\n",
+		       name, attr, val, errno, strerror(errno), cur);
+		return 1;
+	}
+
+	printf("  %s: %s %s -> %s\n", name, attr, cur, val);
+
+	return 0;
+}
+
+static int dmz_tune_attr_int(struct dmz_dev *dev, const char *name,
+			     const char *attr, int val)
+{
+	char str[16];
+
+	snprintf(str, sizeof(str), "%d", val);
+
+	return dmz_tune_attr(dev, name, attr, str);
+}
+
+/*
+ * Test if a scheduler is in the list of available schedulers of a
+ * block device, e.g. "[mq-deadline] kyber none", and get the current
+ * scheduler (between brackets).
+ */
+static bool dmz_tune_has_scheduler(const char *avail, const char *sched,
+				   char *cur, size_t len)
+{
+	char list[256], *tok, *save, *end;
+	bool found = false;
+
+	snprintf(list, sizeof(list), "%s", avail);
+	for (tok = strtok_r(list, " ", &save); tok;
+	     tok = strtok_r(NULL, " ", &save)) {
+		if (*tok == '[') {
+			tok++;
+			end = strchr(tok, ']');
+			if (end)
+				*end = '\0';
+			snprintf(cur, len, "%s", tok);
+		}
+		if (strcmp(tok, sched) == 0)
+			found = true;
+	}
+
+	return found;
+}
+
+/*
+ * Select the first scheduler of the profile supported by a block device.
+ */
+static int dmz_tune_scheduler(struct dmz_dev *dev, const char *name,
+			      const char *schedulers)
+{
+	char avail[256], list[64], cur[64];
+	char *sched, *save;
+
+	if (dmz_tune_get_attr(name, "scheduler", avail, sizeof(avail)) < 0) {
+		printf("  %s: scheduler not available, expected %s\n",
+		       name, schedulers);
+		return 1;
+	}
+
+	cur[0] = '\0';
+	snprintf(list, sizeof(list), "%s", schedulers);
+	for (sched = strtok_r(list, ",", &save); sched;
+	     sched = strtok_r(NULL, ",", &save)) {
+		if (!dmz_tune_has_scheduler(avail, sched, cur, sizeof(cur)))
+			continue;
+		if (strcmp(cur, sched) == 0) {
+			if (dev->flags & DMZ_VERBOSE)
+				printf("  %s: scheduler %s\n", name, cur);
+			return 0;
+		}
+		if (dmz_tune_set_attr(name, "scheduler", sched) < 0) {
+			printf("  %s: set scheduler to %s failed %d (%s), "
+			       "using %s\n",
+			       name, sched, errno, strerror(errno), cur);
+			return 1;
+		}
+		printf("  %s: scheduler %s -> %s\n", name, cur, sched);
+		return 0;
+	}
+
+	printf("  %s: scheduler %s not available, using %s\n",
+	       name, schedulers, cur);
+
+	return 1;
+}
+
+/*
+ * Apply a tuning profile to a block device.
+ * Return the number of settings that could not be applied.
+ */
+static int dmz_tune_bdev(struct dmz_dev *dev, const char *name,
+			 struct dmz_tune_profile *p)
+{
+	int nr_dev = 0;
+
+	if (p->scheduler[0])
+		nr_dev += dmz_tune_scheduler(dev, name, p->scheduler);
+	if (p->nr_requests > 0)
+		nr_dev += dmz_tune_attr_int(dev, name, "nr_requests",
+					    p->nr_requests);
+	if (p->read_ahead_kb >= 0)
+		nr_dev += dmz_tune_attr_int(dev, name, "read_ahead_kb",
+					    p->read_ahead_kb);
+	if (p->write_cache[0])
+		nr_dev += dmz_tune_attr(dev, name, "write_cache",
+					p->write_cache);
+
+	return nr_dev;
+}
+
+/*
+ * Load the tuning profiles.
+ */
+static int dmz_tune_load(struct dmz_dev *dev,
+			 struct dmz_tune_profile *profiles)
+{
+	memcpy(profiles, dmz_tune_defaults, sizeof(dmz_tune_defaults));
+
+	if (dev->tune_profile &&
+	    dmz_tune_parse(dev->tune_profile, profiles) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Apply the tuning profiles to the block devices of a target
+ * before starting it.
+ */
+int dmz_tune_bdevs(struct dmz_dev *dev)
+{
+	struct dmz_tune_profile profiles[DMZ_TUNE_NR_TYPES];
+	struct dmz_block_dev *bdev;
+	int i, ioprio_class, nr_dev = 0;
+
+	if (dmz_tune_load(dev, profiles) < 0)
+		return -1;
+
+	printf("Tuning device%s\n", dev->nr_bdev > 1 ? "s" : "");
+	for (i = 0; i < dev->nr_bdev; i++) {
+		bdev = &dev->bdev[i];
+		nr_dev += dmz_tune_bdev(dev, bdev->name,
+			&profiles[dmz_bdev_is_zoned(bdev) ?
+				  DMZ_TUNE_ZONED : DMZ_TUNE_REGULAR]);
+	}
+
+	/*
+	 * The IOs of the kernel target are issued by kernel workers: the
+	 * I/O priority class can only be applied to the userspace target.
+	 */
+	ioprio_class = profiles[DMZ_TUNE_DM].ioprio_class;
+	if (ioprio_class >= 0) {
+		if (!(dev->flags & DMZ_UBLK)) {
+			printf("  ioprio %s not applicable to the kernel "
+			       "target\n",
+			       dmz_tune_ioprio_names[ioprio_class]);
+			nr_dev++;
+		} else if (syscall(SYS_ioprio_set, DMZ_IOPRIO_WHO_PROCESS, 0,
+			   DMZ_IOPRIO_PRIO_VALUE(ioprio_class, 0)) < 0) {
+			printf("  Set ioprio %s failed %d (%s)\n",
+			       dmz_tune_ioprio_names[ioprio_class],
+			       errno, strerror(errno));
+			nr_dev++;
+		} else {
+			printf("  ioprio %s\n",
+			       dmz_tune_ioprio_names[ioprio_class]);
+		}
+	}
+
+	if (nr_dev)
+		printf("  WARNING: %d setting%s differ%s from the tuning "
+		       "profile\n",
+		       nr_dev, nr_dev > 1 ? "s" : "", nr_dev > 1 ? "" : "s");
+
+	return 0;
+}
+
+/*
+ * Apply the tuning profile to a started target device.
+ */
+int dmz_tune_dm(struct dmz_dev *dev)
+{
+	struct dmz_tune_profile profiles[DMZ_TUNE_NR_TYPES];
+	char path[PATH_MAX], *dm_path;
+	int nr_dev;
+
+	if (dmz_tune_load(dev, profiles) < 0)
+		return -1;
+
+	/*
+	 * A target started with raw ioctls may not have its /dev/mapper
+	 * link created by udev yet.
+	 */
+	if (dev->dm_devno)
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+			 major(dev->dm_devno), minor(dev->dm_devno));
+	else
+		snprintf(path, sizeof(path), "/dev/mapper/%s", dev->label);
+	dm_path = realpath(path, NULL);
+	if (!dm_path) {
+		fprintf(stderr,
+			"Get %s real path failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	nr_dev = dmz_tune_bdev(dev, basename(dm_path),
+			       &profiles[DMZ_TUNE_DM]);
+	if (nr_dev)
+		printf("  WARNING: %s: %d setting%s differ%s from the tuning "
+		       "profile\n",
+		       dev->label, nr_dev, nr_dev > 1 ? "s" : "",
+		       nr_dev > 1 ? "" : "s");
+
+	free(dm_path);
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Load the metadata of a formatted target for offline modifications.
+ * Both metadata sets must be valid and have the same generation.
+ */
+int dmz_txn_open(struct dmz_dev *dev, struct dmz_txn *txn)
+{
+	memset(txn, 0, sizeof(struct dmz_txn));
+	txn->mset[1].id = 1;
+	txn->mset[2].id = 2;
+
+	if (dmz_check_superblocks(dev, txn->mset) < 0)
+		return -1;
+
+	if (!(txn->mset[0].flags & DMZ_MSET_SB_VALID) ||
+	    !(txn->mset[1].flags & DMZ_MSET_SB_VALID) ||
+	    txn->mset[0].gen != txn->mset[1].gen) {
+		fprintf(stderr,
+			"%s: Inconsistent metadata sets, run repair first\n",
+			dev->label);
+		return -1;
+	}
+	txn->gen = txn->mset[0].gen;
+
+	/* Metadata blocks are overwritten in place */
+	if (dmz_zone_seq_req(dev->sb_zone)) {
+		fprintf(stderr,
+			"%s: Metadata in sequential zones is not supported\n",
+			dev->label);
+		return -1;
+	}
+
+	/* Both sets share the same in-memory mapping table */
+	if (dmz_read_map_blocks(dev, &txn->mset[0]) < 0)
+		return -1;
+	txn->mset[1].map_buf = txn->mset[0].map_buf;
+
+	txn->map_dirty = calloc(dev->nr_map_blocks, sizeof(bool));
+	if (!txn->map_dirty) {
+		fprintf(stderr, "Not enough memory\n");
+		dmz_txn_close(dev, txn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the staged changes and free the metadata.
+ */
+void dmz_txn_close(struct dmz_dev *dev, struct dmz_txn *txn)
+{
+	unsigned int i;
+
+	for (i = 0; i < txn->nr_bitmaps; i++)
+		free(txn->bitmaps[i].buf);
+	free(txn->bitmaps);
+	free(txn->map_dirty);
+	free(txn->mset[0].map_buf);
+	memset(txn, 0, sizeof(struct dmz_txn));
+}
+
+/*
+ * Get a chunk mapping.
+ */
+void dmz_txn_get_mapping(struct dmz_dev *dev, struct dmz_txn *txn,
+			 unsigned int chunk, unsigned int *dzone_id,
+			 unsigned int *bzone_id)
+{
+	dmz_get_chunk_mapping(dev, &txn->mset[0], chunk, dzone_id, bzone_id);
+}
+
+/*
+ * Change a chunk mapping and mark its map block dirty.
+ */
+void dmz_txn_set_mapping(struct dmz_dev *dev, struct dmz_txn *txn,
+			 unsigned int chunk, unsigned int dzone_id,
+			 unsigned int bzone_id)
+{
+	unsigned int b = chunk / DMZ_MAP_ENTRIES;
+
+	dmz_set_chunk_mapping(dev, &txn->mset[0], chunk, dzone_id, bzone_id);
+	if (!txn->map_dirty[b]) {
+		txn->map_dirty[b] = true;
+		txn->nr_dirty_map_blocks++;
+	}
+}
+
+/*
+ * Stage a copy of the new bitmap of a zone. A NULL @buf clears the zone
+ * bitmap. Staging a zone bitmap again replaces the previous copy.
+ */
+int dmz_txn_set_bitmap(struct dmz_dev *dev, struct dmz_txn *txn,
+		       unsigned int zone_id, const __u8 *buf)
+{
+	size_t size = (size_t)dev->zone_nr_bitmap_blocks * DMZ_BLOCK_SIZE;
+	struct dmz_txn_bitmap *bitmaps;
+	unsigned int i;
+
+	for (i = 0; i < txn->nr_bitmaps; i++) {
+		if (txn->bitmaps[i].zone_id == zone_id)
+			break;
+	}
+
+	if (i == txn->nr_bitmaps) {
+		if (txn->nr_bitmaps == txn->max_bitmaps) {
+			bitmaps = realloc(txn->bitmaps,
+					  (txn->max_bitmaps + 64) *
+					  sizeof(struct dmz_txn_bitmap));
+			if (!bitmaps) {
+				fprintf(stderr, "Not enough memory\n");
+				return -1;
+			}
+			txn->bitmaps = bitmaps;
+			txn->max_bitmaps += 64;
+		}
+		txn->bitmaps[i].zone_id = zone_id;
+		txn->bitmaps[i].buf = malloc(size);
+		if (!txn->bitmaps[i].buf) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+		txn->nr_bitmaps++;
+	}
+
+	if (buf)
+		memcpy(txn->bitmaps[i].buf, buf, size);
+	else
+		memset(txn->bitmaps[i].buf, 0, size);
+
+	return 0;
+}
+
+/*
+ * Test if a transaction has staged changes.
+ */
+bool dmz_txn_dirty(struct dmz_txn *txn)
+{
+	return txn->nr_dirty_map_blocks || txn->nr_bitmaps;
+}
+
+/*
+ * Write the staged changes of a metadata set followed by its super block
+ * with the transaction generation, and flush all devices.
+ */
+static int dmz_txn_write_set(struct dmz_dev *dev, struct dmz_txn *txn,
+			     int s)
+{
+	struct dmz_meta_set *mset = &txn->mset[s];
+	unsigned int b, i;
+	__u64 offset;
+	int d;
+
+	for (b = 0; b < dev->nr_map_blocks; b++) {
+		if (!txn->map_dirty[b])
+			continue;
+		if (dmz_write_block(dev, mset->map_block + b,
+				    mset->map_buf + (b * DMZ_BLOCK_SIZE)) != 0) {
+			fprintf(stderr,
+				"Write map block %llu failed\n",
+				mset->map_block + b);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < txn->nr_bitmaps; i++) {
+		if (dmz_write_zone_bitmap(dev, mset, txn->bitmaps[i].zone_id,
+					  txn->bitmaps[i].buf) < 0)
+			return -1;
+	}
+
+	offset = s ? dev->nr_meta_zones * dev->zone_nr_blocks : 0;
+	/* Super blocks are written on every commit */
+	if (dmz_write_super(dev, txn->gen, offset, true) < 0)
+		return -1;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		if (fsync(dev->bdev[d].fd) < 0) {
+			fprintf(stderr, "%s: fsync failed %d (%s)\n",
+				dev->bdev[d].name, errno, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Commit the staged changes. The secondary set is written first with a
+ * new generation: until its super block is stable, the primary set holds
+ * the previous generation and is used. Once the secondary super block is
+ * stable, it has the highest generation and is used while the primary
+ * set is updated. The data referenced by the new mappings must be stable
+ * before calling this function.
+ */
+int dmz_txn_commit(struct dmz_dev *dev, struct dmz_txn *txn)
+{
+	unsigned int i;
+	int s;
+
+	if (!dmz_txn_dirty(txn))
+		return 0;
+
+	txn->gen++;
+	for (s = 1; s >= 0; s--) {
+		if (dmz_txn_write_set(dev, txn, s) < 0)
+			return -1;
+	}
+
+	memset(txn->map_dirty, 0, dev->nr_map_blocks * sizeof(bool));
+	txn->nr_dirty_map_blocks = 0;
+	for (i = 0; i < txn->nr_bitmaps; i++)
+		free(txn->bitmaps[i].buf);
+	txn->nr_bitmaps = 0;
+
+	return 0;
+}
@@ -0,0 +1,1417 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <liburing.h>
+#include <linux/ublk_cmd.h>
+
+/*
+ * Userspace implementation of the dm-zoned target IO path, served through
+ * the ublk driver. The on-disk metadata format is the one used by the
+ * dm-zoned kernel target: a device can be started either with the kernel
+ * target or with this userspace target.
+ */
+
+/*
+ * Newer kernels use ioctl encoded ublk commands.
+ */
+#ifdef UBLK_U_CMD_ADD_DEV
+#define DMZ_UBLK_CMD(op)	UBLK_U_CMD_##op
+#define DMZ_UBLK_IO(op)		UBLK_U_IO_##op
+#else
+#define DMZ_UBLK_CMD(op)	UBLK_CMD_##op
+#define DMZ_UBLK_IO(op)		UBLK_IO_##op
+#endif
+
+#define DMZ_UBLK_CTRL_DEV	"/dev/ublk-control"
+
+#define DMZ_UBLK_QUEUE_DEPTH	64
+#define DMZ_UBLK_MAX_IO_SIZE	(512 * 1024)
+#define DMZ_UBLK_COPY_SIZE	(1024 * 1024)
+
+/*
+ * Metadata is flushed at least every 10 seconds, as the kernel target does.
+ */
+#define DMZ_UBLK_FLUSH_USEC	10000000ULL
+
+/*
+ * Reclaim runs in the background when the target is idle
+ * and less than 50% of the cache zones are free.
+ */
+#define DMZ_UBLK_RECLAIM_LOW	50
+
+/*
+ * In-memory zone descriptor.
+ */
+struct dmz_ublk_zone {
+	unsigned int		chunk;
+	unsigned int		weight;
+	unsigned int		wp_block;
+	unsigned long long	atime;
+	__u8			*bitmap;
+	bool			seq;
+	bool			cache;
+	bool			unusable;
+	bool			pending;
+	bool			dirty;
+};
+
+struct dmz_ublk;
+
+/*
+ * Reclaim and cache zone allocation policy.
+ */
+struct dmz_ublk_policy {
+	const char	*name;
+
+	/* Select the chunk to reclaim (DMZ_MAP_UNMAPPED if none) */
+	unsigned int	(*select_victim)(struct dmz_ublk *ub);
+
+	/* Select a free cache zone (DMZ_MAP_UNMAPPED if none) */
+	unsigned int	(*alloc_cache_zone)(struct dmz_ublk *ub,
+					    unsigned int chunk);
+};
+
+/*
+ * Userspace target.
+ */
+struct dmz_ublk {
+	struct dmz_dev			*dev;
+	const struct dmz_ublk_policy	*policy;
+
+	/* Metadata */
+	struct dmz_txn			txn;
+	struct dmz_ublk_zone		*zones;
+	unsigned int			chunk_nr_blocks;
+	__u64				nr_blocks;
+	bool				dirty;
+	unsigned long long		flush_time;
+	unsigned int			alloc_next;
+	unsigned long long		nr_reclaimed;
+
+	/* Data IO */
+	int				*fd;
+	__u8				*copy_buf;
+	__u8				*zero_buf;
+
+	/* ublk device */
+	int				ctrl_fd;
+	int				cdev_fd;
+	int				dev_id;
+	bool				ctrl_ring_init;
+	bool				ring_init;
+	struct io_uring			ctrl_ring;
+	struct io_uring			ring;
+	struct ublksrv_io_desc		*iod;
+	size_t				iod_size;
+	__u8				*buf[DMZ_UBLK_QUEUE_DEPTH];
+
+	/* Device stop, issued while requests are still served */
+	pthread_t			stop_thread;
+	pthread_mutex_t			stop_lock;
+	bool				stop_started;
+	bool				stop_done;
+	int				stop_ret;
+};
+
+static volatile sig_atomic_t dmz_ublk_stop;
+
+static void dmz_ublk_sig_handler(int sig)
+{
+	dmz_ublk_stop = 1;
+}
+
+/*
+ * Read or write blocks of a zone using direct IOs.
+ */
+static int dmz_ublk_zone_io(struct dmz_ublk *ub, unsigned int zone_id,
+			    unsigned int block, unsigned int nr_blocks,
+			    __u8 *buf, bool write)
+{
+	struct dmz_dev *dev = ub->dev;
+	struct dmz_block_dev *bdev;
+	size_t size = (size_t)nr_blocks << DMZ_BLOCK_SHIFT;
+	__u64 sector;
+	ssize_t ret;
+	off_t ofst;
+	int fd;
+
+	bdev = dmz_sector_to_bdev(dev,
+				  dmz_zone_sector(&dev->zones[zone_id]) +
+				  dmz_blk2sect((__u64)block), &sector);
+	fd = ub->fd[bdev - dev->bdev];
+	ofst = sector << 9;
+
+	while (size) {
+		if (write)
+			ret = pwrite(fd, buf, size, ofst);
+		else
+			ret = pread(fd, buf, size, ofst);
+		if (ret <= 0) {
+			fprintf(stderr,
+				"%s: %s zone %u block %u failed %d (%s)\n",
+				bdev->name, write ? "Write" : "Read",
+				zone_id, block, errno, strerror(errno));
+			return -EIO;
+		}
+		buf += ret;
+		ofst += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Zone bitmap operations.
+ */
+static bool dmz_ublk_valid(struct dmz_ublk *ub, unsigned int zone_id,
+			   unsigned int block)
+{
+	struct dmz_ublk_zone *zone = &ub->zones[zone_id];
+
+	return zone->bitmap && dmz_test_bit(zone->bitmap, block);
+}
+
+static int dmz_ublk_validate(struct dmz_ublk *ub, unsigned int zone_id,
+			     unsigned int block, unsigned int nr_blocks)
+{
+	struct dmz_ublk_zone *zone = &ub->zones[zone_id];
+	unsigned int b;
+
+	if (!zone->bitmap) {
+		zone->bitmap = calloc(ub->dev->zone_nr_bitmap_blocks,
+				      DMZ_BLOCK_SIZE);
+		if (!zone->bitmap)
+			return -ENOMEM;
+	}
+
+	for (b = block; b < block + nr_blocks; b++) {
+		if (dmz_test_bit(zone->bitmap, b))
+			continue;
+		dmz_set_bit(zone->bitmap, b);
+		zone->weight++;
+	}
+	zone->dirty = true;
+	ub->dirty = true;
+
+	return 0;
+}
+
+static void dmz_ublk_invalidate(struct dmz_ublk *ub, unsigned int zone_id,
+				unsigned int block, unsigned int nr_blocks)
+{
+	struct dmz_ublk_zone *zone = &ub->zones[zone_id];
+	unsigned int b;
+
+	if (!zone->bitmap)
+		return;
+
+	for (b = block; b < block + nr_blocks; b++) {
+		if (!dmz_test_bit(zone->bitmap, b))
+			continue;
+		dmz_clear_bit(zone->bitmap, b);
+		zone->weight--;
+	}
+	zone->dirty = true;
+	ub->dirty = true;
+}
+
+/*
+ * Get the first valid block of a zone at or after @block.
+ */
+static unsigned int dmz_ublk_next_valid(struct dmz_ublk *ub,
+					unsigned int zone_id,
+					unsigned int block)
+{
+	while (block < ub->chunk_nr_blocks &&
+	       !dmz_ublk_valid(ub, zone_id, block))
+		block++;
+
+	return block;
+}
+
+/*
+ * Release a zone. The zone can be reused only once metadata
+ * not referencing it anymore is flushed.
+ */
+static void dmz_ublk_free_zone(struct dmz_ublk *ub, unsigned int zone_id)
+{
+	struct dmz_ublk_zone *zone = &ub->zones[zone_id];
+
+	if (zone->bitmap)
+		memset(zone->bitmap, 0,
+		       ub->dev->zone_nr_bitmap_blocks * DMZ_BLOCK_SIZE);
+	zone->weight = 0;
+	zone->chunk = DMZ_MAP_UNMAPPED;
+	zone->pending = true;
+	zone->dirty = true;
+	ub->dirty = true;
+}
+
+static bool dmz_ublk_zone_free(struct dmz_ublk_zone *zone)
+{
+	return !zone->unusable && !zone->pending &&
+		zone->chunk == DMZ_MAP_UNMAPPED;
+}
+
+static void dmz_ublk_get_mapping(struct dmz_ublk *ub, unsigned int chunk,
+				 unsigned int *dzone_id,
+				 unsigned int *bzone_id)
+{
+	dmz_txn_get_mapping(ub->dev, &ub->txn, chunk, dzone_id, bzone_id);
+}
+
+static void dmz_ublk_set_mapping(struct dmz_ublk *ub, unsigned int chunk,
+				 unsigned int dzone_id,
+				 unsigned int bzone_id)
+{
+	dmz_txn_set_mapping(ub->dev, &ub->txn, chunk, dzone_id, bzone_id);
+	if (dzone_id != DMZ_MAP_UNMAPPED)
+		ub->zones[dzone_id].chunk = chunk;
+	if (bzone_id != DMZ_MAP_UNMAPPED)
+		ub->zones[bzone_id].chunk = chunk;
+	ub->dirty = true;
+}
+
+/*
+ * Unmap the zones of a chunk that do not have any valid block.
+ */
+static void dmz_ublk_put_chunk(struct dmz_ublk *ub, unsigned int chunk)
+{
+	unsigned int dzone_id, bzone_id;
+
+	dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+	if (dzone_id == DMZ_MAP_UNMAPPED)
+		return;
+
+	if (bzone_id != DMZ_MAP_UNMAPPED && !ub->zones[bzone_id].weight) {
+		dmz_ublk_free_zone(ub, bzone_id);
+		bzone_id = DMZ_MAP_UNMAPPED;
+		dmz_ublk_set_mapping(ub, chunk, dzone_id, DMZ_MAP_UNMAPPED);
+	}
+
+	if (bzone_id == DMZ_MAP_UNMAPPED && !ub->zones[dzone_id].weight) {
+		dmz_ublk_free_zone(ub, dzone_id);
+		dmz_ublk_set_mapping(ub, chunk, DMZ_MAP_UNMAPPED,
+				     DMZ_MAP_UNMAPPED);
+	}
+}
+
+/*
+ * Commit the changed mappings and zone bitmaps with a metadata transaction.
+ */
+static int dmz_ublk_flush(struct dmz_ublk *ub)
+{
+	struct dmz_dev *dev = ub->dev;
+	struct dmz_ublk_zone *zone;
+	unsigned int i;
+
+	/* The data referenced by the metadata must be stable first */
+	for (i = 0; i < (unsigned int)dev->nr_bdev; i++) {
+		if (fdatasync(ub->fd[i]) < 0) {
+			fprintf(stderr, "%s: fdatasync failed %d (%s)\n",
+				dev->bdev[i].name, errno, strerror(errno));
+			return -EIO;
+		}
+	}
+
+	ub->flush_time = dmz_usec();
+	if (!ub->dirty)
+		return 0;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &ub->zones[i];
+		if (zone->dirty &&
+		    dmz_txn_set_bitmap(dev, &ub->txn, i, zone->bitmap) < 0)
+			return -EIO;
+	}
+	if (dmz_txn_commit(dev, &ub->txn) < 0)
+		return -EIO;
+
+	/* Released zones can now be reused */
+	for (i = 0; i < dev->nr_zones; i++) {
+		ub->zones[i].dirty = false;
+		ub->zones[i].pending = false;
+	}
+	ub->dirty = false;
+
+	return 0;
+}
+
+/*
+ * "lru" policy: reclaim the least recently written cache zone and
+ * allocate the first free cache zone.
+ */
+static unsigned int dmz_ublk_victim_lru(struct dmz_ublk *ub)
+{
+	unsigned int i, chunk = DMZ_MAP_UNMAPPED;
+	unsigned long long atime = ULLONG_MAX;
+	struct dmz_ublk_zone *zone;
+
+	for (i = 0; i < ub->dev->nr_zones; i++) {
+		zone = &ub->zones[i];
+		if (zone->cache && zone->chunk != DMZ_MAP_UNMAPPED &&
+		    zone->atime < atime) {
+			atime = zone->atime;
+			chunk = zone->chunk;
+		}
+	}
+
+	return chunk;
+}
+
+static unsigned int dmz_ublk_alloc_first(struct dmz_ublk *ub,
+					 unsigned int chunk)
+{
+	unsigned int i;
+
+	for (i = 0; i < ub->dev->nr_zones; i++) {
+		if (ub->zones[i].cache && dmz_ublk_zone_free(&ub->zones[i]))
+			return i;
+	}
+
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * "greedy" policy: reclaim the cache zone with the least valid blocks
+ * and allocate cache zones round-robin to spread writes.
+ */
+static unsigned int dmz_ublk_victim_greedy(struct dmz_ublk *ub)
+{
+	unsigned int i, weight = UINT_MAX, chunk = DMZ_MAP_UNMAPPED;
+	struct dmz_ublk_zone *zone;
+
+	for (i = 0; i < ub->dev->nr_zones; i++) {
+		zone = &ub->zones[i];
+		if (zone->cache && zone->chunk != DMZ_MAP_UNMAPPED &&
+		    zone->weight < weight) {
+			weight = zone->weight;
+			chunk = zone->chunk;
+		}
+	}
+
+	return chunk;
+}
+
+static unsigned int dmz_ublk_alloc_rr(struct dmz_ublk *ub,
+				      unsigned int chunk)
+{
+	unsigned int i, zone_id;
+
+	for (i = 0; i < ub->dev->nr_zones; i++) {
+		zone_id = (ub->alloc_next + i) % ub->dev->nr_zones;
+		if (ub->zones[zone_id].cache &&
+		    dmz_ublk_zone_free(&ub->zones[zone_id])) {
+			ub->alloc_next = zone_id + 1;
+			return zone_id;
+		}
+	}
+
+	return DMZ_MAP_UNMAPPED;
+}
+
+static const struct dmz_ublk_policy dmz_ublk_policies[] = {
+	{ "lru",	dmz_ublk_victim_lru,	dmz_ublk_alloc_first	},
+	{ "greedy",	dmz_ublk_victim_greedy,	dmz_ublk_alloc_rr	},
+	{ NULL,		NULL,			NULL			}
+};
+
+/*
+ * Get a free sequential zone, resetting it if needed.
+ */
+static unsigned int dmz_ublk_alloc_seq_zone(struct dmz_ublk *ub)
+{
+	struct dmz_dev *dev = ub->dev;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		if (!ub->zones[i].seq || !dmz_ublk_zone_free(&ub->zones[i]))
+			continue;
+		if (ub->zones[i].wp_block) {
+			if (dmz_reset_zone(dev, &dev->zones[i]) < 0)
+				continue;
+			ub->zones[i].wp_block = 0;
+		}
+		return i;
+	}
+
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * Copy the valid blocks of a zone to a sequential zone, starting from
+ * the sequential zone write pointer and filling holes with zeroes.
+ */
+static int dmz_ublk_copy_seq(struct dmz_ublk *ub, unsigned int src_id,
+			     unsigned int dst_id)
+{
+	struct dmz_ublk_zone *dst = &ub->zones[dst_id];
+	unsigned int max = DMZ_UBLK_COPY_SIZE >> DMZ_BLOCK_SHIFT;
+	unsigned int block, nr;
+	int ret;
+
+	block = dmz_ublk_next_valid(ub, src_id, dst->wp_block);
+	while (block < ub->chunk_nr_blocks) {
+
+		/* Fill the hole up to the next valid block */
+		while (dst->wp_block < block) {
+			nr = block - dst->wp_block;
+			if (nr > max)
+				nr = max;
+			ret = dmz_ublk_zone_io(ub, dst_id, dst->wp_block, nr,
+					       ub->zero_buf, true);
+			if (ret)
+				return ret;
+			dst->wp_block += nr;
+		}
+
+		nr = 1;
+		while (nr < max && block + nr < ub->chunk_nr_blocks &&
+		       dmz_ublk_valid(ub, src_id, block + nr))
+			nr++;
+
+		ret = dmz_ublk_zone_io(ub, src_id, block, nr,
+				       ub->copy_buf, false);
+		if (!ret)
+			ret = dmz_ublk_zone_io(ub, dst_id, block, nr,
+					       ub->copy_buf, true);
+		if (!ret)
+			ret = dmz_ublk_validate(ub, dst_id, block, nr);
+		if (ret)
+			return ret;
+		dst->wp_block = block + nr;
+
+		block = dmz_ublk_next_valid(ub, src_id, block + nr);
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the valid blocks of a zone that are not valid in a cache zone
+ * to the cache zone, merging runs of such blocks into large IOs.
+ */
+static int dmz_ublk_copy_rnd(struct dmz_ublk *ub, unsigned int src_id,
+			     unsigned int dst_id)
+{
+	unsigned int max = DMZ_UBLK_COPY_SIZE >> DMZ_BLOCK_SHIFT;
+	unsigned int block, nr;
+	int ret;
+
+	block = dmz_ublk_next_valid(ub, src_id, 0);
+	while (block < ub->chunk_nr_blocks) {
+		if (dmz_ublk_valid(ub, dst_id, block)) {
+			block = dmz_ublk_next_valid(ub, src_id, block + 1);
+			continue;
+		}
+
+		nr = 1;
+		while (nr < max && block + nr < ub->chunk_nr_blocks &&
+		       dmz_ublk_valid(ub, src_id, block + nr) &&
+		       !dmz_ublk_valid(ub, dst_id, block + nr))
+			nr++;
+
+		ret = dmz_ublk_zone_io(ub, src_id, block, nr,
+				       ub->copy_buf, false);
+		if (!ret)
+			ret = dmz_ublk_zone_io(ub, dst_id, block, nr,
+					       ub->copy_buf, true);
+		if (!ret)
+			ret = dmz_ublk_validate(ub, dst_id, block, nr);
+		if (ret)
+			return ret;
+
+		block = dmz_ublk_next_valid(ub, src_id, block + nr);
+	}
+
+	return 0;
+}
+
+/*
+ * Reclaim the cache zone of the chunk selected by the policy, as the
+ * kernel target does: a buffer zone is merged into its sequential data
+ * zone if all its valid blocks are after the data zone write pointer,
+ * otherwise the data zone is merged into the buffer zone. Cache data
+ * zones are moved to a sequential zone.
+ */
+static int dmz_ublk_reclaim(struct dmz_ublk *ub)
+{
+	unsigned int chunk, dzone_id, bzone_id, szone_id;
+	int ret;
+
+	chunk = ub->policy->select_victim(ub);
+	if (chunk == DMZ_MAP_UNMAPPED)
+		return -ENOSPC;
+
+	dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+
+	if (bzone_id != DMZ_MAP_UNMAPPED) {
+		if (dmz_ublk_next_valid(ub, bzone_id, 0) >=
+		    ub->zones[dzone_id].wp_block) {
+			ret = dmz_ublk_copy_seq(ub, bzone_id, dzone_id);
+			if (ret)
+				return ret;
+			dmz_ublk_free_zone(ub, bzone_id);
+			dmz_ublk_set_mapping(ub, chunk, dzone_id,
+					     DMZ_MAP_UNMAPPED);
+		} else {
+			ret = dmz_ublk_copy_rnd(ub, dzone_id, bzone_id);
+			if (ret)
+				return ret;
+			dmz_ublk_free_zone(ub, dzone_id);
+			dmz_ublk_set_mapping(ub, chunk, bzone_id,
+					     DMZ_MAP_UNMAPPED);
+		}
+	} else {
+		szone_id = dmz_ublk_alloc_seq_zone(ub);
+		if (szone_id == DMZ_MAP_UNMAPPED)
+			return -ENOSPC;
+		ret = dmz_ublk_copy_seq(ub, dzone_id, szone_id);
+		if (ret)
+			return ret;
+		dmz_ublk_free_zone(ub, dzone_id);
+		dmz_ublk_set_mapping(ub, chunk, szone_id, DMZ_MAP_UNMAPPED);
+	}
+
+	ub->nr_reclaimed++;
+
+	/* Make the reclaimed zone free */
+	return dmz_ublk_flush(ub);
+}
+
+/*
+ * Get a free cache zone, reclaiming if needed.
+ */
+static int dmz_ublk_get_cache_zone(struct dmz_ublk *ub, unsigned int chunk,
+				   unsigned int *zone_id)
+{
+	int ret;
+
+	while ((*zone_id = ub->policy->alloc_cache_zone(ub, chunk)) ==
+	       DMZ_MAP_UNMAPPED) {
+		/* Released zones may only be waiting for a flush */
+		if (ub->dirty)
+			ret = dmz_ublk_flush(ub);
+		else
+			ret = dmz_ublk_reclaim(ub);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static unsigned int dmz_ublk_nr_free_cache(struct dmz_ublk *ub,
+					   unsigned int *nr_cache)
+{
+	unsigned int i, nr_free = 0;
+
+	*nr_cache = 0;
+	for (i = 0; i < ub->dev->nr_zones; i++) {
+		if (!ub->zones[i].cache || ub->zones[i].unusable)
+			continue;
+		(*nr_cache)++;
+		if (dmz_ublk_zone_free(&ub->zones[i]))
+			nr_free++;
+	}
+
+	return nr_free;
+}
+
+/*
+ * Get the zone holding the current data of a chunk block.
+ */
+static unsigned int dmz_ublk_block_src(struct dmz_ublk *ub,
+				       unsigned int dzone_id,
+				       unsigned int bzone_id,
+				       unsigned int block)
+{
+	/* Valid blocks of the buffer zone are the most recent */
+	if (bzone_id != DMZ_MAP_UNMAPPED &&
+	    dmz_ublk_valid(ub, bzone_id, block))
+		return bzone_id;
+	if (dzone_id != DMZ_MAP_UNMAPPED &&
+	    dmz_ublk_valid(ub, dzone_id, block))
+		return dzone_id;
+
+	return DMZ_MAP_UNMAPPED;
+}
+
+/*
+ * Read blocks, merging runs of blocks from the same zone.
+ */
+static int dmz_ublk_read(struct dmz_ublk *ub, __u64 block,
+			 unsigned int nr_blocks, __u8 *buf)
+{
+	unsigned int chunk, cblock, nr, b, run, src, dzone_id, bzone_id;
+	int ret;
+
+	while (nr_blocks) {
+		chunk = block / ub->chunk_nr_blocks;
+		cblock = block % ub->chunk_nr_blocks;
+		nr = ub->chunk_nr_blocks - cblock;
+		if (nr > nr_blocks)
+			nr = nr_blocks;
+
+		dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+		for (b = cblock; b < cblock + nr; b += run) {
+			src = dmz_ublk_block_src(ub, dzone_id, bzone_id, b);
+			run = 1;
+			while (b + run < cblock + nr &&
+			       dmz_ublk_block_src(ub, dzone_id, bzone_id,
+						  b + run) == src)
+				run++;
+
+			if (src == DMZ_MAP_UNMAPPED) {
+				memset(buf, 0, (size_t)run << DMZ_BLOCK_SHIFT);
+			} else {
+				ret = dmz_ublk_zone_io(ub, src, b, run,
+						       buf, false);
+				if (ret)
+					return ret;
+			}
+			buf += (size_t)run << DMZ_BLOCK_SHIFT;
+		}
+
+		block += nr;
+		nr_blocks -= nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Write blocks: unmapped chunks are mapped to a cache zone and writes
+ * to sequential data zones that are not at the zone write pointer go
+ * to a buffer zone.
+ */
+static int dmz_ublk_write(struct dmz_ublk *ub, __u64 block,
+			  unsigned int nr_blocks, __u8 *buf)
+{
+	unsigned int chunk, cblock, nr, zone_id, dzone_id, bzone_id;
+	struct dmz_ublk_zone *dzone;
+	int ret;
+
+	while (nr_blocks) {
+		chunk = block / ub->chunk_nr_blocks;
+		cblock = block % ub->chunk_nr_blocks;
+		nr = ub->chunk_nr_blocks - cblock;
+		if (nr > nr_blocks)
+			nr = nr_blocks;
+
+		dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED) {
+			ret = dmz_ublk_get_cache_zone(ub, chunk, &dzone_id);
+			if (ret)
+				return ret;
+			dmz_ublk_set_mapping(ub, chunk, dzone_id,
+					     DMZ_MAP_UNMAPPED);
+		}
+		dzone = &ub->zones[dzone_id];
+
+		if (!dzone->seq || cblock == dzone->wp_block) {
+			/* Write in place or at the zone write pointer */
+			zone_id = dzone_id;
+			ret = dmz_ublk_zone_io(ub, zone_id, cblock, nr,
+					       buf, true);
+			if (ret)
+				return ret;
+			if (dzone->seq)
+				dzone->wp_block += nr;
+			if (bzone_id != DMZ_MAP_UNMAPPED)
+				dmz_ublk_invalidate(ub, bzone_id, cblock, nr);
+		} else {
+			if (bzone_id == DMZ_MAP_UNMAPPED) {
+				ret = dmz_ublk_get_cache_zone(ub, chunk,
+							      &bzone_id);
+				if (ret)
+					return ret;
+				/*
+				 * Reclaim may have remapped the chunk: only
+				 * use the buffer zone if it is still needed.
+				 */
+				dmz_ublk_get_mapping(ub, chunk, &dzone_id,
+						     &zone_id);
+				if (zone_id == DMZ_MAP_UNMAPPED &&
+				    ub->zones[dzone_id].seq &&
+				    cblock != ub->zones[dzone_id].wp_block)
+					dmz_ublk_set_mapping(ub, chunk,
+							     dzone_id,
+							     bzone_id);
+				continue;
+			}
+			zone_id = bzone_id;
+			ret = dmz_ublk_zone_io(ub, zone_id, cblock, nr,
+					       buf, true);
+			if (ret)
+				return ret;
+			dmz_ublk_invalidate(ub, dzone_id, cblock, nr);
+		}
+
+		ret = dmz_ublk_validate(ub, zone_id, cblock, nr);
+		if (ret)
+			return ret;
+		ub->zones[zone_id].atime = dmz_usec();
+		dmz_ublk_put_chunk(ub, chunk);
+
+		block += nr;
+		nr_blocks -= nr;
+		buf += (size_t)nr << DMZ_BLOCK_SHIFT;
+	}
+
+	return 0;
+}
+
+/*
+ * Discard blocks.
+ */
+static int dmz_ublk_discard(struct dmz_ublk *ub, __u64 block,
+			    unsigned int nr_blocks)
+{
+	unsigned int chunk, cblock, nr, dzone_id, bzone_id;
+
+	while (nr_blocks) {
+		chunk = block / ub->chunk_nr_blocks;
+		cblock = block % ub->chunk_nr_blocks;
+		nr = ub->chunk_nr_blocks - cblock;
+		if (nr > nr_blocks)
+			nr = nr_blocks;
+
+		dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+		if (dzone_id != DMZ_MAP_UNMAPPED)
+			dmz_ublk_invalidate(ub, dzone_id, cblock, nr);
+		if (bzone_id != DMZ_MAP_UNMAPPED)
+			dmz_ublk_invalidate(ub, bzone_id, cblock, nr);
+		dmz_ublk_put_chunk(ub, chunk);
+
+		block += nr;
+		nr_blocks -= nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Execute a request and return the number of bytes processed
+ * or a negative error code.
+ */
+static int dmz_ublk_handle_io(struct dmz_ublk *ub, unsigned int tag)
+{
+	const struct ublksrv_io_desc *iod = &ub->iod[tag];
+	unsigned int op = iod->op_flags & 0xff;
+	__u64 block = dmz_sect2blk((__u64)iod->start_sector);
+	unsigned int nr_blocks = dmz_sect2blk(iod->nr_sectors);
+	int ret;
+
+	if (op != UBLK_IO_OP_FLUSH &&
+	    (((iod->start_sector | iod->nr_sectors) &
+	      DMZ_BLOCK_SECTORS_MASK) ||
+	     block + nr_blocks > ub->nr_blocks))
+		return -EIO;
+
+	switch (op) {
+	case UBLK_IO_OP_READ:
+		ret = dmz_ublk_read(ub, block, nr_blocks, ub->buf[tag]);
+		break;
+	case UBLK_IO_OP_WRITE:
+		ret = dmz_ublk_write(ub, block, nr_blocks, ub->buf[tag]);
+		if (!ret && (iod->op_flags & UBLK_IO_F_FUA))
+			ret = dmz_ublk_flush(ub);
+		break;
+	case UBLK_IO_OP_FLUSH:
+		ret = dmz_ublk_flush(ub);
+		break;
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		ret = dmz_ublk_discard(ub, block, nr_blocks);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (ret)
+		return ret;
+
+	return iod->nr_sectors << 9;
+}
+
+/*
+ * Background work done when the target is idle.
+ */
+static void dmz_ublk_idle(struct dmz_ublk *ub)
+{
+	unsigned int nr_free, nr_cache;
+
+	nr_free = dmz_ublk_nr_free_cache(ub, &nr_cache);
+	if (nr_free * 100 < nr_cache * DMZ_UBLK_RECLAIM_LOW &&
+	    dmz_ublk_reclaim(ub) == 0)
+		return;
+
+	if (ub->dirty &&
+	    dmz_usec() - ub->flush_time >= DMZ_UBLK_FLUSH_USEC)
+		dmz_ublk_flush(ub);
+}
+
+/*
+ * Load the metadata.
+ */
+static int dmz_ublk_load(struct dmz_ublk *ub)
+{
+	struct dmz_dev *dev = ub->dev;
+	unsigned int chunk, dzone_id, bzone_id, i, b, sb_zone_id;
+	struct dmz_ublk_zone *zone;
+	struct blk_zone *blkz;
+	int d;
+
+	if (dmz_txn_open(dev, &ub->txn) < 0)
+		return -1;
+
+	ub->chunk_nr_blocks = dmz_sect2blk(dev->zone_nr_cap_sectors);
+	ub->nr_blocks = (__u64)dev->nr_chunks * ub->chunk_nr_blocks;
+
+	ub->zones = calloc(dev->nr_zones, sizeof(struct dmz_ublk_zone));
+	if (!ub->zones) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	sb_zone_id = dmz_zone_id(dev, dev->sb_zone);
+	for (i = 0; i < dev->nr_zones; i++) {
+		blkz = &dev->zones[i];
+		zone = &ub->zones[i];
+		zone->chunk = DMZ_MAP_UNMAPPED;
+		zone->cache = dmz_zone_is_cache(dev, blkz);
+		zone->seq = dmz_zone_seq_req(blkz);
+		if (zone->seq) {
+			if (dmz_zone_wp_sector(blkz) >=
+			    dmz_zone_sector(blkz) + dmz_zone_capacity(blkz))
+				zone->wp_block =
+					dmz_sect2blk(dmz_zone_capacity(blkz));
+			else
+				zone->wp_block =
+					dmz_sect2blk(dmz_zone_wp_sector(blkz) -
+						     dmz_zone_sector(blkz));
+		}
+
+		/* Metadata, read-only and offline zones are not used */
+		if ((i >= sb_zone_id &&
+		     i < sb_zone_id + dev->total_nr_meta_zones) ||
+		    dmz_zone_cond(blkz) == BLK_ZONE_COND_READONLY ||
+		    dmz_zone_cond(blkz) == BLK_ZONE_COND_OFFLINE)
+			zone->unusable = true;
+		for (d = 1; d < dev->nr_bdev; d++) {
+			if (dmz_sect2blk(dmz_zone_sector(blkz)) ==
+			    dev->bdev[d].block_offset)
+				zone->unusable = true;
+		}
+	}
+
+	for (chunk = 0; chunk < dev->nr_chunks; chunk++) {
+		dmz_ublk_get_mapping(ub, chunk, &dzone_id, &bzone_id);
+		if (dzone_id == DMZ_MAP_UNMAPPED)
+			continue;
+		if (dzone_id >= dev->nr_zones ||
+		    ub->zones[dzone_id].unusable ||
+		    (bzone_id != DMZ_MAP_UNMAPPED &&
+		     (bzone_id >= dev->nr_zones ||
+		      ub->zones[bzone_id].unusable ||
+		      !ub->zones[bzone_id].cache))) {
+			fprintf(stderr,
+				"%s: Invalid chunk %u mapping, "
+				"run repair first\n",
+				dev->label, chunk);
+			return -1;
+		}
+		ub->zones[dzone_id].chunk = chunk;
+		if (bzone_id != DMZ_MAP_UNMAPPED)
+			ub->zones[bzone_id].chunk = chunk;
+
+		if (dmz_read_zone_bitmap(dev, &ub->txn.mset[0], dzone_id,
+					 &ub->zones[dzone_id].bitmap) < 0)
+			return -1;
+		if (bzone_id != DMZ_MAP_UNMAPPED &&
+		    dmz_read_zone_bitmap(dev, &ub->txn.mset[0], bzone_id,
+					 &ub->zones[bzone_id].bitmap) < 0)
+			return -1;
+	}
+
+	/* Get the zones weight */
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &ub->zones[i];
+		if (!zone->bitmap)
+			continue;
+		for (b = 0; b < ub->chunk_nr_blocks; b++) {
+			if (dmz_test_bit(zone->bitmap, b))
+				zone->weight++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Execute a control command.
+ */
+static int dmz_ublk_ctrl_cmd(struct dmz_ublk *ub, unsigned int cmd_op,
+			     void *addr, unsigned int len, __u64 data)
+{
+	struct ublksrv_ctrl_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	sqe = io_uring_get_sqe(&ub->ctrl_ring);
+	if (!sqe)
+		return -EBUSY;
+
+	memset(sqe, 0, 2 * sizeof(struct io_uring_sqe));
+	sqe->fd = ub->ctrl_fd;
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->cmd_op = cmd_op;
+
+	cmd = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+	cmd->dev_id = ub->dev_id;
+	cmd->queue_id = (__u16)-1;
+	cmd->addr = (__u64)(unsigned long)addr;
+	cmd->len = len;
+	cmd->data[0] = data;
+
+	ret = io_uring_submit_and_wait(&ub->ctrl_ring, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = io_uring_wait_cqe(&ub->ctrl_ring, &cqe);
+	if (ret < 0)
+		return ret;
+	ret = cqe->res;
+	io_uring_cqe_seen(&ub->ctrl_ring, cqe);
+
+	return ret;
+}
+
+/*
+ * Queue a fetch or commit-and-fetch command for a tag.
+ */
+static void dmz_ublk_queue_io(struct dmz_ublk *ub, unsigned int tag,
+			      unsigned int cmd_op, int result)
+{
+	struct ublksrv_io_cmd *cmd;
+	struct io_uring_sqe *sqe;
+
+	/* There are as many SQEs as tags */
+	sqe = io_uring_get_sqe(&ub->ring);
+
+	memset(sqe, 0, 2 * sizeof(struct io_uring_sqe));
+	sqe->fd = ub->cdev_fd;
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->cmd_op = cmd_op;
+	sqe->user_data = tag;
+
+	cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+	cmd->q_id = 0;
+	cmd->tag = tag;
+	cmd->result = result;
+	cmd->addr = (__u64)(unsigned long)ub->buf[tag];
+}
+
+/*
+ * Create and start the ublk device.
+ */
+static int dmz_ublk_add_dev(struct dmz_ublk *ub)
+{
+	struct dmz_dev *dev = ub->dev;
+	struct ublksrv_ctrl_dev_info info;
+	struct ublk_params params;
+	char path[PATH_MAX];
+	unsigned int i;
+	int ret;
+
+	ub->ctrl_fd = open(DMZ_UBLK_CTRL_DEV, O_RDWR);
+	if (ub->ctrl_fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n"
+			"  (is the ublk_drv module loaded ?)\n",
+			DMZ_UBLK_CTRL_DEV, errno, strerror(errno));
+		return -1;
+	}
+
+	ret = io_uring_queue_init(4, &ub->ctrl_ring, IORING_SETUP_SQE128);
+	if (ret < 0) {
+		fprintf(stderr, "Initialize control ring failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+	ub->ctrl_ring_init = true;
+
+	memset(&info, 0, sizeof(info));
+	info.nr_hw_queues = 1;
+	info.queue_depth = DMZ_UBLK_QUEUE_DEPTH;
+	info.max_io_buf_bytes = DMZ_UBLK_MAX_IO_SIZE;
+	info.dev_id = (__u32)-1;
+	info.ublksrv_pid = getpid();
+
+	ret = dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(ADD_DEV),
+				&info, sizeof(info), 0);
+	if (ret < 0) {
+		fprintf(stderr, "Add ublk device failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+	ub->dev_id = info.dev_id;
+
+	memset(&params, 0, sizeof(params));
+	params.len = sizeof(params);
+	params.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD;
+	params.basic.attrs = UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA;
+	params.basic.logical_bs_shift = DMZ_BLOCK_SHIFT;
+	params.basic.physical_bs_shift = DMZ_BLOCK_SHIFT;
+	params.basic.io_min_shift = DMZ_BLOCK_SHIFT;
+	params.basic.io_opt_shift = DMZ_BLOCK_SHIFT;
+	params.basic.max_sectors = DMZ_UBLK_MAX_IO_SIZE >> 9;
+	params.basic.dev_sectors = dmz_blk2sect(ub->nr_blocks);
+	params.discard.discard_granularity = DMZ_BLOCK_SIZE;
+	params.discard.max_discard_sectors = dev->zone_nr_cap_sectors;
+	params.discard.max_write_zeroes_sectors = dev->zone_nr_cap_sectors;
+	params.discard.max_discard_segments = 1;
+
+	ret = dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(SET_PARAMS),
+				&params, sizeof(params), 0);
+	if (ret < 0) {
+		fprintf(stderr, "Set ublk device parameters failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+
+	/* The character device may take some time to show up */
+	snprintf(path, sizeof(path), "/dev/ublkc%d", ub->dev_id);
+	for (i = 0; i < 100; i++) {
+		ub->cdev_fd = open(path, O_RDWR);
+		if (ub->cdev_fd >= 0 || errno != ENOENT)
+			break;
+		usleep(10000);
+	}
+	if (ub->cdev_fd < 0) {
+		fprintf(stderr, "Open %s failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	ub->iod_size = DMZ_UBLK_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc);
+	ub->iod_size = (ub->iod_size + getpagesize() - 1) &
+		~((size_t)getpagesize() - 1);
+	ub->iod = mmap(NULL, ub->iod_size, PROT_READ,
+		       MAP_SHARED | MAP_POPULATE,
+		       ub->cdev_fd, UBLKSRV_CMD_BUF_OFFSET);
+	if (ub->iod == MAP_FAILED) {
+		ub->iod = NULL;
+		fprintf(stderr, "%s: mmap failed %d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+
+	ret = io_uring_queue_init(DMZ_UBLK_QUEUE_DEPTH, &ub->ring,
+				  IORING_SETUP_SQE128);
+	if (ret < 0) {
+		fprintf(stderr, "Initialize queue ring failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+	ub->ring_init = true;
+
+	for (i = 0; i < DMZ_UBLK_QUEUE_DEPTH; i++) {
+		ub->buf[i] = dmz_malloc_buf(DMZ_UBLK_MAX_IO_SIZE);
+		if (!ub->buf[i])
+			return -1;
+		dmz_ublk_queue_io(ub, i, DMZ_UBLK_IO(FETCH_REQ), -1);
+	}
+
+	ret = io_uring_submit(&ub->ring);
+	if (ret < 0) {
+		fprintf(stderr, "Submit fetch requests failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+
+	ret = dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(START_DEV),
+				NULL, 0, getpid());
+	if (ret < 0) {
+		fprintf(stderr, "Start ublk device failed %d (%s)\n",
+			-ret, strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the ublk device. Removing the disk flushes it: this must run
+ * while the queue is served, until its requests are aborted.
+ */
+static void *dmz_ublk_stop_dev(void *arg)
+{
+	struct dmz_ublk *ub = arg;
+	sigset_t mask;
+	int ret;
+
+	/* Leave signals to the thread serving the queue */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	ret = dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(STOP_DEV), NULL, 0, 0);
+
+	pthread_mutex_lock(&ub->stop_lock);
+	ub->stop_ret = ret;
+	ub->stop_done = true;
+	pthread_mutex_unlock(&ub->stop_lock);
+
+	return NULL;
+}
+
+/*
+ * Test if stopping the device failed.
+ */
+static bool dmz_ublk_stop_failed(struct dmz_ublk *ub)
+{
+	bool failed;
+
+	pthread_mutex_lock(&ub->stop_lock);
+	failed = ub->stop_done && ub->stop_ret < 0;
+	pthread_mutex_unlock(&ub->stop_lock);
+
+	return failed;
+}
+
+/*
+ * Delete the ublk device, stopping it first if it was not stopped while
+ * serving requests.
+ */
+static void dmz_ublk_del_dev(struct dmz_ublk *ub)
+{
+	unsigned int i;
+
+	if (ub->stop_started) {
+		pthread_join(ub->stop_thread, NULL);
+		ub->stop_started = false;
+	} else if (ub->dev_id >= 0) {
+		dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(STOP_DEV), NULL, 0, 0);
+	}
+
+	if (ub->iod)
+		munmap(ub->iod, ub->iod_size);
+	if (ub->ring_init)
+		io_uring_queue_exit(&ub->ring);
+	if (ub->cdev_fd >= 0)
+		close(ub->cdev_fd);
+
+	if (ub->dev_id >= 0)
+		dmz_ublk_ctrl_cmd(ub, DMZ_UBLK_CMD(DEL_DEV), NULL, 0, 0);
+
+	if (ub->ctrl_ring_init)
+		io_uring_queue_exit(&ub->ctrl_ring);
+	if (ub->ctrl_fd >= 0)
+		close(ub->ctrl_fd);
+
+	for (i = 0; i < DMZ_UBLK_QUEUE_DEPTH; i++)
+		free(ub->buf[i]);
+}
+
+/*
+ * Process requests until the device is stopped. Once interrupted, the
+ * device stop is started and requests, e.g. the final flush of the disk,
+ * are served until the kernel aborts them.
+ */
+static int dmz_ublk_run(struct dmz_ublk *ub)
+{
+	struct __kernel_timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+	struct io_uring_cqe *cqe;
+	unsigned int tag;
+	bool aborted = false;
+	int ret, res;
+
+	while (!aborted) {
+		if (dmz_ublk_stop && !ub->stop_started) {
+			ret = pthread_create(&ub->stop_thread, NULL,
+					     dmz_ublk_stop_dev, ub);
+			if (ret) {
+				fprintf(stderr,
+					"Create stop thread failed %d (%s)\n",
+					ret, strerror(ret));
+				return -1;
+			}
+			ub->stop_started = true;
+		}
+
+		if (ub->stop_started && dmz_ublk_stop_failed(ub)) {
+			fprintf(stderr, "Stop ublk device failed %d (%s)\n",
+				-ub->stop_ret, strerror(-ub->stop_ret));
+			return -1;
+		}
+
+		ret = io_uring_submit(&ub->ring);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "Submit requests failed %d (%s)\n",
+				-ret, strerror(-ret));
+			return -1;
+		}
+
+		ret = io_uring_wait_cqe_timeout(&ub->ring, &cqe, &ts);
+		if (ret == -ETIME) {
+			dmz_ublk_idle(ub);
+			continue;
+		}
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "Wait for requests failed %d (%s)\n",
+				-ret, strerror(-ret));
+			return -1;
+		}
+
+		while (io_uring_peek_cqe(&ub->ring, &cqe) == 0) {
+			tag = cqe->user_data;
+			res = cqe->res;
+			io_uring_cqe_seen(&ub->ring, cqe);
+
+			if (res == UBLK_IO_RES_ABORT) {
+				/* The device is stopped or deleted */
+				aborted = true;
+				break;
+			}
+			if (res != UBLK_IO_RES_OK ||
+			    tag >= DMZ_UBLK_QUEUE_DEPTH)
+				continue;
+
+			res = dmz_ublk_handle_io(ub, tag);
+			dmz_ublk_queue_io(ub, tag,
+					  DMZ_UBLK_IO(COMMIT_AND_FETCH_REQ),
+					  res);
+		}
+
+		if (ub->dirty &&
+		    dmz_usec() - ub->flush_time >= DMZ_UBLK_FLUSH_USEC)
+			dmz_ublk_flush(ub);
+	}
+
+	return 0;
+}
+
+/*
+ * Start the userspace target and serve requests until interrupted.
+ */
+int dmz_ublk_start(struct dmz_dev *dev)
+{
+	struct dmz_ublk *ub;
+	struct sigaction act;
+	int i, ret = -1;
+
+	ub = calloc(1, sizeof(struct dmz_ublk));
+	if (!ub) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	ub->dev = dev;
+	ub->dev_id = -1;
+	pthread_mutex_init(&ub->stop_lock, NULL);
+	ub->ctrl_fd = -1;
+	ub->cdev_fd = -1;
+
+	for (i = 0; dmz_ublk_policies[i].name; i++) {
+		if (!dev->ublk_policy ||
+		    strcmp(dev->ublk_policy, dmz_ublk_policies[i].name) == 0) {
+			ub->policy = &dmz_ublk_policies[i];
+			break;
+		}
+	}
+	if (!ub->policy) {
+		fprintf(stderr, "Invalid reclaim policy \"%s\"\n",
+			dev->ublk_policy);
+		goto out;
+	}
+
+	if (dmz_ublk_load(ub) < 0)
+		goto out;
+
+	ub->fd = calloc(dev->nr_bdev, sizeof(int));
+	ub->copy_buf = dmz_malloc_buf(DMZ_UBLK_COPY_SIZE);
+	ub->zero_buf = dmz_malloc_buf(DMZ_UBLK_COPY_SIZE);
+	if (!ub->fd || !ub->copy_buf || !ub->zero_buf) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	memset(ub->zero_buf, 0, DMZ_UBLK_COPY_SIZE);
+
+	/* Data IOs bypass the page cache */
+	for (i = 0; i < dev->nr_bdev; i++)
+		ub->fd[i] = -1;
+	for (i = 0; i < dev->nr_bdev; i++) {
+		ub->fd[i] = open(dev->bdev[i].path,
+				 O_RDWR | O_DIRECT | O_LARGEFILE);
+		if (ub->fd[i] < 0) {
+			fprintf(stderr, "%s: Open failed %d (%s)\n",
+				dev->bdev[i].name, errno, strerror(errno));
+			goto out;
+		}
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = dmz_ublk_sig_handler;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	if (dmz_ublk_add_dev(ub) == 0) {
+		printf("%s: Started /dev/ublkb%d (%s reclaim policy)\n",
+		       dev->label, ub->dev_id, ub->policy->name);
+		fflush(stdout);
+
+		ret = dmz_ublk_run(ub);
+
+		printf("%s: Stopping /dev/ublkb%d, %llu zones reclaimed\n",
+		       dev->label, ub->dev_id, ub->nr_reclaimed);
+	}
+
+	dmz_ublk_del_dev(ub);
+
+	if (dmz_ublk_flush(ub) < 0) {
+		fprintf(stderr, "%s: Metadata flush failed\n", dev->label);
+		ret = -1;
+	}
+
+out:
+	if (ub->fd) {
+		for (i = 0; i < dev->nr_bdev; i++) {
+			if (ub->fd[i] >= 0)
+				close(ub->fd[i]);
+		}
+		free(ub->fd);
+	}
+	if (ub->zones) {
+		for (i = 0; i < (int)dev->nr_zones; i++)
+			free(ub->zones[i].bitmap);
+		free(ub->zones);
+	}
+	dmz_txn_close(dev, &ub->txn);
+	free(ub->copy_buf);
+	free(ub->zero_buf);
+	pthread_mutex_destroy(&ub->stop_lock);
+	free(ub);
+
+	return ret;
+}
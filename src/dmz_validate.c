@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * This file is part of dm-zoned tools.
+ * Copyright (c) 2020 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "dmz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/*
+ * Maximum number of blocks written and read with a single IO (1 MiB).
+ */
+#define DMZ_VALIDATE_IO_BLOCKS	256
+
+/*
+ * Number of cache zones sampled and number of blocks verified per zone.
+ */
+#define DMZ_VALIDATE_NR_CACHE_ZONES	16
+#define DMZ_VALIDATE_CACHE_BLOCKS	(DMZ_VALIDATE_IO_BLOCKS * 4)
+
+/*
+ * An IO is a latency outlier if it took more than DMZ_VALIDATE_LAT_MUL
+ * times the median latency of the IOs of the same type, and more than
+ * DMZ_VALIDATE_LAT_MIN_USEC. Validation fails if more than
+ * DMZ_VALIDATE_MAX_OUTLIERS percent of the IOs are outliers.
+ */
+#define DMZ_VALIDATE_LAT_MUL		10
+#define DMZ_VALIDATE_LAT_MIN_USEC	20000ULL
+#define DMZ_VALIDATE_MAX_OUTLIERS	1
+
+/*
+ * IO latencies of a region.
+ */
+struct dmz_validate_lat {
+	unsigned long long	*usec;
+	unsigned int		nr;
+};
+
+/*
+ * Validated region: metadata zones or sampled cache zones.
+ */
+struct dmz_validate_region {
+	const char		*name;
+	struct dmz_validate_lat	write;
+	struct dmz_validate_lat	read;
+	unsigned int		nr_errors;
+	unsigned int		nr_mismatch;
+};
+
+/*
+ * Validation context.
+ */
+struct dmz_validate {
+	struct dmz_block_dev	*bdev;
+	int			fd;
+	__u64			seed;
+	__u8			*wbuf;
+	__u8			*rbuf;
+};
+
+/*
+ * Fill blocks with a pattern identifying each block, so that both
+ * corrupted and misdirected writes are detected.
+ */
+static void dmz_validate_fill(struct dmz_validate *v, __u64 block,
+			      unsigned int nr_blocks)
+{
+	__u64 *p = (__u64 *)v->wbuf;
+	unsigned int b, i;
+
+	for (b = 0; b < nr_blocks; b++) {
+		for (i = 0; i < DMZ_BLOCK_SIZE / sizeof(__u64); i++)
+			*p++ = (block + b) ^ v->seed ^ ((__u64)i << 48);
+	}
+}
+
+/*
+ * Write, read back and verify an extent of blocks.
+ */
+static int dmz_validate_extent(struct dmz_dev *dev, struct dmz_validate *v,
+			       struct dmz_validate_region *reg,
+			       __u64 block, unsigned int nr_blocks)
+{
+	size_t size = (size_t)nr_blocks << DMZ_BLOCK_SHIFT;
+	unsigned long long t;
+	__u64 bdev_block;
+	ssize_t ret;
+
+	dmz_block_to_bdev(dev, block, &bdev_block);
+	dmz_validate_fill(v, block, nr_blocks);
+
+	t = dmz_usec();
+	ret = pwrite(v->fd, v->wbuf, size, bdev_block << DMZ_BLOCK_SHIFT);
+	reg->write.usec[reg->write.nr++] = dmz_usec() - t;
+	if (ret != (ssize_t)size) {
+		fprintf(stderr,
+			"%s: Write %u blocks at block %llu failed %d (%s)\n",
+			v->bdev->name, nr_blocks, bdev_block,
+			errno, strerror(errno));
+		reg->nr_errors++;
+		return -1;
+	}
+
+	t = dmz_usec();
+	ret = pread(v->fd, v->rbuf, size, bdev_block << DMZ_BLOCK_SHIFT);
+	reg->read.usec[reg->read.nr++] = dmz_usec() - t;
+	if (ret != (ssize_t)size) {
+		fprintf(stderr,
+			"%s: Read %u blocks at block %llu failed %d (%s)\n",
+			v->bdev->name, nr_blocks, bdev_block,
+			errno, strerror(errno));
+		reg->nr_errors++;
+		return -1;
+	}
+
+	if (memcmp(v->wbuf, v->rbuf, size) != 0) {
+		fprintf(stderr,
+			"%s: %u blocks at block %llu read back different "
+			"from written\n",
+			v->bdev->name, nr_blocks, bdev_block);
+		reg->nr_mismatch++;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Validate an extent of blocks using large IOs.
+ */
+static void dmz_validate_blocks(struct dmz_dev *dev, struct dmz_validate *v,
+				struct dmz_validate_region *reg,
+				__u64 block, __u64 nr_blocks)
+{
+	unsigned int nr;
+
+	while (nr_blocks) {
+		nr = DMZ_VALIDATE_IO_BLOCKS;
+		if (nr > nr_blocks)
+			nr = nr_blocks;
+		dmz_validate_extent(dev, v, reg, block, nr);
+		block += nr;
+		nr_blocks -= nr;
+	}
+}
+
+static int dmz_validate_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(unsigned long long *)a;
+	unsigned long long y = *(unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the latency of IOs and count the outliers.
+ */
+static unsigned int dmz_validate_lat(const char *name,
+				     struct dmz_validate_lat *lat)
+{
+	unsigned long long median, limit;
+	unsigned int i, nr_outliers = 0;
+
+	if (!lat->nr)
+		return 0;
+
+	qsort(lat->usec, lat->nr, sizeof(unsigned long long),
+	      dmz_validate_cmp);
+	median = lat->usec[lat->nr / 2];
+	limit = median * DMZ_VALIDATE_LAT_MUL;
+	if (limit < DMZ_VALIDATE_LAT_MIN_USEC)
+		limit = DMZ_VALIDATE_LAT_MIN_USEC;
+	for (i = 0; i < lat->nr; i++) {
+		if (lat->usec[i] > limit)
+			nr_outliers++;
+	}
+
+	printf("    %s: %u IOs, latency %llu us median, %llu us max, "
+	       "%u outlier%s\n",
+	       name, lat->nr, median, lat->usec[lat->nr - 1],
+	       nr_outliers, nr_outliers > 1 ? "s" : "");
+
+	return nr_outliers;
+}
+
+/*
+ * Report the validation of a region. Return -1 if the region
+ * is not usable.
+ */
+static int dmz_validate_report(struct dmz_validate_region *reg)
+{
+	unsigned int nr_outliers, nr_ios = reg->write.nr + reg->read.nr;
+
+	printf("  %s:\n", reg->name);
+	nr_outliers = dmz_validate_lat("Write", &reg->write) +
+		dmz_validate_lat("Read", &reg->read);
+
+	if (reg->nr_errors || reg->nr_mismatch) {
+		fprintf(stderr,
+			"%s: %u IO error%s, %u verification failure%s\n",
+			reg->name,
+			reg->nr_errors, reg->nr_errors > 1 ? "s" : "",
+			reg->nr_mismatch, reg->nr_mismatch > 1 ? "s" : "");
+		return -1;
+	}
+
+	if (nr_outliers * 100 > nr_ios * DMZ_VALIDATE_MAX_OUTLIERS) {
+		fprintf(stderr,
+			"%s: Too many latency outliers (%u out of %u IOs)\n",
+			reg->name, nr_outliers, nr_ios);
+		return -1;
+	}
+
+	if (nr_outliers)
+		printf("  WARNING: %s: %u latency outlier%s\n",
+		       reg->name, nr_outliers, nr_outliers > 1 ? "s" : "");
+
+	return 0;
+}
+
+static int dmz_validate_alloc_region(struct dmz_validate_region *reg,
+				     const char *name, unsigned int nr_ios)
+{
+	memset(reg, 0, sizeof(struct dmz_validate_region));
+	reg->name = name;
+	reg->write.usec = calloc(nr_ios, sizeof(unsigned long long));
+	reg->read.usec = calloc(nr_ios, sizeof(unsigned long long));
+	if (!reg->write.usec || !reg->read.usec) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void dmz_validate_free_region(struct dmz_validate_region *reg)
+{
+	free(reg->write.usec);
+	free(reg->read.usec);
+}
+
+/*
+ * Write and read verify the blocks of both metadata sets.
+ */
+static int dmz_validate_meta(struct dmz_dev *dev, struct dmz_validate *v)
+{
+	struct dmz_validate_region reg;
+	unsigned int nr_ios;
+	int ret = -1;
+
+	nr_ios = DIV_ROUND_UP(dev->nr_meta_blocks, DMZ_VALIDATE_IO_BLOCKS);
+	if (dmz_validate_alloc_region(&reg, "Metadata zones", nr_ios * 2) < 0)
+		goto out;
+
+	dmz_validate_blocks(dev, v, &reg, dev->sb_block, dev->nr_meta_blocks);
+	dmz_validate_blocks(dev, v, &reg,
+			    dev->sb_block +
+			    dev->nr_meta_zones * dev->zone_nr_blocks,
+			    dev->nr_meta_blocks);
+
+	ret = dmz_validate_report(&reg);
+
+out:
+	dmz_validate_free_region(&reg);
+
+	return ret;
+}
+
+/*
+ * Write and read verify the start of cache zones spread over the
+ * cache zones not used for metadata.
+ */
+static int dmz_validate_cache(struct dmz_dev *dev, struct dmz_validate *v)
+{
+	unsigned int sb_zone_id = dmz_zone_id(dev, dev->sb_zone);
+	unsigned int i, n, nr_zones = 0, nr_samples, stride;
+	struct dmz_validate_region reg;
+	struct blk_zone *zone;
+	__u64 nr_blocks;
+	int ret = -1;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		if (dmz_zone_is_cache(dev, &dev->zones[i]) &&
+		    (i < sb_zone_id ||
+		     i >= sb_zone_id + dev->total_nr_meta_zones))
+			nr_zones++;
+	}
+	if (!nr_zones)
+		return 0;
+
+	nr_samples = DMZ_VALIDATE_NR_CACHE_ZONES;
+	if (nr_samples > nr_zones)
+		nr_samples = nr_zones;
+
+	/* Spread the samples evenly over the cache zones */
+	stride = nr_zones / nr_samples;
+
+	if (dmz_validate_alloc_region(&reg, "Cache zones",
+			nr_samples * DMZ_VALIDATE_CACHE_BLOCKS /
+			DMZ_VALIDATE_IO_BLOCKS) < 0)
+		goto out;
+
+	for (i = 0, n = 0; i < dev->nr_zones && nr_samples; i++) {
+		zone = &dev->zones[i];
+		if (!dmz_zone_is_cache(dev, zone) ||
+		    (i >= sb_zone_id &&
+		     i < sb_zone_id + dev->total_nr_meta_zones))
+			continue;
+
+		if (n++ % stride)
+			continue;
+		nr_samples--;
+
+		nr_blocks = dmz_sect2blk(dmz_zone_capacity(zone));
+		if (nr_blocks > DMZ_VALIDATE_CACHE_BLOCKS)
+			nr_blocks = DMZ_VALIDATE_CACHE_BLOCKS;
+		dmz_validate_blocks(dev, v, &reg,
+				    dmz_sect2blk(dmz_zone_sector(zone)),
+				    nr_blocks);
+	}
+
+	ret = dmz_validate_report(&reg);
+
+out:
+	dmz_validate_free_region(&reg);
+
+	return ret;
+}
+
+/*
+ * Validate the metadata zones and a sample of the cache zones before
+ * formatting: all random IOs of the target go to these zones.
+ */
+int dmz_validate(struct dmz_dev *dev)
+{
+	struct dmz_validate v;
+	int ret = -1;
+
+	memset(&v, 0, sizeof(struct dmz_validate));
+	v.bdev = dmz_zone_to_bdev(dev, dev->sb_zone);
+	v.seed = dmz_usec();
+
+	printf("Validating metadata and cache zones\n");
+	fflush(stdout);
+
+	/* Test the media, not the page cache */
+	v.fd = open(v.bdev->path, O_RDWR | O_DIRECT | O_LARGEFILE);
+	if (v.fd < 0) {
+		fprintf(stderr,
+			"Open %s failed %d (%s)\n",
+			v.bdev->path,
+			errno, strerror(errno));
+		return -1;
+	}
+
+	v.wbuf = dmz_malloc_buf(DMZ_VALIDATE_IO_BLOCKS * DMZ_BLOCK_SIZE);
+	v.rbuf = dmz_malloc_buf(DMZ_VALIDATE_IO_BLOCKS * DMZ_BLOCK_SIZE);
+	if (!v.wbuf || !v.rbuf) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+
+	if (dmz_validate_meta(dev, &v) < 0 ||
+	    dmz_validate_cache(dev, &v) < 0) {
+		fprintf(stderr,
+			"%s: Validation failed, not formatting\n",
+			v.bdev->name);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(v.wbuf);
+	free(v.rbuf);
+	close(v.fd);
+
+	return ret;
+}
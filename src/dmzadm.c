@@ -33,7 +33,32 @@ static void dmzadm_usage(void)
 	       "  --repair	 : Repair a block device metadata\n"
 	       "  --relabel	 : Change the device label\n"
 	       "  --start	 : Start the device-mapper target\n"
-	       "  --stop	 : Stop the device-mapper target\n");
+	       "  --stop	 : Stop the device-mapper target\n"
+	       "  --bench	 : Benchmark devices before format\n"
+	       "  --bench-target : Format and start the target and\n"
+	       "                   benchmark it using fio\n"
+	       "  --simulate	 : Simulate the target with a workload to\n"
+	       "                   size the cache device and the number\n"
+	       "                   of reserved sequential zones\n"
+	       "  --inject	 : Corrupt a formatted device metadata\n"
+	       "                   to test the check and repair\n"
+	       "                   operations\n"
+	       "  --scrub	 : Read all valid data blocks to detect\n"
+	       "                   unreadable sectors\n"
+	       "  --survey	 : Sample the read throughput and latency\n"
+	       "                   of bands of zones to detect slow or\n"
+	       "                   degraded zones\n"
+	       "  --dump	 : Save the device metadata to an image\n"
+	       "  --delta	 : Compare a metadata image with another\n"
+	       "                   image or with the device metadata\n"
+	       "  --rebalance	 : Move chunks between the zoned devices\n"
+	       "                   of a multi-device target to spread\n"
+	       "                   them evenly\n"
+	       "  --fingerprint	 : Hash the valid blocks of each chunk to\n"
+	       "                   compare the content of targets\n"
+	       "  --decommission : Destroy the metadata, reset all zones\n"
+	       "                   and discard the regular device of a\n"
+	       "                   stopped target\n");
 
 	printf("Devices\n"
 	       "  For a single device target, a zoned block device\n"
@@ -51,11 +76,127 @@ static void dmzadm_usage(void)
 	       "  --label=<str> : Set the target label name to <str>\n"
 	       "  --seq=<num>	: Number of sequential zones reserved\n"
 	       "                  for reclaim. The minimum is 1 and the\n"
-	       "                  default is %d\n",
+	       "                  default is %d\n"
+	       "  --dry-run	: Print the metadata layout and estimate\n"
+	       "                  the format, check and repair durations\n"
+	       "                  for this and alternative configurations\n"
+	       "                  without writing anything\n"
+	       "  --iops=<num>	: With --dry-run, 4KB IOPS of the metadata\n"
+	       "                  device to use instead of measuring it\n"
+	       "  --json=<file> : With --dry-run, also save the layout and\n"
+	       "                  estimates to <file> in JSON format\n"
+	       "  --profile=<file> : With --dry-run, report the slow or\n"
+	       "                  degraded zones of the survey profile\n"
+	       "                  <file>\n"
+	       "  --validate	: Write and read verify the metadata zones\n"
+	       "                  and a sample of the cache zones before\n"
+	       "                  formatting, and abort if they fail or\n"
+	       "                  show too many latency outliers\n",
 	       DMZ_NR_RESERVED_SEQ);
 
+	printf("Check and repair operation options\n"
+	       "  --poll	: Use polled IOs for the metadata of a\n"
+	       "                  regular (cache) block device with poll\n"
+	       "                  queues configured\n");
+
+	printf("Start operation options\n"
+	       "  --tune=<file> : Tuning profile of the devices applied\n"
+	       "                  at start (default: built-in profile)\n"
+	       "  --no-tune	: Do not tune the devices\n"
+	       "  --raw-dm	: Activate the target using device-mapper\n"
+	       "                  ioctls directly, without udev\n"
+	       "                  synchronization (early boot)\n");
+#ifdef HAVE_UBLK
+	printf("  --ublk	: Serve the target with a userspace\n"
+	       "                  implementation through the ublk driver\n"
+	       "                  instead of the dm-zoned kernel target\n"
+	       "  --policy=<p>	: With --ublk, reclaim and cache zone\n"
+	       "                  allocation policy (lru or greedy,\n"
+	       "                  default: lru)\n");
+#endif
+
+	printf("Stop operation options\n"
+	       "  --label=<pat> : Also stop the targets with a label\n"
+	       "                  matching the shell pattern <pat>\n"
+	       "  --all	: Also stop all dm-zoned targets\n");
+
 	printf("Relabel operation options\n"
 	       "  --label=<str> : Set the target new label name to <str>\n");
+
+	printf("Bench operation options\n"
+	       "  --force	: Force overwrite of existing content\n"
+	       "  --mover	: Benchmark the data mover used to move\n"
+	       "                  valid blocks between zones\n");
+
+	printf("Bench-target operation options\n"
+	       "  Format operation options, and\n"
+	       "  --jobs=<list> : Comma separated list of fio jobs to run\n"
+	       "                  (randwrite, seqwrite, mixed). All jobs\n"
+	       "                  are run by default\n"
+	       "  --runtime=<s> : Run time of each job in seconds\n"
+	       "                  (default: 60)\n");
+
+	printf("Simulate operation options\n"
+	       "  --trace=<file> : blkparse text output of a trace to\n"
+	       "                   replay (\"-\" for standard input)\n"
+	       "  --workload=<w> : Synthetic workload to simulate:\n"
+	       "                   <rand|seq|mixed>[,bs=<size>]\n"
+	       "                   [,size=<size>][,rate=<MB/s>]\n"
+	       "  --cache=<list> : Comma separated list of cache device\n"
+	       "                   sizes to simulate (\"none\" for a\n"
+	       "                   single zoned device target)\n"
+	       "  --seq=<list>   : Comma separated list of numbers of\n"
+	       "                   reserved sequential zones to simulate\n"
+	       "  --reclaim-bw=<MB/s> : Reclaim throughput per zoned\n"
+	       "                   device (default: 100)\n");
+
+	printf("Inject operation options\n"
+	       "  --force	: Confirm corruption of the metadata\n"
+	       "                  (mandatory)\n"
+	       "  --corrupt=<list> : Comma separated list of\n"
+	       "                  <type>[:<count>] corruptions to inject,\n"
+	       "                  with <type> one of stale-set, dup-zone,\n"
+	       "                  wp-bits, overlap and torn-sb\n"
+	       "  --seed=<num>	: Random generator seed (default: time)\n"
+	       "  --record=<file> : Save the injected corruptions and the\n"
+	       "                  expected repair outcome to <file>\n");
+
+	printf("Scrub operation options\n"
+	       "  --bw=<MB/s>	: Read throughput limit per device\n"
+	       "                  (default: unlimited)\n");
+
+	printf("Survey operation options\n"
+	       "  --bands=<num> : Number of bands of zones sampled per\n"
+	       "                  device (default: 64)\n"
+	       "  --profile=<file> : Save the survey profile to <file>\n");
+
+	printf("Dump operation options\n"
+	       "  --image=<file> : Save the metadata image to <file>\n"
+	       "  --poll	: Use polled IOs (see check operation)\n");
+
+	printf("Delta operation options\n"
+	       "  --image=<file> : Metadata image or patch to compare\n"
+	       "  --to=<file>	: Compare with this image or patch\n"
+	       "                  instead of the device metadata\n"
+	       "  --patch=<file> : Save the changed metadata blocks to\n"
+	       "                  <file> as a patch of the --image file\n"
+	       "  --poll	: Use polled IOs (see check operation)\n");
+
+	printf("Rebalance operation options\n"
+	       "  --dry-run	: Print the chunk moves without moving\n"
+	       "                  anything\n");
+
+	printf("Fingerprint operation options\n"
+	       "  --save=<file> : Save the chunk hashes to <file>\n"
+	       "  --compare=<file> : Compare the chunk hashes with the\n"
+	       "                  fingerprint saved in <file>\n"
+	       "  --logical=<file> : Hash the raw image <file> of the\n"
+	       "                  logical device instead of the target,\n"
+	       "                  using the target chunk size\n");
+
+	printf("Decommission operation options\n"
+	       "  --force	: Confirm destruction of all data\n"
+	       "                  (mandatory)\n");
 }
 
 void print_dev_info(struct dmz_block_dev *bdev)
@@ -69,6 +210,58 @@ void print_dev_info(struct dmz_block_dev *bdev)
 		printf("  Host-%s device\n",
 		       (bdev->type == DMZ_TYPE_ZONED_HM) ? "managed" : "aware");
 	printf("  %u zones, offset %llu\n", bdev->nr_zones, bdev->block_offset);
+	if (bdev->numa_node >= 0)
+		printf("  NUMA node %d\n", bdev->numa_node);
+}
+
+/*
+ * Print the open and active zone resources of zoned block devices.
+ */
+static void print_zone_resources(struct dmz_dev *dev)
+{
+	struct dmz_block_dev *bdev;
+	struct blk_zone *zone;
+	unsigned int nr_open, nr_active;
+	unsigned int i, z = 0;
+	char max_open[16], max_active[16];
+	int d;
+
+	for (d = 0; d < dev->nr_bdev; d++) {
+		bdev = &dev->bdev[d];
+		if (!dmz_bdev_is_zoned(bdev)) {
+			z += bdev->nr_zones;
+			continue;
+		}
+
+		nr_open = 0;
+		nr_active = 0;
+		for (i = 0; i < bdev->nr_zones; i++, z++) {
+			zone = &dev->zones[z];
+			switch (dmz_zone_cond(zone)) {
+			case BLK_ZONE_COND_IMP_OPEN:
+			case BLK_ZONE_COND_EXP_OPEN:
+				nr_open++;
+				/* fallthrough */
+			case BLK_ZONE_COND_CLOSED:
+				nr_active++;
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (bdev->max_open_zones)
+			sprintf(max_open, "max %u", bdev->max_open_zones);
+		else
+			strcpy(max_open, "no limit");
+		if (bdev->max_active_zones)
+			sprintf(max_active, "max %u", bdev->max_active_zones);
+		else
+			strcpy(max_active, "no limit");
+
+		printf("%s: %u open zones (%s), %u active zones (%s)\n",
+		       bdev->name, nr_open, max_open, nr_active, max_active);
+	}
 }
 
 /*
@@ -114,6 +307,28 @@ int main(int argc, char **argv)
 		op = DMZ_OP_START;
 	} else if (strcmp(argv[1], "--stop") == 0) {
 		op = DMZ_OP_STOP;
+	} else if (strcmp(argv[1], "--bench") == 0) {
+		op = DMZ_OP_BENCH;
+	} else if (strcmp(argv[1], "--bench-target") == 0) {
+		op = DMZ_OP_BENCH_TARGET;
+	} else if (strcmp(argv[1], "--simulate") == 0) {
+		op = DMZ_OP_SIMULATE;
+	} else if (strcmp(argv[1], "--inject") == 0) {
+		op = DMZ_OP_INJECT;
+	} else if (strcmp(argv[1], "--scrub") == 0) {
+		op = DMZ_OP_SCRUB;
+	} else if (strcmp(argv[1], "--survey") == 0) {
+		op = DMZ_OP_SURVEY;
+	} else if (strcmp(argv[1], "--dump") == 0) {
+		op = DMZ_OP_DUMP;
+	} else if (strcmp(argv[1], "--delta") == 0) {
+		op = DMZ_OP_DELTA;
+	} else if (strcmp(argv[1], "--rebalance") == 0) {
+		op = DMZ_OP_REBALANCE;
+	} else if (strcmp(argv[1], "--fingerprint") == 0) {
+		op = DMZ_OP_FINGERPRINT;
+	} else if (strcmp(argv[1], "--decommission") == 0) {
+		op = DMZ_OP_DECOMMISSION;
 	} else {
 		fprintf(stderr,
 			"Unknown operation \"%s\"\n",
@@ -144,7 +359,7 @@ int main(int argc, char **argv)
 		optnum++;
 	}
 	dev->nr_bdev = optnum - 2;
-	if (!dev->nr_bdev) {
+	if (!dev->nr_bdev && op != DMZ_OP_STOP) {
 		fprintf(stderr, "No device specified\n");
 		return 1;
 	}
@@ -152,6 +367,11 @@ int main(int argc, char **argv)
 	dev->bdev = malloc(sizeof(struct dmz_block_dev) * dev->nr_bdev);
 	for (i = 0; i < dev->nr_bdev; i++) {
 		dev->bdev[i].path = realpath(argv[i + 2], NULL);
+		if (!dev->bdev[i].path && errno == ENOENT &&
+		    op == DMZ_OP_STOP && !strchr(argv[i + 2], '/')) {
+			/* Target name */
+			dev->bdev[i].path = strdup(argv[i + 2]);
+		}
 		if (!dev->bdev[i].path) {
 			if (errno == ENOENT)
 				fprintf(stderr,
@@ -180,7 +400,12 @@ int main(int argc, char **argv)
 
 		} else if (strncmp(argv[i], "--seq=", 6) == 0) {
 
-			if (op != DMZ_OP_FORMAT) {
+			if (op == DMZ_OP_SIMULATE) {
+				dev->sim_seq = argv[i] + 6;
+				continue;
+			}
+
+			if (op != DMZ_OP_FORMAT && op != DMZ_OP_BENCH_TARGET) {
 				fprintf(stderr,
 					"--seq option is valid only with the "
 					"format operation\n");
@@ -198,7 +423,18 @@ int main(int argc, char **argv)
 			const char *label = argv[i] + 8;
 			unsigned int label_size = strlen(label);
 
-			if (op != DMZ_OP_FORMAT && op != DMZ_OP_RELABEL) {
+			if (op == DMZ_OP_STOP) {
+				if (dev->stop_pattern) {
+					fprintf(stderr,
+						"--all and --label options "
+						"are exclusive\n");
+					return 1;
+				}
+				dev->stop_pattern = argv[i] + 8;
+				continue;
+			}
+			if (op != DMZ_OP_FORMAT && op != DMZ_OP_RELABEL &&
+			    op != DMZ_OP_BENCH_TARGET) {
 				fprintf(stderr,
 					"--label option is valid only with the "
 					"format operation\n");
@@ -214,22 +450,380 @@ int main(int argc, char **argv)
 					DMZ_LABEL_LEN - 1);
 				return 1;
 			}
-			if (op == DMZ_OP_FORMAT)
-				memcpy(dev->label, label, label_size);
-			else
+			if (op == DMZ_OP_RELABEL)
 				memcpy(dev->new_label, label, label_size);
+			else
+				memcpy(dev->label, label, label_size);
+
+		} else if (strcmp(argv[i], "--all") == 0) {
+
+			if (op != DMZ_OP_STOP) {
+				fprintf(stderr,
+					"--all option is valid only with the "
+					"stop operation\n");
+				return 1;
+			}
+			if (dev->stop_pattern) {
+				fprintf(stderr,
+					"--all and --label options are "
+					"exclusive\n");
+				return 1;
+			}
+			dev->stop_pattern = "*";
 
 		} else if (strcmp(argv[i], "--force") == 0) {
 
-			if (op != DMZ_OP_FORMAT) {
+			if (op != DMZ_OP_FORMAT && op != DMZ_OP_BENCH &&
+			    op != DMZ_OP_BENCH_TARGET && op != DMZ_OP_INJECT &&
+			    op != DMZ_OP_DECOMMISSION) {
 				fprintf(stderr,
 					"--force option is valid only with the "
-					"format operation\n");
+					"format, bench, inject and decommission "
+					"operations\n");
 				return 1;
 			}
 
 			dev->flags |= DMZ_OVERWRITE;
 
+		} else if (strcmp(argv[i], "--dry-run") == 0) {
+
+			if (op != DMZ_OP_FORMAT && op != DMZ_OP_REBALANCE) {
+				fprintf(stderr,
+					"--dry-run option is valid only with the "
+					"format and rebalance operations\n");
+				return 1;
+			}
+
+			dev->flags |= DMZ_DRY_RUN;
+
+		} else if (strcmp(argv[i], "--validate") == 0) {
+
+			if (op != DMZ_OP_FORMAT) {
+				fprintf(stderr,
+					"--validate option is valid only with "
+					"the format operation\n");
+				return 1;
+			}
+
+			dev->flags |= DMZ_VALIDATE;
+
+		} else if (strncmp(argv[i], "--iops=", 7) == 0) {
+
+			if (op != DMZ_OP_FORMAT) {
+				fprintf(stderr,
+					"--iops option is valid only with the "
+					"format operation\n");
+				return 1;
+			}
+
+			dev->plan_iops = strtoull(argv[i] + 7, NULL, 10);
+			if (!dev->plan_iops) {
+				fprintf(stderr, "Invalid number of IOPS\n");
+				return 1;
+			}
+
+		} else if (strncmp(argv[i], "--json=", 7) == 0) {
+
+			if (op != DMZ_OP_FORMAT) {
+				fprintf(stderr,
+					"--json option is valid only with the "
+					"format operation\n");
+				return 1;
+			}
+
+			dev->plan_json = argv[i] + 7;
+
+		} else if (strcmp(argv[i], "--mover") == 0) {
+
+			if (op != DMZ_OP_BENCH) {
+				fprintf(stderr,
+					"--mover option is valid only with the "
+					"bench operation\n");
+				return 1;
+			}
+
+			dev->bench_mover = true;
+
+		} else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+
+			if (op != DMZ_OP_BENCH_TARGET) {
+				fprintf(stderr,
+					"--jobs option is valid only with the "
+					"bench-target operation\n");
+				return 1;
+			}
+
+			dev->bench_jobs = argv[i] + 7;
+
+		} else if (strncmp(argv[i], "--runtime=", 10) == 0) {
+
+			if (op != DMZ_OP_BENCH_TARGET) {
+				fprintf(stderr,
+					"--runtime option is valid only with the "
+					"bench-target operation\n");
+				return 1;
+			}
+
+			if (atoi(argv[i] + 10) <= 0) {
+				fprintf(stderr, "Invalid run time\n");
+				return 1;
+			}
+			dev->bench_runtime = atoi(argv[i] + 10);
+
+		} else if (strncmp(argv[i], "--trace=", 8) == 0 ||
+			   strncmp(argv[i], "--workload=", 11) == 0 ||
+			   strncmp(argv[i], "--cache=", 8) == 0) {
+
+			if (op != DMZ_OP_SIMULATE) {
+				fprintf(stderr,
+					"%.*s option is valid only with the "
+					"simulate operation\n",
+					(int)(strchr(argv[i], '=') - argv[i]),
+					argv[i]);
+				return 1;
+			}
+
+			if (argv[i][2] == 't')
+				dev->sim_trace = argv[i] + 8;
+			else if (argv[i][2] == 'w')
+				dev->sim_workload = argv[i] + 11;
+			else
+				dev->sim_cache = argv[i] + 8;
+
+		} else if (strncmp(argv[i], "--reclaim-bw=", 13) == 0) {
+
+			if (op != DMZ_OP_SIMULATE) {
+				fprintf(stderr,
+					"--reclaim-bw option is valid only with "
+					"the simulate operation\n");
+				return 1;
+			}
+
+			if (atoi(argv[i] + 13) <= 0) {
+				fprintf(stderr, "Invalid reclaim throughput\n");
+				return 1;
+			}
+			dev->sim_reclaim_mbps = atoi(argv[i] + 13);
+
+		} else if (strncmp(argv[i], "--corrupt=", 10) == 0) {
+
+			if (op != DMZ_OP_INJECT) {
+				fprintf(stderr,
+					"--corrupt option is valid only with "
+					"the inject operation\n");
+				return 1;
+			}
+
+			dev->inject_list = argv[i] + 10;
+
+		} else if (strncmp(argv[i], "--seed=", 7) == 0) {
+
+			if (op != DMZ_OP_INJECT) {
+				fprintf(stderr,
+					"--seed option is valid only with "
+					"the inject operation\n");
+				return 1;
+			}
+
+			dev->inject_seed = strtoul(argv[i] + 7, NULL, 10);
+			if (!dev->inject_seed) {
+				fprintf(stderr, "Invalid seed\n");
+				return 1;
+			}
+
+		} else if (strncmp(argv[i], "--record=", 9) == 0) {
+
+			if (op != DMZ_OP_INJECT) {
+				fprintf(stderr,
+					"--record option is valid only with "
+					"the inject operation\n");
+				return 1;
+			}
+
+			dev->inject_record = argv[i] + 9;
+
+		} else if (strncmp(argv[i], "--bw=", 5) == 0) {
+
+			if (op != DMZ_OP_SCRUB) {
+				fprintf(stderr,
+					"--bw option is valid only with "
+					"the scrub operation\n");
+				return 1;
+			}
+
+			if (atoi(argv[i] + 5) <= 0) {
+				fprintf(stderr, "Invalid bandwidth limit\n");
+				return 1;
+			}
+			dev->scrub_mbps = atoi(argv[i] + 5);
+
+		} else if (strncmp(argv[i], "--bands=", 8) == 0) {
+
+			if (op != DMZ_OP_SURVEY) {
+				fprintf(stderr,
+					"--bands option is valid only with "
+					"the survey operation\n");
+				return 1;
+			}
+
+			if (atoi(argv[i] + 8) <= 0) {
+				fprintf(stderr, "Invalid number of bands\n");
+				return 1;
+			}
+			dev->survey_nr_bands = atoi(argv[i] + 8);
+
+		} else if (strncmp(argv[i], "--profile=", 10) == 0) {
+
+			if (op != DMZ_OP_SURVEY && op != DMZ_OP_FORMAT) {
+				fprintf(stderr,
+					"--profile option is valid only with "
+					"the survey and format operations\n");
+				return 1;
+			}
+
+			dev->survey_profile = argv[i] + 10;
+
+		} else if (strncmp(argv[i], "--image=", 8) == 0) {
+
+			if (op != DMZ_OP_DUMP && op != DMZ_OP_DELTA) {
+				fprintf(stderr,
+					"--image option is valid only with "
+					"the dump and delta operations\n");
+				return 1;
+			}
+
+			dev->image_path = argv[i] + 8;
+
+		} else if (strncmp(argv[i], "--to=", 5) == 0) {
+
+			if (op != DMZ_OP_DELTA) {
+				fprintf(stderr,
+					"--to option is valid only with "
+					"the delta operation\n");
+				return 1;
+			}
+
+			dev->delta_to = argv[i] + 5;
+
+		} else if (strncmp(argv[i], "--patch=", 8) == 0) {
+
+			if (op != DMZ_OP_DELTA) {
+				fprintf(stderr,
+					"--patch option is valid only with "
+					"the delta operation\n");
+				return 1;
+			}
+
+			dev->delta_patch = argv[i] + 8;
+
+		} else if (strncmp(argv[i], "--save=", 7) == 0) {
+
+			if (op != DMZ_OP_FINGERPRINT) {
+				fprintf(stderr,
+					"--save option is valid only with "
+					"the fingerprint operation\n");
+				return 1;
+			}
+
+			dev->fp_save = argv[i] + 7;
+
+		} else if (strncmp(argv[i], "--compare=", 10) == 0) {
+
+			if (op != DMZ_OP_FINGERPRINT) {
+				fprintf(stderr,
+					"--compare option is valid only with "
+					"the fingerprint operation\n");
+				return 1;
+			}
+
+			dev->fp_compare = argv[i] + 10;
+
+		} else if (strncmp(argv[i], "--logical=", 10) == 0) {
+
+			if (op != DMZ_OP_FINGERPRINT) {
+				fprintf(stderr,
+					"--logical option is valid only with "
+					"the fingerprint operation\n");
+				return 1;
+			}
+
+			dev->fp_image = argv[i] + 10;
+
+		} else if (strcmp(argv[i], "--poll") == 0) {
+
+			if (op != DMZ_OP_CHECK && op != DMZ_OP_REPAIR &&
+			    op != DMZ_OP_DUMP && op != DMZ_OP_DELTA) {
+				fprintf(stderr,
+					"--poll option is valid only with the "
+					"check, repair, dump and delta "
+					"operations\n");
+				return 1;
+			}
+
+			dev->flags |= DMZ_POLL;
+
+		} else if (strncmp(argv[i], "--tune=", 7) == 0) {
+
+			if (op != DMZ_OP_START) {
+				fprintf(stderr,
+					"--tune option is valid only with "
+					"the start operation\n");
+				return 1;
+			}
+
+			dev->tune_profile = argv[i] + 7;
+
+		} else if (strcmp(argv[i], "--no-tune") == 0) {
+
+			if (op != DMZ_OP_START) {
+				fprintf(stderr,
+					"--no-tune option is valid only with "
+					"the start operation\n");
+				return 1;
+			}
+
+			dev->flags |= DMZ_NO_TUNE;
+
+		} else if (strcmp(argv[i], "--raw-dm") == 0) {
+
+			if (op != DMZ_OP_START) {
+				fprintf(stderr,
+					"--raw-dm option is valid only with "
+					"the start operation\n");
+				return 1;
+			}
+
+			dev->flags |= DMZ_RAW_DM;
+
+		} else if (strcmp(argv[i], "--ublk") == 0) {
+
+			if (op != DMZ_OP_START) {
+				fprintf(stderr,
+					"--ublk option is valid only with "
+					"the start operation\n");
+				return 1;
+			}
+
+#ifdef HAVE_UBLK
+			dev->flags |= DMZ_UBLK;
+#else
+			fprintf(stderr,
+				"--ublk option is not supported "
+				"(dmzadm built without ublk support)\n");
+			return 1;
+#endif
+
+		} else if (strncmp(argv[i], "--policy=", 9) == 0) {
+
+			if (op != DMZ_OP_START) {
+				fprintf(stderr,
+					"--policy option is valid only with "
+					"the start operation\n");
+				return 1;
+			}
+
+			dev->ublk_policy = argv[i] + 9;
+
 		} else if (argv[i][0] != '-') {
 
 			break;
@@ -245,13 +839,74 @@ int main(int argc, char **argv)
 
 	}
 
+	if ((dev->plan_iops || dev->plan_json ||
+	     (op == DMZ_OP_FORMAT && dev->survey_profile)) &&
+	    !(dev->flags & DMZ_DRY_RUN)) {
+		fprintf(stderr,
+			"--iops, --json and --profile options are valid only "
+			"with --dry-run\n");
+		return 1;
+	}
+
+	if ((dev->flags & DMZ_VALIDATE) && (dev->flags & DMZ_DRY_RUN)) {
+		fprintf(stderr,
+			"--validate and --dry-run options are exclusive\n");
+		return 1;
+	}
+
+	if (dev->tune_profile && (dev->flags & DMZ_NO_TUNE)) {
+		fprintf(stderr,
+			"--tune and --no-tune options are exclusive\n");
+		return 1;
+	}
+
+	if ((dev->flags & DMZ_RAW_DM) && (dev->flags & DMZ_UBLK)) {
+		fprintf(stderr,
+			"--raw-dm and --ublk options are exclusive\n");
+		return 1;
+	}
+
+	if (dev->ublk_policy && !(dev->flags & DMZ_UBLK)) {
+		fprintf(stderr,
+			"--policy option is valid only with --ublk\n");
+		return 1;
+	}
+
+	if ((op == DMZ_OP_DUMP || op == DMZ_OP_DELTA) && !dev->image_path) {
+		fprintf(stderr,
+			"The dump and delta operations require --image\n");
+		return 1;
+	}
+
+	if (op == DMZ_OP_STOP && !dev->nr_bdev && !dev->stop_pattern) {
+		fprintf(stderr, "No device or target specified\n");
+		return 1;
+	}
+
+	if (op == DMZ_OP_INJECT && !(dev->flags & DMZ_OVERWRITE)) {
+		fprintf(stderr,
+			"The inject operation corrupts the device metadata: "
+			"use --force to confirm\n");
+		return 1;
+	}
+
+	if (op == DMZ_OP_DECOMMISSION && !(dev->flags & DMZ_OVERWRITE)) {
+		fprintf(stderr,
+			"The decommission operation destroys all data: "
+			"use --force to confirm\n");
+		return 1;
+	}
+
 	/* Load module if not present */
 	ret = dmz_load_module(modname, log_level);
 	if (ret)
 		return 1;
 
 	/* Check device-mapper target version */
-	dmz_mod_ver = dmz_init_dm(log_level);
+	if (dev->flags & DMZ_RAW_DM)
+		dmz_mod_ver = dmz_init_dm_raw(log_level);
+	else
+		dmz_mod_ver = dmz_init_dm(log_level);
 	if (dmz_mod_ver <= 0)
 		return 1;
 
@@ -263,18 +918,8 @@ int main(int argc, char **argv)
 		printf("Defaulting to metadata version %d from version %d\n",
 		       dev->sb_version, dmz_mod_ver);
 	}
-	if (op == DMZ_OP_STOP) {
-		char holder[PATH_MAX];
-
-		if (dmz_get_bdev_holder(&dev->bdev[0], holder) < 0)
-			return 1;
-		if (!strlen(holder)) {
-			fprintf(stderr, "%s: no dm-zoned device found\n",
-				dev->bdev[0].name);
-			return 1;
-		}
-		return dmz_stop(dev, holder);
-	}
+	if (op == DMZ_OP_STOP)
+		return dmz_stop(dev) < 0 ? 1 : 0;
 
 	/* Open the device */
 	ret = dmz_open_bdev(&dev->bdev[0], op,
@@ -343,15 +988,21 @@ int main(int argc, char **argv)
 	}
 
 	if (dev->nr_bdev > 1) {
-		__u64 block_offset = 0;
+		__u64 block_offset = 0, nr_zones0;
 
 		dev->bdev[0].zone_nr_sectors = dev->zone_nr_sectors;
 		dev->bdev[0].zone_nr_blocks = dev->zone_nr_blocks;
-		dev->bdev[0].nr_zones =
-			dev->bdev[0].capacity / dev->zone_nr_sectors;
+		nr_zones0 = DIV_ROUND_UP(dev->bdev[0].capacity,
+					 dev->zone_nr_sectors);
+		if (nr_zones0 > DMZ_MAX_NR_ZONES) {
+			fprintf(stderr,
+				"%s: Too many emulated zones (%llu, maximum %u)\n",
+				dev->bdev[0].name, nr_zones0, DMZ_MAX_NR_ZONES);
+			ret = 1;
+			goto out_close;
+		}
+		dev->bdev[0].nr_zones = nr_zones0;
 		dev->bdev[0].block_offset = block_offset;
-		if (dev->bdev[0].capacity % dev->zone_nr_sectors)
-			dev->bdev[0].nr_zones++;
 		block_offset = dev->bdev[0].nr_zones * dev->zone_nr_blocks;
 		for (i = 1; i < dev->nr_bdev; i++) {
 			dev->bdev[i].block_offset = block_offset;
@@ -366,6 +1017,9 @@ int main(int argc, char **argv)
 	if (dmz_get_dev_zones(dev) < 0)
 		return 1;
 
+	if (dev->flags & DMZ_VERBOSE)
+		print_zone_resources(dev);
+
 	nr_zones = dev->capacity / dev->zone_nr_sectors;
 	printf("  %u zones of %zu 512-byte sectors (%zu MiB)\n",
 	       nr_zones,
@@ -403,6 +1057,53 @@ int main(int argc, char **argv)
 		ret = dmz_start(dev);
 		break;
 
+	case DMZ_OP_BENCH:
+		if (dev->bench_mover)
+			ret = dmz_mover_bench(dev);
+		else
+			ret = dmz_bench(dev);
+		break;
+
+	case DMZ_OP_BENCH_TARGET:
+		ret = dmz_bench_target(dev);
+		break;
+
+	case DMZ_OP_SIMULATE:
+		ret = dmz_simulate(dev);
+		break;
+
+	case DMZ_OP_INJECT:
+		ret = dmz_inject(dev);
+		break;
+
+	case DMZ_OP_SCRUB:
+		ret = dmz_scrub(dev);
+		break;
+
+	case DMZ_OP_SURVEY:
+		ret = dmz_survey(dev);
+		break;
+
+	case DMZ_OP_DUMP:
+		ret = dmz_dump(dev);
+		break;
+
+	case DMZ_OP_DELTA:
+		ret = dmz_delta(dev);
+		break;
+
+	case DMZ_OP_REBALANCE:
+		ret = dmz_rebalance(dev);
+		break;
+
+	case DMZ_OP_FINGERPRINT:
+		ret = dmz_fingerprint(dev);
+		break;
+
+	case DMZ_OP_DECOMMISSION:
+		ret = dmz_decommission(dev);
+		break;
+
 	default:
 
 		fprintf(stderr, "Unknown operation\n");
@@ -411,6 +1112,9 @@ int main(int argc, char **argv)
 
 	}
 
+	if (dmz_release_zones(dev) < 0)
+		ret = 1;
+
 	free(dev->zones);
 	dev->zones = NULL;
 